@@ -2,21 +2,41 @@
 
 function add_cp {
 	if [ -z "$1" ]; then
-		echo "Usage: $0 <IFACE> <RATE>"
+		echo "Usage: $0 <IFACE> <RATE> [mq|fifo]"
+		echo "  mq: one CP per TX queue below an mq root, RATE is per queue"
+		echo "  fifo: unshaped qcnfifo CP, RATE is ignored"
 		return;
 	fi
 
 	IFACE=$1;
 	RATE=$2;
+	MODE=$3;
 	LIMIT=163840				# Queue size (160KB)
 	
-	if [ ! -z "$(tc qdisc show dev ${IFACE} | grep tbf)" ]; then
+	if [ ! -z "$(tc qdisc show dev ${IFACE} | grep 'tbf\|mq\|qcnfifo')" ]; then
 		echo "Initializing..."
 		tc qdisc del dev ${IFACE} root
 	fi
 	
-	tc qdisc add dev ${IFACE} root tbf rate ${RATE} burst 1500kb limit ${LIMIT}
+	if [ "${MODE}" == "fifo" ]; then
+		# tc has no option parser for qcnfifo, the limit defaults to
+		# txqueuelen * mtu
+		tc qdisc add dev ${IFACE} root qcnfifo
+		return;
+	fi
+
+	if [ "${MODE}" != "mq" ]; then
+		tc qdisc add dev ${IFACE} root tbf rate ${RATE} burst 1500kb limit ${LIMIT}
+		return;
+	fi
 
+	# The CP instances share one congestion view, LIMIT stays per queue
+	NTXQ=$(ls -d /sys/class/net/${IFACE}/queues/tx-* 2>/dev/null | wc -l)
+	tc qdisc add dev ${IFACE} root handle 1: mq
+	for i in $(seq 1 ${NTXQ}); do
+		tc qdisc add dev ${IFACE} parent 1:$(printf %x $i) tbf \
+			rate ${RATE} burst 1500kb limit ${LIMIT}
+	done
 }
 
 add_cp $@
@@ -27,42 +27,64 @@ function gethandle {
 
 }
 
+QCNCTL=${QCNCTL:-$(dirname $0)/tools/qcnctl}
+
 function rp_init {
 	IFACE=$1
 	tc qdisc del dev ${IFACE} root;
 	tc qdisc add dev ${IFACE} root handle 1: htb default 255;
+	${QCNCTL} rp ${IFACE} classify 1;
 }
 
 function add_rp {
 	if [ -z "$1" ] || [ -z "$2" ] || [ -z "$3" ]; then
-		echo "Usage: $0 <IFACE> <IP_SRC> <IP_DST>"
+		echo "Usage: $0 <IFACE> <IP_SRC> <IP_DST|any> [BACKPRESSURE_US]"
 		return;
 	fi
 
 	IFACE=$1;
 	IP_SRC=$2;
 	IP_DST=$3;
+	BP=$4;
 	RATE="1000000kbit";
 	
 
+	# "any": one class for everything IP_SRC sends, the RP is then
+	# keyed by source only and a CNM for any of its flows slows all
+	if [ "${IP_DST}" == "any" ]; then
+		IP_DST="0.0.0.0";
+		AGGREGATE=1;
+	fi
+
 	HANDLE=$(gethandle ${IP_SRC} ${IP_DST});
 
 	if [ -z "$(tc qdisc show dev ${IFACE} | grep htb)" ]; then
 		echo "Initializing..."
 		rp_init ${IFACE};
 	fi
+	if [ -n "${AGGREGATE}" ]; then
+		${QCNCTL} rp ${IFACE} aggregate src;
+	fi
 
 	echo "Adding RP Class..."
+	# burst and cburst are kept as times at RATE, so they shrink with
+	# crate; qcnctl stats shows them in bytes at the rate in force
 	tc class add dev ${IFACE} parent root classid 1:${HANDLE} htb \
 		rate ${RATE} ceil ${RATE} burst 1500kb cburst 1500kb quantum 3000;
 
 	echo "Adding RP Qdisc..."
-	tc qdisc add dev ${IFACE} parent 1:${HANDLE} handle ${HANDLE}: \
-		sfq perturb 10;
+	if [ -z "${BP}" ]; then
+		tc qdisc add dev ${IFACE} parent 1:${HANDLE} handle ${HANDLE}: \
+			sfq perturb 10;
+	else
+		# the guest holds the excess, the tap's send buffer bounds this
+		tc qdisc add dev ${IFACE} parent 1:${HANDLE} handle ${HANDLE}: \
+			pfifo;
+		${QCNCTL} rp ${IFACE} classid 1:${HANDLE} backpressure ${BP};
+	fi
 
-	echo "Adding RP Filter..."
-	tc filter add dev ${IFACE} protocol ip parent 1: prio 1 u32 \
-		match ip src ${IP_SRC} match ip dst ${IP_DST} flowid 1:${HANDLE};
+	echo "Adding RP Flow..."
+	${QCNCTL} rp ${IFACE} classid 1:${HANDLE} src ${IP_SRC} dst ${IP_DST};
 
 
 }
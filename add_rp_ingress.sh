@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# The RP on the receive side of a port, e.g. the vif or tap of a guest,
+# for when its egress qdisc is not ours: every pair behind IFACE that
+# gets a CNM is policed at its current rate before it enters the bridge.
+# The bridge has to be the QCN bridge of bridge2.6.3x, which hands the
+# RP the CNMs it would forward out of IFACE. With CP_RATE the port is a
+# CP as well, for senders that bring in more than the bridge forwards.
+
+QCNCTL=${QCNCTL:-$(dirname $0)/tools/qcnctl}
+
+function add_rp_ingress {
+	if [ -z "$1" ]; then
+		echo "Usage: $0 <IFACE> [RATE_BPS] [BURST_BYTES] [CP_RATE_BPS]"
+		return;
+	fi
+
+	IFACE=$1;
+	RATE=${2:-125000000};		# bytes/s, 1Gbit
+	BURST=${3:-1536000};		# bytes at RATE (1500KB)
+	CP_RATE=${4:-0};		# bytes/s the bridge keeps up with, 0 no CP
+
+	tc qdisc del dev ${IFACE} ingress 2> /dev/null;
+
+	echo "Adding ingress RP..."
+	# tc has no option parser for qcningress, qcnctl sets the rest
+	tc qdisc add dev ${IFACE} handle ffff: parent ffff:fff1 qcningress;
+	${QCNCTL} rp ${IFACE} parent ffff:fff1 rate ${RATE} burst ${BURST} \
+		cp_rate ${CP_RATE};
+}
+
+add_rp_ingress $@
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# One RP per TX queue: the mq root keeps a child htb on each queue, and
+# each htb creates a class per flow from the template class X:1 its
+# packets or CNMs end up in.
+
+QCNCTL=${QCNCTL:-$(dirname $0)/tools/qcnctl}
+
+function add_rp_mq {
+	if [ -z "$1" ]; then
+		echo "Usage: $0 <IFACE> [RATE] [IDLE_MS]"
+		return;
+	fi
+
+	IFACE=$1;
+	RATE=${2:-"1000000kbit"};
+	IDLE=${3:-10000};
+	NQ=$(ls -d /sys/class/net/${IFACE}/queues/tx-* | wc -l);
+
+	tc qdisc del dev ${IFACE} root 2> /dev/null;
+	tc qdisc add dev ${IFACE} root handle 1: mq;
+
+	for Q in $(seq 1 ${NQ}); do
+		H=$(printf "%x" $[${Q}+1]);
+
+		echo "Adding RP on queue $[${Q}-1]..."
+		tc qdisc add dev ${IFACE} parent 1:$(printf "%x" ${Q}) \
+			handle ${H}: htb default 1;
+		tc class add dev ${IFACE} parent ${H}: classid ${H}:1 htb \
+			rate ${RATE} ceil ${RATE} burst 1500kb cburst 1500kb \
+			quantum 3000;
+		tc qdisc add dev ${IFACE} parent ${H}:1 sfq perturb 10;
+		${QCNCTL} rp ${IFACE} parent 1:$(printf "%x" ${Q}) \
+			classify 1 auto ${H}:1 idle ${IDLE};
+	done;
+}
+
+add_rp_mq $@
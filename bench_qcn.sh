@@ -0,0 +1,176 @@
+#!/bin/bash
+
+# End to end run of N senders through their RPs into one CP, on one host:
+#
+#   pktgen -> vethA0 = vethA1 [br-rp] vethB0 (RP htb) = vethB1 [br-cp]
+#                                          vethC0 (CP tbf) = vethC1 (sink)
+#
+# pktgen does not go through the qdiscs of its own device, so its frames
+# are bridged into the RP. The CP sends its CNMs out of the br-cp port
+# the frames came in on, vethB1, and they come back in on vethB0. Both
+# bridges have to be the QCN bridge of bridge2.6.3x: br-cp records that
+# port in the frames, whose skb_iif would otherwise still name vethA1,
+# and br-rp hands the CNMs to the RP. The sch_*, qcn and bridge modules
+# have to be loaded, pktgen too.
+#
+# The CP rate steps through RATES, PHASE seconds each. One line of
+# key=value results is printed per step.
+
+QCNCTL=${QCNCTL:-$(dirname $0)/tools/qcnctl}
+DIR=$(dirname $0)
+
+SENDERS=${SENDERS:-8}
+RATES=${RATES:-"1000mbit 500mbit 200mbit 800mbit"}
+PHASE=${PHASE:-5}			# seconds per rate
+POLL=${POLL:-0.05}			# seconds between samples
+TOL=${TOL:-10}				# converged: RPs within TOL% of the CP rate
+PKT_SIZE=${PKT_SIZE:-1500}
+
+PG=/proc/net/pktgen
+SAMPLES=$(mktemp /tmp/qcn_bench.XXXXXX)
+
+function pgset {
+	echo "$2" > ${PG}/$1 || echo "pktgen: $1: $2 failed" >&2
+}
+
+function tobps {
+	echo $1 | awk '{
+		n = $1 + 0; u = tolower($1); sub(/^[0-9.]+/, "", u);
+		if (u == "kbit") n *= 1000; else if (u == "mbit") n *= 1000000;
+		else if (u == "gbit") n *= 1000000000; else if (u == "bps") n *= 8;
+		else if (u == "kbps") n *= 8000; else if (u == "mbps") n *= 8000000;
+		printf "%.0f\n", n }'
+}
+
+function setup {
+	for L in A B C; do
+		ip link add veth${L}0 type veth peer name veth${L}1 || return 1;
+	done;
+	# br_qcn_cp_set is only in the QCN bridge
+	if ! grep -qw br_qcn_cp_set /proc/kallsyms; then
+		echo "bench_qcn: the QCN bridge and qcn modules are not loaded" >&2
+		return 1;
+	fi
+	brctl addbr br-rp && brctl addif br-rp vethA1 && brctl addif br-rp vethB0
+	brctl addbr br-cp && brctl addif br-cp vethB1 && brctl addif br-cp vethC0
+	for D in vethA0 vethA1 vethB0 vethB1 vethC0 vethC1 br-rp br-cp; do
+		ip link set ${D} up;
+	done;
+
+	for i in $(seq 1 ${SENDERS}); do
+		${DIR}/add_rp.sh vethB0 10.0.0.${i} 10.1.0.1 > /dev/null;
+	done;
+	${DIR}/add_cp.sh vethC0 $(echo ${RATES} | cut -d ' ' -f 1) > /dev/null;
+
+	pgset kpktgend_0 "rem_device_all"
+	pgset kpktgend_0 "add_device vethA0"
+	pgset vethA0 "count 0"
+	pgset vethA0 "clone_skb 0"
+	pgset vethA0 "pkt_size ${PKT_SIZE}"
+	pgset vethA0 "delay 0"
+	pgset vethA0 "src_min 10.0.0.1"
+	pgset vethA0 "src_max 10.0.0.${SENDERS}"
+	pgset vethA0 "flag IPSRC_RND"
+	pgset vethA0 "dst 10.1.0.1"
+	pgset vethA0 "dst_mac $(cat /sys/class/net/vethC1/address)"
+}
+
+function cleanup {
+	kill ${POLLER} 2> /dev/null
+	echo "stop" > ${PG}/pgctrl 2> /dev/null
+	pgset kpktgend_0 "rem_device_all" 2> /dev/null
+	for B in br-rp br-cp; do
+		ip link set ${B} down 2> /dev/null;
+		brctl delbr ${B} 2> /dev/null;
+	done;
+	for L in A B C; do
+		ip link del veth${L}0 2> /dev/null;
+	done;
+	rm -f ${SAMPLES}
+}
+
+# t_ms qlen cnm_sent crate_sum tx_bytes
+function poll {
+	while true; do
+		T=$(date +%s%N)
+		CP=$(${QCNCTL} stats vethC0 | grep '^cp ' | head -1)
+		RP=$(${QCNCTL} stats vethB0 | grep '^rp class' | tr '\n' ' ')
+		TX=$(cat /sys/class/net/vethC0/statistics/tx_bytes)
+		echo "${CP}" | awk -v t=${T} -v tx=${TX} -v rp="${RP}" '{
+			q = 0; s = 0;
+			for (i = 1; i < NF; i++) {
+				if ($i == "qlen") q += $(i + 1);
+				if ($i == "sent") s = $(i + 1);
+			}
+			n = split(rp, f, " "); c = 0;
+			for (i = 1; i < n; i++)
+				if (f[i] == "crate") c += f[i + 1];
+			printf "%.0f %d %d %.0f %.0f\n", t / 1000000, q, s, c, tx }'
+		sleep ${POLL}
+	done
+}
+
+# Bytes sent by each RP class so far
+function class_bytes {
+	tc -s class show dev vethB0 | awk '
+		/^class htb/ { id = $3 }
+		/Sent/ && id != "" { print id, $2; id = "" }'
+}
+
+# phase start_ms end_ms rate_bps bytes_before bytes_after
+function report {
+	awk -v ph=$1 -v t0=$2 -v t1=$3 -v bps=$4 -v tol=${TOL} \
+		-v kern=$(uname -r) -v snd=${SENDERS} -v rate=$7 \
+		-v jain=$(join -j 1 $5 $6 | awk '{ d = $3 - $2; s += d; s2 += d * d;
+			n++ } END { printf "%.3f", n && s2 ? s * s / (n * s2) : 0 }') '
+	$1 >= t0 && $1 <= t1 {
+		t[n] = $1; q[n] = $2; c[n] = $4 * 8; n++;
+		if (n == 1) { s0 = $3; x0 = $5 } s1 = $3; x1 = $5;
+	}
+	END {
+		if (n < 2) exit;
+		conv = n;
+		for (i = n - 1; i >= 0; i--) {
+			if (c[i] - bps > bps * tol / 100 || bps - c[i] > bps * tol / 100)
+				break;
+			conv = i;
+		}
+		peak = 0; sum = 0; m = 0;
+		for (i = 0; i < n; i++) {
+			if (q[i] > peak) peak = q[i];
+			if (i >= (conv < n ? conv : n / 2)) { sum += q[i]; m++ }
+		}
+		dt = (t[n - 1] - t[0]) / 1000;
+		cms = conv < n ? t[conv] - t0 : "never";
+		util = dt > 0 ? (x1 - x0) * 8 / (dt * bps) : 0;
+		cnms = dt > 0 ? (s1 - s0) / dt : 0;
+		printf "kernel=%s senders=%d phase=%d rate=%s converge_ms=%s ",
+			kern, snd, ph, rate, cms;
+		printf "qlen_peak=%d qlen_steady=%d util=%.3f jain=%s cnm_per_s=%.1f\n",
+			peak, m ? sum / m : 0, util, jain, cnms
+	}' ${SAMPLES}
+}
+
+function bench_qcn {
+	trap cleanup EXIT
+	setup || exit 1;
+
+	poll >> ${SAMPLES} &
+	POLLER=$!
+	echo "start" > ${PG}/pgctrl &
+
+	PH=0
+	for RATE in ${RATES}; do
+		PH=$[${PH}+1];
+		${DIR}/change_cp.sh vethC0 ${RATE} > /dev/null;
+		B0=$(mktemp /tmp/qcn_bench.XXXXXX); class_bytes | sort > ${B0}
+		T0=$(($(date +%s%N) / 1000000))
+		sleep ${PHASE}
+		T1=$(($(date +%s%N) / 1000000))
+		B1=$(mktemp /tmp/qcn_bench.XXXXXX); class_bytes | sort > ${B1}
+		report ${PH} ${T0} ${T1} $(tobps ${RATE}) ${B0} ${B1} ${RATE}
+		rm -f ${B0} ${B1}
+	done;
+}
+
+bench_qcn $@
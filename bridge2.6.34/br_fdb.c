@@ -21,6 +21,9 @@
 #include <linux/jhash.h>
 #include <linux/random.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
 #include <asm/atomic.h>
 #include <asm/unaligned.h>
 #include "br_private.h"
@@ -65,11 +68,192 @@ static inline int has_expired(const struct net_bridge *br,
 		time_before_eq(fdb->ageing_timer + hold_time(br), jiffies);
 }
 
-static inline int br_mac_hash(const unsigned char *mac)
+static inline int br_mac_hash(const struct net_bridge_fdb_htable *tbl,
+			      const unsigned char *mac)
 {
 	/* use 1 byte of OUI cnd 3 bytes of NIC */
 	u32 key = get_unaligned((u32 *)(mac + 2));
-	return jhash_1word(key, fdb_salt) & (BR_HASH_SIZE - 1);
+	return jhash_1word(key, fdb_salt) & (tbl->max - 1);
+}
+
+/*
+ * The hash table grows and shrinks with the number of entries, the same
+ * way the multicast database does: every entry sits on two sets of
+ * chains, so a new table can be built under hash_lock while readers
+ * keep walking the old one. Large bucket arrays come from vmalloc, so
+ * the rehash runs from a work item rather than from the receive path.
+ */
+static struct hlist_head *fdb_hash_alloc(u32 max)
+{
+	size_t size = max * sizeof(struct hlist_head);
+	struct hlist_head *hash;
+
+	if (size <= PAGE_SIZE)
+		return kzalloc(size, GFP_KERNEL);
+
+	hash = vmalloc(size);
+	if (hash)
+		memset(hash, 0, size);
+	return hash;
+}
+
+static struct net_bridge_fdb_htable *fdb_htable_alloc(u32 max)
+{
+	struct net_bridge_fdb_htable *tbl;
+
+	tbl = kzalloc(sizeof(*tbl), GFP_KERNEL);
+	if (!tbl)
+		return NULL;
+
+	tbl->hash = fdb_hash_alloc(max);
+	if (!tbl->hash) {
+		kfree(tbl);
+		return NULL;
+	}
+	tbl->max = max;
+	return tbl;
+}
+
+static void fdb_htable_free(struct net_bridge_fdb_htable *tbl)
+{
+	if (is_vmalloc_addr(tbl->hash))
+		vfree(tbl->hash);
+	else
+		kfree(tbl->hash);
+	kfree(tbl);
+}
+
+/* about one entry per chain */
+static u32 fdb_hash_target(const struct net_bridge *br, u32 size)
+{
+	u32 max = BR_FDB_HASH_MIN;
+
+	if (size > max)
+		max = roundup_pow_of_two(size);
+	return min(max, br->fdb_hash_max);
+}
+
+/* Grow once the chains average more than one entry, shrink when the
+ * table is down to a quarter. Called with hash_lock held.
+ */
+static void fdb_check_resize(struct net_bridge *br,
+			     const struct net_bridge_fdb_htable *tbl)
+{
+	if (tbl->old)
+		return;
+
+	if ((tbl->size > tbl->max && tbl->max < br->fdb_hash_max) ||
+	    (tbl->size < tbl->max / 4 && tbl->max > BR_FDB_HASH_MIN) ||
+	    tbl->max > br->fdb_hash_max)
+		schedule_work(&br->fdb_rehash_work);
+}
+
+static void br_fdb_rehash(struct work_struct *work)
+{
+	struct net_bridge *br = container_of(work, struct net_bridge,
+					     fdb_rehash_work);
+	struct net_bridge_fdb_htable *old, *tbl;
+	struct net_bridge_fdb_entry *f;
+	struct hlist_node *h;
+	u32 i, max, cur;
+
+	spin_lock_bh(&br->hash_lock);
+	old = br->fdb;
+	cur = old->max;
+	max = old->old ? cur : fdb_hash_target(br, old->size);
+	spin_unlock_bh(&br->hash_lock);
+
+	if (max == cur)
+		return;
+
+	tbl = fdb_htable_alloc(max);
+	if (!tbl) {
+		if (net_ratelimit())
+			printk(KERN_WARNING "%s: cannot resize forwarding "
+			       "table to %u buckets\n", br->dev->name, max);
+		return;
+	}
+
+	spin_lock_bh(&br->hash_lock);
+	old = br->fdb;
+	if (old->old) {
+		/* lost against a concurrent run */
+		spin_unlock_bh(&br->hash_lock);
+		fdb_htable_free(tbl);
+		return;
+	}
+
+	tbl->size = old->size;
+	tbl->ver = old->ver ^ 1;
+	tbl->old = old;
+	for (i = 0; i < old->max; i++)
+		hlist_for_each_entry(f, h, &old->hash[i], hlist[old->ver])
+			hlist_add_head(&f->hlist[tbl->ver],
+				       &tbl->hash[br_mac_hash(tbl, f->addr.addr)]);
+	rcu_assign_pointer(br->fdb, tbl);
+	spin_unlock_bh(&br->hash_lock);
+
+	/* wait for the readers still walking the old chains */
+	synchronize_rcu();
+
+	spin_lock_bh(&br->hash_lock);
+	tbl->old = NULL;
+	fdb_check_resize(br, tbl);
+	spin_unlock_bh(&br->hash_lock);
+
+	fdb_htable_free(old);
+}
+
+int br_fdb_hash_init(struct net_bridge *br)
+{
+	br->fdb_hash_max = BR_FDB_HASH_MAX;
+	INIT_WORK(&br->fdb_rehash_work, br_fdb_rehash);
+
+	br->fdb_cache = alloc_percpu(struct br_fdb_cache);
+	if (!br->fdb_cache)
+		return -ENOMEM;
+
+	br->fdb = fdb_htable_alloc(BR_FDB_HASH_MIN);
+	if (!br->fdb) {
+		free_percpu(br->fdb_cache);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* called once all ports, and so all entries, are gone */
+void br_fdb_hash_fini(struct net_bridge *br)
+{
+	fdb_htable_free(br->fdb);
+	br->fdb = NULL;
+	free_percpu(br->fdb_cache);
+	br->fdb_cache = NULL;
+}
+
+void br_fdb_cache_stats(struct net_bridge *br,
+			unsigned long *hits, unsigned long *misses)
+{
+	int cpu;
+
+	*hits = *misses = 0;
+	for_each_possible_cpu(cpu) {
+		const struct br_fdb_cache *c = per_cpu_ptr(br->fdb_cache, cpu);
+
+		*hits += c->hits;
+		*misses += c->misses;
+	}
+}
+
+/* called under bridge lock */
+int br_fdb_set_hash_max(struct net_bridge *br, unsigned long val)
+{
+	if (!is_power_of_2(val) || val < BR_FDB_HASH_MIN ||
+	    val > BR_FDB_HASH_LIMIT)
+		return -EINVAL;
+
+	br->fdb_hash_max = val;
+	schedule_work(&br->fdb_rehash_work);
+	return 0;
 }
 
 static void fdb_rcu_free(struct rcu_head *head)
@@ -79,26 +263,47 @@ static void fdb_rcu_free(struct rcu_head *head)
 	kmem_cache_free(br_fdb_cache, ent);
 }
 
-static inline void fdb_delete(struct net_bridge_fdb_entry *f)
+/* Drop every cached pointer, see fdb_lookup(). Called after the table
+ * change is visible, so a reader that still sees the old generation
+ * also still sees the old table state. A move in br_fdb_update() bumps
+ * it without hash_lock; two racing bumps may count once, but the
+ * generation still changes.
+ */
+static inline void fdb_gen_bump(struct net_bridge *br)
+{
+	smp_wmb();
+	br->fdb_gen++;
+}
+
+static inline void fdb_delete(struct net_bridge *br,
+			      struct net_bridge_fdb_entry *f)
 {
-	hlist_del_rcu(&f->hlist);
+	struct net_bridge_fdb_htable *tbl = br->fdb;
+
+	hlist_del_rcu(&f->hlist[tbl->ver]);
+	fdb_gen_bump(br);
+	tbl->size--;
+	fdb_check_resize(br, tbl);
 	call_rcu(&f->rcu, fdb_rcu_free);
 }
 
 void br_fdb_changeaddr(struct net_bridge_port *p, const unsigned char *newaddr)
 {
 	struct net_bridge *br = p->br;
+	struct net_bridge_fdb_htable *tbl;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
+	tbl = br->fdb;
 
 	/* Search all chains since old address/hash is unknown */
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	for (i = 0; i < tbl->max; i++) {
 		struct hlist_node *h;
-		hlist_for_each(h, &br->hash[i]) {
+		hlist_for_each(h, &tbl->hash[i]) {
 			struct net_bridge_fdb_entry *f;
 
-			f = hlist_entry(h, struct net_bridge_fdb_entry, hlist);
+			f = hlist_entry(h, struct net_bridge_fdb_entry,
+					hlist[tbl->ver]);
 			if (f->dst == p && f->is_local) {
 				/* maybe another port has same hw addr? */
 				struct net_bridge_port *op;
@@ -107,12 +312,13 @@ void br_fdb_changeaddr(struct net_bridge_port *p, const unsigned char *newaddr)
 					    !compare_ether_addr(op->dev->dev_addr,
 								f->addr.addr)) {
 						f->dst = op;
+						fdb_gen_bump(br);
 						goto insert;
 					}
 				}
 
 				/* delete old one */
-				fdb_delete(f);
+				fdb_delete(br, f);
 				goto insert;
 			}
 		}
@@ -129,20 +335,23 @@ void br_fdb_cleanup(unsigned long _data)
 	struct net_bridge *br = (struct net_bridge *)_data;
 	unsigned long delay = hold_time(br);
 	unsigned long next_timer = jiffies + br->forward_delay;
+	struct net_bridge_fdb_htable *tbl;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	tbl = br->fdb;
+	for (i = 0; i < tbl->max; i++) {
 		struct net_bridge_fdb_entry *f;
 		struct hlist_node *h, *n;
 
-		hlist_for_each_entry_safe(f, h, n, &br->hash[i], hlist) {
+		hlist_for_each_entry_safe(f, h, n, &tbl->hash[i],
+					  hlist[tbl->ver]) {
 			unsigned long this_timer;
 			if (f->is_static)
 				continue;
 			this_timer = f->ageing_timer + delay;
 			if (time_before_eq(this_timer, jiffies))
-				fdb_delete(f);
+				fdb_delete(br, f);
 			else if (time_before(this_timer, next_timer))
 				next_timer = this_timer;
 		}
@@ -157,15 +366,18 @@ void br_fdb_cleanup(unsigned long _data)
 /* Completely flush all dynamic entries in forwarding database.*/
 void br_fdb_flush(struct net_bridge *br)
 {
+	struct net_bridge_fdb_htable *tbl;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	tbl = br->fdb;
+	for (i = 0; i < tbl->max; i++) {
 		struct net_bridge_fdb_entry *f;
 		struct hlist_node *h, *n;
-		hlist_for_each_entry_safe(f, h, n, &br->hash[i], hlist) {
+		hlist_for_each_entry_safe(f, h, n, &tbl->hash[i],
+					  hlist[tbl->ver]) {
 			if (!f->is_static)
-				fdb_delete(f);
+				fdb_delete(br, f);
 		}
 	}
 	spin_unlock_bh(&br->hash_lock);
@@ -178,15 +390,18 @@ void br_fdb_delete_by_port(struct net_bridge *br,
 			   const struct net_bridge_port *p,
 			   int do_all)
 {
+	struct net_bridge_fdb_htable *tbl;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	tbl = br->fdb;
+	for (i = 0; i < tbl->max; i++) {
 		struct hlist_node *h, *g;
 
-		hlist_for_each_safe(h, g, &br->hash[i]) {
+		hlist_for_each_safe(h, g, &tbl->hash[i]) {
 			struct net_bridge_fdb_entry *f
-				= hlist_entry(h, struct net_bridge_fdb_entry, hlist);
+				= hlist_entry(h, struct net_bridge_fdb_entry,
+					      hlist[tbl->ver]);
 			if (f->dst != p)
 				continue;
 
@@ -204,36 +419,81 @@ void br_fdb_delete_by_port(struct net_bridge *br,
 					    !compare_ether_addr(op->dev->dev_addr,
 								f->addr.addr)) {
 						f->dst = op;
+						fdb_gen_bump(br);
 						goto skip_delete;
 					}
 				}
 			}
 
-			fdb_delete(f);
+			fdb_delete(br, f);
 		skip_delete: ;
 		}
 	}
 	spin_unlock_bh(&br->hash_lock);
 }
 
-/* No locking or refcounting, assumes caller has no preempt (rcu_read_lock) */
-struct net_bridge_fdb_entry *__br_fdb_get(struct net_bridge *br,
-					  const unsigned char *addr)
+static inline int br_fdb_cache_slot(const unsigned char *mac)
 {
+	return (mac[4] ^ mac[5]) & (BR_FDB_CACHE_SIZE - 1);
+}
+
+/*
+ * Lookup through the per-CPU cache, shared by the destination lookup
+ * and source learning, so a burst of frames between the same stations
+ * walks the chains once. Caller has rcu_read_lock and BH disabled.
+ *
+ * Cached entries are only trusted while br->fdb_gen is unchanged.
+ * Every insert, port move and delete bumps it, the last after
+ * unlinking and before the entry can be freed, so an entry found
+ * under the old generation is still valid here.
+ */
+static struct net_bridge_fdb_entry *fdb_lookup(struct net_bridge *br,
+					       const unsigned char *addr)
+{
+	struct br_fdb_cache *c = per_cpu_ptr(br->fdb_cache,
+					     smp_processor_id());
+	int slot = br_fdb_cache_slot(addr);
+	struct net_bridge_fdb_htable *tbl;
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *fdb;
+	unsigned int gen;
+
+	gen = ACCESS_ONCE(br->fdb_gen);
+	smp_rmb();
 
-	hlist_for_each_entry_rcu(fdb, h, &br->hash[br_mac_hash(addr)], hlist) {
+	fdb = c->slot[slot].fdb;
+	if (fdb && c->slot[slot].gen == gen &&
+	    !compare_ether_addr(fdb->addr.addr, addr)) {
+		c->hits++;
+		return fdb;
+	}
+	c->misses++;
+
+	tbl = rcu_dereference(br->fdb);
+	hlist_for_each_entry_rcu(fdb, h, &tbl->hash[br_mac_hash(tbl, addr)],
+				 hlist[tbl->ver]) {
 		if (!compare_ether_addr(fdb->addr.addr, addr)) {
-			if (unlikely(has_expired(br, fdb)))
-				break;
+			c->slot[slot].fdb = fdb;
+			c->slot[slot].gen = gen;
 			return fdb;
 		}
 	}
-
 	return NULL;
 }
 
+/* No locking or refcounting, assumes caller has rcu_read_lock and BH
+ * disabled (the destination cache is per CPU).
+ */
+struct net_bridge_fdb_entry *__br_fdb_get(struct net_bridge *br,
+					  const unsigned char *addr)
+{
+	struct net_bridge_fdb_entry *fdb = fdb_lookup(br, addr);
+
+	if (fdb && unlikely(has_expired(br, fdb)))
+		return NULL;
+	return fdb;
+}
+
 #if defined(CONFIG_ATM_LANE) || defined(CONFIG_ATM_LANE_MODULE)
 /* Interface used by ATM LANE hook to test
  * if an addr is on some other bridge port */
@@ -246,9 +506,11 @@ int br_fdb_test_addr(struct net_device *dev, unsigned char *addr)
 		return 0;
 
 	rcu_read_lock();
+	local_bh_disable();
 	fdb = __br_fdb_get(dev->br_port->br, addr);
 	ret = fdb && fdb->dst->dev != dev &&
 		fdb->dst->state == BR_STATE_FORWARDING;
+	local_bh_enable();
 	rcu_read_unlock();
 
 	return ret;
@@ -266,12 +528,14 @@ int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 	int i, num = 0;
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *f;
+	struct net_bridge_fdb_htable *tbl;
 
 	memset(buf, 0, maxnum*sizeof(struct __fdb_entry));
 
 	rcu_read_lock();
-	for (i = 0; i < BR_HASH_SIZE; i++) {
-		hlist_for_each_entry_rcu(f, h, &br->hash[i], hlist) {
+	tbl = rcu_dereference(br->fdb);
+	for (i = 0; i < tbl->max; i++) {
+		hlist_for_each_entry_rcu(f, h, &tbl->hash[i], hlist[tbl->ver]) {
 			if (num >= maxnum)
 				goto out;
 
@@ -304,35 +568,42 @@ int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 	return num;
 }
 
-static inline struct net_bridge_fdb_entry *fdb_find(struct hlist_head *head,
-						    const unsigned char *addr)
+static inline struct net_bridge_fdb_entry *fdb_find(
+	const struct net_bridge_fdb_htable *tbl, const unsigned char *addr)
 {
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *fdb;
 
-	hlist_for_each_entry_rcu(fdb, h, head, hlist) {
+	hlist_for_each_entry_rcu(fdb, h, &tbl->hash[br_mac_hash(tbl, addr)],
+				 hlist[tbl->ver]) {
 		if (!compare_ether_addr(fdb->addr.addr, addr))
 			return fdb;
 	}
 	return NULL;
 }
 
-static struct net_bridge_fdb_entry *fdb_create(struct hlist_head *head,
+/* called with hash_lock held */
+static struct net_bridge_fdb_entry *fdb_create(struct net_bridge *br,
 					       struct net_bridge_port *source,
 					       const unsigned char *addr,
 					       int is_local)
 {
+	struct net_bridge_fdb_htable *tbl = br->fdb;
 	struct net_bridge_fdb_entry *fdb;
 
 	fdb = kmem_cache_alloc(br_fdb_cache, GFP_ATOMIC);
 	if (fdb) {
 		memcpy(fdb->addr.addr, addr, ETH_ALEN);
-		hlist_add_head_rcu(&fdb->hlist, head);
-
 		fdb->dst = source;
 		fdb->is_local = is_local;
 		fdb->is_static = is_local;
 		fdb->ageing_timer = jiffies;
+
+		hlist_add_head_rcu(&fdb->hlist[tbl->ver],
+				   &tbl->hash[br_mac_hash(tbl, addr)]);
+		fdb_gen_bump(br);
+		tbl->size++;
+		fdb_check_resize(br, tbl);
 	}
 	return fdb;
 }
@@ -340,13 +611,12 @@ static struct net_bridge_fdb_entry *fdb_create(struct hlist_head *head,
 static int fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 		  const unsigned char *addr)
 {
-	struct hlist_head *head = &br->hash[br_mac_hash(addr)];
 	struct net_bridge_fdb_entry *fdb;
 
 	if (!is_valid_ether_addr(addr))
 		return -EINVAL;
 
-	fdb = fdb_find(head, addr);
+	fdb = fdb_find(br->fdb, addr);
 	if (fdb) {
 		/* it is okay to have multiple ports with same
 		 * address, just use the first one.
@@ -357,10 +627,10 @@ static int fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 		printk(KERN_WARNING "%s adding interface with same address "
 		       "as a received packet\n",
 		       source->dev->name);
-		fdb_delete(fdb);
+		fdb_delete(br, fdb);
 	}
 
-	if (!fdb_create(head, source, addr, 1))
+	if (!fdb_create(br, source, addr, 1))
 		return -ENOMEM;
 
 	return 0;
@@ -380,7 +650,6 @@ int br_fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 		   const unsigned char *addr)
 {
-	struct hlist_head *head = &br->hash[br_mac_hash(addr)];
 	struct net_bridge_fdb_entry *fdb;
 
 	/* some users want to always flood. */
@@ -392,7 +661,7 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 	      source->state == BR_STATE_FORWARDING))
 		return;
 
-	fdb = fdb_find(head, addr);
+	fdb = fdb_lookup(br, addr);
 	if (likely(fdb)) {
 		/* attempt to update an entry for a local interface */
 		if (unlikely(fdb->is_local)) {
@@ -401,14 +670,22 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 				       "own address as source address\n",
 				       source->dev->name);
 		} else {
-			/* fastpath: update of existing entry */
-			fdb->dst = source;
-			fdb->ageing_timer = jiffies;
+			/* fastpath: update of existing entry. Only write
+			 * what changed, so that a burst from one station
+			 * dirties the entry once per jiffy at most.
+			 */
+			if (unlikely(fdb->dst != source)) {
+				fdb->dst = source;
+				fdb_gen_bump(br);
+			}
+			if (fdb->ageing_timer != jiffies)
+				fdb->ageing_timer = jiffies;
 		}
 	} else {
 		spin_lock(&br->hash_lock);
-		if (!fdb_find(head, addr))
-			fdb_create(head, source, addr, 0);
+		/* the table may have been resized meanwhile */
+		if (!fdb_find(br->fdb, addr))
+			fdb_create(br, source, addr, 0);
 		/* else  we lose race and someone else inserts
 		 * it first, don't bother updating
 		 */
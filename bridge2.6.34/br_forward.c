@@ -19,11 +19,7 @@
 #include <linux/if_vlan.h>
 #include <linux/netfilter_bridge.h>
 #include "br_private.h"
-
-#include <linux/if_ether.h>
-#include <linux/netdevice.h>
-#include <net/sch_generic.h>
-#define ETH_QCN                 0xA9A9
+#include "../qcn.h"
 
 static int deliver_clone(const struct net_bridge_port *prev,
 			 struct sk_buff *skb,
@@ -43,6 +39,28 @@ static inline unsigned packet_length(const struct sk_buff *skb)
 	return skb->len - (skb->protocol == htons(ETH_P_8021Q) ? VLAN_HLEN : 0);
 }
 
+/* The port's CP, if any, samples the frame as a tbf CP below it would;
+   called with rcu_read_lock */
+static inline void br_qcn_cp_xmit(struct sk_buff *skb)
+{
+	const struct net_bridge_port *p = rcu_dereference(skb->dev->br_port);
+	struct qcn_port_cp *pcp;
+
+	if (p && (pcp = rcu_dereference(p->qcn_cp)) != NULL)
+		qcn_port_cp_xmit(pcp, skb);
+}
+
+/* Below mq the RP of a flow is the htb of one TX queue; pick that one
+   rather than the stack's hash, which puts every bridged frame on the
+   same queue. Called with rcu_read_lock */
+static inline void br_qcn_tx_queue(struct sk_buff *skb)
+{
+	int queue = qcn_tx_queue(skb->dev, skb);
+
+	if (queue >= 0)
+		skb_record_rx_queue(skb, queue);
+}
+
 int br_dev_queue_push_xmit(struct sk_buff *skb)
 {
 	/* drop mtu oversized packets except gso */
@@ -55,6 +73,8 @@ int br_dev_queue_push_xmit(struct sk_buff *skb)
 		else {
 			skb_push(skb, ETH_HLEN);
 
+			br_qcn_cp_xmit(skb);
+			br_qcn_tx_queue(skb);
 			dev_queue_xmit(skb);
 		}
 	}
@@ -76,34 +96,28 @@ static void __br_deliver(const struct net_bridge_port *to, struct sk_buff *skb)
 			br_forward_finish);
 }
 
-static void __br_forward(const struct net_bridge_port *to, struct sk_buff *skb)
+/* skb already passed the LRO and checksum fixups of __br_forward() */
+static void __br_forward_one(const struct net_bridge_port *to,
+			     struct sk_buff *skb)
 {
 	struct net_device *indev;
-	struct ethhdr *ethh = eth_hdr(skb);
 
+	indev = skb->dev;
+	skb->dev = to->dev;
+
+	NF_HOOK(PF_BRIDGE, NF_BR_FORWARD, skb, indev, skb->dev,
+			br_forward_finish);
+}
+
+static void __br_forward(const struct net_bridge_port *to, struct sk_buff *skb)
+{
 	if (skb_warn_if_lro(skb)) {
 		kfree_skb(skb);
 		return;
 	}
 
-	indev = skb->dev;
-	if (likely(ntohs(ethh->h_proto) != ETH_QCN)) {
-		skb->dev = to->dev;
-		skb_forward_csum(skb);
-
-		NF_HOOK(PF_BRIDGE, NF_BR_FORWARD, skb, indev, skb->dev,
-				br_forward_finish);
-	} else {
-		/* Intercept QCN packets being forwarded to vifs */
-		if (strncmp("vif", to->dev->name, 3) == 0 &&
-			strcmp("htb", indev->qdisc->ops->id) == 0 && 
-			indev->qdisc->ops->change != NULL) {
-			/* Change QCN RP Rate */
-			indev->qdisc->ops->change(indev->qdisc, 
-			   (struct nlattr *) skb->data);
-		}
-		kfree(skb);
-	}
+	skb_forward_csum(skb);
+	__br_forward_one(to, skb);
 }
 
 /* called with rcu_read_lock */
@@ -149,26 +163,37 @@ static int deliver_clone(const struct net_bridge_port *prev,
 	return 0;
 }
 
-static struct net_bridge_port *maybe_deliver(
-	struct net_bridge_port *prev, struct net_bridge_port *p,
-	struct sk_buff *skb,
-	void (*__packet_hook)(const struct net_bridge_port *p,
-			      struct sk_buff *skb))
-{
-	int err;
-
-	if (!should_deliver(p, skb))
-		return prev;
-
-	if (!prev)
-		goto out;
+/* Flooding to many ports.
+ *
+ * The ports a frame goes to are gathered BR_FLOOD_BATCH at a time and
+ * the clones for a whole batch are taken in one go before any of them
+ * leaves. Every clone shares the data of skb, and taking them back to
+ * back keeps skb and its shared info in cache, rather than fetching
+ * them again after each port's transmit path has run. The last port
+ * of the flood gets skb itself unless the caller keeps it (skb0).
+ */
+#define BR_FLOOD_BATCH	16
 
-	err = deliver_clone(prev, skb, __packet_hook);
-	if (err)
-		return ERR_PTR(err);
+static int br_flood_batch(struct net_bridge *br, struct sk_buff *skb,
+			  struct net_bridge_port **port, int n,
+			  void (*__packet_hook)(const struct net_bridge_port *p,
+						struct sk_buff *skb))
+{
+	struct sk_buff *clone[BR_FLOOD_BATCH];
+	int i, k;
 
-out:
-	return p;
+	for (i = 0; i < n; i++) {
+		clone[i] = skb_clone(skb, GFP_ATOMIC);
+		if (!clone[i])
+			break;
+	}
+	for (k = 0; k < i; k++)
+		__packet_hook(port[k], clone[k]);
+	if (i < n) {
+		br->dev->stats.tx_dropped++;
+		return -ENOMEM;
+	}
+	return 0;
 }
 
 /* called under bridge lock */
@@ -177,24 +202,31 @@ static void br_flood(struct net_bridge *br, struct sk_buff *skb,
 		     void (*__packet_hook)(const struct net_bridge_port *p,
 					   struct sk_buff *skb))
 {
+	struct net_bridge_port *port[BR_FLOOD_BATCH];
 	struct net_bridge_port *p;
-	struct net_bridge_port *prev;
-
-	prev = NULL;
+	int n = 0;
 
 	list_for_each_entry_rcu(p, &br->port_list, list) {
-		prev = maybe_deliver(prev, p, skb, __packet_hook);
-		if (IS_ERR(prev))
-			goto out;
+		if (!should_deliver(p, skb))
+			continue;
+		if (n == BR_FLOOD_BATCH) {
+			if (br_flood_batch(br, skb, port, n, __packet_hook))
+				goto out;
+			n = 0;
+		}
+		port[n++] = p;
 	}
 
-	if (!prev)
+	if (!n)
 		goto out;
 
-	if (skb0)
-		deliver_clone(prev, skb, __packet_hook);
-	else
-		__packet_hook(prev, skb);
+	if (skb0) {
+		br_flood_batch(br, skb, port, n, __packet_hook);
+		return;
+	}
+	if (n > 1 && br_flood_batch(br, skb, port, n - 1, __packet_hook))
+		goto out;
+	__packet_hook(port[n - 1], skb);
 	return;
 
 out:
@@ -213,10 +245,46 @@ void br_flood_deliver(struct net_bridge *br, struct sk_buff *skb)
 void br_flood_forward(struct net_bridge *br, struct sk_buff *skb,
 		      struct sk_buff *skb2)
 {
-	br_flood(br, skb, skb2, __br_forward);
+	/* What __br_forward() checks and fixes holds for every copy of the
+	 * frame, so it is done once here. A caller that keeps skb for the
+	 * local stack gets it back untouched; the flood starts from a
+	 * clone then, which costs no more clones than before.
+	 */
+	if (skb2 && !(skb = skb_clone(skb, GFP_ATOMIC))) {
+		br->dev->stats.tx_dropped++;
+		return;
+	}
+	if (skb_warn_if_lro(skb)) {
+		kfree_skb(skb);
+		return;
+	}
+	skb_forward_csum(skb);
+	br_flood(br, skb, NULL, __br_forward_one);
 }
 
 #ifdef CONFIG_BRIDGE_IGMP_SNOOPING
+static struct net_bridge_port *maybe_deliver(
+	struct net_bridge_port *prev, struct net_bridge_port *p,
+	struct sk_buff *skb,
+	void (*__packet_hook)(const struct net_bridge_port *p,
+			      struct sk_buff *skb))
+{
+	int err;
+
+	if (!should_deliver(p, skb))
+		return prev;
+
+	if (!prev)
+		goto out;
+
+	err = deliver_clone(prev, skb, __packet_hook);
+	if (err)
+		return ERR_PTR(err);
+
+out:
+	return p;
+}
+
 /* called with rcu_read_lock */
 static void br_multicast_flood(struct net_bridge_mdb_entry *mdst,
 			       struct sk_buff *skb, struct sk_buff *skb0,
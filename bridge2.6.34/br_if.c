@@ -23,6 +23,7 @@
 #include <net/sock.h>
 
 #include "br_private.h"
+#include "../qcn.h"
 
 /*
  * Determine initial path cost based on speed.
@@ -90,6 +91,7 @@ static void release_nbp(struct kobject *kobj)
 {
 	struct net_bridge_port *p
 		= container_of(kobj, struct net_bridge_port, kobj);
+	free_percpu(p->stats);
 	kfree(p);
 }
 
@@ -147,6 +149,7 @@ static void del_nbp(struct net_bridge_port *p)
 	list_del_rcu(&p->list);
 
 	rcu_assign_pointer(dev->br_port, NULL);
+	br_qcn_cp_set(p, 0);
 
 	br_multicast_del_port(p);
 
@@ -168,6 +171,7 @@ static void del_br(struct net_bridge *br, struct list_head *head)
 	del_timer_sync(&br->gc_timer);
 
 	br_sysfs_delbr(br->dev);
+	cancel_work_sync(&br->fdb_rehash_work);
 	unregister_netdevice_queue(br->dev, head);
 }
 
@@ -189,6 +193,10 @@ static struct net_device *new_bridge_dev(struct net *net, const char *name)
 	spin_lock_init(&br->lock);
 	INIT_LIST_HEAD(&br->port_list);
 	spin_lock_init(&br->hash_lock);
+	if (br_fdb_hash_init(br)) {
+		free_netdev(dev);
+		return NULL;
+	}
 
 	br->bridge_id.prio[0] = 0x80;
 	br->bridge_id.prio[1] = 0x00;
@@ -210,7 +218,11 @@ static struct net_device *new_bridge_dev(struct net *net, const char *name)
 	br_netfilter_rtable_init(br);
 
 	br_stp_timer_init(br);
-	br_multicast_init(br);
+	if (br_multicast_init(br)) {
+		br_fdb_hash_fini(br);
+		free_netdev(dev);
+		return NULL;
+	}
 
 	return dev;
 }
@@ -252,6 +264,12 @@ static struct net_bridge_port *new_nbp(struct net_bridge *br,
 	if (p == NULL)
 		return ERR_PTR(-ENOMEM);
 
+	p->stats = alloc_percpu(struct br_port_stats);
+	if (p->stats == NULL) {
+		kfree(p);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	p->br = br;
 	dev_hold(dev);
 	p->dev = dev;
@@ -259,6 +277,8 @@ static struct net_bridge_port *new_nbp(struct net_bridge *br,
 	p->priority = 0x8000 >> BR_PORT_BITS;
 	p->port_no = index;
 	p->flags = 0;
+	p->qcn_q_eq = QCN_PORT_Q_EQ;
+	p->qcn_w = QCN_PORT_W;
 	br_init_port(p);
 	p->state = BR_STATE_DISABLED;
 	br_stp_port_timer_init(p);
@@ -267,6 +287,43 @@ static struct net_bridge_port *new_nbp(struct net_bridge *br,
 	return p;
 }
 
+/* Turns the QCN CP of the port on or off; called with RTNL */
+int br_qcn_cp_set(struct net_bridge_port *p, unsigned long on)
+{
+	struct qcn_port_cp *pcp = p->qcn_cp;
+
+	if (!on == !pcp)
+		return 0;
+	if (on) {
+		pcp = qcn_port_cp_create(p->dev, p->qcn_q_eq, p->qcn_w);
+		if (pcp == NULL)
+			return -ENOMEM;
+		rcu_assign_pointer(p->qcn_cp, pcp);
+		return 0;
+	}
+	rcu_assign_pointer(p->qcn_cp, NULL);
+	synchronize_net();
+	qcn_port_cp_destroy(pcp);
+	return 0;
+}
+
+void br_port_get_stats(const struct net_bridge_port *p,
+		       struct br_port_stats *sum)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		const struct br_port_stats *st = per_cpu_ptr(p->stats, cpu);
+
+		sum->forwarded += st->forwarded;
+		sum->flooded += st->flooded;
+		sum->dropped += st->dropped;
+		sum->cnm_intercepted += st->cnm_intercepted;
+		sum->cnm_delivered += st->cnm_delivered;
+	}
+}
+
 static struct device_type br_type = {
 	.name	= "bridge",
 };
@@ -301,6 +358,8 @@ int br_add_bridge(struct net *net, const char *name)
 	return ret;
 
 out_free:
+	br_multicast_free(netdev_priv(dev));
+	br_fdb_hash_fini(netdev_priv(dev));
 	free_netdev(dev);
 	goto out;
 }
@@ -448,6 +507,8 @@ err0:
 	dev_set_promiscuity(dev, -1);
 put_back:
 	dev_put(dev);
+	if (p)
+		free_percpu(p->stats);
 	kfree(p);
 	return err;
 }
@@ -26,7 +26,8 @@ static inline size_t br_nlmsg_size(void)
 	       + nla_total_size(4) /* IFLA_MTU */
 	       + nla_total_size(4) /* IFLA_LINK */
 	       + nla_total_size(1) /* IFLA_OPERSTATE */
-	       + nla_total_size(1); /* IFLA_PROTINFO */
+	       + nla_total_size(1) /* IFLA_PROTINFO */
+	       + nla_total_size(sizeof(struct br_port_xstats));
 }
 
 /*
@@ -41,6 +42,8 @@ static int br_fill_ifinfo(struct sk_buff *skb, const struct net_bridge_port *por
 	struct ifinfomsg *hdr;
 	struct nlmsghdr *nlh;
 	u8 operstate = netif_running(dev) ? dev->operstate : IF_OPER_DOWN;
+	struct br_port_stats st;
+	struct br_port_xstats xst;
 
 	pr_debug("br_fill_info event %d port %s master %s\n",
 		 event, dev->name, br->dev->name);
@@ -68,9 +71,18 @@ static int br_fill_ifinfo(struct sk_buff *skb, const struct net_bridge_port *por
 	if (dev->ifindex != dev->iflink)
 		NLA_PUT_U32(skb, IFLA_LINK, dev->iflink);
 
-	if (event == RTM_NEWLINK)
+	if (event == RTM_NEWLINK) {
 		NLA_PUT_U8(skb, IFLA_PROTINFO, port->state);
 
+		br_port_get_stats(port, &st);
+		xst.forwarded = st.forwarded;
+		xst.flooded = st.flooded;
+		xst.dropped = st.dropped;
+		xst.cnm_intercepted = st.cnm_intercepted;
+		xst.cnm_delivered = st.cnm_delivered;
+		NLA_PUT(skb, IFLA_BRPORT_XSTATS, sizeof(xst), &xst);
+	}
+
 	return nlmsg_end(skb, nlh);
 
 nla_put_failure:
@@ -19,11 +19,13 @@
 #include <linux/spinlock.h>
 
 #include "br_private.h"
+#include "../qcn.h"
 
 struct brport_attribute {
 	struct attribute	attr;
 	ssize_t (*show)(struct net_bridge_port *, char *);
 	ssize_t (*store)(struct net_bridge_port *, unsigned long);
+	int	sleeps;		/* store under RTNL alone, not br->lock */
 };
 
 #define BRPORT_ATTR(_name,_mode,_show,_store)		        \
@@ -34,6 +36,15 @@ struct brport_attribute brport_attr_##_name = { 	        \
 	.store	= _store,					\
 };
 
+#define BRPORT_ATTR_SLEEPS(_name,_mode,_show,_store)	        \
+struct brport_attribute brport_attr_##_name = { 	        \
+	.attr = {.name = __stringify(_name), 			\
+		 .mode = _mode },				\
+	.show	= _show,					\
+	.store	= _store,					\
+	.sleeps	= 1,						\
+};
+
 static ssize_t show_path_cost(struct net_bridge_port *p, char *buf)
 {
 	return sprintf(buf, "%d\n", p->path_cost);
@@ -159,6 +170,78 @@ static ssize_t store_hairpin_mode(struct net_bridge_port *p, unsigned long v)
 static BRPORT_ATTR(hairpin_mode, S_IRUGO | S_IWUSR,
 		   show_hairpin_mode, store_hairpin_mode);
 
+#define BRPORT_STAT_ATTR(_name)						\
+static ssize_t show_##_name(struct net_bridge_port *p, char *buf)	\
+{									\
+	struct br_port_stats st;					\
+									\
+	br_port_get_stats(p, &st);					\
+	return sprintf(buf, "%lu\n", st._name);				\
+}									\
+static BRPORT_ATTR(_name, S_IRUGO, show_##_name, NULL)
+
+BRPORT_STAT_ATTR(forwarded);
+BRPORT_STAT_ATTR(flooded);
+BRPORT_STAT_ATTR(dropped);
+BRPORT_STAT_ATTR(cnm_intercepted);
+BRPORT_STAT_ATTR(cnm_delivered);
+
+static ssize_t show_qcn_cp(struct net_bridge_port *p, char *buf)
+{
+	return sprintf(buf, "%d\n", p->qcn_cp != NULL);
+}
+static ssize_t store_qcn_cp(struct net_bridge_port *p, unsigned long v)
+{
+	return br_qcn_cp_set(p, v);
+}
+static BRPORT_ATTR_SLEEPS(qcn_cp, S_IRUGO | S_IWUSR,
+			  show_qcn_cp, store_qcn_cp);
+
+static ssize_t show_qcn_q_eq(struct net_bridge_port *p, char *buf)
+{
+	return sprintf(buf, "%u\n", p->qcn_q_eq);
+}
+static ssize_t store_qcn_q_eq(struct net_bridge_port *p, unsigned long v)
+{
+	if (v > INT_MAX || qcn_port_cp_check(v, p->qcn_w))
+		return -EINVAL;
+	p->qcn_q_eq = v;
+	if (p->qcn_cp)
+		qcn_port_cp_change(p->qcn_cp, p->qcn_q_eq, p->qcn_w);
+	return 0;
+}
+static BRPORT_ATTR(qcn_q_eq, S_IRUGO | S_IWUSR,
+		   show_qcn_q_eq, store_qcn_q_eq);
+
+static ssize_t show_qcn_w(struct net_bridge_port *p, char *buf)
+{
+	return sprintf(buf, "%u\n", p->qcn_w);
+}
+static ssize_t store_qcn_w(struct net_bridge_port *p, unsigned long v)
+{
+	if (v > INT_MAX || qcn_port_cp_check(p->qcn_q_eq, v))
+		return -EINVAL;
+	p->qcn_w = v;
+	if (p->qcn_cp)
+		qcn_port_cp_change(p->qcn_cp, p->qcn_q_eq, p->qcn_w);
+	return 0;
+}
+static BRPORT_ATTR(qcn_w, S_IRUGO | S_IWUSR, show_qcn_w, store_qcn_w);
+
+static ssize_t show_qcn_cnm_generated(struct net_bridge_port *p, char *buf)
+{
+	struct qcn_port_cp *pcp;
+	u32 n = 0;
+
+	rcu_read_lock();
+	pcp = rcu_dereference(p->qcn_cp);
+	if (pcp)
+		n = pcp->cp.cnm_generated;
+	rcu_read_unlock();
+	return sprintf(buf, "%u\n", n);
+}
+static BRPORT_ATTR(qcn_cnm_generated, S_IRUGO, show_qcn_cnm_generated, NULL);
+
 #ifdef CONFIG_BRIDGE_IGMP_SNOOPING
 static ssize_t show_multicast_router(struct net_bridge_port *p, char *buf)
 {
@@ -191,6 +274,15 @@ static struct brport_attribute *brport_attrs[] = {
 	&brport_attr_hold_timer,
 	&brport_attr_flush,
 	&brport_attr_hairpin_mode,
+	&brport_attr_forwarded,
+	&brport_attr_flooded,
+	&brport_attr_dropped,
+	&brport_attr_cnm_intercepted,
+	&brport_attr_cnm_delivered,
+	&brport_attr_qcn_cp,
+	&brport_attr_qcn_q_eq,
+	&brport_attr_qcn_w,
+	&brport_attr_qcn_cnm_generated,
 #ifdef CONFIG_BRIDGE_IGMP_SNOOPING
 	&brport_attr_multicast_router,
 #endif
@@ -227,9 +319,13 @@ static ssize_t brport_store(struct kobject * kobj,
 		if (!rtnl_trylock())
 			return restart_syscall();
 		if (p->dev && p->br && brport_attr->store) {
-			spin_lock_bh(&p->br->lock);
-			ret = brport_attr->store(p, val);
-			spin_unlock_bh(&p->br->lock);
+			if (brport_attr->sleeps)
+				ret = brport_attr->store(p, val);
+			else {
+				spin_lock_bh(&p->br->lock);
+				ret = brport_attr->store(p, val);
+				spin_unlock_bh(&p->br->lock);
+			}
 			if (ret == 0)
 				ret = count;
 		}
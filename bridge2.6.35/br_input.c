@@ -17,6 +17,7 @@
 #include <linux/etherdevice.h>
 #include <linux/netfilter_bridge.h>
 #include "br_private.h"
+#include "../qcn.h"
 
 /* Bridge group multicast address 802.1d (pg 51). */
 const u8 br_group_address[ETH_ALEN] = { 0x01, 0x80, 0xc2, 0x00, 0x00, 0x00 };
@@ -78,6 +79,7 @@ int br_handle_frame_finish(struct sk_buff *skb)
 			    br_multicast_is_router(br))
 				skb2 = skb;
 			br_multicast_forward(mdst, skb, skb2);
+			br_port_stat_inc(p, flooded);
 			skb = NULL;
 			if (!skb2)
 				goto out;
@@ -91,11 +93,24 @@ int br_handle_frame_finish(struct sk_buff *skb)
 		skb = NULL;
 	}
 
+	/* A CNM on its way to a sender behind a port with an ingress RP
+	   is that RP's business, see qcn_fb_ingress() */
+	if (skb && dst && !skb2 && unlikely(qcn_is_cnm(skb)) &&
+	    qcn_fb_ingress(dst->dst->dev->ifindex)) {
+		br_port_stat_inc(dst->dst, cnm_delivered);
+		qcn_fb_deliver(dst->dst->dev, skb);
+		consume_skb(skb);
+		goto out;
+	}
+
 	if (skb) {
-		if (dst)
+		if (dst) {
 			br_forward(dst->dst, skb, skb2);
-		else
+			br_port_stat_inc(p, forwarded);
+		} else {
 			br_flood_forward(br, skb, skb2);
+			br_port_stat_inc(p, flooded);
+		}
 	}
 
 	if (skb2)
@@ -104,6 +119,8 @@ int br_handle_frame_finish(struct sk_buff *skb)
 out:
 	return 0;
 drop:
+	if (p)
+		br_port_stat_inc(p, dropped);
 	kfree_skb(skb);
 	goto out;
 }
@@ -147,6 +164,28 @@ struct sk_buff *br_handle_frame(struct net_bridge_port *p, struct sk_buff *skb)
 	if (!skb)
 		return NULL;
 
+	/* The QCN CPs send their CNMs out of skb_iif, see qcn_ingress_dev():
+	   make that this port rather than the first device the frame was
+	   received on, which is the lower device of a VLAN port or a port
+	   of another bridge the frame already crossed on this host */
+	skb->skb_iif = p->dev->ifindex;
+
+	/* CNMs for the RP of this port go up to the qcn receive handler,
+	   everybody else's are bridged like any other frame. Tagged ones
+	   are handed over right here, the port need not have a VLAN
+	   device to take them up. */
+	if (unlikely(qcn_is_cnm(skb))) {
+		br_port_stat_inc(p, cnm_intercepted);
+		if (qcn_fb_registered(p->dev->ifindex)) {
+			br_port_stat_inc(p, cnm_delivered);
+			if (!qcn_is_vlan_proto(skb->protocol))
+				return skb;
+			qcn_fb_deliver(p->dev, skb);
+			consume_skb(skb);
+			return NULL;
+		}
+	}
+
 	if (unlikely(is_link_local(dest))) {
 		/* Pause frames shouldn't be passed up by driver anyway */
 		if (skb->protocol == htons(ETH_P_PAUSE))
@@ -182,6 +221,7 @@ forward:
 		break;
 	default:
 drop:
+		br_port_stat_inc(p, dropped);
 		kfree_skb(skb);
 	}
 	return NULL;
@@ -23,6 +23,8 @@
 #include <linux/skbuff.h>
 #include <linux/slab.h>
 #include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
 #include <net/ip.h>
 #if defined(CONFIG_IPV6) || defined(CONFIG_IPV6_MODULE)
 #include <net/ipv6.h>
@@ -132,6 +134,29 @@ static struct net_bridge_mdb_entry *br_mdb_ip6_get(
 }
 #endif
 
+/* The lookup of the forwarding path, which also counts its cost */
+static struct net_bridge_mdb_entry *br_mdb_fwd_get(struct net_bridge *br,
+	struct net_bridge_mdb_htable *mdb, struct br_ip *dst)
+{
+	struct br_mdb_stats *st;
+	struct net_bridge_mdb_entry *mp;
+	struct hlist_node *p;
+
+	if (!mdb)
+		return NULL;
+
+	st = per_cpu_ptr(br->mdb_stats, smp_processor_id());
+	st->lookups++;
+	hlist_for_each_entry_rcu(mp, p, &mdb->mhash[br_ip_hash(mdb, dst)],
+				 hlist[mdb->ver]) {
+		st->steps++;
+		if (br_ip_equal(&mp->addr, dst))
+			return mp;
+	}
+
+	return NULL;
+}
+
 struct net_bridge_mdb_entry *br_mdb_get(struct net_bridge *br,
 					struct sk_buff *skb)
 {
@@ -159,7 +184,7 @@ struct net_bridge_mdb_entry *br_mdb_get(struct net_bridge *br,
 		return NULL;
 	}
 
-	return br_mdb_ip_get(mdb, &ip);
+	return br_mdb_fwd_get(br, mdb, &ip);
 }
 
 static void br_mdb_free(struct rcu_head *head)
@@ -1330,6 +1355,63 @@ static void br_ip6_multicast_leave_group(struct net_bridge *br,
 }
 #endif
 
+/* Applies the IGMP message at skb->data, the transport header, to the
+ * database: right away for the bridge device itself, from the backlog
+ * worker for the ports.
+ */
+static int br_multicast_ipv4_process(struct net_bridge *br,
+				     struct net_bridge_port *port,
+				     struct sk_buff *skb)
+{
+	struct igmphdr *ih = igmp_hdr(skb);
+	int err = 0;
+
+	switch (ih->type) {
+	case IGMP_HOST_MEMBERSHIP_REPORT:
+	case IGMPV2_HOST_MEMBERSHIP_REPORT:
+		err = br_ip4_multicast_add_group(br, port, ih->group);
+		break;
+	case IGMPV3_HOST_MEMBERSHIP_REPORT:
+		err = br_ip4_multicast_igmp3_report(br, port, skb);
+		break;
+	case IGMP_HOST_MEMBERSHIP_QUERY:
+		err = br_ip4_multicast_query(br, port, skb);
+		break;
+	case IGMP_HOST_LEAVE_MESSAGE:
+		br_ip4_multicast_leave_group(br, port, ih->group);
+		break;
+	}
+
+	return err;
+}
+
+#define BR_MULTICAST_BACKLOG	1000
+
+/* Messages received on a port are left to a worker, so that a storm of
+ * reports, and the rehashes it triggers, does not hold up forwarding.
+ * The copy keeps a reference on the receiving device until the worker
+ * is done with it. A full backlog only loses the snooping, the message
+ * itself is still forwarded.
+ */
+static int br_multicast_defer(struct net_bridge *br, struct sk_buff *skb)
+{
+	struct sk_buff *nskb;
+
+	if (skb_queue_len(&br->multicast_backlog) >= BR_MULTICAST_BACKLOG) {
+		br->multicast_backlog_drops++;
+		return 0;
+	}
+
+	nskb = skb_clone(skb, GFP_ATOMIC);
+	if (!nskb)
+		return -ENOMEM;
+
+	dev_hold(nskb->dev);
+	skb_queue_tail(&br->multicast_backlog, nskb);
+	schedule_work(&br->multicast_work);
+	return 0;
+}
+
 static int br_multicast_ipv4_rcv(struct net_bridge *br,
 				 struct net_bridge_port *port,
 				 struct sk_buff *skb)
@@ -1400,22 +1482,14 @@ static int br_multicast_ipv4_rcv(struct net_bridge *br,
 	BR_INPUT_SKB_CB(skb)->igmp = 1;
 	ih = igmp_hdr(skb2);
 
-	switch (ih->type) {
-	case IGMP_HOST_MEMBERSHIP_REPORT:
-	case IGMPV2_HOST_MEMBERSHIP_REPORT:
+	if (ih->type == IGMP_HOST_MEMBERSHIP_REPORT ||
+	    ih->type == IGMPV2_HOST_MEMBERSHIP_REPORT)
 		BR_INPUT_SKB_CB(skb2)->mrouters_only = 1;
-		err = br_ip4_multicast_add_group(br, port, ih->group);
-		break;
-	case IGMPV3_HOST_MEMBERSHIP_REPORT:
-		err = br_ip4_multicast_igmp3_report(br, port, skb2);
-		break;
-	case IGMP_HOST_MEMBERSHIP_QUERY:
-		err = br_ip4_multicast_query(br, port, skb2);
-		break;
-	case IGMP_HOST_LEAVE_MESSAGE:
-		br_ip4_multicast_leave_group(br, port, ih->group);
-		break;
-	}
+
+	if (port)
+		err = br_multicast_defer(br, skb2);
+	else
+		err = br_multicast_ipv4_process(br, port, skb2);
 
 out:
 	__skb_push(skb2, offset);
@@ -1426,6 +1500,33 @@ err_out:
 }
 
 #if defined(CONFIG_IPV6) || defined(CONFIG_IPV6_MODULE)
+/* The MLD counterpart of br_multicast_ipv4_process() */
+static int br_multicast_ipv6_process(struct net_bridge *br,
+				     struct net_bridge_port *port,
+				     struct sk_buff *skb)
+{
+	struct icmp6hdr *icmp6h = icmp6_hdr(skb);
+	struct mld_msg *mld = (struct mld_msg *)icmp6h;
+	int err = 0;
+
+	switch (icmp6h->icmp6_type) {
+	case ICMPV6_MGM_REPORT:
+		err = br_ip6_multicast_add_group(br, port, &mld->mld_mca);
+		break;
+	case ICMPV6_MLD2_REPORT:
+		err = br_ip6_multicast_mld2_report(br, port, skb);
+		break;
+	case ICMPV6_MGM_QUERY:
+		err = br_ip6_multicast_query(br, port, skb);
+		break;
+	case ICMPV6_MGM_REDUCTION:
+		br_ip6_multicast_leave_group(br, port, &mld->mld_mca);
+		break;
+	}
+
+	return err;
+}
+
 static int br_multicast_ipv6_rcv(struct net_bridge *br,
 				 struct net_bridge_port *port,
 				 struct sk_buff *skb)
@@ -1513,26 +1614,13 @@ static int br_multicast_ipv6_rcv(struct net_bridge *br,
 
 	BR_INPUT_SKB_CB(skb)->igmp = 1;
 
-	switch (icmp6h->icmp6_type) {
-	case ICMPV6_MGM_REPORT:
-	    {
-		struct mld_msg *mld = (struct mld_msg *)icmp6h;
+	if (icmp6h->icmp6_type == ICMPV6_MGM_REPORT)
 		BR_INPUT_SKB_CB(skb2)->mrouters_only = 1;
-		err = br_ip6_multicast_add_group(br, port, &mld->mld_mca);
-		break;
-	    }
-	case ICMPV6_MLD2_REPORT:
-		err = br_ip6_multicast_mld2_report(br, port, skb2);
-		break;
-	case ICMPV6_MGM_QUERY:
-		err = br_ip6_multicast_query(br, port, skb2);
-		break;
-	case ICMPV6_MGM_REDUCTION:
-	    {
-		struct mld_msg *mld = (struct mld_msg *)icmp6h;
-		br_ip6_multicast_leave_group(br, port, &mld->mld_mca);
-	    }
-	}
+
+	if (port)
+		err = br_multicast_defer(br, skb2);
+	else
+		err = br_multicast_ipv6_process(br, port, skb2);
 
 out:
 	__skb_push(skb2, offset);
@@ -1563,6 +1651,52 @@ int br_multicast_rcv(struct net_bridge *br, struct net_bridge_port *port,
 	return 0;
 }
 
+static void br_multicast_backlog_run(struct work_struct *work)
+{
+	struct net_bridge *br = container_of(work, struct net_bridge,
+					     multicast_work);
+	struct net_bridge_mdb_htable *mdb;
+	struct net_bridge_port *port;
+	struct sk_buff *skb;
+	int busy;
+
+	while ((skb = skb_dequeue(&br->multicast_backlog))) {
+		/* We may sleep here: rather than have a join refused while
+		 * the previous table waits for its grace period, wait for it.
+		 */
+		rcu_read_lock_bh();
+		mdb = rcu_dereference(br->mdb);
+		busy = mdb && mdb->old;
+		rcu_read_unlock_bh();
+		if (busy)
+			rcu_barrier_bh();
+
+		__skb_pull(skb, skb_transport_offset(skb));
+
+		rcu_read_lock();
+		local_bh_disable();
+		port = rcu_dereference(skb->dev->br_port);
+		if (port && port->br == br) {
+			switch (skb->protocol) {
+			case htons(ETH_P_IP):
+				br_multicast_ipv4_process(br, port, skb);
+				break;
+#if defined(CONFIG_IPV6) || defined(CONFIG_IPV6_MODULE)
+			case htons(ETH_P_IPV6):
+				br_multicast_ipv6_process(br, port, skb);
+				break;
+#endif
+			}
+		}
+		local_bh_enable();
+		rcu_read_unlock();
+
+		dev_put(skb->dev);
+		kfree_skb(skb);
+		cond_resched();
+	}
+}
+
 static void br_multicast_query_expired(unsigned long data)
 {
 	struct net_bridge *br = (void *)data;
@@ -1577,7 +1711,7 @@ static void br_multicast_query_expired(unsigned long data)
 	spin_unlock(&br->multicast_lock);
 }
 
-void br_multicast_init(struct net_bridge *br)
+int br_multicast_init(struct net_bridge *br)
 {
 	br->hash_elasticity = 4;
 	br->hash_max = 512;
@@ -1600,6 +1734,40 @@ void br_multicast_init(struct net_bridge *br)
 		    br_multicast_local_router_expired, 0);
 	setup_timer(&br->multicast_query_timer, br_multicast_query_expired,
 		    (unsigned long)br);
+
+	skb_queue_head_init(&br->multicast_backlog);
+	INIT_WORK(&br->multicast_work, br_multicast_backlog_run);
+
+	br->mdb_stats = alloc_percpu(struct br_mdb_stats);
+	return br->mdb_stats ? 0 : -ENOMEM;
+}
+
+/* called from the bridge destructor */
+void br_multicast_free(struct net_bridge *br)
+{
+	struct sk_buff *skb;
+
+	cancel_work_sync(&br->multicast_work);
+	while ((skb = skb_dequeue(&br->multicast_backlog))) {
+		dev_put(skb->dev);
+		kfree_skb(skb);
+	}
+	free_percpu(br->mdb_stats);
+	br->mdb_stats = NULL;
+}
+
+void br_multicast_lookup_stats(struct net_bridge *br,
+			       unsigned long *lookups, unsigned long *steps)
+{
+	int cpu;
+
+	*lookups = *steps = 0;
+	for_each_possible_cpu(cpu) {
+		const struct br_mdb_stats *st = per_cpu_ptr(br->mdb_stats, cpu);
+
+		*lookups += st->lookups;
+		*steps += st->steps;
+	}
 }
 
 void br_multicast_open(struct net_bridge *br)
@@ -31,6 +31,7 @@
 #include <linux/netfilter_arp.h>
 #include <linux/in_route.h>
 #include <linux/inetdevice.h>
+#include <linux/mutex.h>
 
 #include <net/ip.h>
 #include <net/ipv6.h>
@@ -876,6 +877,38 @@ static struct nf_hook_ops br_nf_ops[] __read_mostly = {
 	},
 };
 
+/* The hooks are only registered while bridged traffic is handed to the
+ * IP, IPv6 or ARP tables. With all three switched off, and no ebtables
+ * table loaded, the NF_HOOK()s of the bridge find their hook lists empty
+ * and call okfn directly; setting one of the sysctls brings them back.
+ */
+static DEFINE_MUTEX(brnf_ops_mutex);
+static int brnf_ops_registered;
+
+static int brnf_update_hooks(void)
+{
+	int want, ret = 0;
+
+#ifdef CONFIG_SYSCTL
+	want = brnf_call_iptables || brnf_call_ip6tables ||
+	       brnf_call_arptables;
+#else
+	want = 1;
+#endif
+
+	mutex_lock(&brnf_ops_mutex);
+	if (want && !brnf_ops_registered) {
+		ret = nf_register_hooks(br_nf_ops, ARRAY_SIZE(br_nf_ops));
+		if (!ret)
+			brnf_ops_registered = 1;
+	} else if (!want && brnf_ops_registered) {
+		nf_unregister_hooks(br_nf_ops, ARRAY_SIZE(br_nf_ops));
+		brnf_ops_registered = 0;
+	}
+	mutex_unlock(&brnf_ops_mutex);
+	return ret;
+}
+
 #ifdef CONFIG_SYSCTL
 static
 int brnf_sysctl_call_tables(ctl_table * ctl, int write,
@@ -887,6 +920,8 @@ int brnf_sysctl_call_tables(ctl_table * ctl, int write,
 
 	if (write && *(int *)(ctl->data))
 		*(int *)(ctl->data) = 1;
+	if (write && !ret)
+		ret = brnf_update_hooks();
 	return ret;
 }
 
@@ -940,7 +975,7 @@ int __init br_netfilter_init(void)
 {
 	int ret;
 
-	ret = nf_register_hooks(br_nf_ops, ARRAY_SIZE(br_nf_ops));
+	ret = brnf_update_hooks();
 	if (ret < 0)
 		return ret;
 #ifdef CONFIG_SYSCTL
@@ -948,7 +983,8 @@ int __init br_netfilter_init(void)
 	if (brnf_sysctl_header == NULL) {
 		printk(KERN_WARNING
 		       "br_netfilter: can't register to sysctl.\n");
-		nf_unregister_hooks(br_nf_ops, ARRAY_SIZE(br_nf_ops));
+		if (brnf_ops_registered)
+			nf_unregister_hooks(br_nf_ops, ARRAY_SIZE(br_nf_ops));
 		return -ENOMEM;
 	}
 #endif
@@ -958,7 +994,8 @@ int __init br_netfilter_init(void)
 
 void br_netfilter_fini(void)
 {
-	nf_unregister_hooks(br_nf_ops, ARRAY_SIZE(br_nf_ops));
+	if (brnf_ops_registered)
+		nf_unregister_hooks(br_nf_ops, ARRAY_SIZE(br_nf_ops));
 #ifdef CONFIG_SYSCTL
 	unregister_sysctl_table(brnf_sysctl_header);
 #endif
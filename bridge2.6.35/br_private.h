@@ -17,9 +17,20 @@
 #include <linux/if_bridge.h>
 #include <net/route.h>
 
+#include "../qcn_tc.h"
+
 #define BR_HASH_BITS 8
 #define BR_HASH_SIZE (1 << BR_HASH_BITS)
 
+/* forwarding table buckets, resized with the number of entries */
+#define BR_FDB_HASH_MIN		BR_HASH_SIZE
+#define BR_FDB_HASH_MAX		(1 << 17)	/* default limit */
+#define BR_FDB_HASH_LIMIT	(1 << 22)
+
+/* per-CPU cache of recently looked up destinations */
+#define BR_FDB_CACHE_BITS	6
+#define BR_FDB_CACHE_SIZE	(1 << BR_FDB_CACHE_BITS)
+
 #define BR_HOLD_TIME (1*HZ)
 
 #define BR_PORT_BITS	10
@@ -58,7 +69,7 @@ struct br_ip
 
 struct net_bridge_fdb_entry
 {
-	struct hlist_node		hlist;
+	struct hlist_node		hlist[2];
 	struct net_bridge_port		*dst;
 
 	struct rcu_head			rcu;
@@ -68,6 +79,31 @@ struct net_bridge_fdb_entry
 	unsigned char			is_static;
 };
 
+struct br_mdb_stats
+{
+	unsigned long			lookups;
+	unsigned long			steps;		/* entries compared */
+};
+
+struct net_bridge_fdb_htable
+{
+	struct hlist_head		*hash;
+	struct net_bridge_fdb_htable	*old;
+	u32				size;
+	u32				max;
+	u32				ver;
+};
+
+struct br_fdb_cache
+{
+	struct {
+		struct net_bridge_fdb_entry	*fdb;
+		unsigned int			gen;
+	} slot[BR_FDB_CACHE_SIZE];
+	unsigned long			hits;
+	unsigned long			misses;
+};
+
 struct net_bridge_port_group {
 	struct net_bridge_port		*port;
 	struct net_bridge_port_group	*next;
@@ -103,6 +139,20 @@ struct net_bridge_mdb_htable
 	u32				ver;
 };
 
+/* Counted on the port a frame came in on */
+struct br_port_stats
+{
+	unsigned long			forwarded;	/* to one port */
+	unsigned long			flooded;	/* to all or a group */
+	unsigned long			dropped;
+	unsigned long			cnm_intercepted;
+	unsigned long			cnm_delivered;	/* to the local RP */
+};
+
+#define br_port_stat_inc(p, field)	(this_cpu_ptr((p)->stats)->field++)
+
+/* The sums of the above go out as IFLA_BRPORT_XSTATS, see qcn_tc.h */
+
 struct net_bridge_port
 {
 	struct net_bridge		*br;
@@ -127,10 +177,16 @@ struct net_bridge_port
 	struct timer_list		message_age_timer;
 	struct kobject			kobj;
 	struct rcu_head			rcu;
+	struct br_port_stats		*stats;
 
 	unsigned long 			flags;
 #define BR_HAIRPIN_MODE		0x00000001
 
+	/* QCN CP on what the port sends, see qcn_port_cp_xmit() */
+	struct qcn_port_cp		*qcn_cp;	/* RCU, NULL while off */
+	u32				qcn_q_eq;
+	u32				qcn_w;
+
 #ifdef CONFIG_BRIDGE_IGMP_SNOOPING
 	u32				multicast_startup_queries_sent;
 	unsigned char			multicast_router;
@@ -160,7 +216,11 @@ struct net_bridge
 
 	struct br_cpu_netstats __percpu *stats;
 	spinlock_t			hash_lock;
-	struct hlist_head		hash[BR_HASH_SIZE];
+	struct net_bridge_fdb_htable	*fdb;
+	u32				fdb_hash_max;
+	struct work_struct		fdb_rehash_work;
+	struct br_fdb_cache		*fdb_cache;
+	unsigned int			fdb_gen;
 	unsigned long			feature_mask;
 #ifdef CONFIG_BRIDGE_NETFILTER
 	struct rtable 			fake_rtable;
@@ -219,6 +279,11 @@ struct net_bridge
 	struct timer_list		multicast_router_timer;
 	struct timer_list		multicast_querier_timer;
 	struct timer_list		multicast_query_timer;
+
+	struct sk_buff_head		multicast_backlog;
+	struct work_struct		multicast_work;
+	u32				multicast_backlog_drops;
+	struct br_mdb_stats		*mdb_stats;
 #endif
 
 	struct timer_list		hello_timer;
@@ -302,6 +367,11 @@ extern int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 extern int br_fdb_insert(struct net_bridge *br,
 			 struct net_bridge_port *source,
 			 const unsigned char *addr);
+extern int br_fdb_hash_init(struct net_bridge *br);
+extern void br_fdb_hash_fini(struct net_bridge *br);
+extern int br_fdb_set_hash_max(struct net_bridge *br, unsigned long val);
+extern void br_fdb_cache_stats(struct net_bridge *br,
+			       unsigned long *hits, unsigned long *misses);
 extern void br_fdb_update(struct net_bridge *br,
 			  struct net_bridge_port *source,
 			  const unsigned char *addr);
@@ -321,6 +391,9 @@ extern void br_flood_forward(struct net_bridge *br, struct sk_buff *skb,
 extern void br_port_carrier_check(struct net_bridge_port *p);
 extern int br_add_bridge(struct net *net, const char *name);
 extern int br_del_bridge(struct net *net, const char *name);
+extern void br_port_get_stats(const struct net_bridge_port *p,
+			      struct br_port_stats *sum);
+extern int br_qcn_cp_set(struct net_bridge_port *p, unsigned long on);
 extern void br_net_exit(struct net *net);
 extern int br_add_if(struct net_bridge *br,
 	      struct net_device *dev);
@@ -349,7 +422,8 @@ extern void br_multicast_add_port(struct net_bridge_port *port);
 extern void br_multicast_del_port(struct net_bridge_port *port);
 extern void br_multicast_enable_port(struct net_bridge_port *port);
 extern void br_multicast_disable_port(struct net_bridge_port *port);
-extern void br_multicast_init(struct net_bridge *br);
+extern int br_multicast_init(struct net_bridge *br);
+extern void br_multicast_free(struct net_bridge *br);
 extern void br_multicast_open(struct net_bridge *br);
 extern void br_multicast_stop(struct net_bridge *br);
 extern void br_multicast_deliver(struct net_bridge_mdb_entry *mdst,
@@ -361,6 +435,9 @@ extern int br_multicast_set_port_router(struct net_bridge_port *p,
 					unsigned long val);
 extern int br_multicast_toggle(struct net_bridge *br, unsigned long val);
 extern int br_multicast_set_hash_max(struct net_bridge *br, unsigned long val);
+extern void br_multicast_lookup_stats(struct net_bridge *br,
+				      unsigned long *lookups,
+				      unsigned long *steps);
 
 static inline bool br_multicast_is_router(struct net_bridge *br)
 {
@@ -398,7 +475,12 @@ static inline void br_multicast_disable_port(struct net_bridge_port *port)
 {
 }
 
-static inline void br_multicast_init(struct net_bridge *br)
+static inline int br_multicast_init(struct net_bridge *br)
+{
+	return 0;
+}
+
+static inline void br_multicast_free(struct net_bridge *br)
 {
 }
 
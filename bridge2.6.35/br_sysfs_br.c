@@ -345,6 +345,55 @@ static ssize_t store_flush(struct device *d,
 }
 static DEVICE_ATTR(flush, S_IWUSR, NULL, store_flush);
 
+static ssize_t show_fdb_hash_size(struct device *d,
+				  struct device_attribute *attr, char *buf)
+{
+	struct net_bridge *br = to_bridge(d);
+	u32 max;
+
+	rcu_read_lock();
+	max = rcu_dereference(br->fdb)->max;
+	rcu_read_unlock();
+	return sprintf(buf, "%u\n", max);
+}
+static DEVICE_ATTR(fdb_hash_size, S_IRUGO, show_fdb_hash_size, NULL);
+
+static ssize_t show_fdb_hash_max(struct device *d,
+				 struct device_attribute *attr, char *buf)
+{
+	struct net_bridge *br = to_bridge(d);
+	return sprintf(buf, "%u\n", br->fdb_hash_max);
+}
+
+static ssize_t store_fdb_hash_max(struct device *d,
+				  struct device_attribute *attr,
+				  const char *buf, size_t len)
+{
+	return store_bridge_parm(d, buf, len, br_fdb_set_hash_max);
+}
+static DEVICE_ATTR(fdb_hash_max, S_IRUGO | S_IWUSR, show_fdb_hash_max,
+		   store_fdb_hash_max);
+
+static ssize_t show_fdb_cache_hits(struct device *d,
+				   struct device_attribute *attr, char *buf)
+{
+	unsigned long hits, misses;
+
+	br_fdb_cache_stats(to_bridge(d), &hits, &misses);
+	return sprintf(buf, "%lu\n", hits);
+}
+static DEVICE_ATTR(fdb_cache_hits, S_IRUGO, show_fdb_cache_hits, NULL);
+
+static ssize_t show_fdb_cache_misses(struct device *d,
+				     struct device_attribute *attr, char *buf)
+{
+	unsigned long hits, misses;
+
+	br_fdb_cache_stats(to_bridge(d), &hits, &misses);
+	return sprintf(buf, "%lu\n", misses);
+}
+static DEVICE_ATTR(fdb_cache_misses, S_IRUGO, show_fdb_cache_misses, NULL);
+
 #ifdef CONFIG_BRIDGE_IGMP_SNOOPING
 static ssize_t show_multicast_router(struct device *d,
 				     struct device_attribute *attr, char *buf)
@@ -416,6 +465,38 @@ static ssize_t store_hash_max(struct device *d, struct device_attribute *attr,
 static DEVICE_ATTR(hash_max, S_IRUGO | S_IWUSR, show_hash_max,
 		   store_hash_max);
 
+static ssize_t show_multicast_lookups(struct device *d,
+				      struct device_attribute *attr, char *buf)
+{
+	unsigned long lookups, steps;
+
+	br_multicast_lookup_stats(to_bridge(d), &lookups, &steps);
+	return sprintf(buf, "%lu\n", lookups);
+}
+static DEVICE_ATTR(multicast_lookups, S_IRUGO, show_multicast_lookups, NULL);
+
+static ssize_t show_multicast_lookup_steps(struct device *d,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	unsigned long lookups, steps;
+
+	br_multicast_lookup_stats(to_bridge(d), &lookups, &steps);
+	return sprintf(buf, "%lu\n", steps);
+}
+static DEVICE_ATTR(multicast_lookup_steps, S_IRUGO,
+		   show_multicast_lookup_steps, NULL);
+
+static ssize_t show_multicast_backlog_drops(struct device *d,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	struct net_bridge *br = to_bridge(d);
+	return sprintf(buf, "%u\n", br->multicast_backlog_drops);
+}
+static DEVICE_ATTR(multicast_backlog_drops, S_IRUGO,
+		   show_multicast_backlog_drops, NULL);
+
 static ssize_t show_multicast_last_member_count(struct device *d,
 						struct device_attribute *attr,
 						char *buf)
@@ -631,11 +712,18 @@ static struct attribute *bridge_attrs[] = {
 	&dev_attr_gc_timer.attr,
 	&dev_attr_group_addr.attr,
 	&dev_attr_flush.attr,
+	&dev_attr_fdb_hash_size.attr,
+	&dev_attr_fdb_hash_max.attr,
+	&dev_attr_fdb_cache_hits.attr,
+	&dev_attr_fdb_cache_misses.attr,
 #ifdef CONFIG_BRIDGE_IGMP_SNOOPING
 	&dev_attr_multicast_router.attr,
 	&dev_attr_multicast_snooping.attr,
 	&dev_attr_hash_elasticity.attr,
 	&dev_attr_hash_max.attr,
+	&dev_attr_multicast_lookups.attr,
+	&dev_attr_multicast_lookup_steps.attr,
+	&dev_attr_multicast_backlog_drops.attr,
 	&dev_attr_multicast_last_member_count.attr,
 	&dev_attr_multicast_startup_query_count.attr,
 	&dev_attr_multicast_last_member_interval.attr,
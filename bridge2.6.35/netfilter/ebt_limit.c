@@ -14,12 +14,14 @@
 #include <linux/module.h>
 #include <linux/netdevice.h>
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_bridge/ebtables.h>
 #include <linux/netfilter_bridge/ebt_limit.h>
 
-static DEFINE_SPINLOCK(limit_lock);
-
 #define MAX_CPJ (0xFFFFFFFF / (HZ*60*60*24))
 
 #define _POW2_BELOW2(x) ((x)|((x)>>1))
@@ -31,25 +33,98 @@ static DEFINE_SPINLOCK(limit_lock);
 
 #define CREDITS_PER_JIFFY POW2_BELOW32(MAX_CPJ)
 
-static bool
-ebt_limit_mt(const struct sk_buff *skb, struct xt_action_param *par)
+/*
+ * The bucket of a rule is refilled by time under its own lock. Each cpu
+ * takes credit out of it a batch at a time and spends that without any
+ * locking, so the lock is only taken once every few packets. Credit is
+ * never created, only moved, so the rate holds; what an idle cpu keeps
+ * adds at most a batch per cpu to the burst.
+ *
+ * ebt_limit_info is shared with userspace, which reads it back with the
+ * table, so it cannot carry a pointer to the bucket. The buckets are
+ * found instead by the address of their ebt_limit_info, which stays put
+ * for as long as the rule is in the kernel's copy of the table.
+ */
+struct ebt_limit_cpu {
+	u_int32_t credit;
+};
+
+struct ebt_limit_priv {
+	spinlock_t lock;
+	unsigned long prev;
+	u_int32_t credit;
+	u_int32_t batch;
+	struct ebt_limit_cpu *cpu;
+	const struct ebt_limit_info *info;
+	struct hlist_node node;
+	struct rcu_head rcu;
+};
+
+#define EBT_LIMIT_HASH_BITS	6
+
+static struct hlist_head ebt_limit_hash[1 << EBT_LIMIT_HASH_BITS];
+static DEFINE_SPINLOCK(ebt_limit_hash_lock);
+
+static inline struct hlist_head *
+ebt_limit_bucket(const struct ebt_limit_info *info)
 {
-	struct ebt_limit_info *info = (void *)par->matchinfo;
-	unsigned long now = jiffies;
+	return &ebt_limit_hash[hash_ptr((void *)info, EBT_LIMIT_HASH_BITS)];
+}
+
+/* under rcu_read_lock(), or ebt_limit_hash_lock */
+static struct ebt_limit_priv *
+ebt_limit_priv(const struct ebt_limit_info *info)
+{
+	struct ebt_limit_priv *priv;
+	struct hlist_node *n;
 
-	spin_lock_bh(&limit_lock);
-	info->credit += (now - xchg(&info->prev, now)) * CREDITS_PER_JIFFY;
-	if (info->credit > info->credit_cap)
-		info->credit = info->credit_cap;
+	hlist_for_each_entry_rcu(priv, n, ebt_limit_bucket(info), node)
+		if (priv->info == info)
+			return priv;
+	return NULL;
+}
 
-	if (info->credit >= info->cost) {
+static bool
+ebt_limit_mt(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	const struct ebt_limit_info *info = par->matchinfo;
+	struct ebt_limit_priv *priv;
+	struct ebt_limit_cpu *lc;
+	unsigned long now, delta;
+	u_int32_t take;
+
+	rcu_read_lock();
+	priv = ebt_limit_priv(info);
+	rcu_read_unlock();
+	/* the rule, and with it the bucket, outlasts this packet */
+	if (unlikely(priv == NULL))
+		return false;
+
+	/* ebtables runs with bottom halves off */
+	lc = per_cpu_ptr(priv->cpu, smp_processor_id());
+	if (lc->credit >= info->cost) {
 		/* We're not limited. */
-		info->credit -= info->cost;
-		spin_unlock_bh(&limit_lock);
+		lc->credit -= info->cost;
 		return true;
 	}
 
-	spin_unlock_bh(&limit_lock);
+	now = jiffies;
+	spin_lock(&priv->lock);
+	delta = now - priv->prev;
+	priv->prev = now;
+	if (delta > (info->credit_cap - priv->credit) / CREDITS_PER_JIFFY)
+		priv->credit = info->credit_cap;
+	else
+		priv->credit += delta * CREDITS_PER_JIFFY;
+	take = min(priv->credit, priv->batch);
+	priv->credit -= take;
+	spin_unlock(&priv->lock);
+
+	lc->credit += take;
+	if (lc->credit >= info->cost) {
+		lc->credit -= info->cost;
+		return true;
+	}
 	return false;
 }
 
@@ -68,6 +143,7 @@ user2credits(u_int32_t user)
 static int ebt_limit_mt_check(const struct xt_mtchk_param *par)
 {
 	struct ebt_limit_info *info = par->matchinfo;
+	struct ebt_limit_priv *priv;
 
 	/* Check for overflow. */
 	if (info->burst == 0 ||
@@ -77,14 +153,56 @@ static int ebt_limit_mt_check(const struct xt_mtchk_param *par)
 		return -EINVAL;
 	}
 
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+	priv->cpu = alloc_percpu(struct ebt_limit_cpu);
+	if (!priv->cpu) {
+		kfree(priv);
+		return -ENOMEM;
+	}
+
 	/* User avg in seconds * EBT_LIMIT_SCALE: convert to jiffies * 128. */
-	info->prev = jiffies;
 	info->credit = user2credits(info->avg * info->burst);
 	info->credit_cap = user2credits(info->avg * info->burst);
 	info->cost = user2credits(info->avg);
+
+	spin_lock_init(&priv->lock);
+	priv->prev = jiffies;
+	priv->credit = info->credit_cap;
+	priv->batch = max_t(u_int32_t, info->cost,
+			    info->credit_cap / (2 * num_possible_cpus()));
+	priv->info = info;
+	spin_lock_bh(&ebt_limit_hash_lock);
+	hlist_add_head_rcu(&priv->node, ebt_limit_bucket(info));
+	spin_unlock_bh(&ebt_limit_hash_lock);
 	return 0;
 }
 
+static void ebt_limit_free(struct rcu_head *head)
+{
+	struct ebt_limit_priv *priv =
+		container_of(head, struct ebt_limit_priv, rcu);
+
+	free_percpu(priv->cpu);
+	kfree(priv);
+}
+
+/* The rule is out of the table, but the chains it hashed into are still
+   walked for the others */
+static void ebt_limit_mt_destroy(const struct xt_mtdtor_param *par)
+{
+	struct ebt_limit_priv *priv;
+
+	spin_lock_bh(&ebt_limit_hash_lock);
+	priv = ebt_limit_priv(par->matchinfo);
+	if (priv != NULL)
+		hlist_del_rcu(&priv->node);
+	spin_unlock_bh(&ebt_limit_hash_lock);
+	if (priv != NULL)
+		call_rcu(&priv->rcu, ebt_limit_free);
+}
+
 
 #ifdef CONFIG_COMPAT
 /*
@@ -104,6 +222,7 @@ static struct xt_match ebt_limit_mt_reg __read_mostly = {
 	.family		= NFPROTO_BRIDGE,
 	.match		= ebt_limit_mt,
 	.checkentry	= ebt_limit_mt_check,
+	.destroy	= ebt_limit_mt_destroy,
 	.matchsize	= sizeof(struct ebt_limit_info),
 #ifdef CONFIG_COMPAT
 	.compatsize	= sizeof(struct ebt_compat_limit_info),
@@ -119,6 +238,7 @@ static int __init ebt_limit_init(void)
 static void __exit ebt_limit_fini(void)
 {
 	xt_unregister_match(&ebt_limit_mt_reg);
+	rcu_barrier();	/* for ebt_limit_free() */
 }
 
 module_init(ebt_limit_init);
@@ -20,6 +20,12 @@
 #include <linux/vmalloc.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_bridge/ebtables.h>
+#include <linux/netfilter_bridge/ebt_among.h>
+#include <linux/netfilter_bridge/ebt_ip.h>
+#include <linux/etherdevice.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <asm/unaligned.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
@@ -47,6 +53,55 @@
 #define COUNTER_BASE(c, n, cpu) ((struct ebt_counter *)(((char *)c) + \
    COUNTER_OFFSET(n) * cpu))
 
+/*
+ * Classification index
+ *
+ * A base chain made mostly of rules that each need one exact source MAC
+ * (the basic match or among --among-src) or one exact IPv4 source address
+ * (ip --ip-src) gets a hash of those keys when the table is replaced.
+ * Every bucket lists, in chain order, the rules whose key hashes there
+ * and all the rules the index can't tell anything about, so a frame only
+ * walks the rules that can match it and the first match still wins.
+ * Frames without a key (non-IPv4 frames for an address index) walk the
+ * unindexed rules only. User defined chains are walked as before.
+ *
+ * struct ebt_table_info has no room for the index, so it is kept behind
+ * the counters; the allocations reserve EBT_INDEX_SIZE for it.
+ */
+#define EBT_INDEX_SMAC		0
+#define EBT_INDEX_IPSRC		1
+#define EBT_INDEX_KINDS		2
+#define EBT_INDEX_MAX		(1 << 18)	/* entries in all buckets */
+#define EBT_INDEX_SIZE		sizeof(struct ebt_index *)
+#define EBT_INDEX(info) (*(struct ebt_index **)((char *)(info)->counters + \
+   COUNTER_OFFSET((info)->nentries) * nr_cpu_ids))
+
+struct ebt_index_rule
+{
+	unsigned int n;			/* position in the chain */
+	struct ebt_entry *e;
+};
+
+struct ebt_chain_index
+{
+	int kind;
+	unsigned int hmask;
+	/* bucket b is rules[bucket[b]] up to rules[bucket[b + 1]], bucket
+	   hmask + 1 holds the rules for frames without a key */
+	unsigned int *bucket;
+	struct ebt_index_rule *rules;
+};
+
+struct ebt_index
+{
+	struct ebt_chain_index *chain[NF_BR_NUMHOOKS];
+};
+
+static unsigned int index_min = 64;
+module_param(index_min, uint, 0644);
+MODULE_PARM_DESC(index_min, "Index base chains with at least this many "
+		 "exact match rules, 0 disables the index");
+
 
 
 static DEFINE_MUTEX(ebt_mutex);
@@ -172,6 +227,44 @@ struct ebt_entry *ebt_next_entry(const struct ebt_entry *entry)
 	return (void *)entry + entry->next_offset;
 }
 
+static inline u32 ebt_index_hash_mac(const unsigned char *mac)
+{
+	return jhash_2words(get_unaligned((const u32 *)mac),
+			    get_unaligned((const u16 *)(mac + 4)), 0);
+}
+
+static inline u32 ebt_index_hash_ip(__be32 addr)
+{
+	return jhash_1word((__force u32)addr, 0);
+}
+
+/* the rules of a base chain that frame can match, NULL if not indexed */
+static const struct ebt_index_rule *
+ebt_index_lookup(const struct ebt_table_info *private, unsigned int hook,
+   const struct sk_buff *skb, const struct ebt_index_rule **end)
+{
+	const struct ebt_index *idx = EBT_INDEX(private);
+	const struct ebt_chain_index *ci;
+	const struct iphdr *ih;
+	struct iphdr _iph;
+	unsigned int b;
+
+	if (!idx || !(ci = idx->chain[hook]))
+		return NULL;
+
+	b = ci->hmask + 1;
+	if (ci->kind == EBT_INDEX_SMAC)
+		b = ebt_index_hash_mac(eth_hdr(skb)->h_source) & ci->hmask;
+	else if (eth_hdr(skb)->h_proto == htons(ETH_P_IP)) {
+		ih = skb_header_pointer(skb, 0, sizeof(_iph), &_iph);
+		if (ih)
+			b = ebt_index_hash_ip(ih->saddr) & ci->hmask;
+	}
+
+	*end = ci->rules + ci->bucket[b + 1];
+	return ci->rules + ci->bucket[b];
+}
+
 /* Do some firewalling */
 unsigned int ebt_do_table (unsigned int hook, struct sk_buff *skb,
    const struct net_device *in, const struct net_device *out,
@@ -186,6 +279,7 @@ unsigned int ebt_do_table (unsigned int hook, struct sk_buff *skb,
 	struct ebt_entries *chaininfo;
 	const char *base;
 	const struct ebt_table_info *private;
+	const struct ebt_index_rule *cand, *cand_end = NULL;
 	struct xt_action_param acpar;
 
 	acpar.family  = NFPROTO_BRIDGE;
@@ -209,6 +303,14 @@ unsigned int ebt_do_table (unsigned int hook, struct sk_buff *skb,
 	/* base for chain jumps */
 	base = private->entries;
 	i = 0;
+	cand = ebt_index_lookup(private, hook, skb, &cand_end);
+	if (cand) {
+		if (cand < cand_end) {
+			i = cand->n;
+			point = cand->e;
+		} else
+			i = nentries;
+	}
 	while (i < nentries) {
 		if (ebt_basic_match(point, eth_hdr(skb), in, out))
 			goto letscontinue;
@@ -263,6 +365,10 @@ letsreturn:
 			point = cs[sp].e;
 			counter_base = cb_base +
 			   chaininfo->counter_offset;
+			/* back in an indexed base chain, i is not our
+			   position in the bucket */
+			if (cand && sp == 0)
+				goto letscontinue;
 			continue;
 		}
 		if (verdict == EBT_CONTINUE)
@@ -293,6 +399,14 @@ letsreturn:
 		sp++;
 		continue;
 letscontinue:
+		if (cand && sp == 0) {
+			if (++cand < cand_end) {
+				i = cand->n;
+				point = cand->e;
+			} else
+				i = nentries;
+			continue;
+		}
 		point = ebt_next_entry(point);
 		i++;
 	}
@@ -824,6 +938,225 @@ letscontinue:
 	return 0;
 }
 
+struct ebt_index_walk
+{
+	int kind;
+	unsigned int n;			/* the rule being added */
+	struct ebt_entry *e;
+	unsigned int hmask;
+	unsigned int *last;		/* last rule added to each bucket + 1 */
+	unsigned int *pos;		/* count or next free slot per bucket */
+	struct ebt_index_rule *rules;	/* NULL while counting */
+};
+
+static void ebt_index_add(struct ebt_index_walk *w, unsigned int b)
+{
+	/* among lists can hash more than one address of a rule here */
+	if (w->last[b] == w->n + 1)
+		return;
+	w->last[b] = w->n + 1;
+	if (w->rules) {
+		w->rules[w->pos[b]].n = w->n;
+		w->rules[w->pos[b]].e = w->e;
+	}
+	w->pos[b]++;
+}
+
+static int ebt_index_match_keys(const struct ebt_entry_match *m,
+   struct ebt_index_walk *w, bool *indexed)
+{
+	const struct ebt_ip_info *ipinfo;
+	const struct ebt_among_info *aminfo;
+	const struct ebt_mac_wormhash *wh;
+	int i;
+
+	if (w->kind == EBT_INDEX_IPSRC && !strcmp(m->u.match->name, "ip")) {
+		ipinfo = (const void *)m->data;
+		if (!(ipinfo->bitmask & EBT_IP_SOURCE) ||
+		    (ipinfo->invflags & EBT_IP_SOURCE) ||
+		    ipinfo->smsk != htonl(0xffffffff))
+			return 0;
+		if (w->pos)
+			ebt_index_add(w, ebt_index_hash_ip(ipinfo->saddr) &
+				      w->hmask);
+		*indexed = true;
+		return 1;
+	}
+	if (w->kind == EBT_INDEX_SMAC && !strcmp(m->u.match->name, "among")) {
+		aminfo = (const void *)m->data;
+		wh = ebt_among_wh_src(aminfo);
+		if (!wh || (aminfo->bitmask & EBT_AMONG_SRC_NEG))
+			return 0;
+		/* the address sits behind two bytes of padding in cmp[] */
+		if (w->pos)
+			for (i = 0; i < wh->poolsize; i++)
+				ebt_index_add(w, ebt_index_hash_mac(
+				   (const unsigned char *)wh->pool[i].cmp + 2) &
+				   w->hmask);
+		*indexed = true;
+		return 1;
+	}
+	return 0;
+}
+
+/* Adds the keys a frame needs for w->e to match, returns false if there
+   are none: the rule then goes into every bucket */
+static bool ebt_index_keys(struct ebt_index_walk *w)
+{
+	const struct ebt_entry *e = w->e;
+	bool indexed = false;
+
+	if (w->kind == EBT_INDEX_SMAC && (e->bitmask & EBT_SOURCEMAC) &&
+	    !(e->invflags & EBT_ISOURCE) &&
+	    is_broadcast_ether_addr(e->sourcemsk)) {
+		if (w->pos)
+			ebt_index_add(w, ebt_index_hash_mac(e->sourcemac) &
+				      w->hmask);
+		return true;
+	}
+	EBT_MATCH_ITERATE(e, ebt_index_match_keys, w, &indexed);
+	return indexed;
+}
+
+/* one pass over the chain, counting or filling in w->pos */
+static unsigned int ebt_index_walk_chain(const struct ebt_entries *chain,
+   struct ebt_index_walk *w)
+{
+	unsigned int b, total = 0;
+
+	memset(w->last, 0, (w->hmask + 2) * sizeof(*w->last));
+	w->e = (struct ebt_entry *)chain->data;
+	for (w->n = 0; w->n < chain->nentries; w->n++) {
+		if (!ebt_index_keys(w))
+			for (b = 0; b <= w->hmask + 1; b++)
+				ebt_index_add(w, b);
+		w->e = ebt_next_entry(w->e);
+	}
+	for (b = 0; b <= w->hmask + 1; b++)
+		total += w->pos[b];
+	return total;
+}
+
+static struct ebt_chain_index *ebt_index_chain(const struct ebt_entries *chain)
+{
+	struct ebt_index_walk w = { .pos = NULL };
+	struct ebt_chain_index *ci;
+	unsigned int n, nidx[EBT_INDEX_KINDS], buckets, total, b;
+	int kind;
+
+	if (!index_min || chain->nentries < index_min)
+		return NULL;
+
+	/* index on whichever key most rules have */
+	for (kind = 0; kind < EBT_INDEX_KINDS; kind++) {
+		nidx[kind] = 0;
+		w.kind = kind;
+		w.e = (struct ebt_entry *)chain->data;
+		for (n = 0; n < chain->nentries; n++) {
+			if (ebt_index_keys(&w))
+				nidx[kind]++;
+			w.e = ebt_next_entry(w.e);
+		}
+	}
+	w.kind = nidx[EBT_INDEX_IPSRC] > nidx[EBT_INDEX_SMAC] ?
+		 EBT_INDEX_IPSRC : EBT_INDEX_SMAC;
+	if (nidx[w.kind] < index_min)
+		return NULL;
+
+	/* every bucket repeats the unindexed rules, so with many of those
+	   fewer, fuller buckets are cheaper */
+	buckets = roundup_pow_of_two(nidx[w.kind]);
+	w.last = vmalloc((buckets + 2) * sizeof(*w.last));
+	w.pos = vmalloc((buckets + 2) * sizeof(*w.pos));
+	if (!w.last || !w.pos)
+		goto free_walk;
+	for (;;) {
+		w.hmask = buckets - 1;
+		memset(w.pos, 0, (buckets + 2) * sizeof(*w.pos));
+		total = ebt_index_walk_chain(chain, &w);
+		if (total <= EBT_INDEX_MAX)
+			break;
+		if (buckets <= 16)
+			goto free_walk;
+		buckets >>= 1;
+	}
+
+	ci = kzalloc(sizeof(*ci), GFP_KERNEL);
+	if (!ci)
+		goto free_walk;
+	ci->kind = w.kind;
+	ci->hmask = w.hmask;
+	ci->bucket = vmalloc((buckets + 2) * sizeof(*ci->bucket));
+	ci->rules = vmalloc((total ? : 1) * sizeof(*ci->rules));
+	if (!ci->bucket || !ci->rules) {
+		vfree(ci->bucket);
+		vfree(ci->rules);
+		kfree(ci);
+		goto free_walk;
+	}
+
+	/* turn the counts into offsets and fill the buckets in */
+	for (b = 0, n = 0; b <= buckets; b++) {
+		ci->bucket[b] = n;
+		n += w.pos[b];
+		w.pos[b] = ci->bucket[b];
+	}
+	ci->bucket[buckets + 1] = n;
+	w.rules = ci->rules;
+	ebt_index_walk_chain(chain, &w);
+
+	vfree(w.pos);
+	vfree(w.last);
+	return ci;
+
+free_walk:
+	vfree(w.pos);
+	vfree(w.last);
+	return NULL;
+}
+
+static void ebt_index_free(struct ebt_table_info *info)
+{
+	struct ebt_index *idx = EBT_INDEX(info);
+	int i;
+
+	if (!idx)
+		return;
+	for (i = 0; i < NF_BR_NUMHOOKS; i++) {
+		if (!idx->chain[i])
+			continue;
+		vfree(idx->chain[i]->bucket);
+		vfree(idx->chain[i]->rules);
+		kfree(idx->chain[i]);
+	}
+	kfree(idx);
+	EBT_INDEX(info) = NULL;
+}
+
+/* The index is only a shortcut: without memory for it, or with rule sets
+   it can't help, the chains are walked in full. */
+static void ebt_index_build(struct ebt_table_info *info)
+{
+	struct ebt_index *idx;
+	int i, used = 0;
+
+	idx = kzalloc(sizeof(*idx), GFP_KERNEL);
+	if (!idx)
+		return;
+	for (i = 0; i < NF_BR_NUMHOOKS; i++) {
+		if (!info->hook_entry[i])
+			continue;
+		idx->chain[i] = ebt_index_chain(info->hook_entry[i]);
+		if (idx->chain[i])
+			used = 1;
+	}
+	if (!used) {
+		kfree(idx);
+		return;
+	}
+	EBT_INDEX(info) = idx;
+}
+
 /* do the parsing of the table/chains/entries/matches/watchers/targets, heh */
 static int translate_table(struct net *net, const char *name,
 			   struct ebt_table_info *newinfo)
@@ -832,6 +1165,7 @@ static int translate_table(struct net *net, const char *name,
 	int ret;
 	struct ebt_cl_stack *cl_s = NULL; /* used in the checking for chain loops */
 
+	EBT_INDEX(newinfo) = NULL;
 	i = 0;
 	while (i < NF_BR_NUMHOOKS && !newinfo->hook_entry[i])
 		i++;
@@ -939,7 +1273,8 @@ static int translate_table(struct net *net, const char *name,
 	if (ret != 0) {
 		EBT_ENTRY_ITERATE(newinfo->entries, newinfo->entries_size,
 				  ebt_cleanup_entry, net, &i);
-	}
+	} else
+		ebt_index_build(newinfo);
 	vfree(cl_s);
 	return ret;
 }
@@ -1044,6 +1379,7 @@ static int do_replace_finish(struct net *net, struct ebt_replace *repl,
 	EBT_ENTRY_ITERATE(table->entries, table->entries_size,
 			  ebt_cleanup_entry, net, NULL);
 
+	ebt_index_free(table);
 	vfree(table->entries);
 	if (table->chainstack) {
 		for_each_possible_cpu(i)
@@ -1060,6 +1396,7 @@ free_unlock:
 free_iterate:
 	EBT_ENTRY_ITERATE(newinfo->entries, newinfo->entries_size,
 			  ebt_cleanup_entry, net, NULL);
+	ebt_index_free(newinfo);
 free_counterstmp:
 	vfree(counterstmp);
 	/* can be initialized in translate_table() */
@@ -1099,7 +1436,7 @@ static int do_replace(struct net *net, const void __user *user,
 		return -ENOMEM;
 
 	countersize = COUNTER_OFFSET(tmp.nentries) * nr_cpu_ids;
-	newinfo = vmalloc(sizeof(*newinfo) + countersize);
+	newinfo = vmalloc(sizeof(*newinfo) + countersize + EBT_INDEX_SIZE);
 	if (!newinfo)
 		return -ENOMEM;
 
@@ -1152,7 +1489,7 @@ ebt_register_table(struct net *net, const struct ebt_table *input_table)
 	}
 
 	countersize = COUNTER_OFFSET(repl->nentries) * nr_cpu_ids;
-	newinfo = vmalloc(sizeof(*newinfo) + countersize);
+	newinfo = vmalloc(sizeof(*newinfo) + countersize + EBT_INDEX_SIZE);
 	ret = -ENOMEM;
 	if (!newinfo)
 		goto free_table;
@@ -1215,6 +1552,7 @@ ebt_register_table(struct net *net, const struct ebt_table *input_table)
 free_unlock:
 	mutex_unlock(&ebt_mutex);
 free_chainstack:
+	ebt_index_free(newinfo);
 	if (newinfo->chainstack) {
 		for_each_possible_cpu(i)
 			vfree(newinfo->chainstack[i]);
@@ -1244,6 +1582,7 @@ void ebt_unregister_table(struct net *net, struct ebt_table *table)
 			  ebt_cleanup_entry, net, NULL);
 	if (table->private->nentries)
 		module_put(table->me);
+	ebt_index_free(table->private);
 	vfree(table->private->entries);
 	if (table->private->chainstack) {
 		for_each_possible_cpu(i)
@@ -2204,7 +2543,7 @@ static int compat_do_replace(struct net *net, void __user *user,
 	}
 
 	countersize = COUNTER_OFFSET(tmp.nentries) * nr_cpu_ids;
-	newinfo = vmalloc(sizeof(*newinfo) + countersize);
+	newinfo = vmalloc(sizeof(*newinfo) + countersize + EBT_INDEX_SIZE);
 	if (!newinfo)
 		return -ENOMEM;
 
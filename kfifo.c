@@ -585,3 +585,112 @@ void __kfifo_dma_out_finish_r(struct __kfifo *fifo, size_t recsize)
 	len = __kfifo_peek_n(fifo, recsize);
 	fifo->out += len + recsize;
 }
+
+int __kfifo_mp_alloc(struct __kfifo_mp *fifo, unsigned int size,
+		size_t esize, gfp_t gfp_mask)
+{
+	if (!is_power_of_2(size))
+		size = rounddown_pow_of_two(size);
+
+	atomic_set(&fifo->in, 0);
+	fifo->out = 0;
+	fifo->esize = esize;
+	fifo->mask = 0;
+	fifo->seq = NULL;
+	fifo->data = NULL;
+
+	if (size < 2)
+		return -EINVAL;
+
+	/* a zeroed seq publishes nothing: position n needs n + 1 */
+	fifo->seq = kcalloc(size, sizeof(*fifo->seq), gfp_mask);
+	fifo->data = kmalloc(size * esize, gfp_mask);
+	if (!fifo->seq || !fifo->data) {
+		__kfifo_mp_free(fifo);
+		return -ENOMEM;
+	}
+	fifo->mask = size - 1;
+
+	return 0;
+}
+EXPORT_SYMBOL(__kfifo_mp_alloc);
+
+void __kfifo_mp_free(struct __kfifo_mp *fifo)
+{
+	kfree(fifo->seq);
+	kfree(fifo->data);
+	fifo->seq = NULL;
+	fifo->data = NULL;
+	fifo->mask = 0;
+}
+EXPORT_SYMBOL(__kfifo_mp_free);
+
+unsigned int __kfifo_mp_in_r(struct __kfifo_mp *fifo, const void *buf,
+		unsigned int len)
+{
+	unsigned int pos, slot;
+
+	if (len != fifo->esize || !fifo->mask)
+		return 0;
+
+	do {
+		pos = atomic_read(&fifo->in);
+		if (pos - ACCESS_ONCE(fifo->out) > fifo->mask)
+			return 0;
+	} while ((unsigned int)atomic_cmpxchg(&fifo->in, pos, pos + 1) != pos);
+
+	slot = pos & fifo->mask;
+	memcpy((char *)fifo->data + slot * len, buf, len);
+	/* the record before its sequence number */
+	smp_wmb();
+	ACCESS_ONCE(fifo->seq[slot]) = pos + 1;
+	return len;
+}
+EXPORT_SYMBOL(__kfifo_mp_in_r);
+
+/*
+ * internal helper: copies out up to n published records from the head,
+ * without handing their slots back yet
+ */
+static unsigned int kfifo_mp_copy_out(struct __kfifo_mp *fifo, void *buf,
+		unsigned int n)
+{
+	unsigned int i, pos, slot;
+
+	for (i = 0; i < n; i++) {
+		pos = fifo->out + i;
+		slot = pos & fifo->mask;
+		if (ACCESS_ONCE(fifo->seq[slot]) != pos + 1)
+			break;
+		/* the sequence number before the record */
+		smp_rmb();
+		memcpy((char *)buf + i * fifo->esize,
+			(char *)fifo->data + slot * fifo->esize, fifo->esize);
+	}
+	if (i) {
+		/* done reading the slots before producers may reuse them */
+		smp_mb();
+		ACCESS_ONCE(fifo->out) = fifo->out + i;
+	}
+	return i;
+}
+
+unsigned int __kfifo_mp_out_r(struct __kfifo_mp *fifo, void *buf,
+		unsigned int len)
+{
+	if (len < fifo->esize || !fifo->mask)
+		return 0;
+
+	return kfifo_mp_copy_out(fifo, buf, 1) ? fifo->esize : 0;
+}
+EXPORT_SYMBOL(__kfifo_mp_out_r);
+
+unsigned int __kfifo_mp_drain_r(struct __kfifo_mp *fifo, void *buf,
+		unsigned int n)
+{
+	if (!fifo->mask)
+		return 0;
+
+	return kfifo_mp_copy_out(fifo, buf, min(n, fifo->mask + 1));
+}
+EXPORT_SYMBOL(__kfifo_mp_drain_r);
@@ -787,6 +787,139 @@ __kfifo_uint_must_check_helper( \
 }) \
 )
 
+/*
+ * Multi-producer, single-consumer record fifo.
+ *
+ * For fixed-size records put from many CPUs at once and taken by a
+ * single consumer, with no lock on either side. A producer reserves a
+ * slot by advancing in with cmpxchg, copies its record in and then
+ * publishes the slot through its sequence number; the consumer takes
+ * records in order as long as their slot is published. A producer
+ * interrupted between reserving and publishing holds up the records
+ * behind its own until it is done, none is lost. Consumers must be
+ * serialized by the caller.
+ */
+struct __kfifo_mp {
+	atomic_t	in;		/* next slot to reserve */
+	unsigned int	out;		/* consumer only */
+	unsigned int	mask;
+	unsigned int	esize;
+	unsigned int	*seq;		/* slot of position n: n + 1 once
+					   published */
+	void		*data;
+};
+
+#define STRUCT_KFIFO_MP(datatype) \
+	struct { \
+		union { \
+			struct __kfifo_mp	kfifo; \
+			datatype		*type; \
+			const datatype		*ptr_const; \
+		}; \
+	}
+
+/**
+ * DECLARE_KFIFO_MP - macro to declare a multi-producer fifo object
+ * @fifo: name of the declared fifo
+ * @type: type of the records
+ */
+#define DECLARE_KFIFO_MP(fifo, type)	STRUCT_KFIFO_MP(type) fifo
+
+/**
+ * kfifo_mp_alloc - dynamically allocates a new multi-producer fifo
+ * @fifo: pointer to the fifo
+ * @size: number of records, rounded down to a power of 2
+ * @gfp_mask: get_free_pages mask, passed to kmalloc()
+ */
+#define kfifo_mp_alloc(fifo, size, gfp_mask) \
+__kfifo_int_must_check_helper( \
+({ \
+	typeof((fifo) + 1) __tmp = (fifo); \
+	__kfifo_mp_alloc(&__tmp->kfifo, size, sizeof(*__tmp->type), gfp_mask); \
+}) \
+)
+
+#define kfifo_mp_free(fifo)	__kfifo_mp_free(&(fifo)->kfifo)
+
+#define kfifo_mp_initialized(fifo)	((fifo)->kfifo.mask)
+
+/**
+ * kfifo_mp_len - records reserved and not yet taken
+ * @fifo: address of the fifo to be used
+ *
+ * Counts the records whose producer is still writing them too, so 0
+ * means no record is on its way.
+ */
+#define kfifo_mp_len(fifo) \
+({ \
+	typeof((fifo) + 1) __tmpl = (fifo); \
+	(unsigned int)atomic_read(&__tmpl->kfifo.in) - \
+		ACCESS_ONCE(__tmpl->kfifo.out); \
+})
+
+/**
+ * kfifo_mp_put - put one record into the fifo, from any context
+ * @fifo: address of the fifo to be used
+ * @val: address of the record
+ *
+ * Returns 0 if the fifo was full, the record size otherwise.
+ */
+#define kfifo_mp_put(fifo, val) \
+({ \
+	typeof((fifo) + 1) __tmp = (fifo); \
+	typeof(__tmp->ptr_const) __val = (val); \
+	__kfifo_mp_in_r(&__tmp->kfifo, __val, sizeof(*__val)); \
+})
+
+/**
+ * kfifo_mp_get - take the oldest record, consumer only
+ * @fifo: address of the fifo to be used
+ * @val: where to store it
+ *
+ * Returns 0 if no record is published at the head, the record size
+ * otherwise.
+ */
+#define kfifo_mp_get(fifo, val) \
+__kfifo_uint_must_check_helper( \
+({ \
+	typeof((fifo) + 1) __tmp = (fifo); \
+	typeof(__tmp->type) __val = (val); \
+	__kfifo_mp_out_r(&__tmp->kfifo, __val, sizeof(*__val)); \
+}) \
+)
+
+/**
+ * kfifo_mp_drain - take up to n records at once, consumer only
+ * @fifo: address of the fifo to be used
+ * @buf: array of at least n records
+ * @n: max. number of records
+ *
+ * Returns the number of records taken. The slots are handed back to
+ * the producers once for the whole batch.
+ */
+#define kfifo_mp_drain(fifo, buf, n) \
+__kfifo_uint_must_check_helper( \
+({ \
+	typeof((fifo) + 1) __tmp = (fifo); \
+	typeof(__tmp->type) __buf = (buf); \
+	__kfifo_mp_drain_r(&__tmp->kfifo, __buf, (n)); \
+}) \
+)
+
+extern int __kfifo_mp_alloc(struct __kfifo_mp *fifo, unsigned int size,
+	size_t esize, gfp_t gfp_mask);
+
+extern void __kfifo_mp_free(struct __kfifo_mp *fifo);
+
+extern unsigned int __kfifo_mp_in_r(struct __kfifo_mp *fifo,
+	const void *buf, unsigned int len);
+
+extern unsigned int __kfifo_mp_out_r(struct __kfifo_mp *fifo,
+	void *buf, unsigned int len);
+
+extern unsigned int __kfifo_mp_drain_r(struct __kfifo_mp *fifo,
+	void *buf, unsigned int n);
+
 /* extern int __kfifo_alloc(struct __kfifo *fifo, unsigned int size, */
 /* 	size_t esize, gfp_t gfp_mask); */
 
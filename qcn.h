@@ -0,0 +1,1346 @@
+/*
+ * qcn.h	Definitions shared by the QCN Congestion Point (sch_tbf_switch,
+ *		sch_fifo_switch), the QCN Reaction Point (sch_htb_nic) and the
+ *		qcn core module.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _QCN_H
+#define _QCN_H
+
+#include <linux/types.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/skbuff.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/net.h>
+#include <linux/netdevice.h>
+#include <linux/cache.h>
+#include <linux/compiler.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/version.h>
+#include <net/sch_generic.h>
+
+#include "kfifo.h"
+#include "qcn_tc.h"
+/* 64 bit divisions on 32 bit hosts */
+#define qcn_div64(a, b)	div64_u64(a, b)
+#include "qcn_alg.h"
+
+/* Kernel compatibility.
+   =======================================
+
+   The modules grew up on 2.6.34/35. Where later kernels dropped an
+   interface they used, the code now sticks to what every kernel has
+   (nla_put(), get_cycles()); what has no such common form is wrapped
+   here.
+*/
+
+/* A dequeue that returns a packet clears the throttled state the
+   watchdog set: a flag before 3.2, a state bit from 3.2 on. 4.8 dropped
+   the state altogether. */
+#ifdef TCQ_F_THROTTLED
+#define qcn_qdisc_unthrottled(sch)	((sch)->flags &= ~TCQ_F_THROTTLED)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+#define qcn_qdisc_unthrottled(sch)	qdisc_unthrottled(sch)
+#else
+#define qcn_qdisc_unthrottled(sch)	do { } while (0)
+#endif
+
+#define ETH_QCN                 0xA9A9
+#define ETH_QCN_AGG             0xA9AA	/* several qcn_frames, see below */
+#define ETH_P_CNTAG             0x22E9	/* 802.1Qau CN-TAG */
+#define ETH_P_CNM               0x22E7	/* 802.1Qau CNM */
+
+struct net_device;
+
+#define QCN_VLAN_DEPTH		2	/* tags a CP looks through */
+
+/* Private CNM payload, follows the ethernet header */
+struct qcn_frame {
+	u32 DA;
+	u32 SA;
+	u32 Fb;
+	int qoff;
+	int qdelta;
+	__be16 flags;		/* QCN_FRAME_* */
+	__be16 flow_id;		/* CN-TAG flow ID, if QCN_FRAME_FLOWID */
+	__be32 tstamp;		/* CP clock when Fb was decided, ns, low 32
+				   bits, if QCN_FRAME_TSTAMP */
+	u32 rx_stamp;		/* local: RP host clock on reception */
+	__be16 vlan_proto[QCN_VLAN_DEPTH];	/* tags of the sampled frame,
+						   outer first, */
+	__be16 vlan_tci[QCN_VLAN_DEPTH];	/* if QCN_FRAME_VLAN; 0 past
+						   the last */
+};
+
+#define QCN_FRAME_FLOWID	0x0001	/* flow_id is valid, ignore SA/DA */
+#define QCN_FRAME_TSTAMP	0x0002	/* tstamp is valid */
+#define QCN_FRAME_VLAN		0x0004	/* vlan_proto/vlan_tci are valid */
+#define QCN_FRAME_IPV6		0x0008	/* SA/DA are qcn_ipv6_fold()s */
+#define QCN_FRAME_LOOKUP	0x8000	/* local: only an RP that knows it */
+
+/* Feedback latency.
+   =======================================
+
+   A CP stamps every private CNM it builds; qcn_fb_recv() notes when it
+   reached the host of the RP, and the RP how long after the CP decided
+   it got to cut its rate. See the histograms in qcn_tc.h. */
+
+static inline u32 qcn_stamp(void)
+{
+	return (u32)ktime_to_ns(ktime_get());
+}
+
+/* Appends frame to the private CNM being built in skb, stamped */
+static inline void qcn_cnm_put_frame(struct sk_buff *skb,
+				     const struct qcn_frame *frame)
+{
+	struct qcn_frame *f = (struct qcn_frame *)skb_put(skb, sizeof(*f));
+
+	memcpy(f, frame, sizeof(*f));
+	f->tstamp = htonl(qcn_stamp());
+	f->flags |= htons(QCN_FRAME_TSTAMP);
+	f->rx_stamp = 0;
+}
+
+/* Counts a span of ns into a QCN_LAT_BUCKETS histogram; a negative one
+   comes from clocks that disagree and is left out */
+static inline void qcn_lat_note(u32 *hist, s32 ns)
+{
+	int b;
+
+	if (ns < 0)
+		return;
+	b = fls(ns >> 10);
+	hist[b < QCN_LAT_BUCKETS ? b : QCN_LAT_BUCKETS - 1]++;
+}
+
+/* The upper bound in ns of the bucket the pct-th percentile of hist
+   falls in, the lower one for the last bucket; 0 if hist is empty */
+static inline u32 qcn_lat_percentile(const u32 *hist, unsigned int pct)
+{
+	u64 total = 0, sum = 0, want;
+	int b;
+
+	for (b = 0; b < QCN_LAT_BUCKETS; b++)
+		total += hist[b];
+	if (total == 0)
+		return 0;
+	want = div_u64(total * pct + 99, 100);
+	for (b = 0; b < QCN_LAT_BUCKETS - 1; b++) {
+		sum += hist[b];
+		if (sum >= want)
+			break;
+	}
+	return 1024U << (b < QCN_LAT_BUCKETS - 1 ? b : QCN_LAT_BUCKETS - 2);
+}
+
+/* CN-TAG.
+   =======================================
+
+   A RP may tag its frames with a flow ID (ETH_P_CNTAG in place of the
+   ethertype, followed by the header below), so that a CP can tell flows
+   apart without looking into the payload, i.e. for any ethertype. The
+   CP echoes the ID in the CNM and the RP maps it back to its class
+   directly. Receivers strip the tag again in the qcn module.
+*/
+
+#define QCN_CNTAG_LEN		4
+
+struct qcn_cntag_hdr {
+	__be16	h_flow_id;
+	__be16	h_encap_proto;
+};
+
+/* VLAN tags.
+   =======================================
+
+   Tenant traffic mostly comes 802.1Q tagged, or QinQ with an 802.1ad
+   (or second 802.1Q) tag outside of the tenant's. The CP looks through
+   up to QCN_VLAN_DEPTH tags, in the frame or, for the outer one, held
+   by the NIC in vlan_tci, and keeps them in the qcn_frame. The CNM goes
+   back with the same tags, PCP included, so it travels the VLAN and
+   priority of the sampled frame toward its sender; the RP looks its
+   flow up within the VLAN, qcn_vlan_key(). Tagged CNMs are never
+   coalesced.
+*/
+
+#ifndef ETH_P_8021AD
+#define ETH_P_8021AD		0x88A8	/* 802.1ad service VLAN tag */
+#endif
+
+static inline int qcn_is_vlan_proto(__be16 proto)
+{
+	return proto == __constant_htons(ETH_P_8021Q) ||
+		proto == __constant_htons(ETH_P_8021AD);
+}
+
+/* The VIDs of the tags of frame, the outer one in bits 23-12; 0 for an
+   untagged frame, see also flow_scope in qcn_tc.h */
+static inline u32 qcn_vlan_key(const struct qcn_frame *frame)
+{
+	if (!(frame->flags & htons(QCN_FRAME_VLAN)))
+		return 0;
+	return (ntohs(frame->vlan_tci[0]) & VLAN_VID_MASK) << 12 |
+		(ntohs(frame->vlan_tci[1]) & VLAN_VID_MASK);
+}
+
+/* Fills the tags of skb, whose data starts at the MAC header as on the
+   way out, into frame. Returns the ethertype behind them, of the header
+   at skb->data + *off; 0 if there are more than QCN_VLAN_DEPTH or they
+   are not all in the linear data. */
+static inline __be16 qcn_vlan_parse(const struct sk_buff *skb,
+				    struct qcn_frame *frame, int *off)
+{
+	const struct vlan_hdr *vh;
+	__be16 proto;
+	int n = 0;
+
+	if (skb_headlen(skb) < ETH_HLEN)
+		return 0;
+	proto = ((const struct ethhdr *)skb->data)->h_proto;
+	*off = ETH_HLEN;
+	if (vlan_tx_tag_present(skb)) {
+		frame->vlan_proto[n] = htons(ETH_P_8021Q);
+		frame->vlan_tci[n++] = htons(vlan_tx_tag_get(skb));
+	}
+	while (qcn_is_vlan_proto(proto)) {
+		if (n == QCN_VLAN_DEPTH || *off + VLAN_HLEN > skb_headlen(skb))
+			return 0;
+		vh = (const struct vlan_hdr *)(skb->data + *off);
+		frame->vlan_proto[n] = proto;
+		frame->vlan_tci[n++] = vh->h_vlan_TCI;
+		proto = vh->h_vlan_encapsulated_proto;
+		*off += VLAN_HLEN;
+	}
+	if (n)
+		frame->flags |= htons(QCN_FRAME_VLAN);
+	return proto;
+}
+
+/* Puts the tags of frame behind the MAC addresses of the CNM completed
+   in skb. skb->protocol stays that of the CNM, which is what the qdiscs
+   on the way out look at. */
+static inline void qcn_cnm_put_vlan(struct sk_buff *skb,
+				    const struct qcn_frame *frame)
+{
+	unsigned int len = skb->len - 2 * ETH_ALEN;
+	__be16 *tag;
+	int i, n;
+
+	if (!(frame->flags & htons(QCN_FRAME_VLAN)))
+		return;
+	for (n = 0; n < QCN_VLAN_DEPTH && frame->vlan_proto[n]; n++)
+		;
+	skb_put(skb, n * VLAN_HLEN);
+	tag = (__be16 *)(skb->data + 2 * ETH_ALEN);
+	memmove(tag + 2 * n, tag, len);
+	for (i = 0; i < n; i++) {
+		tag[2 * i] = frame->vlan_proto[i];
+		tag[2 * i + 1] = frame->vlan_tci[i];
+	}
+}
+
+/* Standard CNMs.
+   =======================================
+
+   Besides the private ETH_QCN frame, a CP can emit 802.1Qau CNMs, which
+   NICs with a built-in RP understand. The PDU follows the ethertype (or
+   the CN-TAG echoing the flow ID of the sampled frame) and ends with the
+   first bytes of the sampled MSDU, starting at its ethertype. qoffset
+   and qdelta count 64 byte units. qcn_fb_deliver() accepts both
+   formats, so the software RP works with either.
+*/
+
+#define QCN_CNM_VERSION		0
+#define QCN_CNM_FB_MASK		0x3F
+#define QCN_CNM_QUNIT_SHIFT	6	/* qoffset/qdelta are in 64B units */
+#define QCN_CNM_MSDU_MAX	64
+
+struct qcn_cnm_pdu {
+	__be16	ver_fb;			/* version:4 reserved:6 qntzFb:6 */
+	u8	cpid[8];		/* congestion point identifier */
+	__be16	qoffset;
+	__be16	qdelta;
+	__be16	encap_prio;
+	u8	encap_da[ETH_ALEN];
+	__be16	encap_len;		/* bytes of encap_msdu[] */
+	u8	encap_msdu[0];
+} __attribute__((packed));
+
+/* skb->data at the payload, i.e. past the ethertype; a tagged CNM
+   is one behind its VLAN tags */
+static inline int qcn_is_cnm(struct sk_buff *skb)
+{
+	__be16 proto = skb->protocol;
+	int off = 0;
+
+	while (unlikely(qcn_is_vlan_proto(proto))) {
+		if (off == QCN_VLAN_DEPTH * VLAN_HLEN ||
+		    !pskb_may_pull(skb, off + VLAN_HLEN))
+			return 0;
+		proto = ((struct vlan_hdr *)(skb->data + off))->
+			h_vlan_encapsulated_proto;
+		off += VLAN_HLEN;
+	}
+	if (proto == __constant_htons(ETH_QCN) ||
+	    proto == __constant_htons(ETH_QCN_AGG) ||
+	    proto == __constant_htons(ETH_P_CNM))
+		return 1;
+	return proto == __constant_htons(ETH_P_CNTAG) &&
+		pskb_may_pull(skb, off + QCN_CNTAG_LEN) &&
+		((struct qcn_cntag_hdr *)(skb->data + off))->h_encap_proto ==
+		__constant_htons(ETH_P_CNM);
+}
+
+/* A CNM on its way out as qcn_cnm_flush() hands it to the stack. The
+   qdiscs of the reverse path queue these ahead of their backlog. */
+static inline int qcn_is_cnm_tx(const struct sk_buff *skb)
+{
+	return skb->priority == TC_PRIO_CONTROL &&
+		(skb->protocol == __constant_htons(ETH_QCN) ||
+		 skb->protocol == __constant_htons(ETH_QCN_AGG) ||
+		 skb->protocol == __constant_htons(ETH_P_CNM) ||
+		 skb->protocol == __constant_htons(ETH_P_CNTAG));
+}
+
+/* The device skb came in on, i.e. the way back to its sender. The
+   stack sets skb_iif once, to the first device that received the frame,
+   and it survives any qdisc that uses skb->cb; the QCN bridge sets it
+   again to the bridge port each time it takes the frame in, so that
+   behind a VLAN port, or a second bridge on the same host, it names the
+   port and not the lower or first device. Only bridged traffic has a
+   sender on the link, so a CP needs the QCN bridge in front of it. NULL
+   for locally generated traffic. For the CPs, which run under
+   rcu_read_lock_bh() in dev_queue_xmit(). */
+static inline struct net_device *qcn_ingress_dev(struct net *net,
+						 const struct sk_buff *skb)
+{
+	if (!skb->skb_iif)
+		return NULL;
+	return dev_get_by_index_rcu(net, skb->skb_iif);
+}
+
+/* IPv6 flows.
+   =======================================
+
+   An IPv6 pair does not fit SA/DA; the CP folds each address into 32
+   bits and flags the frame QCN_FRAME_IPV6, and the RP looks the folded
+   pair up in the same O(1) table as an IPv4 one, within its own scope,
+   qcn_flow_scope(). Two pairs that fold the same share an RP; a flow
+   that must not can have the RP tag it, see the CN-TAG above.
+*/
+
+static inline __be32 qcn_ipv6_fold(const struct in6_addr *a)
+{
+	return a->s6_addr32[0] ^ a->s6_addr32[1] ^
+		a->s6_addr32[2] ^ a->s6_addr32[3];
+}
+
+static inline void qcn_flow_ipv6(struct qcn_frame *frame,
+				 const struct ipv6hdr *ip6h)
+{
+	frame->flags |= htons(QCN_FRAME_IPV6);
+	frame->DA = qcn_ipv6_fold(&ip6h->daddr);
+	frame->SA = qcn_ipv6_fold(&ip6h->saddr);
+}
+
+/* What the RP keys the pair of frame by besides SA/DA: its VLAN and
+   whether it is an IPv6 one, see flow_scope in qcn_tc.h */
+static inline u32 qcn_flow_scope(const struct qcn_frame *frame)
+{
+	return qcn_vlan_key(frame) |
+		(frame->flags & htons(QCN_FRAME_IPV6) ? QCN_SCOPE_IPV6 : 0);
+}
+
+/* qcn_flow_fill() for a VLAN tagged frame, from behind the tags */
+static inline int qcn_flow_fill_vlan(struct sk_buff *skb,
+				     struct qcn_frame *frame)
+{
+	const struct qcn_cntag_hdr *tag;
+	const struct iphdr *iph;
+	__be16 proto;
+	int off;
+
+	proto = qcn_vlan_parse(skb, frame, &off);
+	if (proto == __constant_htons(ETH_P_CNTAG)) {
+		if (off + QCN_CNTAG_LEN > skb_headlen(skb))
+			return 0;
+		tag = (const struct qcn_cntag_hdr *)(skb->data + off);
+		frame->flags |= htons(QCN_FRAME_FLOWID);
+		frame->flow_id = tag->h_flow_id;
+		return 1;
+	}
+	if (proto == __constant_htons(ETH_P_IPV6)) {
+		if (off + sizeof(struct ipv6hdr) > skb_headlen(skb))
+			return 0;
+		qcn_flow_ipv6(frame,
+			      (const struct ipv6hdr *)(skb->data + off));
+		return 1;
+	}
+	if (proto != __constant_htons(ETH_P_IP) ||
+	    off + sizeof(struct iphdr) > skb_headlen(skb))
+		return 0;
+	iph = (const struct iphdr *)(skb->data + off);
+	frame->DA = iph->daddr;
+	frame->SA = iph->saddr;
+	return 1;
+}
+
+/* Identifies the flow of skb in frame, by its CN-TAG flow ID if the RP
+   tagged it and by its IPv4 or folded IPv6 addresses otherwise, and
+   the VLAN it is in.
+   Returns 0 if there is no way to address feedback to the sender. */
+static inline int qcn_flow_fill(struct sk_buff *skb, struct qcn_frame *frame)
+{
+	struct qcn_cntag_hdr *tag;
+	struct iphdr *iph;
+
+	/* Filling the qcn_frame structure */
+	memset(frame, 0, sizeof(struct qcn_frame));
+	if (unlikely(qcn_is_vlan_proto(skb->protocol) ||
+		     vlan_tx_tag_present(skb)))
+		return qcn_flow_fill_vlan(skb, frame);
+	if (skb->protocol == __constant_htons(ETH_P_CNTAG)) {
+		tag = (struct qcn_cntag_hdr *)(skb_mac_header(skb) + ETH_HLEN);
+		if ((unsigned char *)(tag + 1) > skb_tail_pointer(skb))
+			return 0;
+		frame->flags = htons(QCN_FRAME_FLOWID);
+		frame->flow_id = tag->h_flow_id;
+		return 1;
+	}
+
+	/* Without a tag we are using IP addresses, we cant sample non-IP
+	   packets. */
+	if (!skb->network_header)
+		return 0;
+	if (skb->protocol == __constant_htons(ETH_P_IPV6)) {
+		if (skb_network_header(skb) + sizeof(struct ipv6hdr) >
+		    skb_tail_pointer(skb))
+			return 0;
+		qcn_flow_ipv6(frame, ipv6_hdr(skb));
+		return 1;
+	}
+	if (skb->protocol != __constant_htons(ETH_P_IP))
+		return 0;
+
+	iph = ip_hdr(skb);
+	frame->DA = iph->daddr;	/* Already in network byte order */
+	frame->SA = iph->saddr;	/* Already in network byte order */
+	return 1;
+}
+
+/* Feedback delivery.
+   =======================================
+
+   A Reaction Point registers one handler for the device its qdisc is
+   attached to. The qcn module receives CNMs through its own packet_type
+   handlers (tagged ones through the CN-TAG handler) and hands the payload
+   over with qcn_fb_deliver(), which finds the handler by ifindex and
+   network namespace in an RCU protected hash, so the same ifindex in
+   another namespace is another RP. On a bridge port the bridge passes up
+   the CNMs for which qcn_fb_registered() says an RP is waiting, and
+   forwards the rest; it and qcn_fb_ingress() know the ifindex alone and
+   answer for any namespace. recv() is called from softirq context
+   under rcu_read_lock(), with a private copy of the feedback (standard
+   CNMs are translated into a qcn_frame first).
+
+   Below mq every TX queue can have an RP of its own (queue >= 0), all
+   registered for the same device. Feedback is then first offered with
+   QCN_FRAME_LOOKUP set to every one of them, and an RP that does not
+   know the flow answers with -ENOENT at once; if nobody knows it, it
+   goes around once more without the flag, for the one RP that counts
+   it or creates its class. home() names the queue a packet's flow
+   belongs on, the one its feedback creates the class in; the bridge
+   steers what it forwards there with qcn_tx_queue(), which the stack's
+   TX hash would otherwise put on one queue for all bridged flows.
+   Locally sent packets follow their socket's hash, so one pair may be
+   carried, and then throttled, by several queues.
+
+   An RP that polices what its device receives (ingress set, see
+   sch_ingress_port.c) stands in for the senders behind that device, so
+   the bridge hands it the CNMs it would otherwise forward out of it.
+*/
+
+struct qcn_fb_handler {
+	struct hlist_node	hnode;
+	int			ifindex;
+	struct net		*net;	/* of ifindex */
+	int			queue;	/* TX queue of the RP, -1 whole device */
+	int			ingress;	/* 1: RP of what the device receives */
+	int			(*recv)(struct qcn_fb_handler *h,
+					struct qcn_frame *frame);
+	/* queue >= 0 only, may be NULL: the TX queue of skb's flow, -1 for
+	   any. Under rcu_read_lock(), in any context. */
+	int			(*home)(struct qcn_fb_handler *h,
+					struct sk_buff *skb);
+	/* QCN_CMD_RP_DUMP, may be NULL: fills up to n records from where
+	   pos[2] (0, 0 at first) says, moves pos past them and returns
+	   how many, 0 when done. Process context, under rcu_read_lock(). */
+	int			(*dump)(struct qcn_fb_handler *h,
+					struct qcn_rp_rec *rec, int n,
+					unsigned long *pos);
+	void			*priv;
+};
+
+extern int qcn_fb_register(struct qcn_fb_handler *h);
+extern void qcn_fb_unregister(struct qcn_fb_handler *h);
+extern int qcn_fb_deliver(struct net_device *dev, struct sk_buff *skb);
+extern int qcn_fb_registered(int ifindex);
+extern int qcn_fb_ingress(int ifindex);
+extern int qcn_tx_queue(struct net_device *dev, struct sk_buff *skb);
+
+/* Deferred feedback.
+   recv() runs on whichever CPU the CNM came in on, and applying it there
+   takes the rate lock of the class while another CPU may be dequeueing
+   from it. An RP can instead decide in recv() only whether the record is
+   its own, queue it here and apply it from its dequeue, under its root
+   lock. Any number of CPUs add records lock free; the consumer is the
+   holder of the root lock. The first record after the consumer took
+   its kick kicks it again; the bit orders the two, so that a record is
+   either drained by a consumer that took the kick after it was added,
+   or kicks the consumer itself. */
+
+#define QCN_FB_QUEUE_LEN	64	/* records, a power of 2 */
+
+struct qcn_fb_queue {
+	DECLARE_KFIFO_MP(fifo, struct qcn_frame);
+	atomic_t	overflows;	/* applied at once, queue full */
+	unsigned long	kick;		/* bit 0: the consumer is due */
+};
+
+/* Best effort: without the ring every record is applied at once */
+static inline void qcn_fb_queue_init(struct qcn_fb_queue *fq)
+{
+	if (kfifo_mp_alloc(&fq->fifo, QCN_FB_QUEUE_LEN, GFP_KERNEL))
+		printk(KERN_WARNING "qcn: no memory to defer feedback\n");
+	atomic_set(&fq->overflows, 0);
+	fq->kick = 0;
+}
+
+static inline void qcn_fb_queue_destroy(struct qcn_fb_queue *fq)
+{
+	if (kfifo_mp_initialized(&fq->fifo))
+		kfifo_mp_free(&fq->fifo);
+}
+
+/* Softirq context. Returns 1 if the consumer needs a kick, 0 if it has
+   one already, -ENOBUFS if the record could not be queued. */
+static inline int qcn_fb_queue_add(struct qcn_fb_queue *fq,
+				   const struct qcn_frame *frame)
+{
+	if (!kfifo_mp_put(&fq->fifo, frame)) {
+		atomic_inc(&fq->overflows);
+		return -ENOBUFS;
+	}
+	/* a full barrier after the record, see above */
+	return !test_and_set_bit(0, &fq->kick);
+}
+
+/* Consumer side: whether it was kicked, taking the kick before it
+   drains the queue */
+static inline int qcn_fb_queue_kicked(struct qcn_fb_queue *fq)
+{
+	return test_bit(0, &fq->kick) && test_and_clear_bit(0, &fq->kick);
+}
+
+/* Consumer side, after a drain: 1 if records are left or still being
+   added and nobody kicked it since, so that it must run again */
+static inline int qcn_fb_queue_rearm(struct qcn_fb_queue *fq)
+{
+	return kfifo_mp_len(&fq->fifo) != 0 &&
+		!test_and_set_bit(0, &fq->kick);
+}
+
+/* Consumer only, up to n records in one go */
+static inline unsigned int qcn_fb_queue_drain(struct qcn_fb_queue *fq,
+					      struct qcn_frame *frames,
+					      unsigned int n)
+{
+	return kfifo_mp_drain(&fq->fifo, frames, n);
+}
+
+/**
+ * qcn_randomize - uniformly jitter a sampling interval or timer period
+ *
+ * Returns a value drawn uniformly from base * [1 - pct/100, 1 + pct/100].
+ * net_random() keeps its state per CPU, so this costs a few cycles and
+ * no shared cacheline (802.1Qau suggests pct = 15).
+ */
+static inline u32 qcn_randomize(u32 base, unsigned int pct)
+{
+	u32 span;
+
+	if (pct == 0)
+		return base;
+	span = (u32)(((u64)base * min(pct, 100U)) / 100);
+	return base - span + (u32)(((u64)net_random() * (2 * span + 1)) >> 32);
+}
+
+/* Preallocated CNM skbs.
+   =======================================
+
+   CNMs are generated in softirq context with the CP root lock held,
+   which under heavy congestion is exactly when GFP_ATOMIC allocations
+   fail. Each CP keeps a small ring of QCN_CNM_LEN byte skbs with the
+   QCN ethertype already written. A slot is in flight while somebody
+   other than the pool holds a reference (skb_shared()); once the driver
+   frees it, the skb is reset with skb_recycle_check() and reused. Only
+   when every slot is in flight do we fall back to alloc_skb(GFP_ATOMIC).
+*/
+
+#define QCN_CNM_LEN		384	/* fits a standard CNM, CN-TAG and VLAN
+					   tags included, and a full aggregated
+					   CNM */
+#define QCN_CNM_POOL_SIZE	16	/* must be a power of 2 */
+
+struct qcn_cnm_pool {
+	struct sk_buff	*skb[QCN_CNM_POOL_SIZE];
+	unsigned int	next;		/* next slot to try */
+	u32		fallbacks;	/* CNMs built outside of the pool */
+};
+
+extern int qcn_cnm_pool_init(struct qcn_cnm_pool *pool);
+extern void qcn_cnm_pool_destroy(struct qcn_cnm_pool *pool);
+extern struct sk_buff *qcn_cnm_alloc(struct qcn_cnm_pool *pool);
+
+/* Deferred CNM transmission.
+   =======================================
+
+   Calling dev_queue_xmit() on the reverse path from inside the CP
+   enqueue nests qdisc locks and makes every sampled packet pay for the
+   transmit. Instead the CP (single producer, under its qdisc lock) puts
+   the CNM into a small lockless ring and a tasklet (single consumer)
+   flushes the whole ring in one go.
+
+   Behind the qdisc of the reverse path a CNM would wait for whatever
+   backlog that device has, milliseconds under congestion, the very
+   time the feedback loop cannot afford. With the cnm_bypass parameter
+   of qcn set, the tasklet hands CNMs straight to the driver and only
+   goes through dev_queue_xmit() when the TX queue is busy. There they
+   carry TC_PRIO_CONTROL, see qcn_is_cnm_tx().
+
+   The same ring is the feedback delay line of fb_delay (see qcn_tc.h):
+   a CNM goes in stamped, in skb->tstamp, with the time it is due, and
+   the tasklet stops at the first one that is not, leaving an hrtimer
+   to bring it back then. Every CNM of a CP is held equally long, so
+   the ring stays in the order they are due. Held CNMs keep their ring
+   and pool slots, which is what the ring is sized for.
+
+   A CNM holds a reference to skb->dev from the time it is queued until
+   it has been sent or purged, so its device (the RP facing port) can
+   not go away while the CNM waits out fb_delay. dropped and lost are
+   bumped by the CP and by the tasklet, on different CPUs, so they are
+   atomic.
+*/
+
+#define QCN_CNM_QUEUE_LEN	256	/* must be a power of 2 */
+
+struct qcn_cnm_sender {
+	DECLARE_KFIFO(fifo, struct sk_buff *, QCN_CNM_QUEUE_LEN);
+	struct tasklet_struct	tasklet;
+	struct hrtimer		timer;		/* the head is held until then */
+	u64			delay;		/* ns, see above */
+	u32			loss;		/* per million */
+	int			dying;		/* the timer is not rearmed */
+
+	u32	queued;		/* CNMs handed over by the CP */
+	u32	sent;		/* CNMs accepted by dev_queue_xmit() */
+	u32	bypassed;	/* of them, straight to the driver */
+	atomic_t dropped;	/* ring full or dev_queue_xmit() failure */
+	atomic_t lost;		/* dropped on purpose, see loss */
+};
+
+extern void qcn_cnm_sender_init(struct qcn_cnm_sender *tx);
+extern void qcn_cnm_sender_destroy(struct qcn_cnm_sender *tx);
+extern int qcn_cnm_send(struct qcn_cnm_sender *tx, struct sk_buff *skb);
+
+/* fb_delay us and fb_loss of qcn_tc.h; under the CP qdisc lock */
+static inline void qcn_cnm_sender_set(struct qcn_cnm_sender *tx,
+				      u32 fb_delay, u32 fb_loss)
+{
+	tx->delay = (u64)fb_delay * NSEC_PER_USEC;
+	tx->loss = fb_loss;
+}
+
+/* CNM coalescing.
+   =======================================
+
+   Under heavy fan-in a CP samples many culprit flows behind the same
+   host, and one CNM per sample loads the reverse path and the bridge.
+   Optionally, private CNMs headed for the same host (same device and
+   MAC addresses) are collected into one ETH_QCN_AGG frame: a
+   qcn_agg_hdr followed by up to QCN_AGG_MAX qcn_frame records. A frame
+   is sent when it is full, when its slot is needed for another host,
+   or at the latest one window after its first record; the window timer
+   takes the root lock of the CP. qcn_fb_deliver() hands each record to
+   the RP in turn. Standard CNMs are never coalesced.
+*/
+
+#define QCN_AGG_MAX		8	/* records per aggregated CNM */
+#define QCN_AGG_SLOTS		4	/* hosts collected for at a time */
+#define QCN_CNM_COALESCE_MAX	10000	/* longest window (us) */
+
+struct qcn_agg_hdr {
+	__be16	count;			/* qcn_frame records that follow */
+	__be16	reserved;
+};
+
+struct Qdisc;
+
+struct qcn_cnm_agg {
+	struct sk_buff		*skb[QCN_AGG_SLOTS];	/* NULL if free */
+	unsigned int		next;		/* slot to evict next */
+	struct tasklet_hrtimer	timer;		/* window, see above */
+
+	struct Qdisc		*sch;		/* whose root lock to take */
+	spinlock_t		*lock;		/* the one taken without sch */
+	struct qcn_cnm_pool	*pool;
+	struct qcn_cnm_sender	*tx;
+
+	u32	coalesced;	/* records that joined a pending frame */
+};
+
+extern void qcn_cnm_agg_init(struct qcn_cnm_agg *agg, struct Qdisc *sch,
+			     struct qcn_cnm_pool *pool,
+			     struct qcn_cnm_sender *tx);
+extern void qcn_cnm_agg_destroy(struct qcn_cnm_agg *agg);
+extern int qcn_cnm_agg_add(struct qcn_cnm_agg *agg, struct net_device *dev,
+			   const u8 *dest, const u8 *source,
+			   const struct qcn_frame *frame, unsigned int window);
+
+/* Per-flow CNM suppression.
+   =======================================
+
+   A CP keeps CNMs pending until one gets out, so under incast the same
+   flow can be sampled again before its RP even saw the first CNM, and
+   the redundant feedback collapses its rate. With a minimum interval
+   set, the CP remembers in a small direct mapped table when it last
+   notified each flow, and holds back a CNM to a flow notified less
+   than the interval ago; the pending CNM then goes to the next sampled
+   flow that was not. A collision only evicts the older flow, so the
+   worst case is a CNM that would have been suppressed getting out.
+*/
+
+#define QCN_FILTER_BITS		6
+#define QCN_FILTER_SIZE		(1 << QCN_FILTER_BITS)
+#define QCN_CNM_MIN_INTERVAL_MAX	1000000	/* us, one second */
+
+struct qcn_cnm_filter_ent {
+	u32	SA;
+	u32	DA;
+	__be16	flags;
+	__be16	flow_id;
+	u32	vlan;			/* qcn_vlan_key() */
+	s64	stamp;			/* ns, ktime_get() of the last CNM */
+};
+
+struct qcn_cnm_filter {
+	struct qcn_cnm_filter_ent ent[QCN_FILTER_SIZE];
+	u32	suppressed;		/* CNMs held back */
+};
+
+static inline struct qcn_cnm_filter_ent *
+qcn_cnm_filter_slot(struct qcn_cnm_filter *f, const struct qcn_frame *frame)
+{
+	u32 h = jhash_3words(frame->SA, frame->DA, frame->flow_id,
+			     qcn_vlan_key(frame));
+
+	return &f->ent[h & (QCN_FILTER_SIZE - 1)];
+}
+
+/* Returns 1 (and counts it) if the flow of frame got a CNM less than
+   interval us ago. Under the CP qdisc lock, like qcn_cnm_filter_note(). */
+static inline int qcn_cnm_suppress(struct qcn_cnm_filter *f,
+				   const struct qcn_frame *frame,
+				   unsigned int interval)
+{
+	struct qcn_cnm_filter_ent *e;
+
+	if (interval == 0)
+		return 0;
+	e = qcn_cnm_filter_slot(f, frame);
+	if (e->SA != frame->SA || e->DA != frame->DA ||
+	    e->flags != frame->flags || e->flow_id != frame->flow_id ||
+	    e->vlan != qcn_vlan_key(frame) ||
+	    ktime_to_ns(ktime_get()) - e->stamp >=
+	    (s64)interval * NSEC_PER_USEC)
+		return 0;
+	f->suppressed++;
+	return 1;
+}
+
+/* The flow of frame was just sent a CNM */
+static inline void qcn_cnm_filter_note(struct qcn_cnm_filter *f,
+				       const struct qcn_frame *frame,
+				       unsigned int interval)
+{
+	struct qcn_cnm_filter_ent *e;
+
+	if (interval == 0)
+		return;
+	e = qcn_cnm_filter_slot(f, frame);
+	e->SA = frame->SA;
+	e->DA = frame->DA;
+	e->flags = frame->flags;
+	e->flow_id = frame->flow_id;
+	e->vlan = qcn_vlan_key(frame);
+	e->stamp = ktime_to_ns(ktime_get());
+}
+
+/* Heavy hitters.
+   =======================================
+
+   The sampled packet picks the flow a CNM goes to, so a mouse is cut
+   about as often as an elephant. With a window set, the CP keeps a
+   space saving sketch of the bytes of the QCN_HH_SLOTS largest flows:
+   a flow that is not in it takes over the smallest counter, and all
+   counters are halved every window bytes, so that they follow the
+   recent traffic. A CNM is only sent to a flow within half of the
+   largest count; otherwise it stays pending for the next arrival of
+   one that is. A new flow may be overestimated by the smallest count.
+   deferred counts the CNMs held back, each once however many arrivals
+   pass it by.
+*/
+
+#define QCN_HH_SLOTS		8
+
+struct qcn_hh_ent {
+	u32	SA;
+	u32	DA;
+	__be16	flags;
+	__be16	flow_id;
+	u32	vlan;			/* qcn_vlan_key() */
+	u32	bytes;
+};
+
+struct qcn_hh {
+	struct qcn_hh_ent ent[QCN_HH_SLOTS];
+	u32	total;			/* bytes since the last halving */
+	u32	deferred;		/* CNMs held back from a mouse */
+	u32	held;			/* the pending one is counted */
+};
+
+/* A CNM became pending; under the CP qdisc lock */
+static inline void qcn_hh_pending(struct qcn_hh *hh)
+{
+	hh->held = 0;
+}
+
+/* The pending CNM was held back from the flow of an arrival */
+static inline void qcn_hh_defer(struct qcn_hh *hh)
+{
+	if (!hh->held) {
+		hh->held = 1;
+		hh->deferred++;
+	}
+}
+
+static inline int qcn_hh_match(const struct qcn_hh_ent *e,
+			       const struct qcn_frame *frame)
+{
+	return e->SA == frame->SA && e->DA == frame->DA &&
+		e->flags == frame->flags && e->flow_id == frame->flow_id &&
+		e->vlan == qcn_vlan_key(frame);
+}
+
+/* Called for every arrival of frame's flow, under the CP qdisc lock */
+static inline void qcn_hh_add(struct qcn_hh *hh, const struct qcn_frame *frame,
+			      unsigned int len, u32 window)
+{
+	struct qcn_hh_ent *e, *min = &hh->ent[0];
+	int i;
+
+	for (i = 0, e = hh->ent; i < QCN_HH_SLOTS; i++, e++) {
+		if (qcn_hh_match(e, frame))
+			goto found;
+		if (e->bytes < min->bytes)
+			min = e;
+	}
+	e = min;
+	e->SA = frame->SA;
+	e->DA = frame->DA;
+	e->flags = frame->flags;
+	e->flow_id = frame->flow_id;
+	e->vlan = qcn_vlan_key(frame);
+found:
+	e->bytes += len;
+	hh->total += len;
+	if (hh->total >= window) {
+		for (i = 0; i < QCN_HH_SLOTS; i++)
+			hh->ent[i].bytes >>= 1;
+		hh->total >>= 1;
+	}
+}
+
+/* Returns 1 if frame's flow is among the largest, or the sketch is off */
+static inline int qcn_hh_heavy(struct qcn_hh *hh,
+			       const struct qcn_frame *frame, u32 window)
+{
+	u32 max = 0, bytes = 0;
+	int i;
+
+	if (window == 0)
+		return 1;
+	for (i = 0; i < QCN_HH_SLOTS; i++) {
+		if (hh->ent[i].bytes > max)
+			max = hh->ent[i].bytes;
+		if (qcn_hh_match(&hh->ent[i], frame))
+			bytes = hh->ent[i].bytes;
+	}
+	if (bytes && bytes >= max >> 1)
+		return 1;
+	qcn_hh_defer(hh);
+	return 0;
+}
+
+/* Multiqueue congestion points.
+   =======================================
+
+   On a multiqueue NIC the CP is attached once per TX queue below an mq
+   root, so that CPUs transmitting on different queues do not share a
+   qdisc lock. The congestion point is still the port, though: every
+   instance on a device joins one qcn_cp_group and publishes its own
+   backlog into a private, cacheline aligned slot (plain stores, no
+   atomics, no sharing on the enqueue path). The port backlog is the sum
+   of all slots and is only computed when an instance actually needs Fb,
+   i.e. at sampling time. Backlogs are kept per priority (see
+   QCN_NR_PRIO), as each priority is a congestion point of its own.
+*/
+
+struct qcn_cp_slot {
+	int	qlen[QCN_NR_PRIO];	/* bytes queued on this TX queue */
+	unsigned long	sent;		/* bytes handed to the driver */
+} ____cacheline_aligned_in_smp;
+
+struct qcn_cp_group {
+	struct hlist_node	hnode;
+	int			ifindex;
+	struct net		*net;	/* of ifindex */
+	int			refcnt;		/* under qcn_cp_group_lock */
+	unsigned int		nr_slots;	/* dev->num_tx_queues */
+	struct qcn_cp_slot	slot[0];
+};
+
+extern struct qcn_cp_group *qcn_cp_group_get(struct net_device *dev);
+extern void qcn_cp_group_put(struct qcn_cp_group *g);
+
+/* Port backlog of priority prio: the sum over all TX queue slots */
+static inline int qcn_cp_group_qlen(const struct qcn_cp_group *g, int prio)
+{
+	unsigned int i;
+	int qlen = 0;
+
+	for (i = 0; i < g->nr_slots; i++)
+		qlen += ACCESS_ONCE(g->slot[i].qlen[prio]);
+	return qlen;
+}
+
+/* What every TX queue handed to the driver, for the port's qcn_ring */
+static inline unsigned long qcn_cp_group_sent(const struct qcn_cp_group *g)
+{
+	unsigned long sent = 0;
+	unsigned int i;
+
+	for (i = 0; i < g->nr_slots; i++)
+		sent += ACCESS_ONCE(g->slot[i].sent);
+	return sent;
+}
+
+/* Driver TX ring.
+   =======================================
+
+   The kernel has no byte queue limits to ask what a driver holds in its
+   TX ring, so a CP with ring set (see qcn_tc.h) estimates it: the bytes
+   its owner handed to the driver, less what the driver has added to
+   dev->stats.tx_bytes since. Both are read without locks and only as
+   deltas, so wrapping is harmless. The estimate is refreshed at most
+   every QCN_RING_PERIOD on the path that wants Fb, under the owner's
+   lock; it is clamped to the ring size, which also bounds what frames
+   the driver dropped leave behind, and starts over at 0 when the driver
+   has completed nothing, or nobody asked, for QCN_RING_IDLE.
+*/
+
+#define QCN_RING_PERIOD		(20 * NSEC_PER_USEC)
+#define QCN_RING_IDLE		(100 * NSEC_PER_MSEC)
+#define QCN_RING_SLOTS		256	/* if the driver does not say */
+
+struct qcn_ring {
+	struct net_device	*dev;
+	unsigned long		sent;	/* at the last refresh */
+	unsigned long		done;	/* dev->stats.tx_bytes then */
+	s64			next;	/* ns, next refresh, 0 start over */
+	s64			active;	/* ns, done last moved */
+	int			inflight;	/* the estimate */
+	int			limit;	/* bytes the ring can hold */
+};
+
+extern void qcn_ring_init(struct qcn_ring *r, struct net_device *dev);
+extern void qcn_ring_update(struct qcn_ring *r, unsigned long sent, s64 now);
+
+static inline void qcn_ring_reset(struct qcn_ring *r)
+{
+	r->next = 0;
+	r->inflight = 0;
+}
+
+/* Bytes below the qdisc, given what the owner handed down in total */
+static inline int qcn_ring_inflight(struct qcn_ring *r, unsigned long sent)
+{
+	s64 now = ktime_to_ns(ktime_get());
+
+	if (now >= r->next)
+		qcn_ring_update(r, sent, now);
+	return r->inflight;
+}
+
+/* Shared buffer domains.
+   =======================================
+
+   CPs on different ports that model one switch buffer join a qcn_sbuf
+   by the ID in their tc options (see sbuf in qcn_tc.h). As in a
+   qcn_cp_group, each member owns a cacheline aligned slot and writes
+   its total backlog there under its own qdisc lock. The occupancy of
+   the domain is the sum of the slots, computed only when a member
+   needs Fb.
+*/
+
+#define QCN_SBUF_PORTS		64	/* members of one domain */
+
+struct qcn_sbuf_slot {
+	int	qlen;			/* bytes the member holds */
+} ____cacheline_aligned_in_smp;
+
+struct qcn_sbuf {
+	struct hlist_node	hnode;
+	u32			id;		/* within net */
+	struct net		*net;
+	int			refcnt;		/* under qcn_sbuf_lock */
+	u32			size;		/* bytes, 0 no threshold */
+	unsigned int		nr_slots;	/* highest slot taken + 1 */
+	unsigned long		used[BITS_TO_LONGS(QCN_SBUF_PORTS)];
+	struct qcn_sbuf_slot	slot[QCN_SBUF_PORTS];
+};
+
+extern struct qcn_sbuf *qcn_sbuf_get(struct net *net, u32 id,
+				     struct qcn_sbuf_slot **slot);
+extern void qcn_sbuf_put(struct qcn_sbuf *b, struct qcn_sbuf_slot *slot);
+
+/* Bytes held in the whole domain; slots not taken are 0 */
+static inline int qcn_sbuf_qlen(const struct qcn_sbuf *b)
+{
+	unsigned int i, n = ACCESS_ONCE(b->nr_slots);
+	int qlen = 0;
+
+	for (i = 0; i < n; i++)
+		qlen += ACCESS_ONCE(b->slot[i].qlen);
+	return qlen;
+}
+
+/* The dynamic threshold of a member: alpha / 16 of the free buffer.
+   INT_MAX for a domain without a size. */
+static inline int qcn_sbuf_thresh(const struct qcn_sbuf *b, u32 alpha)
+{
+	u32 size = ACCESS_ONCE(b->size);
+	int qlen;
+
+	if (!size)
+		return INT_MAX;
+	qlen = qcn_sbuf_qlen(b);
+	if (qlen >= (int)size)
+		return 0;
+	return (int)min_t(u64, ((u64)(size - qlen) * alpha) >> 4, INT_MAX);
+}
+
+/* Algorithms.
+   =======================================
+
+   Congestion control algorithms, the qcn_alg_ops of qcn_alg.h, are
+   registered by name, as TCP's are; the qcn module registers the ones
+   qcn_alg.h brings. A CP or RP looks its algorithm up by the name in
+   its tc options with qcn_alg_get(), which takes a reference on the
+   module of the algorithm, and drops it with qcn_alg_put() once it no
+   longer runs it. The standard ("qcn", or "") is NULL and needs no
+   reference. Algorithms are called under the owner's locks only; a
+   module can go once nothing holds a reference to it.
+*/
+
+extern int qcn_alg_register(struct qcn_alg_ops *alg);
+extern void qcn_alg_unregister(struct qcn_alg_ops *alg);
+extern const struct qcn_alg_ops *qcn_alg_get(const char *name);
+
+/* Another reference, for one already held */
+static inline void qcn_alg_hold(const struct qcn_alg_ops *alg)
+{
+	if (alg)
+		__module_get(alg->owner);
+}
+
+static inline void qcn_alg_put(const struct qcn_alg_ops *alg)
+{
+	if (alg)
+		module_put(alg->owner);
+}
+
+/* 1 and the algorithm name names, referenced, in *alg if flag is set
+   in flags, 0 and *alg left alone if not */
+static inline int qcn_alg_opt_get(u32 flags, u32 flag, const char *name,
+				  const struct qcn_alg_ops **alg)
+{
+	const struct qcn_alg_ops *a;
+
+	if (!(flags & flag))
+		return 0;
+	a = qcn_alg_get(name);
+	if (IS_ERR(a))
+		return PTR_ERR(a);
+	*alg = a;
+	return 1;
+}
+
+/* Congestion Point library.
+   =======================================
+
+   The CP of qcnfifo, for any qdisc that wants one without a fork of its
+   own: the owner keeps its queue, holds its qdisc lock around every call
+   and passes its byte backlog in; the library samples, computes Fb and
+   sends the CNMs. One qcn_cp is a single congestion point, a qdisc with
+   several priorities keeps one per priority. Parameters come in the
+   tc_qcn_cp_opt of TCA_TBF_QCN, of which the first priority of
+   prio_mask counts; the tbf-only ones are ignored.
+*/
+
+struct qcn_cp {
+	/* Parameters */
+	int			q_eq, w;
+	u32			sample_jitter;	/* percent */
+	u32			coalesce;	/* us, 0 off */
+	u32			min_interval;	/* us, 0 off */
+	u32			mark_cfg[QCN_MARK_STEPS];	/* at mark_rate */
+	u32			mark_rate;
+	u32			fb_period;	/* us, 0 at each sample */
+	u32			heavy;		/* bytes, 0 off */
+	u32			limit;		/* bytes the owner queues, 0 unknown */
+	u64			rate;		/* bytes/s of the port, 0 unknown */
+	u32			enable;		/* 0 the owner skips the CP */
+	u32			fb_delay;	/* us, see cnm_tx */
+	u32			fb_loss;	/* per million, see cnm_tx */
+	u32			ring_on;	/* add ring to the backlog */
+
+	/* Variables */
+	int			qlen;		/* backlog and ring Fb sees */
+	int			backlog;	/* last passed in */
+	unsigned long		sent;		/* bytes gone to the driver */
+	struct qcn_ring		ring;
+	int			qlen_old;
+	int			sample;
+	u32			generate_fb_frame;
+	u32			fb;		/* last quantized Fb */
+	u32			fb_max;
+	int			fb_shift;
+	int			prof;		/* qcn_cp_prof() of w */
+	u32			mark[QCN_MARK_STEPS];	/* at rate */
+	u64			fb_next;	/* psched ticks */
+	const struct qcn_alg_ops *alg;		/* NULL: 802.1Qau */
+
+	struct Qdisc		*sch;		/* NULL for a qcn_port_cp */
+	struct net_device	*dev;		/* whose queue this is */
+	int			prio;
+	struct qcn_cnm_pool	cnm_pool;
+	struct qcn_cnm_sender	cnm_tx;
+	struct qcn_cnm_agg	cnm_agg;
+	struct qcn_cnm_filter	cnm_filter;
+	struct qcn_hh		hh;
+	u32			cnm_generated;
+	u32			cnm_create_failed;
+	struct qcn_telem	*telem;
+};
+
+extern int qcn_cp_init(struct qcn_cp *cp, struct Qdisc *sch, int prio,
+		       const struct tc_qcn_cp_opt *def, u64 rate);
+extern void qcn_cp_destroy(struct qcn_cp *cp);
+extern int qcn_cp_check(const struct tc_qcn_cp_opt *opt);
+extern void qcn_cp_change(struct qcn_cp *cp, const struct tc_qcn_cp_opt *opt);
+extern void qcn_cp_set_limit(struct qcn_cp *cp, u32 limit);
+extern void qcn_cp_set_alg(struct qcn_cp *cp, const struct qcn_alg_ops *alg);
+extern void qcn_cp_reset(struct qcn_cp *cp);
+extern void qcn_cp_enqueue(struct qcn_cp *cp, struct sk_buff *skb,
+			   unsigned int len, int backlog);
+extern void qcn_cp_dequeue(struct qcn_cp *cp, int backlog);
+extern void qcn_cp_update(struct qcn_cp *cp, int backlog);
+extern void qcn_cp_dump(const struct qcn_cp *cp, struct tc_qcn_cp_opt *opt);
+extern void qcn_cp_stats(const struct qcn_cp *cp,
+			 struct tc_qcn_cp_xstats *st);
+
+/* Bridge port CP.
+   =======================================
+
+   The same CP without a qdisc of its own, for the bridge to run on the
+   frames it hands to a port: the bridge calls qcn_port_cp_xmit() from
+   br_dev_queue_push_xmit(), and the CP samples the backlog of the
+   qdiscs of the port, see qcn_dev_backlog(), with the frame counted in,
+   instead of a tbf CP qdisc on every port. It sees no departures, so
+   what left the port between two frames counts as sent when the later
+   one comes. The CNMs go out of the port the frame came in on, skb_iif
+   as for every other CP. Only q_eq and w are set, the rest keeps the
+   defaults of qcnfifo.
+*/
+
+#define QCN_PORT_Q_EQ		34000	/* bytes */
+#define QCN_PORT_W		2
+
+struct qcn_port_cp {
+	spinlock_t		lock;		/* as the qdisc lock */
+	struct qcn_cp		cp;
+};
+
+extern struct qcn_port_cp *qcn_port_cp_create(struct net_device *dev,
+					      u32 q_eq, u32 w);
+extern void qcn_port_cp_destroy(struct qcn_port_cp *pcp);
+extern int qcn_port_cp_check(u32 q_eq, u32 w);
+extern void qcn_port_cp_change(struct qcn_port_cp *pcp, u32 q_eq, u32 w);
+extern void qcn_port_cp_xmit(struct qcn_port_cp *pcp, struct sk_buff *skb);
+
+/* Bytes queued in the qdiscs of dev, without their locks; under
+   rcu_read_lock(). Only a classless qdisc such as pfifo_fast, the fifos
+   or sfq keeps qstats.backlog as it queues. tbf, htb, prio and the
+   other classful ones add up the bytes of their children when dumped,
+   and only keep q.qlen current; their frames count at the MTU of dev,
+   which errs on the side of congestion. Below mq every TX queue has a
+   qdisc of its own. A port below noqueue has none. */
+static inline int qcn_dev_backlog(struct net_device *dev)
+{
+	unsigned int i, mtu = dev->mtu + dev->hard_header_len;
+	u64 backlog = 0;
+
+	for (i = 0; i < dev->real_num_tx_queues; i++) {
+		struct Qdisc *q = rcu_dereference(netdev_get_tx_queue(dev,
+								      i)->qdisc);
+
+		if (q->ops->cl_ops == NULL)
+			backlog += ACCESS_ONCE(q->qstats.backlog);
+		else
+			backlog += (u64)ACCESS_ONCE(q->q.qlen) * mtu;
+	}
+	return min_t(u64, backlog, INT_MAX);
+}
+
+/* Reaction Point parameters.
+   =======================================
+
+   Every RP keeps the rate state of qcn_alg.h per flow and takes its
+   parameters in the tc_qcn_rp_opt of TCA_HTB_QCN; these check and apply
+   the fields all of them share. Where a field only means something to
+   one kind of RP, that one looks at it itself.
+*/
+
+/* Netmask of an IPv4 prefix of len bits, network order */
+static inline __be32 qcn_prefix_mask(u32 len)
+{
+	return len ? htonl(~0U << (32 - min(len, 32U))) : 0;
+}
+
+extern int qcn_rp_check(const struct tc_qcn_rp_opt *opt);
+extern void qcn_rp_change(struct tc_qcn_rp_opt *qp,
+			  const struct tc_qcn_rp_opt *opt);
+
+/* Binary trace ring.
+   =======================================
+
+   Every CP enqueue and every RP charge/feedback used to printk() one
+   line. Instead, each CPU owns a fixed-record kfifo which the hot path
+   fills without any lock (the qdisc code runs with BH disabled, so the
+   local CPU is the only writer) and which userspace drains in bulk from
+   debugfs (<debugfs>/qcn/trace<cpu>). When a ring is full the record is
+   dropped and counted; tracing never slows the data path down. It is
+   off unless the module is loaded with trace=1 or the parameter is set
+   later, so that the hot path only tests a flag.
+*/
+
+enum {
+	QCN_TRACE_CP,		/* CP enqueue (tbf/bfifo) */
+	QCN_TRACE_RP_TX,	/* RP charged a packet */
+	QCN_TRACE_RP_FB,	/* RP received a feedback frame */
+};
+
+struct qcn_trace_rec {
+	u64	tsc;		/* get_cycles() at the time of the event */
+	u32	id;		/* CP: ifindex, RP: leaf qdisc major handle */
+	u16	type;		/* QCN_TRACE_* */
+	u16	cpu;
+	u32	qlen;		/* CP: qcn_qlen (bytes), RP: leaf qlen (pkts) */
+	u32	fb;		/* quantized Fb, 0 if none */
+	s64	toks;		/* tokens left after the event */
+	u32	crate;		/* RP current rate (bytes/s) */
+	u32	trate;		/* RP target rate (bytes/s) */
+	u16	bcount_stg;	/* RP byte counter stage */
+	u16	timer_stg;	/* RP timer stage */
+	u32	pad;
+};
+
+extern int qcn_trace_enabled;
+
+/* Callers test qcn_trace_enabled before filling in a record */
+extern void __qcn_trace(struct qcn_trace_rec *rec);
+
+/* Rate events, see qcn_tc.h, to the subscribers in net, the namespace
+   of the RP's device. Fills in ns; callable with BH disabled and with
+   the rate lock of the RP held. */
+extern void qcn_rate_notify(struct net *net, struct qcn_rate_event *ev);
+
+static inline void qcn_rate_event_fill(struct qcn_rate_event *ev, u16 type,
+				       int ifindex, u32 handle,
+				       u32 old_crate,
+				       const struct qcn_rp_state *rp, u32 fb)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->ifindex = ifindex;
+	ev->handle = handle;
+	ev->old_crate = old_crate;
+	ev->crate = rp->crate;
+	ev->trate = rp->trate;
+	ev->fb = fb;
+	ev->bcount_stg = rp->bcount_stg;
+	ev->timer_stg = rp->timer_stg;
+}
+
+/* Telemetry page.
+   =======================================
+
+   The modules publish their live state into slots of the array described
+   in qcn_tc.h. A writer holds whatever lock already serializes the state
+   it copies, so qcn_telem_begin()/end() only have to order the stores
+   for lockless readers.
+*/
+
+/* Returns NULL once all slots are in use; callers then go without */
+extern struct qcn_telem *qcn_telem_get(u16 type, int ifindex, u32 handle,
+									   u16 prio);
+extern void qcn_telem_put(struct qcn_telem *t);
+
+static inline void qcn_telem_begin(struct qcn_telem *t)
+{
+	t->seq++;
+	smp_wmb();
+}
+
+static inline void qcn_telem_end(struct qcn_telem *t)
+{
+	smp_wmb();
+	t->seq++;
+}
+
+#endif /* _QCN_H */
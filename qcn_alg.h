@@ -0,0 +1,590 @@
+/*
+ * qcn_alg.h	The arithmetic of the QCN Congestion and Reaction Points.
+ *		Nothing here depends on the kernel, so tools/qcnsim runs the
+ *		very code the modules run.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _QCN_ALG_H
+#define _QCN_ALG_H
+
+#include "qcn_tc.h"
+
+/* Congestion Point.
+   =======================================
+
+   On every sample the CP quantizes the feedback of its queue into a
+   6 bit Fb, 0 meaning no congestion, and picks the number of bytes to
+   the next sample from Fb.
+
+   -Fb is clamped at fb_max and its 6 most significant bits, counted
+   from fb_max, are sent. Both depend on Q_EQ, W and the queue limit
+   only, so the CP derives them whenever those change rather than per
+   packet.
+*/
+
+#define QCN_FB_BITS	6
+#define QCN_FB_MASK	((1 << QCN_FB_BITS) - 1)
+
+/* Largest -Fb: the 802.1Qau clamp Q_EQ (2W + 1), or what a queue of
+   limit bytes can reach at most if that is less (limit 0: unknown) */
+static inline __u32 qcn_fb_max(int q_eq, int w, __u32 limit)
+{
+	__u64 max = (__u64)q_eq * (2 * (__u64)w + 1);
+	__u64 reach = (__u64)limit * ((__u64)w + 1);
+
+	if (limit && reach > (__u64)q_eq && reach - q_eq < max)
+		max = reach - q_eq;
+	if (max > 0x7FFFFFFF)
+		max = 0x7FFFFFFF;
+	return max ? (__u32)max : 1;
+}
+
+/* Shift that brings fb_max down to the top of the QCN_FB_BITS range */
+static inline int qcn_fb_shift(__u32 fb_max)
+{
+	int shift = 0;
+
+	while ((fb_max >> shift) > QCN_FB_MASK)
+		shift++;
+	return shift;
+}
+
+static inline __u32 qcn_quantize_fb(int q_eq, int w, int qlen, int qlen_old,
+									__u32 fb_max, int shift)
+{
+	__s64 Fb;
+
+	/* in 64 bits: W times a swing of the queue overflows an int */
+	Fb = ((__s64)q_eq - qlen) - (__s64)w * ((__s64)qlen - qlen_old);
+	if (Fb < -(__s64)fb_max)
+		Fb = -(__s64)fb_max;
+	else if (Fb > 0)
+		Fb = 0;
+
+	/* Uniform quantization of -Fb, qntz_Fb, uses its most significant
+	   bits. With Q_EQ = 33KB, W = 2 and a long queue fb_max is 168960,
+	   18 bits, and the 12 least significant bits are dropped. */
+	return QCN_FB_MASK & (((__u32) -Fb) >> shift);
+}
+
+/* The 802.1Qau sampling table, tuned for 1G */
+#define QCN_MARK_DEFAULT \
+	{ 153600, 76800, 51200, 38400, 30720, 25600, 22016, 18944 }
+
+/* Not below one frame per sample */
+#define QCN_MARK_MIN	1500
+
+#ifndef qcn_div64
+#define qcn_div64(a, b)	((a) / (b))
+#endif
+
+/* The table a CP of rate bytes/s samples with, see mark_rate in
+   qcn_tc.h; 0 for either rate copies mark as it is */
+static inline void qcn_mark_scale(__u32 *dst, const __u32 *mark,
+								  __u32 mark_rate, __u64 rate)
+{
+	__u64 v, whole;
+	int i;
+
+	for (i = 0; i < QCN_MARK_STEPS; i++) {
+		v = mark[i];
+		/* v * rate may not fit in 64 bits; v times either part of
+		   rate / mark_rate does, unless the result is past the clamp */
+		if (mark_rate && rate) {
+			whole = qcn_div64(rate, mark_rate);
+			if (whole >> 32)
+				v = 0x7FFFFFFF;
+			else
+				v = whole * v + qcn_div64((rate - whole * mark_rate) * v,
+										  mark_rate);
+		}
+		if (v < QCN_MARK_MIN)
+			v = QCN_MARK_MIN;
+		dst[i] = v > 0x7FFFFFFF ? 0x7FFFFFFF : (__u32)v;
+	}
+}
+
+static inline int qcn_mark_table(const __u32 *mark, __u32 qntz_Fb)
+{
+	return mark[(qntz_Fb >> 3) & (QCN_MARK_STEPS - 1)];
+}
+
+/* Reaction Point.
+   =======================================
+
+   The rate state of one RP. The caller serializes the writers and,
+   after each call, refreshes whatever it derives from crate.
+
+   Rates are bytes/s in 32 bits, as the tc rate tables of the modules
+   are, which covers up to 34 Gbit/s. Every product and sum of rates is
+   taken in 64 bits and saturates at ~0U rather than wrapping, so the
+   arithmetic holds over that whole range.
+*/
+
+static inline __u32 qcn_rate_sat(__u64 rate)
+{
+	return rate > 0xFFFFFFFF ? 0xFFFFFFFF : (__u32)rate;
+}
+
+struct qcn_rp_state {
+	__u32 trate;			/* Target rate */
+	__u32 crate;			/* Current rate */
+	__u32 bcount_tx;		/* Byte counter */
+	__u16 bcount_stg;		/* Byte counter stage (si_count) */
+	__u16 timer_stg;		/* Timer stage */
+	__u32 priv[2];			/* the algorithm's own, see below */
+};
+
+/* The stages below take fastrec and gd as arguments rather than from qp
+   so that a profile can pass them as constants, see qcn_rp_prof() */
+static inline void __qcn_rp_self_increase(struct qcn_rp_state *rp,
+										  const struct tc_qcn_rp_opt *qp,
+										  __u32 fastrec)
+{
+	__u32 rate_increase;
+
+	if (rp->bcount_stg > fastrec ||
+		rp->timer_stg > fastrec) {
+		if (rp->bcount_stg > fastrec &&
+				rp->timer_stg > fastrec)
+			/* Hyperactive increase */
+			rate_increase = qp->hai;
+		else
+			rate_increase = qp->ai;
+	}
+	else
+		rate_increase = 0;
+
+	/* At the end of the first cycle of recovery */
+	if ((rp->bcount_stg == 1 || rp->timer_stg == 1) &&
+		rp->trate > 10 * (__u64)rp->crate)
+		rp->trate = rp->trate >> 3;
+	else
+		rp->trate = qcn_rate_sat((__u64)rp->trate + rate_increase);
+
+	rp->crate = ((__u64)rp->trate + rp->crate) >> 1;
+}
+
+/* The byte counter expired */
+static inline void __qcn_rp_byte_stage(struct qcn_rp_state *rp,
+									   const struct tc_qcn_rp_opt *qp,
+									   __u32 fastrec)
+{
+	rp->bcount_stg++;
+	if (rp->bcount_stg < fastrec)
+		rp->bcount_tx = qp->bc; /* TODO: "Randomize" */
+	else
+		rp->bcount_tx = qp->bc >> 1;
+	__qcn_rp_self_increase(rp, qp, fastrec);
+}
+
+static inline void qcn_rp_byte_stage(struct qcn_rp_state *rp,
+									 const struct tc_qcn_rp_opt *qp)
+{
+	__qcn_rp_byte_stage(rp, qp, qp->fastrec);
+}
+
+/* The timer expired */
+static inline void __qcn_rp_timer_stage(struct qcn_rp_state *rp,
+										const struct tc_qcn_rp_opt *qp,
+										__u32 fastrec)
+{
+	rp->timer_stg++;
+	__qcn_rp_self_increase(rp, qp, fastrec);
+}
+
+static inline void qcn_rp_timer_stage(struct qcn_rp_state *rp,
+									  const struct tc_qcn_rp_opt *qp)
+{
+	__qcn_rp_timer_stage(rp, qp, qp->fastrec);
+}
+
+/* Timer period in ns: TIMER during fast recovery, TIMER/2 after */
+static inline __u32 qcn_rp_timer_period(const struct qcn_rp_state *rp,
+										const struct tc_qcn_rp_opt *qp)
+{
+	return rp->timer_stg >= qp->fastrec ? qp->timer >> 1 : qp->timer;
+}
+
+/* Timer stages due within elapsed ns of the one due now, that one
+   included, at the mean period; *left is the time to the next one */
+static inline __u32 qcn_rp_timer_due(const struct qcn_rp_state *rp,
+									 const struct tc_qcn_rp_opt *qp,
+									 __u64 elapsed, __u64 *left)
+{
+	__u64 slow = qp->timer ? qp->timer : 1;
+	__u64 fast = qp->timer >> 1 ? qp->timer >> 1 : 1;
+	__u64 full = 0, n;
+
+	/* stages that still leave the timer in fast recovery wait TIMER */
+	if (qp->fastrec > rp->timer_stg + 1)
+		full = qp->fastrec - rp->timer_stg - 1;
+	if (elapsed < full * slow) {
+		n = qcn_div64(elapsed, slow);
+		*left = (n + 1) * slow - elapsed;
+	} else {
+		elapsed -= full * slow;
+		n = qcn_div64(elapsed, fast);
+		*left = (n + 1) * fast - elapsed;
+		n += full;
+	}
+	return n < 0xFFFFFFFF ? (__u32)n + 1 : 0xFFFFFFFF;
+}
+
+/* n timer stages at once. Fast recovery and the stages that may still
+   cut trate are taken one by one, a handful at most; after them each
+   stage adds the same increase inc to trate and halves how far crate
+   lags behind trate - inc, so the rest is closed form,
+	trate' = trate + n inc
+	crate' = trate' - inc - (trate - crate - inc) / 2^n
+   as n calls of qcn_rp_timer_stage() would leave them but for
+   rounding, at constant cost. */
+static inline void __qcn_rp_timer_stages(struct qcn_rp_state *rp,
+										 const struct tc_qcn_rp_opt *qp,
+										 __u32 n, __u32 fastrec)
+{
+	__u64 trate;
+	__s64 lag, crate;
+	__u32 inc;
+
+	while (n && (rp->timer_stg <= fastrec ||
+				 (rp->bcount_stg == 1 &&
+				  rp->trate > 10 * (__u64)rp->crate))) {
+		__qcn_rp_timer_stage(rp, qp, fastrec);
+		n--;
+	}
+	if (!n)
+		return;
+
+	inc = rp->bcount_stg > fastrec ? qp->hai : qp->ai;
+	trate = rp->trate + (__u64)inc * n;
+	lag = (__s64)rp->trate - rp->crate - inc;
+	lag = n < 40 ? lag >> n : (lag < 0 ? -1 : 0);
+	crate = (__s64)trate - inc - lag;
+
+	rp->trate = qcn_rate_sat(trate);
+	rp->crate = crate < 0 ? 0 : qcn_rate_sat(crate);
+	rp->timer_stg = rp->timer_stg + n > 0xFFFF ? 0xFFFF :
+		rp->timer_stg + n;
+}
+
+static inline void qcn_rp_timer_stages(struct qcn_rp_state *rp,
+									   const struct tc_qcn_rp_opt *qp,
+									   __u32 n)
+{
+	__qcn_rp_timer_stages(rp, qp, n, qp->fastrec);
+}
+
+/* The decrease of qcn_rp_decrease(), by dec_factor bytes/s within the
+   bounds of qp */
+static inline int qcn_rp_cut(struct qcn_rp_state *rp,
+							 const struct tc_qcn_rp_opt *qp,
+							 __u32 rate, __u64 dec_factor)
+{
+	int restart_timer = 0;
+
+	/* Use the current rate as the next target rate
+	   In the first cycle of fast recovery, the Fb
+	   signal would not reset the target rate */
+	if (rp->bcount_stg != 0) {
+		rp->trate = rp->crate < rate ? rp->crate : rate;
+		rp->bcount_tx = qp->bc;
+		restart_timer = 1;
+	}
+
+	/* Set the stage counters */
+	rp->bcount_stg = 0;
+	rp->timer_stg = 0;
+
+	if (dec_factor < rp->crate >> qp->min_rate_dec)
+		dec_factor = rp->crate >> qp->min_rate_dec;
+	if (dec_factor > rp->crate)
+		dec_factor = rp->crate;
+	rp->crate = rp->crate - dec_factor > qp->min_rate ?
+		rp->crate - dec_factor : qp->min_rate;
+	return restart_timer;
+}
+
+/* A CNM with quantized feedback Fb != 0 arrived; rate is the configured
+   rate of the RP. Returns 1 if the timer stages start over. */
+static inline int __qcn_rp_decrease(struct qcn_rp_state *rp,
+									const struct tc_qcn_rp_opt *qp,
+									__u32 Fb, __u32 rate, __u32 gd)
+{
+	/* Update the current rate, multiplicative decrease */
+	/* Changing the expression to avoid the use of floating
+	   point values; crate * Fb needs 38 bits */
+	return qcn_rp_cut(rp, qp, rate, ((__u64)rp->crate * Fb) >> gd);
+}
+
+static inline int qcn_rp_decrease(struct qcn_rp_state *rp,
+								  const struct tc_qcn_rp_opt *qp,
+								  __u32 Fb, __u32 rate)
+{
+	return __qcn_rp_decrease(rp, qp, Fb, rate, qp->gd);
+}
+
+/* As qcn_rp_decrease(), also using the queue offset (Q_EQ - Q) and
+   derivative (Q - Q_old) of the CNM, host order, in the spirit of
+   AF-QCN: only their signs count, so the units of the CP do not
+   matter. A queue that is already shrinking is being corrected by
+   the cuts that came before this CNM, and one below Q_EQ needs less
+   time at the lowered rate. */
+static inline int __qcn_rp_decrease_exact(struct qcn_rp_state *rp,
+										  const struct tc_qcn_rp_opt *qp,
+										  __u32 Fb, __u32 rate,
+										  int qoff, int qdelta,
+										  __u32 gd, __u32 fastrec)
+{
+	int restart_timer;
+
+	if (qdelta < 0)
+		Fb = (Fb + 1) >> 1;
+	restart_timer = __qcn_rp_decrease(rp, qp, Fb, rate, gd);
+
+	/* Half of fast recovery, so active increase comes sooner */
+	if (qoff > 0)
+		rp->bcount_stg = rp->timer_stg = fastrec >> 1;
+	return restart_timer;
+}
+
+static inline int qcn_rp_decrease_exact(struct qcn_rp_state *rp,
+										const struct tc_qcn_rp_opt *qp,
+										__u32 Fb, __u32 rate,
+										int qoff, int qdelta)
+{
+	return __qcn_rp_decrease_exact(rp, qp, Fb, rate, qoff, qdelta,
+								   qp->gd, qp->fastrec);
+}
+
+/* Profiles.
+   =======================================
+
+   Nearly every CP and RP runs the defaults of the modules, W = 2,
+   GD = 7 and FASTREC = 5. One that does runs the routines above with
+   them as constants instead, which the compiler folds: w * (Q - Q_old)
+   becomes a shift and add, the cut a shift by an immediate and the
+   stage tests compares against one. The owner finds out once, whenever
+   the parameters change, with qcn_cp_prof() and qcn_rp_prof() and
+   hands the answer to the qcn_alg_*() calls below; everything else
+   runs the generic code. Results are the same either way.
+*/
+
+#define QCN_PROF_W			2
+#define QCN_PROF_GD			7
+#define QCN_PROF_FASTREC	5
+
+static inline int qcn_cp_prof(int w)
+{
+	return w == QCN_PROF_W;
+}
+
+static inline int qcn_rp_prof(const struct tc_qcn_rp_opt *qp)
+{
+	return qp->gd == QCN_PROF_GD && qp->fastrec == QCN_PROF_FASTREC;
+}
+
+/* Algorithms.
+   =======================================
+
+   The rules above are the 802.1Qau standard. Another congestion control
+   algorithm replaces any of them by filling in the member of a
+   qcn_alg_ops that makes the same decision; members left NULL keep the
+   standard one, so an algorithm only names what it does differently.
+   A CP or RP without an algorithm (NULL) runs the standard without an
+   indirect call. The hooks run under whatever serializes the state they
+   are handed, and may keep their own in priv of the rate state.
+
+   The kernel side registers algorithms by name, see qcn.h.
+*/
+
+struct qcn_alg_ops {
+	const char *name;
+	/* CP: quantized Fb of a sample, as qcn_quantize_fb() */
+	__u32	(*fb)(int q_eq, int w, int qlen, int qlen_old, __u32 fb_max,
+				  int shift);
+	/* RP: priv set up, for a new RP or one switched to the algorithm */
+	void	(*init)(struct qcn_rp_state *rp, const struct tc_qcn_rp_opt *qp);
+	void	(*byte_stage)(struct qcn_rp_state *rp,
+						  const struct tc_qcn_rp_opt *qp);
+	/* n >= 1 timer stages, as qcn_rp_timer_stages() */
+	void	(*timer_stages)(struct qcn_rp_state *rp,
+							const struct tc_qcn_rp_opt *qp, __u32 n);
+	/* as qcn_rp_decrease_exact(), whatever exact says */
+	int		(*decrease)(struct qcn_rp_state *rp,
+						const struct tc_qcn_rp_opt *qp, __u32 Fb,
+						__u32 rate, int qoff, int qdelta);
+#ifdef __KERNEL__
+	struct list_head	list;
+	struct module		*owner;
+#endif
+};
+
+static inline const char *qcn_alg_name(const struct qcn_alg_ops *alg)
+{
+	return alg ? alg->name : "qcn";
+}
+
+/* prof is what qcn_cp_prof() or qcn_rp_prof() said of the parameters */
+static inline __u32 qcn_alg_fb(const struct qcn_alg_ops *alg, int prof,
+							   int q_eq, int w, int qlen, int qlen_old,
+							   __u32 fb_max, int shift)
+{
+	if (alg && alg->fb)
+		return alg->fb(q_eq, w, qlen, qlen_old, fb_max, shift);
+	if (prof)
+		return qcn_quantize_fb(q_eq, QCN_PROF_W, qlen, qlen_old, fb_max,
+							   shift);
+	return qcn_quantize_fb(q_eq, w, qlen, qlen_old, fb_max, shift);
+}
+
+static inline void qcn_alg_init(const struct qcn_alg_ops *alg,
+								struct qcn_rp_state *rp,
+								const struct tc_qcn_rp_opt *qp)
+{
+	rp->priv[0] = rp->priv[1] = 0;
+	if (alg && alg->init)
+		alg->init(rp, qp);
+}
+
+static inline void qcn_alg_byte_stage(const struct qcn_alg_ops *alg,
+									  int prof, struct qcn_rp_state *rp,
+									  const struct tc_qcn_rp_opt *qp)
+{
+	if (alg && alg->byte_stage)
+		alg->byte_stage(rp, qp);
+	else if (prof)
+		__qcn_rp_byte_stage(rp, qp, QCN_PROF_FASTREC);
+	else
+		qcn_rp_byte_stage(rp, qp);
+}
+
+static inline void qcn_alg_timer_stage(const struct qcn_alg_ops *alg,
+									   int prof, struct qcn_rp_state *rp,
+									   const struct tc_qcn_rp_opt *qp)
+{
+	if (alg && alg->timer_stages)
+		alg->timer_stages(rp, qp, 1);
+	else if (prof)
+		__qcn_rp_timer_stage(rp, qp, QCN_PROF_FASTREC);
+	else
+		qcn_rp_timer_stage(rp, qp);
+}
+
+static inline void qcn_alg_timer_stages(const struct qcn_alg_ops *alg,
+										int prof, struct qcn_rp_state *rp,
+										const struct tc_qcn_rp_opt *qp,
+										__u32 n)
+{
+	if (alg && alg->timer_stages)
+		alg->timer_stages(rp, qp, n);
+	else if (prof)
+		__qcn_rp_timer_stages(rp, qp, n, QCN_PROF_FASTREC);
+	else
+		qcn_rp_timer_stages(rp, qp, n);
+}
+
+/* A CNM with Fb != 0 and the qoff and qdelta it carries, host order */
+static inline int qcn_alg_decrease(const struct qcn_alg_ops *alg, int prof,
+								   struct qcn_rp_state *rp,
+								   const struct tc_qcn_rp_opt *qp,
+								   __u32 Fb, __u32 rate,
+								   int qoff, int qdelta)
+{
+	if (alg && alg->decrease)
+		return alg->decrease(rp, qp, Fb, rate, qoff, qdelta);
+	if (prof && qp->exact)
+		return __qcn_rp_decrease_exact(rp, qp, Fb, rate, qoff, qdelta,
+									   QCN_PROF_GD, QCN_PROF_FASTREC);
+	if (prof)
+		return __qcn_rp_decrease(rp, qp, Fb, rate, QCN_PROF_GD);
+	if (qp->exact)
+		return qcn_rp_decrease_exact(rp, qp, Fb, rate, qoff, qdelta);
+	return qcn_rp_decrease(rp, qp, Fb, rate);
+}
+
+/* DCQCN style.
+   The RP cuts by alpha / 2, where alpha, priv[0] in units of 2^-16,
+   follows how often the CP reports congestion rather than how much:
+   every CNM moves it by g = 1 / 2^gd toward 1, every timer stage toward
+   0, both as EWMAs, and a CNM may still cut no less than 1 in
+   2^min_rate_dec. Recovery is the one of QCN. Its CP reports the queue
+   above Q_EQ alone, a ramp much like the marking probability of a RED
+   queue, with no term for the derivative. */
+
+#define QCN_ALPHA_ONE	(1 << 16)
+
+/* (f / 2^16)^n, f <= 2^16, by squaring */
+static inline __u32 qcn_fix16_pow(__u32 f, __u32 n)
+{
+	__u64 r = QCN_ALPHA_ONE, b = f;
+
+	while (n) {
+		if (n & 1)
+			r = (r * b) >> 16;
+		b = (b * b) >> 16;
+		n >>= 1;
+	}
+	return (__u32)r;
+}
+
+static inline __u32 qcn_dcqcn_fb(int q_eq, int w, int qlen, int qlen_old,
+								 __u32 fb_max, int shift)
+{
+	__u32 over;
+
+	if (qlen <= q_eq)
+		return 0;
+	over = (__u32)(qlen - q_eq);
+	if (over > fb_max)
+		over = fb_max;
+	/* a queue just over Q_EQ still counts */
+	return (over >> shift) ? QCN_FB_MASK & (over >> shift) : 1;
+}
+
+static inline void qcn_dcqcn_init(struct qcn_rp_state *rp,
+								  const struct tc_qcn_rp_opt *qp)
+{
+	rp->priv[0] = QCN_ALPHA_ONE;	/* the first cut halves crate */
+}
+
+static inline void qcn_dcqcn_timer_stages(struct qcn_rp_state *rp,
+										  const struct tc_qcn_rp_opt *qp,
+										  __u32 n)
+{
+	__u32 keep = QCN_ALPHA_ONE - (QCN_ALPHA_ONE >> qp->gd);
+
+	rp->priv[0] = ((__u64)rp->priv[0] * qcn_fix16_pow(keep, n)) >> 16;
+	if (n == 1)
+		qcn_rp_timer_stage(rp, qp);
+	else
+		qcn_rp_timer_stages(rp, qp, n);
+}
+
+static inline int qcn_dcqcn_decrease(struct qcn_rp_state *rp,
+									 const struct tc_qcn_rp_opt *qp,
+									 __u32 Fb, __u32 rate,
+									 int qoff, int qdelta)
+{
+	__u32 alpha = rp->priv[0];
+
+	alpha = alpha - (alpha >> qp->gd) + (QCN_ALPHA_ONE >> qp->gd);
+	rp->priv[0] = alpha > QCN_ALPHA_ONE ? QCN_ALPHA_ONE : alpha;
+	return qcn_rp_cut(rp, qp, rate,
+					  ((__u64)rp->crate * rp->priv[0]) >> 17);
+}
+
+/* Initializers of a qcn_alg_ops, for whoever runs the algorithm */
+#define QCN_ALG_DCQCN						\
+	.name		= "dcqcn",				\
+	.fb		= qcn_dcqcn_fb,				\
+	.init		= qcn_dcqcn_init,			\
+	.timer_stages	= qcn_dcqcn_timer_stages,		\
+	.decrease	= qcn_dcqcn_decrease
+
+#endif /* _QCN_ALG_H */
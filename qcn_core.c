@@ -0,0 +1,2421 @@
+/*
+ * qcn_core.c	Services shared by the QCN Congestion and Reaction Points.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/skbuff.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/netdevice.h>
+#include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/bitmap.h>
+#include <linux/hrtimer.h>
+#include <linux/etherdevice.h>
+#include <linux/ethtool.h>
+#include <linux/if_vlan.h>
+#include <linux/rtnetlink.h>
+#include <linux/udp.h>
+#include <net/ip.h>
+#include <net/sch_generic.h>
+#include <net/pkt_sched.h>
+#include <linux/timex.h>
+#include <linux/timer.h>
+#include <linux/netlink.h>
+#include <net/net_namespace.h>
+#include <net/genetlink.h>
+#include <net/netns/generic.h>
+
+#include "kfifo.h"
+#include "qcn.h"
+
+int qcn_trace_enabled __read_mostly = 0;
+module_param_named(trace, qcn_trace_enabled, int, 0640);
+MODULE_PARM_DESC(trace, "Record CP/RP events into the per-CPU trace rings, "
+				 "default 0");
+EXPORT_SYMBOL(qcn_trace_enabled);
+
+static int qcn_trace_size __read_mostly = 16384;
+module_param_named(trace_size, qcn_trace_size, int, 0440);
+MODULE_PARM_DESC(trace_size, "Records per CPU trace ring (power of 2), "
+				 "default 16384");
+
+struct qcn_trace_cpu {
+	DECLARE_KFIFO_PTR(fifo, struct qcn_trace_rec);
+	u32		drops;		/* records lost because ring was full */
+	struct mutex	read_lock;	/* one reader at a time */
+	struct dentry	*file;
+};
+
+static DEFINE_PER_CPU(struct qcn_trace_cpu, qcn_trace_rings);
+static struct dentry *qcn_debugfs_root;
+
+/* Called from qdisc enqueue/dequeue context, i.e. with BH disabled, so
+   this CPU is the only producer of its ring. */
+void __qcn_trace(struct qcn_trace_rec *rec)
+{
+	struct qcn_trace_cpu *tc = &__get_cpu_var(qcn_trace_rings);
+
+	if (unlikely(!kfifo_initialized(&tc->fifo)))
+		return;
+
+	rec->cpu = smp_processor_id();
+	if (!kfifo_put(&tc->fifo, rec))
+		tc->drops++;
+}
+EXPORT_SYMBOL(__qcn_trace);
+
+static int qcn_trace_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t qcn_trace_read(struct file *file, char __user *buf,
+							  size_t count, loff_t *ppos)
+{
+	struct qcn_trace_cpu *tc = file->private_data;
+	unsigned int copied;
+	int err;
+
+	/* Only whole records are handed out */
+	count -= count % sizeof(struct qcn_trace_rec);
+	if (count == 0)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&tc->read_lock))
+		return -ERESTARTSYS;
+	err = kfifo_to_user(&tc->fifo, buf, count, &copied);
+	mutex_unlock(&tc->read_lock);
+
+	return err ? err : copied;
+}
+
+static const struct file_operations qcn_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= qcn_trace_open,
+	.read		= qcn_trace_read,
+	.llseek		= no_llseek,
+};
+
+static void qcn_trace_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct qcn_trace_cpu *tc = &per_cpu(qcn_trace_rings, cpu);
+
+		if (kfifo_initialized(&tc->fifo))
+			kfifo_free(&tc->fifo);
+	}
+}
+
+static int qcn_trace_init(void)
+{
+	char name[16];
+	int cpu, err;
+
+	for_each_possible_cpu(cpu) {
+		struct qcn_trace_cpu *tc = &per_cpu(qcn_trace_rings, cpu);
+
+		mutex_init(&tc->read_lock);
+		err = kfifo_alloc(&tc->fifo, qcn_trace_size, GFP_KERNEL);
+		if (err) {
+			qcn_trace_free();
+			return err;
+		}
+	}
+
+	qcn_debugfs_root = debugfs_create_dir("qcn", NULL);
+	if (IS_ERR_OR_NULL(qcn_debugfs_root)) {
+		/* Tracing is still recorded, but nobody can drain it */
+		printk(KERN_WARNING "qcn: unable to create debugfs directory\n");
+		qcn_debugfs_root = NULL;
+		return 0;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct qcn_trace_cpu *tc = &per_cpu(qcn_trace_rings, cpu);
+
+		snprintf(name, sizeof(name), "trace%d", cpu);
+		tc->file = debugfs_create_file(name, 0400, qcn_debugfs_root,
+									   tc, &qcn_trace_fops);
+		snprintf(name, sizeof(name), "trace%d_drops", cpu);
+		debugfs_create_u32(name, 0400, qcn_debugfs_root, &tc->drops);
+	}
+	return 0;
+}
+
+static int qcn_telem_slots __read_mostly = 2048;
+module_param_named(telemetry_slots, qcn_telem_slots, int, 0440);
+MODULE_PARM_DESC(telemetry_slots, "Slots of the mmap()able telemetry array, "
+				 "default 2048");
+
+static struct qcn_telem *qcn_telem_area;
+static unsigned long *qcn_telem_used;
+static DEFINE_SPINLOCK(qcn_telem_lock);
+
+struct qcn_telem *qcn_telem_get(u16 type, int ifindex, u32 handle, u16 prio)
+{
+	struct qcn_telem *t;
+	int i;
+
+	if (!qcn_telem_area)
+		return NULL;
+
+	spin_lock_bh(&qcn_telem_lock);
+	i = find_first_zero_bit(qcn_telem_used, qcn_telem_slots);
+	if (i >= qcn_telem_slots) {
+		spin_unlock_bh(&qcn_telem_lock);
+		return NULL;
+	}
+	set_bit(i, qcn_telem_used);
+	spin_unlock_bh(&qcn_telem_lock);
+
+	/* seq carries on from the previous owner, readers never see it
+	   going back */
+	t = &qcn_telem_area[i];
+	qcn_telem_begin(t);
+	memset((char *)t + sizeof(t->seq), 0, sizeof(*t) - sizeof(t->seq));
+	t->prio = prio;
+	t->ifindex = ifindex;
+	t->handle = handle;
+	t->type = type;
+	qcn_telem_end(t);
+	return t;
+}
+EXPORT_SYMBOL(qcn_telem_get);
+
+void qcn_telem_put(struct qcn_telem *t)
+{
+	if (!t)
+		return;
+
+	qcn_telem_begin(t);
+	t->type = QCN_TELEM_FREE;
+	qcn_telem_end(t);
+
+	spin_lock_bh(&qcn_telem_lock);
+	clear_bit(t - qcn_telem_area, qcn_telem_used);
+	spin_unlock_bh(&qcn_telem_lock);
+}
+EXPORT_SYMBOL(qcn_telem_put);
+
+static int qcn_telem_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, qcn_telem_area, vma->vm_pgoff);
+}
+
+static const struct file_operations qcn_telem_fops = {
+	.owner	= THIS_MODULE,
+	.mmap	= qcn_telem_mmap,
+};
+
+static void qcn_telem_free(void)
+{
+	vfree(qcn_telem_area);
+	kfree(qcn_telem_used);
+	qcn_telem_area = NULL;
+}
+
+static int qcn_telem_init(void)
+{
+	if (qcn_telem_slots <= 0)
+		return 0;
+
+	/* vmalloc_user() hands out zeroed pages, every slot starts free */
+	qcn_telem_area = vmalloc_user(PAGE_ALIGN(qcn_telem_slots *
+											 sizeof(struct qcn_telem)));
+	qcn_telem_used = kcalloc(BITS_TO_LONGS(qcn_telem_slots),
+							 sizeof(unsigned long), GFP_KERNEL);
+	if (!qcn_telem_area || !qcn_telem_used) {
+		qcn_telem_free();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int qcn_events_interval __read_mostly = 10;
+module_param_named(events_interval, qcn_events_interval, int, 0640);
+MODULE_PARM_DESC(events_interval, "ms rate events are batched for, "
+				 "default 10");
+
+static int qcn_events_max __read_mostly = 256;
+module_param_named(events_max, qcn_events_max, int, 0440);
+MODULE_PARM_DESC(events_max, "Rate events per batch, more are counted as "
+				 "lost, default 256");
+
+static struct genl_family qcn_genl_family = {
+	.id		= GENL_ID_GENERATE,
+	.name		= QCN_GENL_NAME,
+	.version	= QCN_GENL_VERSION,
+	.maxattr	= QCN_ATTR_MAX,
+	.netnsok	= true,
+};
+
+static struct genl_multicast_group qcn_rate_mcgrp = {
+	.name		= QCN_GENL_MCGRP_RATE,
+};
+
+static const struct nla_policy qcn_genl_policy[QCN_ATTR_MAX + 1] = {
+	[QCN_ATTR_IFINDEX]	= { .type = NLA_U32 },
+};
+
+static int qcn_rp_dump(struct sk_buff *skb, struct netlink_callback *cb);
+
+static struct genl_ops qcn_rp_dump_ops = {
+	.cmd		= QCN_CMD_RP_DUMP,
+	.policy		= qcn_genl_policy,
+	.dumpit		= qcn_rp_dump,
+};
+
+static int qcn_genl_registered;
+static int qcn_events_on;		/* the rate group is there */
+
+/* Every network namespace batches the events of the RPs of its own
+   devices, for its own subscribers */
+struct qcn_net {
+	struct net		*net;
+	struct qcn_rate_event	*events;	/* the batch being collected */
+	unsigned int		events_nr;
+	u32			events_lost;
+	spinlock_t		events_lock;
+	struct timer_list	events_timer;
+};
+
+static int qcn_net_id __read_mostly;
+
+/* Sends the batch, from the timer the first event of it armed */
+static void qcn_events_flush(unsigned long data)
+{
+	struct qcn_net *qn = (struct qcn_net *)data;
+	struct sk_buff *skb;
+	void *hdr;
+	unsigned int nr;
+
+	spin_lock_bh(&qn->events_lock);
+	nr = qn->events_nr;
+	skb = genlmsg_new(nla_total_size(nr * sizeof(*qn->events)) +
+					  nla_total_size(sizeof(u32)), GFP_ATOMIC);
+	hdr = skb ? genlmsg_put(skb, 0, 0, &qcn_genl_family, 0,
+							QCN_CMD_RATE) : NULL;
+	if (hdr == NULL ||
+		nla_put(skb, QCN_ATTR_EVENTS, nr * sizeof(*qn->events),
+				qn->events) < 0 ||
+		nla_put_u32(skb, QCN_ATTR_LOST, qn->events_lost) < 0) {
+		/* reported with the next batch */
+		qn->events_lost += nr;
+		if (skb)
+			nlmsg_free(skb);
+		skb = NULL;
+	} else {
+		genlmsg_end(skb, hdr);
+		qn->events_lost = 0;
+	}
+	qn->events_nr = 0;
+	spin_unlock_bh(&qn->events_lock);
+
+	if (skb)
+		genlmsg_multicast_netns(qn->net, skb, 0, qcn_rate_mcgrp.id,
+								GFP_ATOMIC);
+}
+
+void qcn_rate_notify(struct net *net, struct qcn_rate_event *ev)
+{
+	struct qcn_net *qn;
+	unsigned long delay;
+
+	if (!qcn_events_on)
+		return;
+	qn = net_generic(net, qcn_net_id);
+	if (!qn->events ||
+		!netlink_has_listeners(net->genl_sock, qcn_rate_mcgrp.id))
+		return;
+
+	ev->ns = ktime_to_ns(ktime_get());
+	spin_lock_bh(&qn->events_lock);
+	if (qn->events_nr < qcn_events_max) {
+		qn->events[qn->events_nr] = *ev;
+		if (qn->events_nr++ == 0) {
+			delay = msecs_to_jiffies(max(qcn_events_interval, 0));
+			mod_timer(&qn->events_timer, jiffies + max(delay, 1UL));
+		}
+	} else {
+		qn->events_lost++;
+	}
+	spin_unlock_bh(&qn->events_lock);
+}
+EXPORT_SYMBOL(qcn_rate_notify);
+
+/* Without a batch the namespace simply reports nothing, it is not
+   worth failing the namespace for */
+static int qcn_net_init(struct net *net)
+{
+	struct qcn_net *qn = net_generic(net, qcn_net_id);
+
+	qn->net = net;
+	spin_lock_init(&qn->events_lock);
+	setup_timer(&qn->events_timer, qcn_events_flush, (unsigned long)qn);
+	if (qcn_events_max > 0)
+		qn->events = kcalloc(qcn_events_max, sizeof(*qn->events),
+				     GFP_KERNEL);
+	return 0;
+}
+
+/* The devices, and so the RPs, of net are gone by now */
+static void qcn_net_exit(struct net *net)
+{
+	struct qcn_net *qn = net_generic(net, qcn_net_id);
+
+	del_timer_sync(&qn->events_timer);
+	kfree(qn->events);
+	qn->events = NULL;
+}
+
+static struct pernet_operations qcn_net_ops = {
+	.init	= qcn_net_init,
+	.exit	= qcn_net_exit,
+	.id		= &qcn_net_id,
+	.size	= sizeof(struct qcn_net),
+};
+
+/* Without the family the RPs simply report nothing, and cannot be
+   dumped either */
+static void qcn_events_init(void)
+{
+	if (genl_register_family(&qcn_genl_family))
+		goto fail;
+	if (genl_register_ops(&qcn_genl_family, &qcn_rp_dump_ops) ||
+		register_pernet_subsys(&qcn_net_ops)) {
+		genl_unregister_family(&qcn_genl_family);
+		goto fail;
+	}
+	qcn_genl_registered = 1;
+	if (qcn_events_max <= 0)
+		return;
+	if (genl_register_mc_group(&qcn_genl_family, &qcn_rate_mcgrp) == 0) {
+		qcn_events_on = 1;
+		return;
+	}
+fail:
+	printk(KERN_WARNING "qcn: unable to register rate events\n");
+}
+
+static void qcn_events_free(void)
+{
+	if (!qcn_genl_registered)
+		return;
+	qcn_events_on = 0;
+	qcn_genl_registered = 0;
+	unregister_pernet_subsys(&qcn_net_ops);
+	genl_unregister_family(&qcn_genl_family);
+}
+
+static struct sk_buff *qcn_cnm_skb_new(unsigned int headroom, gfp_t gfp)
+{
+	struct sk_buff *skb;
+
+	if ((skb = alloc_skb(QCN_CNM_LEN + headroom, gfp)) == NULL)
+		return NULL;
+	skb_reserve(skb, headroom);
+	/* The ethertype never changes, write it once */
+	*(__be16 *)(skb->data + 2 * ETH_ALEN) = htons(ETH_QCN);
+	return skb;
+}
+
+int qcn_cnm_pool_init(struct qcn_cnm_pool *pool)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	for (i = 0; i < QCN_CNM_POOL_SIZE; i++) {
+		/* Same headroom skb_recycle_check() restores */
+		pool->skb[i] = qcn_cnm_skb_new(NET_SKB_PAD, GFP_KERNEL);
+		if (pool->skb[i] == NULL) {
+			qcn_cnm_pool_destroy(pool);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+EXPORT_SYMBOL(qcn_cnm_pool_init);
+
+void qcn_cnm_pool_destroy(struct qcn_cnm_pool *pool)
+{
+	int i;
+
+	/* In flight skbs are released by whoever holds the last reference */
+	for (i = 0; i < QCN_CNM_POOL_SIZE; i++) {
+		if (pool->skb[i])
+			kfree_skb(pool->skb[i]);
+		pool->skb[i] = NULL;
+	}
+}
+EXPORT_SYMBOL(qcn_cnm_pool_destroy);
+
+/**
+ * qcn_cnm_alloc - get an empty CNM skb
+ *
+ * Returns an skb with no data put yet, whose ethertype bytes are already
+ * set to ETH_QCN, or NULL. The caller owns one reference, which is
+ * normally consumed by dev_queue_xmit(). Must be serialized by the
+ * caller (CPs call it under their qdisc lock).
+ */
+struct sk_buff *qcn_cnm_alloc(struct qcn_cnm_pool *pool)
+{
+	struct sk_buff *skb;
+	unsigned int i, slot;
+
+	for (i = 0; i < QCN_CNM_POOL_SIZE; i++) {
+		slot = pool->next;
+		pool->next = (pool->next + 1) & (QCN_CNM_POOL_SIZE - 1);
+
+		skb = pool->skb[slot];
+		if (skb == NULL || skb_shared(skb))
+			continue;	/* still in flight */
+
+		if (!skb_recycle_check(skb, QCN_CNM_LEN)) {
+			/* somebody left it unrecyclable, replace it */
+			kfree_skb(skb);
+			pool->skb[slot] = qcn_cnm_skb_new(NET_SKB_PAD, GFP_ATOMIC);
+			if ((skb = pool->skb[slot]) == NULL)
+				continue;
+		}
+		goto found;
+	}
+
+	pool->fallbacks++;
+	if ((skb = qcn_cnm_skb_new(0, GFP_ATOMIC)) == NULL)
+		return NULL;
+	goto init;
+
+found:
+	/* The pool keeps its own reference to notice transmit completion */
+	skb_get(skb);
+init:
+	skb->pkt_type = PACKET_OTHERHOST;
+	/* checksum: we dont need any checksum */
+	skb->ip_summed = CHECKSUM_NONE;
+	return skb;
+}
+EXPORT_SYMBOL(qcn_cnm_alloc);
+
+static int qcn_cnm_bypass __read_mostly = 1;
+module_param_named(cnm_bypass, qcn_cnm_bypass, int, 0640);
+MODULE_PARM_DESC(cnm_bypass, "Hand CNMs straight to the driver, past the "
+				 "qdisc backlog of the reverse path, default 1");
+
+/* As pktgen does: only the TX lock, not the qdisc, so no backlog and no
+   taps either. Returns 0 if the driver sent the skb and -ENOBUFS if it
+   dropped it; either way the skb is gone. A stacked device returns
+   NET_XMIT_DROP after it has freed the skb. Only on -EBUSY or
+   -ENETDOWN is the skb still ours. */
+static int qcn_cnm_xmit_direct(struct sk_buff *skb)
+{
+	struct net_device *dev = skb->dev;
+	struct netdev_queue *txq;
+	netdev_tx_t ret = NETDEV_TX_BUSY;
+
+	if (!netif_running(dev) || !netif_carrier_ok(dev))
+		return -ENETDOWN;
+
+	skb_set_queue_mapping(skb, skb_tx_hash(dev, skb));
+	txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
+
+	__netif_tx_lock(txq, smp_processor_id());
+	if (!netif_tx_queue_stopped(txq) && !netif_tx_queue_frozen(txq)) {
+		ret = dev->netdev_ops->ndo_start_xmit(skb, dev);
+		if (dev_xmit_complete(ret))
+			txq_trans_update(txq);
+	}
+	__netif_tx_unlock(txq);
+	if (!dev_xmit_complete(ret))
+		return -EBUSY;
+	return ret == NETDEV_TX_OK || ret == NET_XMIT_CN ? 0 : -ENOBUFS;
+}
+
+static void qcn_cnm_flush(unsigned long data)
+{
+	struct qcn_cnm_sender *tx = (struct qcn_cnm_sender *)data;
+	struct net_device *dev;
+	struct sk_buff *skb;
+	ktime_t now = { .tv64 = 0 };
+	int err;
+
+	while (kfifo_peek(&tx->fifo, &skb)) {
+		/* held by fb_delay */
+		if (skb->tstamp.tv64) {
+			if (!now.tv64)
+				now = ktime_get();
+			if (skb->tstamp.tv64 > now.tv64) {
+				if (!tx->dying)
+					hrtimer_start(&tx->timer, skb->tstamp,
+						      HRTIMER_MODE_ABS);
+				break;
+			}
+			skb->tstamp.tv64 = 0;
+		}
+		kfifo_skip(&tx->fifo);
+
+		/* the reference qcn_cnm_send() took, dropped once sent */
+		dev = skb->dev;
+		skb_reset_mac_header(skb);
+		skb->protocol = eth_hdr(skb)->h_proto;
+		skb->priority = TC_PRIO_CONTROL;
+		if (qcn_cnm_bypass) {
+			err = qcn_cnm_xmit_direct(skb);
+			if (!err) {
+				tx->sent++;
+				tx->bypassed++;
+				dev_put(dev);
+				continue;
+			}
+			/* consumed by the driver, must not be sent again */
+			if (err == -ENOBUFS) {
+				atomic_inc(&tx->dropped);
+				dev_put(dev);
+				continue;
+			}
+		}
+		if (dev_queue_xmit(skb) == NET_XMIT_SUCCESS)
+			tx->sent++;
+		else
+			atomic_inc(&tx->dropped);
+		dev_put(dev);
+	}
+}
+
+/* The head of the ring is due, in hardirq context */
+static enum hrtimer_restart qcn_cnm_release(struct hrtimer *timer)
+{
+	struct qcn_cnm_sender *tx = container_of(timer, struct qcn_cnm_sender,
+						 timer);
+
+	tasklet_schedule(&tx->tasklet);
+	return HRTIMER_NORESTART;
+}
+
+void qcn_cnm_sender_init(struct qcn_cnm_sender *tx)
+{
+	INIT_KFIFO(tx->fifo);
+	tasklet_init(&tx->tasklet, qcn_cnm_flush, (unsigned long)tx);
+	hrtimer_init(&tx->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	tx->timer.function = qcn_cnm_release;
+	tx->delay = 0;
+	tx->loss = 0;
+	tx->dying = 0;
+	tx->queued = 0;
+	tx->sent = 0;
+	tx->bypassed = 0;
+	atomic_set(&tx->dropped, 0);
+	atomic_set(&tx->lost, 0);
+}
+EXPORT_SYMBOL(qcn_cnm_sender_init);
+
+void qcn_cnm_sender_destroy(struct qcn_cnm_sender *tx)
+{
+	struct sk_buff *skb;
+
+	/* The last flush may have armed the timer, and the timer may have
+	   scheduled another flush: the second round catches either, and
+	   that flush no longer arms it */
+	tx->dying = 1;
+	smp_wmb();
+	hrtimer_cancel(&tx->timer);
+	tasklet_kill(&tx->tasklet);
+	hrtimer_cancel(&tx->timer);
+	tasklet_kill(&tx->tasklet);
+	while (kfifo_get(&tx->fifo, &skb)) {
+		dev_put(skb->dev);
+		kfree_skb(skb);
+	}
+}
+EXPORT_SYMBOL(qcn_cnm_sender_destroy);
+
+/**
+ * qcn_cnm_send - queue a CNM for deferred transmission
+ *
+ * skb->dev must already be set. The skb is always consumed. Returns 0 if
+ * the CNM was queued, or lost on purpose (see fb_loss in qcn_tc.h),
+ * -ENOBUFS if the ring was full.
+ */
+int qcn_cnm_send(struct qcn_cnm_sender *tx, struct sk_buff *skb)
+{
+	if (unlikely(tx->loss) &&
+	    (u32)(((u64)net_random() * 1000000) >> 32) < tx->loss) {
+		atomic_inc(&tx->lost);
+		consume_skb(skb);
+		return 0;
+	}
+	skb->tstamp.tv64 = 0;
+	if (unlikely(tx->delay))
+		skb->tstamp = ktime_add_ns(ktime_get(), tx->delay);
+	/* before the tasklet can see it */
+	dev_hold(skb->dev);
+	if (!kfifo_put(&tx->fifo, &skb)) {
+		atomic_inc(&tx->dropped);
+		dev_put(skb->dev);
+		kfree_skb(skb);
+		return -ENOBUFS;
+	}
+	tx->queued++;
+	/* a pending timer flushes anything due, this one is due after */
+	if (!hrtimer_active(&tx->timer))
+		tasklet_schedule(&tx->tasklet);
+	return 0;
+}
+EXPORT_SYMBOL(qcn_cnm_send);
+
+/* Sends the frame of slot i, under the CP root lock */
+static void qcn_cnm_agg_flush(struct qcn_cnm_agg *agg, unsigned int i)
+{
+	struct sk_buff *skb = agg->skb[i];
+	struct net_device *dev = skb->dev;
+
+	agg->skb[i] = NULL;
+	/* a full ring is counted in tx->dropped; the sender holds dev on
+	   its own */
+	qcn_cnm_send(agg->tx, skb);
+	dev_put(dev);
+}
+
+static enum hrtimer_restart qcn_cnm_agg_timer(struct hrtimer *timer)
+{
+	struct qcn_cnm_agg *agg = container_of(timer, struct qcn_cnm_agg,
+					       timer.timer);
+	spinlock_t *root_lock = agg->sch ? qdisc_root_sleeping_lock(agg->sch) :
+		agg->lock;
+	unsigned int i;
+
+	spin_lock(root_lock);
+	for (i = 0; i < QCN_AGG_SLOTS; i++)
+		if (agg->skb[i])
+			qcn_cnm_agg_flush(agg, i);
+	spin_unlock(root_lock);
+	return HRTIMER_NORESTART;
+}
+
+void qcn_cnm_agg_init(struct qcn_cnm_agg *agg, struct Qdisc *sch,
+		      struct qcn_cnm_pool *pool, struct qcn_cnm_sender *tx)
+{
+	memset(agg, 0, sizeof(*agg));
+	tasklet_hrtimer_init(&agg->timer, qcn_cnm_agg_timer,
+			     CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	agg->sch = sch;
+	agg->pool = pool;
+	agg->tx = tx;
+}
+EXPORT_SYMBOL(qcn_cnm_agg_init);
+
+/* Before the pool and the sender go; pending records are dropped */
+void qcn_cnm_agg_destroy(struct qcn_cnm_agg *agg)
+{
+	unsigned int i;
+
+	tasklet_hrtimer_cancel(&agg->timer);
+	for (i = 0; i < QCN_AGG_SLOTS; i++) {
+		if (agg->skb[i]) {
+			dev_put(agg->skb[i]->dev);
+			kfree_skb(agg->skb[i]);
+		}
+		agg->skb[i] = NULL;
+	}
+}
+EXPORT_SYMBOL(qcn_cnm_agg_destroy);
+
+/**
+ * qcn_cnm_agg_add - coalesce a private CNM with others to the same host
+ *
+ * dest and source are the MAC addresses of the CNM, window the longest
+ * time (us) the record may wait for company. Called under the CP root
+ * lock. Returns 0 if the record was taken, -ENOMEM if no skb was left
+ * for a new frame.
+ */
+int qcn_cnm_agg_add(struct qcn_cnm_agg *agg, struct net_device *dev,
+		    const u8 *dest, const u8 *source,
+		    const struct qcn_frame *frame, unsigned int window)
+{
+	struct qcn_agg_hdr *ah;
+	struct sk_buff *skb;
+	struct ethhdr *eth;
+	unsigned int i, n;
+
+	for (i = 0; i < QCN_AGG_SLOTS; i++) {
+		skb = agg->skb[i];
+		if (skb == NULL || skb->dev != dev)
+			continue;
+		eth = (struct ethhdr *)skb->data;
+		if (!compare_ether_addr(eth->h_dest, dest) &&
+		    !compare_ether_addr(eth->h_source, source)) {
+			agg->coalesced++;
+			goto append;
+		}
+	}
+
+	/* A new frame, in a free slot or in place of the oldest one */
+	for (i = 0; i < QCN_AGG_SLOTS && agg->skb[i]; i++)
+		;
+	if (i == QCN_AGG_SLOTS) {
+		i = agg->next;
+		agg->next = (agg->next + 1) % QCN_AGG_SLOTS;
+		qcn_cnm_agg_flush(agg, i);
+	}
+
+	if ((skb = qcn_cnm_alloc(agg->pool)) == NULL)
+		return -ENOMEM;
+	skb_reset_mac_header(skb);
+	eth = (struct ethhdr *)skb_put(skb, ETH_HLEN);
+	memcpy(eth->h_dest, dest, ETH_ALEN);
+	memcpy(eth->h_source, source, ETH_ALEN);
+	eth->h_proto = htons(ETH_QCN_AGG);
+	ah = (struct qcn_agg_hdr *)skb_put(skb, sizeof(*ah));
+	ah->count = 0;
+	ah->reserved = 0;
+	/* held while the frame waits in its slot */
+	dev_hold(dev);
+	skb->dev = dev;
+	agg->skb[i] = skb;
+
+	if (!hrtimer_active(&agg->timer.timer))
+		tasklet_hrtimer_start(&agg->timer,
+				      ns_to_ktime((u64)window * NSEC_PER_USEC),
+				      HRTIMER_MODE_REL);
+
+append:
+	ah = (struct qcn_agg_hdr *)(skb->data + ETH_HLEN);
+	qcn_cnm_put_frame(skb, frame);
+	n = ntohs(ah->count) + 1;
+	ah->count = htons(n);
+	if (n == QCN_AGG_MAX)
+		qcn_cnm_agg_flush(agg, i);
+	return 0;
+}
+EXPORT_SYMBOL(qcn_cnm_agg_add);
+
+#define QCN_FB_HASH_BITS	6
+#define QCN_FB_HASH_SIZE	(1 << QCN_FB_HASH_BITS)
+
+static struct hlist_head qcn_fb_hash[QCN_FB_HASH_SIZE];
+static DEFINE_SPINLOCK(qcn_fb_lock);		/* writers only */
+
+static inline struct hlist_head *qcn_fb_bucket(int ifindex)
+{
+	return &qcn_fb_hash[ifindex & (QCN_FB_HASH_SIZE - 1)];
+}
+
+/* net NULL: any namespace */
+static inline int qcn_fb_match(const struct qcn_fb_handler *h,
+			       struct net *net, int ifindex)
+{
+	return h->ifindex == ifindex && (net == NULL || net_eq(h->net, net));
+}
+
+static struct qcn_fb_handler *__qcn_fb_find(struct net *net, int ifindex)
+{
+	struct qcn_fb_handler *h;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_rcu(h, n, qcn_fb_bucket(ifindex), hnode)
+		if (qcn_fb_match(h, net, ifindex))
+			return h;
+	return NULL;
+}
+
+/* Several handlers per device only if each owns a different TX queue */
+int qcn_fb_register(struct qcn_fb_handler *h)
+{
+	struct qcn_fb_handler *o;
+	struct hlist_node *n;
+	int err = 0;
+
+	spin_lock_bh(&qcn_fb_lock);
+	hlist_for_each_entry(o, n, qcn_fb_bucket(h->ifindex), hnode)
+		if (qcn_fb_match(o, h->net, h->ifindex) &&
+		    (o->queue < 0 || h->queue < 0 || o->queue == h->queue))
+			err = -EEXIST;
+	if (!err)
+		hlist_add_head_rcu(&h->hnode, qcn_fb_bucket(h->ifindex));
+	spin_unlock_bh(&qcn_fb_lock);
+	return err;
+}
+EXPORT_SYMBOL(qcn_fb_register);
+
+/* Sleeps: once it returns no CPU is inside h->recv() any more */
+void qcn_fb_unregister(struct qcn_fb_handler *h)
+{
+	spin_lock_bh(&qcn_fb_lock);
+	hlist_del_init_rcu(&h->hnode);
+	spin_unlock_bh(&qcn_fb_lock);
+	synchronize_rcu();
+}
+EXPORT_SYMBOL(qcn_fb_unregister);
+
+/* QCN_CMD_RP_DUMP, see qcn_tc.h: one message of records per call.
+   args[0] holds the ifindex, args[1] one past the TX queue of the RP
+   being dumped and args[2..3] its position. The RPs of a device go in
+   the order of their queues, which unlike the hash does not change
+   under a running dump. */
+static int qcn_rp_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct net *net = sock_net(skb->sk);
+	struct nlattr *tb[QCN_ATTR_MAX + 1];
+	struct qcn_fb_handler *h, *next;
+	struct hlist_node *n;
+	struct nlattr *attr;
+	void *hdr;
+	int ifindex, room, nr = 0;
+
+	if (cb->args[0] == 0) {
+		if (nlmsg_parse(cb->nlh, GENL_HDRLEN, tb, QCN_ATTR_MAX,
+				qcn_genl_policy) < 0 ||
+		    tb[QCN_ATTR_IFINDEX] == NULL ||
+		    (int)nla_get_u32(tb[QCN_ATTR_IFINDEX]) <= 0)
+			return -EINVAL;
+		cb->args[0] = nla_get_u32(tb[QCN_ATTR_IFINDEX]);
+	}
+	ifindex = cb->args[0];
+
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).pid, cb->nlh->nlmsg_seq,
+			  &qcn_genl_family, NLM_F_MULTI, QCN_CMD_RP_DUMP);
+	if (hdr == NULL)
+		return -EMSGSIZE;
+	room = (int)(skb_tailroom(skb) - nla_total_size(0)) /
+		(int)sizeof(struct qcn_rp_rec);
+	attr = room > 0 ? nla_reserve(skb, QCN_ATTR_RPS,
+				      room * sizeof(struct qcn_rp_rec)) : NULL;
+	if (attr == NULL) {
+		genlmsg_cancel(skb, hdr);
+		return -EMSGSIZE;
+	}
+
+	rcu_read_lock();
+	for (;;) {
+		next = NULL;
+		hlist_for_each_entry_rcu(h, n, qcn_fb_bucket(ifindex), hnode)
+			if (qcn_fb_match(h, net, ifindex) && h->dump &&
+			    h->queue + 1L >= cb->args[1] &&
+			    (next == NULL || h->queue < next->queue))
+				next = h;
+		if (next == NULL)
+			break;
+		nr = next->dump(next, nla_data(attr), room, &cb->args[2]);
+		if (nr > 0)
+			break;
+		cb->args[1] = next->queue + 2L;
+		cb->args[2] = 0;
+		cb->args[3] = 0;
+	}
+	rcu_read_unlock();
+
+	/* nothing left, an empty message ends the dump */
+	if (nr == 0) {
+		genlmsg_cancel(skb, hdr);
+		return skb->len;
+	}
+	attr->nla_len = nla_attr_size(nr * sizeof(struct qcn_rp_rec));
+	nlmsg_trim(skb, (char *)attr + nla_total_size(nr *
+						      sizeof(struct qcn_rp_rec)));
+	return genlmsg_end(skb, hdr);
+}
+
+/* Translates a standard CNM (skb->data past the ethertype) */
+static int qcn_cnm_parse(struct sk_buff *skb, struct qcn_frame *frame)
+{
+	struct qcn_cntag_hdr *tag = NULL;
+	struct qcn_cnm_pdu *cnm;
+	unsigned int off = 0, len;
+	u8 *msdu;
+	int n;
+
+	if (skb->protocol == htons(ETH_P_CNTAG)) {
+		tag = (struct qcn_cntag_hdr *)skb->data;
+		off = QCN_CNTAG_LEN;
+	}
+	if (!pskb_may_pull(skb, off + sizeof(*cnm)))
+		return -EINVAL;
+	if (tag)	/* pskb_may_pull() may have moved the data */
+		tag = (struct qcn_cntag_hdr *)skb->data;
+	cnm = (struct qcn_cnm_pdu *)(skb->data + off);
+
+	frame->Fb = htonl(ntohs(cnm->ver_fb) & QCN_CNM_FB_MASK);
+	frame->qoff = htonl((s16)ntohs(cnm->qoffset) << QCN_CNM_QUNIT_SHIFT);
+	frame->qdelta = htonl((s16)ntohs(cnm->qdelta) << QCN_CNM_QUNIT_SHIFT);
+
+	/* The CN-TAG of the CNM carries the flow ID of the sampled frame */
+	if (tag) {
+		frame->flags |= htons(QCN_FRAME_FLOWID);
+		frame->flow_id = tag->h_flow_id;
+		return 0;
+	}
+
+	/* Otherwise recover the flow from the encapsulated MSDU */
+	len = min_t(unsigned int, ntohs(cnm->encap_len), QCN_CNM_MSDU_MAX);
+	if (!pskb_may_pull(skb, off + sizeof(*cnm) + len))
+		return -EINVAL;
+	cnm = (struct qcn_cnm_pdu *)(skb->data + off);
+	msdu = cnm->encap_msdu;
+
+	/* which starts at the VLAN tags of the sampled frame, if any */
+	for (n = 0; n < QCN_VLAN_DEPTH && len >= 2 + VLAN_HLEN &&
+		     qcn_is_vlan_proto(*(__be16 *)msdu); n++) {
+		frame->flags |= htons(QCN_FRAME_VLAN);
+		frame->vlan_proto[n] = *(__be16 *)msdu;
+		frame->vlan_tci[n] = *(__be16 *)(msdu + 2);
+		msdu += VLAN_HLEN;
+		len -= VLAN_HLEN;
+	}
+
+	if (len >= 2 + QCN_CNTAG_LEN &&
+	    *(__be16 *)msdu == htons(ETH_P_CNTAG)) {
+		tag = (struct qcn_cntag_hdr *)(msdu + 2);
+		frame->flags |= htons(QCN_FRAME_FLOWID);
+		frame->flow_id = tag->h_flow_id;
+		return 0;
+	}
+	if (len >= 2 + sizeof(struct iphdr) &&
+	    *(__be16 *)msdu == htons(ETH_P_IP)) {
+		struct iphdr *iph = (struct iphdr *)(msdu + 2);
+
+		frame->SA = iph->saddr;
+		frame->DA = iph->daddr;
+		return 0;
+	}
+	if (len >= 2 + sizeof(struct ipv6hdr) &&
+	    *(__be16 *)msdu == htons(ETH_P_IPV6)) {
+		qcn_flow_ipv6(frame, (struct ipv6hdr *)(msdu + 2));
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/* Hands one record to the RP of ifindex, or to the RPs of its TX queues
+   as described at qcn_fb_handler. -ENOENT if no RP took it. */
+static int qcn_fb_recv(struct net *net, int ifindex,
+		       struct qcn_frame *frame)
+{
+	struct qcn_fb_handler *h;
+	struct hlist_node *n;
+	struct qcn_frame copy;
+	int ret = -ENOENT, r;
+
+	frame->flags &= ~htons(QCN_FRAME_LOOKUP);
+	frame->rx_stamp = qcn_stamp();
+	h = __qcn_fb_find(net, ifindex);
+	if (h == NULL)
+		return -ENOENT;
+	if (h->queue < 0)
+		return h->recv(h, frame);
+
+	/* every queue that carries the pair takes it, each from a copy of
+	   its own, since recv() may byte swap the frame in place */
+	frame->flags |= htons(QCN_FRAME_LOOKUP);
+	hlist_for_each_entry_rcu(h, n, qcn_fb_bucket(ifindex), hnode) {
+		if (!qcn_fb_match(h, net, ifindex))
+			continue;
+		copy = *frame;
+		if ((r = h->recv(h, &copy)) != -ENOENT && ret == -ENOENT)
+			ret = r;
+	}
+	if (ret != -ENOENT)
+		return ret;
+
+	frame->flags &= ~htons(QCN_FRAME_LOOKUP);
+	hlist_for_each_entry_rcu(h, n, qcn_fb_bucket(ifindex), hnode) {
+		if (!qcn_fb_match(h, net, ifindex))
+			continue;
+		if ((ret = h->recv(h, frame)) != -ENOENT)
+			return ret;
+	}
+	return ret;
+}
+
+/* Every record of an aggregated CNM, in one go. Returns the result of
+   the last one. */
+static int qcn_agg_deliver(struct net *net, int ifindex,
+			   struct sk_buff *skb)
+{
+	struct qcn_frame frame;
+	unsigned int i, n;
+	int ret = -EINVAL;
+
+	if (!pskb_may_pull(skb, sizeof(struct qcn_agg_hdr)))
+		return -EINVAL;
+	n = min_t(unsigned int,
+		  ntohs(((struct qcn_agg_hdr *)skb->data)->count), QCN_AGG_MAX);
+	if (!pskb_may_pull(skb, sizeof(struct qcn_agg_hdr) + n * sizeof(frame)))
+		return -EINVAL;
+
+	for (i = 0; i < n; i++) {
+		memcpy(&frame, skb->data + sizeof(struct qcn_agg_hdr) +
+		       i * sizeof(frame), sizeof(frame));
+		ret = qcn_fb_recv(net, ifindex, &frame);
+	}
+	return ret;
+}
+
+/* Takes the VLAN tags off a CNM the bridge hands over as it came in,
+   the tags its sampled frame had are in the CNM itself */
+static int qcn_cnm_vlan_pull(struct sk_buff *skb)
+{
+	struct vlan_hdr *vh;
+	int n;
+
+	for (n = 0; qcn_is_vlan_proto(skb->protocol); n++) {
+		if (n == QCN_VLAN_DEPTH || !pskb_may_pull(skb, VLAN_HLEN))
+			return -EINVAL;
+		vh = (struct vlan_hdr *)skb->data;
+		skb->protocol = vh->h_vlan_encapsulated_proto;
+		skb_pull(skb, VLAN_HLEN);
+	}
+	return 0;
+}
+
+/**
+ * qcn_fb_deliver - hand a received CNM to the RP of device dev
+ *
+ * skb->data must point to the CNM payload (i.e. the ethernet header was
+ * already pulled); the private ETH_QCN and ETH_QCN_AGG frames and
+ * standard CNMs are accepted, see qcn_is_cnm(), tagged ones too. The
+ * skb is not consumed, but loses its VLAN tags. Returns the handler
+ * result, or -ENOENT if no RP is registered for dev.
+ */
+int qcn_fb_deliver(struct net_device *dev, struct sk_buff *skb)
+{
+	struct qcn_frame frame;
+	int ret = -ENOENT;
+
+	rcu_read_lock();
+	if (__qcn_fb_find(dev_net(dev), dev->ifindex) == NULL)
+		goto out;
+
+	ret = -EINVAL;
+	if (qcn_cnm_vlan_pull(skb))
+		goto out;
+	memset(&frame, 0, sizeof(frame));
+	if (skb->protocol == htons(ETH_QCN)) {
+		if (!pskb_may_pull(skb, sizeof(struct qcn_frame)))
+			goto out;
+		memcpy(&frame, skb->data, sizeof(struct qcn_frame));
+	} else if (skb->protocol == htons(ETH_QCN_AGG)) {
+		ret = qcn_agg_deliver(dev_net(dev), dev->ifindex, skb);
+		goto out;
+	} else if (qcn_cnm_parse(skb, &frame)) {
+		goto out;
+	}
+	ret = qcn_fb_recv(dev_net(dev), dev->ifindex, &frame);
+out:
+	rcu_read_unlock();
+	return ret;
+}
+EXPORT_SYMBOL(qcn_fb_deliver);
+
+/* Whether an RP takes the CNMs received on ifindex. Lets the bridge
+   divert only those and keep forwarding everybody else's; the caller
+   holds rcu_read_lock(). */
+int qcn_fb_registered(int ifindex)
+{
+	return __qcn_fb_find(NULL, ifindex) != NULL;
+}
+EXPORT_SYMBOL(qcn_fb_registered);
+
+/**
+ * qcn_tx_queue - the TX queue of dev that skb's flow belongs on
+ *
+ * Below mq, the queue whose RP the feedback for the flow goes to, see
+ * qcn_fb_handler; -1 if dev has no RP per queue or skb no flow. The
+ * caller holds rcu_read_lock().
+ */
+int qcn_tx_queue(struct net_device *dev, struct sk_buff *skb)
+{
+	struct qcn_fb_handler *h = __qcn_fb_find(dev_net(dev), dev->ifindex);
+
+	if (h == NULL || h->queue < 0 || h->home == NULL)
+		return -1;
+	return h->home(h, skb);
+}
+EXPORT_SYMBOL(qcn_tx_queue);
+
+/* qcn_fb_registered() for dev in its own namespace */
+static inline int qcn_fb_dev_registered(struct net_device *dev)
+{
+	return __qcn_fb_find(dev_net(dev), dev->ifindex) != NULL;
+}
+
+/* Whether the RP of ifindex is an ingress one, which takes the CNMs the
+   bridge would forward out of the device to the senders behind it; the
+   caller holds rcu_read_lock(). */
+int qcn_fb_ingress(int ifindex)
+{
+	struct qcn_fb_handler *h = __qcn_fb_find(NULL, ifindex);
+
+	return h != NULL && h->ingress;
+}
+EXPORT_SYMBOL(qcn_fb_ingress);
+
+#define QCN_CP_HASH_BITS	4
+#define QCN_CP_HASH_SIZE	(1 << QCN_CP_HASH_BITS)
+
+static struct hlist_head qcn_cp_hash[QCN_CP_HASH_SIZE];
+static DEFINE_MUTEX(qcn_cp_group_lock);
+
+/**
+ * qcn_cp_group_get - join (or create) the CP group of device dev
+ *
+ * Called from qdisc init, i.e. process context with RTNL held. Each
+ * call takes a reference which qcn_cp_group_put() drops.
+ */
+struct qcn_cp_group *qcn_cp_group_get(struct net_device *dev)
+{
+	struct qcn_cp_group *g;
+	struct hlist_node *n;
+	struct hlist_head *head = &qcn_cp_hash[dev->ifindex &
+					       (QCN_CP_HASH_SIZE - 1)];
+
+	mutex_lock(&qcn_cp_group_lock);
+	hlist_for_each_entry(g, n, head, hnode)
+		if (g->ifindex == dev->ifindex && net_eq(g->net, dev_net(dev))) {
+			g->refcnt++;
+			goto out;
+		}
+
+	g = kzalloc(sizeof(*g) + dev->num_tx_queues * sizeof(g->slot[0]),
+		    GFP_KERNEL);
+	if (g) {
+		g->ifindex = dev->ifindex;
+		g->net = dev_net(dev);
+		g->refcnt = 1;
+		g->nr_slots = dev->num_tx_queues;
+		hlist_add_head(&g->hnode, head);
+	}
+out:
+	mutex_unlock(&qcn_cp_group_lock);
+	return g;
+}
+EXPORT_SYMBOL(qcn_cp_group_get);
+
+void qcn_cp_group_put(struct qcn_cp_group *g)
+{
+	mutex_lock(&qcn_cp_group_lock);
+	if (--g->refcnt == 0) {
+		hlist_del(&g->hnode);
+		kfree(g);
+	}
+	mutex_unlock(&qcn_cp_group_lock);
+}
+EXPORT_SYMBOL(qcn_cp_group_put);
+
+/**
+ * qcn_ring_init - set up the TX ring estimate of dev
+ *
+ * The size is what the driver reports now, in descriptors of an MTU
+ * each, or of their share of a 64KB frame with TSO. Process context,
+ * from the owner's init.
+ */
+void qcn_ring_init(struct qcn_ring *r, struct net_device *dev)
+{
+	struct ethtool_ringparam ring = { .cmd = ETHTOOL_GRINGPARAM };
+	u32 slots = QCN_RING_SLOTS, bytes = psched_mtu(dev);
+
+	if (dev->ethtool_ops && dev->ethtool_ops->get_ringparam) {
+		dev->ethtool_ops->get_ringparam(dev, &ring);
+		if (ring.tx_pending)
+			slots = ring.tx_pending;
+	}
+	if (dev->features & NETIF_F_TSO)
+		bytes = max_t(u32, bytes, GSO_MAX_SIZE / MAX_SKB_FRAGS);
+	memset(r, 0, sizeof(*r));
+	r->dev = dev;
+	r->limit = min_t(u64, (u64)slots * bytes, INT_MAX);
+}
+EXPORT_SYMBOL(qcn_ring_init);
+
+/* See qcn_ring_inflight(); under the owner's lock */
+void qcn_ring_update(struct qcn_ring *r, unsigned long sent, s64 now)
+{
+	unsigned long done = ACCESS_ONCE(r->dev->stats.tx_bytes);
+	long delta = (long)(sent - r->sent) - (long)(done - r->done);
+
+	if (r->next == 0 || now - r->next > QCN_RING_IDLE) {
+		/* new, or not looked at for long: from here on */
+		r->active = now;
+		r->inflight = 0;
+	} else {
+		if (done != r->done)
+			r->active = now;
+		if (now - r->active > QCN_RING_IDLE)
+			r->inflight = 0;
+		else
+			r->inflight = clamp_t(long, r->inflight + delta, 0,
+					      r->limit);
+	}
+	r->sent = sent;
+	r->done = done;
+	r->next = now + QCN_RING_PERIOD;
+}
+EXPORT_SYMBOL(qcn_ring_update);
+
+static HLIST_HEAD(qcn_sbuf_list);
+static DEFINE_MUTEX(qcn_sbuf_lock);
+
+/**
+ * qcn_sbuf_get - join (or create) shared buffer domain id of net
+ *
+ * Process context, RTNL held. Returns NULL for id 0, the domain
+ * and in @slot a slot of our own otherwise, ERR_PTR(-ENOSPC) once
+ * QCN_SBUF_PORTS members have joined. qcn_sbuf_put() leaves it again.
+ */
+struct qcn_sbuf *qcn_sbuf_get(struct net *net, u32 id,
+			      struct qcn_sbuf_slot **slot)
+{
+	struct qcn_sbuf *b;
+	struct hlist_node *n;
+	unsigned int i;
+
+	*slot = NULL;
+	if (!id)
+		return NULL;
+	mutex_lock(&qcn_sbuf_lock);
+	hlist_for_each_entry(b, n, &qcn_sbuf_list, hnode)
+		if (b->id == id && net_eq(b->net, net))
+			goto found;
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (b == NULL) {
+		b = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	b->id = id;
+	b->net = net;
+	hlist_add_head(&b->hnode, &qcn_sbuf_list);
+found:
+	i = find_first_zero_bit(b->used, QCN_SBUF_PORTS);
+	if (i >= QCN_SBUF_PORTS) {
+		b = ERR_PTR(-ENOSPC);	/* not a new one, that has room */
+		goto out;
+	}
+	__set_bit(i, b->used);
+	b->slot[i].qlen = 0;
+	if (i >= b->nr_slots)
+		b->nr_slots = i + 1;
+	b->refcnt++;
+	*slot = &b->slot[i];
+out:
+	mutex_unlock(&qcn_sbuf_lock);
+	return b;
+}
+EXPORT_SYMBOL(qcn_sbuf_get);
+
+/* The member has stopped writing its slot; NULL is fine */
+void qcn_sbuf_put(struct qcn_sbuf *b, struct qcn_sbuf_slot *slot)
+{
+	if (b == NULL)
+		return;
+	mutex_lock(&qcn_sbuf_lock);
+	slot->qlen = 0;
+	__clear_bit(slot - b->slot, b->used);
+	if (--b->refcnt == 0) {
+		hlist_del(&b->hnode);
+		kfree(b);
+	}
+	mutex_unlock(&qcn_sbuf_lock);
+}
+EXPORT_SYMBOL(qcn_sbuf_put);
+
+static LIST_HEAD(qcn_alg_list);
+static DEFINE_SPINLOCK(qcn_alg_lock);
+
+static struct qcn_alg_ops qcn_alg_dcqcn = {
+	QCN_ALG_DCQCN,
+	.owner		= THIS_MODULE,
+};
+
+static struct qcn_alg_ops *__qcn_alg_find(const char *name)
+{
+	struct qcn_alg_ops *a;
+
+	list_for_each_entry(a, &qcn_alg_list, list)
+		if (strcmp(a->name, name) == 0)
+			return a;
+	return NULL;
+}
+
+int qcn_alg_register(struct qcn_alg_ops *alg)
+{
+	int err = 0;
+
+	if (alg->name == NULL || !alg->name[0] ||
+	    strlen(alg->name) >= QCN_ALG_NAME_MAX ||
+	    strcmp(alg->name, "qcn") == 0)
+		return -EINVAL;
+	spin_lock(&qcn_alg_lock);
+	if (__qcn_alg_find(alg->name))
+		err = -EEXIST;
+	else
+		list_add_tail(&alg->list, &qcn_alg_list);
+	spin_unlock(&qcn_alg_lock);
+	if (!err)
+		printk(KERN_INFO "qcn: algorithm %s registered\n", alg->name);
+	return err;
+}
+EXPORT_SYMBOL(qcn_alg_register);
+
+/* From the owner's exit, when nothing holds a reference any more */
+void qcn_alg_unregister(struct qcn_alg_ops *alg)
+{
+	spin_lock(&qcn_alg_lock);
+	list_del(&alg->list);
+	spin_unlock(&qcn_alg_lock);
+}
+EXPORT_SYMBOL(qcn_alg_unregister);
+
+/* NULL for the standard, ERR_PTR(-ENOENT) for a name nobody registered */
+const struct qcn_alg_ops *qcn_alg_get(const char *name)
+{
+	struct qcn_alg_ops *a;
+
+	if (!name[0] || strcmp(name, "qcn") == 0)
+		return NULL;
+	spin_lock(&qcn_alg_lock);
+	a = __qcn_alg_find(name);
+	if (a && !try_module_get(a->owner))
+		a = NULL;
+	spin_unlock(&qcn_alg_lock);
+	return a ? a : ERR_PTR(-ENOENT);
+}
+EXPORT_SYMBOL(qcn_alg_get);
+
+/* The CNM goes back out indev, the device skb was received on */
+static struct sk_buff *qcn_cp_cnm_create(struct qcn_cp *cp,
+					 struct sk_buff *skb,
+					 struct net_device *indev,
+					 struct qcn_frame *frame)
+{
+	struct ethhdr *ethh, *cnmh;
+	struct sk_buff *qcnskb;
+
+	/* Initialization: pooled skb, ethertype already in place */
+	if ((qcnskb = qcn_cnm_alloc(&cp->cnm_pool)) == NULL)
+		return NULL;
+
+	ethh = eth_hdr(skb);
+	cnmh = (struct ethhdr *)skb_put(qcnskb, ETH_HLEN);
+	memcpy(cnmh->h_dest, ethh->h_source, ETH_ALEN);
+	memcpy(cnmh->h_source, ethh->h_dest, ETH_ALEN);
+	cnmh->h_proto = htons(ETH_QCN);
+	qcn_cnm_put_frame(qcnskb, frame);
+	qcn_cnm_put_vlan(qcnskb, frame);
+	qcnskb->dev = indev;
+
+	return qcnskb;
+}
+
+/* Fb resolution follows q_eq, w and the limit, the sampling table the
+   rate */
+static void qcn_cp_scale(struct qcn_cp *cp)
+{
+	u32 limit = cp->limit;
+
+	/* Fb may see the ring on top of a full queue */
+	if (cp->ring_on && limit)
+		limit = min_t(u64, (u64)limit + cp->ring.limit, ~0U);
+	cp->fb_max = qcn_fb_max(cp->q_eq, cp->w, limit);
+	cp->fb_shift = qcn_fb_shift(cp->fb_max);
+	cp->prof = qcn_cp_prof(cp->w);
+	qcn_mark_scale(cp->mark, cp->mark_cfg, cp->mark_rate, cp->rate);
+}
+
+static void qcn_cp_telem(struct qcn_cp *cp)
+{
+	struct qcn_telem *t = cp->telem;
+
+	if (!t)
+		return;
+	qcn_telem_begin(t);
+	t->qlen = cp->backlog;
+	t->fb = cp->fb;
+	t->cnm = cp->cnm_generated;
+	t->cnm_sent = cp->cnm_tx.sent;
+	t->cnm_failed = cp->cnm_create_failed +
+		atomic_read(&cp->cnm_tx.dropped);
+	qcn_telem_end(t);
+}
+
+/* sch is NULL for a qcn_port_cp, telemetry goes by dev and handle */
+static int __qcn_cp_init(struct qcn_cp *cp, struct Qdisc *sch,
+			 struct net_device *dev, u32 handle, int prio,
+			 const struct tc_qcn_cp_opt *def, u64 rate)
+{
+	int err;
+
+	memset(cp, 0, sizeof(*cp));
+	cp->sch = sch;
+	cp->dev = dev;
+	cp->prio = prio;
+	cp->rate = rate;
+	cp->enable = 1;
+	qcn_ring_init(&cp->ring, dev);
+	err = qcn_cnm_pool_init(&cp->cnm_pool);
+	if (err)
+		return err;
+	qcn_cnm_sender_init(&cp->cnm_tx);
+	qcn_cnm_agg_init(&cp->cnm_agg, sch, &cp->cnm_pool, &cp->cnm_tx);
+
+	qcn_cp_change(cp, def);
+	/* Best effort, the CP works the same without a slot */
+	cp->telem = qcn_telem_get(QCN_TELEM_CP, dev->ifindex, handle, prio);
+	qcn_cp_reset(cp);
+	return 0;
+}
+
+/**
+ * qcn_cp_init - set up the congestion point of priority prio of sch
+ *
+ * def holds the defaults, e.g. from module parameters, and is taken
+ * without checks; rate is the port speed in bytes/s, 0 if unknown.
+ * Process context, from the owner's init.
+ */
+int qcn_cp_init(struct qcn_cp *cp, struct Qdisc *sch, int prio,
+		const struct tc_qcn_cp_opt *def, u64 rate)
+{
+	return __qcn_cp_init(cp, sch, qdisc_dev(sch), sch->handle, prio, def,
+			     rate);
+}
+EXPORT_SYMBOL(qcn_cp_init);
+
+void qcn_cp_destroy(struct qcn_cp *cp)
+{
+	qcn_alg_put(cp->alg);
+	cp->alg = NULL;
+	qcn_telem_put(cp->telem);
+	cp->telem = NULL;
+	qcn_cnm_agg_destroy(&cp->cnm_agg);
+	qcn_cnm_sender_destroy(&cp->cnm_tx);
+	qcn_cnm_pool_destroy(&cp->cnm_pool);
+}
+EXPORT_SYMBOL(qcn_cp_destroy);
+
+/* Validates a change request before the owner takes its tree lock */
+int qcn_cp_check(const struct tc_qcn_cp_opt *opt)
+{
+	int prio = ffs(opt->prio_mask) - 1, i;
+
+	if (prio < 0 || prio >= QCN_NR_PRIO)
+		prio = 0;
+	if ((opt->flags & TC_QCN_CP_Q_EQ) && opt->q_eq[prio] <= 0)
+		return -EINVAL;
+	if ((opt->flags & TC_QCN_CP_W) && opt->w[prio] < 0)
+		return -EINVAL;
+	if ((opt->flags & TC_QCN_CP_JITTER) && opt->sample_jitter > 100)
+		return -EINVAL;
+	if ((opt->flags & TC_QCN_CP_COALESCE) &&
+	    opt->coalesce > QCN_CNM_COALESCE_MAX)
+		return -EINVAL;
+	if ((opt->flags & TC_QCN_CP_MIN_INTERVAL) &&
+	    opt->min_interval > QCN_CNM_MIN_INTERVAL_MAX)
+		return -EINVAL;
+	if (opt->flags & TC_QCN_CP_MARK) {
+		for (i = 0; i < QCN_MARK_STEPS; i++)
+			if (opt->mark[i] == 0 || opt->mark[i] > 0x7FFFFFFF)
+				return -EINVAL;
+	}
+	if ((opt->flags & TC_QCN_CP_FB_PERIOD) &&
+	    opt->fb_period > QCN_FB_PERIOD_MAX)
+		return -EINVAL;
+	if ((opt->flags & TC_QCN_CP_ALG) &&
+	    strnlen(opt->alg, QCN_ALG_NAME_MAX) == QCN_ALG_NAME_MAX)
+		return -EINVAL;
+	if ((opt->flags & TC_QCN_CP_ENABLE) && opt->enable > 1)
+		return -EINVAL;
+	if ((opt->flags & TC_QCN_CP_FB_DELAY) &&
+	    opt->fb_delay > QCN_FB_DELAY_MAX)
+		return -EINVAL;
+	if ((opt->flags & TC_QCN_CP_FB_LOSS) && opt->fb_loss > QCN_FB_LOSS_MAX)
+		return -EINVAL;
+	if ((opt->flags & TC_QCN_CP_RING) && opt->ring > 1)
+		return -EINVAL;
+	return 0;
+}
+EXPORT_SYMBOL(qcn_cp_check);
+
+/* Under sch_tree_lock, opt was checked */
+void qcn_cp_change(struct qcn_cp *cp, const struct tc_qcn_cp_opt *opt)
+{
+	int prio = ffs(opt->prio_mask) - 1;
+
+	if (prio < 0 || prio >= QCN_NR_PRIO)
+		prio = 0;
+	if (opt->flags & TC_QCN_CP_Q_EQ)
+		cp->q_eq = opt->q_eq[prio];
+	if (opt->flags & TC_QCN_CP_W)
+		cp->w = opt->w[prio];
+	if (opt->flags & TC_QCN_CP_JITTER)
+		cp->sample_jitter = opt->sample_jitter;
+	if (opt->flags & TC_QCN_CP_COALESCE)
+		cp->coalesce = opt->coalesce;
+	if (opt->flags & TC_QCN_CP_MIN_INTERVAL)
+		cp->min_interval = opt->min_interval;
+	if (opt->flags & TC_QCN_CP_MARK)
+		memcpy(cp->mark_cfg, opt->mark, sizeof(cp->mark_cfg));
+	if (opt->flags & TC_QCN_CP_MARK_RATE)
+		cp->mark_rate = opt->mark_rate;
+	if (opt->flags & TC_QCN_CP_FB_PERIOD)
+		cp->fb_period = opt->fb_period;
+	if (opt->flags & TC_QCN_CP_HEAVY)
+		cp->heavy = opt->heavy;
+	if (opt->flags & TC_QCN_CP_FB_DELAY)
+		cp->fb_delay = opt->fb_delay;
+	if (opt->flags & TC_QCN_CP_FB_LOSS)
+		cp->fb_loss = opt->fb_loss;
+	if (opt->flags & TC_QCN_CP_RING)
+		cp->ring_on = opt->ring;
+	qcn_cnm_sender_set(&cp->cnm_tx, cp->fb_delay, cp->fb_loss);
+	qcn_cp_scale(cp);
+	/* the owner stops calling us while off, so start over */
+	if ((opt->flags & TC_QCN_CP_ENABLE) && opt->enable != cp->enable) {
+		cp->enable = opt->enable;
+		qcn_cp_reset(cp);
+	}
+}
+EXPORT_SYMBOL(qcn_cp_change);
+
+/* The most the owner queues, 0 if it cannot tell; under sch_tree_lock */
+void qcn_cp_set_limit(struct qcn_cp *cp, u32 limit)
+{
+	cp->limit = limit;
+	qcn_cp_scale(cp);
+}
+EXPORT_SYMBOL(qcn_cp_set_limit);
+
+/* Takes over the reference of alg (see qcn_alg_opt_get()) and drops the
+   one of the algorithm it replaces; under sch_tree_lock */
+void qcn_cp_set_alg(struct qcn_cp *cp, const struct qcn_alg_ops *alg)
+{
+	qcn_alg_put(cp->alg);
+	cp->alg = alg;
+}
+EXPORT_SYMBOL(qcn_cp_set_alg);
+
+/* The owner's queue was emptied */
+void qcn_cp_reset(struct qcn_cp *cp)
+{
+	cp->qlen = 0;
+	cp->backlog = 0;
+	qcn_ring_reset(&cp->ring);
+	cp->qlen_old = 0;
+	cp->sample = qcn_randomize(cp->mark[0], cp->sample_jitter);
+	cp->generate_fb_frame = 0;
+	cp->fb = 0;
+	cp->fb_next = 0;
+	qcn_cp_telem(cp);
+}
+EXPORT_SYMBOL(qcn_cp_reset);
+
+/* qlen_old every fb_period rather than at each sample, see qcn_tc.h */
+static void qcn_cp_period(struct qcn_cp *cp, psched_time_t now)
+{
+	if (now < cp->fb_next)
+		return;
+	cp->fb = qcn_alg_fb(cp->alg, cp->prof, cp->q_eq, cp->w, cp->qlen,
+			    cp->qlen_old, cp->fb_max, cp->fb_shift);
+	cp->qlen_old = cp->qlen;
+	cp->fb_next = now + PSCHED_NS2TICKS((u64)cp->fb_period *
+					    NSEC_PER_USEC);
+	if (cp->fb == 0)
+		cp->generate_fb_frame = 0;
+}
+
+/* The owner's backlog went from cp->backlog to backlog; a departure if
+   sent, a drop or reset otherwise. Returns what Fb is computed from. */
+static int qcn_cp_backlog(struct qcn_cp *cp, int backlog, int sent)
+{
+	if (sent && backlog < cp->backlog)
+		cp->sent += cp->backlog - backlog;
+	cp->backlog = backlog;
+	if (cp->ring_on)
+		backlog += qcn_ring_inflight(&cp->ring, cp->sent);
+	return backlog;
+}
+
+/**
+ * qcn_cp_enqueue - run the CP for an arrival
+ *
+ * After skb of len bytes was queued, i.e. backlog includes it. The
+ * owner must not have touched skb->cb in a way that loses skb_iif or
+ * the headers, the CNM is built from them.
+ */
+void qcn_cp_enqueue(struct qcn_cp *cp, struct sk_buff *skb,
+		    unsigned int len, int backlog)
+{
+	struct sk_buff *qcnskb;
+	struct net_device *indev;
+	struct qcn_frame frame;
+	struct qcn_trace_rec rec;
+	u32 qntz_Fb, qntz_Fb_sent = 0;
+	int err, segs;
+
+	cp->qlen = backlog = qcn_cp_backlog(cp, backlog, 0);
+	if (cp->heavy && qcn_flow_fill(skb, &frame))
+		qcn_hh_add(&cp->hh, &frame, len, cp->heavy);
+	if (cp->fb_period)
+		qcn_cp_period(cp, psched_get_time());
+	qntz_Fb = qcn_alg_fb(cp->alg, cp->prof, cp->q_eq, cp->w, backlog,
+			     cp->qlen_old, cp->fb_max, cp->fb_shift);
+	cp->fb = qntz_Fb;
+	/* a pending CNM only goes while there is still congestion */
+	if (qntz_Fb == 0)
+		cp->generate_fb_frame = 0;
+
+	cp->sample -= len;
+	/* A GSO skb passes as many sampling points as its segments would
+	   have one by one, but no more than one per segment */
+	segs = skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+	while (cp->sample < 0 && segs-- > 0) {
+		if (qntz_Fb > 0) {
+			if (!cp->generate_fb_frame)
+				qcn_hh_pending(&cp->hh);
+			cp->generate_fb_frame = 1;
+		}
+		if (!cp->fb_period)
+			cp->qlen_old = backlog;
+		cp->sample += qcn_randomize(qcn_mark_table(cp->mark, qntz_Fb),
+					    cp->sample_jitter);
+	}
+
+	/* Locally generated traffic has no way back, and no CNM */
+	if (cp->generate_fb_frame &&
+	    (indev = qcn_ingress_dev(dev_net(cp->dev), skb)) &&
+	    qcn_flow_fill(skb, &frame) &&
+	    qcn_hh_heavy(&cp->hh, &frame, cp->heavy) &&
+	    !qcn_cnm_suppress(&cp->cnm_filter, &frame, cp->min_interval)) {
+		frame.Fb = htonl(qntz_Fb);
+		frame.qoff = htonl(cp->q_eq - backlog);
+		frame.qdelta = htonl(backlog - cp->qlen_old);
+
+		if (cp->coalesce && !(frame.flags & htons(QCN_FRAME_VLAN)))
+			err = qcn_cnm_agg_add(&cp->cnm_agg, indev,
+					      eth_hdr(skb)->h_source,
+					      eth_hdr(skb)->h_dest, &frame,
+					      cp->coalesce);
+		else if ((qcnskb = qcn_cp_cnm_create(cp, skb, indev,
+						     &frame)) == NULL)
+			err = -ENOMEM;
+		else
+			err = qcn_cnm_send(&cp->cnm_tx, qcnskb);
+
+		if (err == -ENOMEM)
+			cp->cnm_create_failed++;
+		else
+			cp->cnm_generated++;
+		if (err == 0) {
+			/* a full ring is counted in cnm_tx.dropped */
+			qcn_cnm_filter_note(&cp->cnm_filter, &frame,
+					    cp->min_interval);
+			cp->generate_fb_frame = 0;
+			qntz_Fb_sent = qntz_Fb;
+		}
+	}
+
+	qcn_cp_telem(cp);
+	if (qcn_trace_enabled) {
+		memset(&rec, 0, sizeof(rec));
+		rec.tsc = get_cycles();
+		rec.type = QCN_TRACE_CP;
+		rec.id = cp->dev->ifindex;
+		rec.qlen = backlog;
+		rec.fb = qntz_Fb_sent;
+		__qcn_trace(&rec);
+	}
+}
+EXPORT_SYMBOL(qcn_cp_enqueue);
+
+/* A departure; the queue drains without arrivals to sample it, so these
+   keep Fb current as well and drop a pending CNM once it is 0 */
+void qcn_cp_dequeue(struct qcn_cp *cp, int backlog)
+{
+	cp->qlen = backlog = qcn_cp_backlog(cp, backlog, 1);
+	if (cp->fb_period)
+		qcn_cp_period(cp, psched_get_time());
+	else if (cp->generate_fb_frame) {
+		cp->fb = qcn_alg_fb(cp->alg, cp->prof, cp->q_eq, cp->w, backlog,
+				    cp->qlen_old, cp->fb_max, cp->fb_shift);
+		if (cp->fb == 0)
+			cp->generate_fb_frame = 0;
+	}
+	qcn_cp_telem(cp);
+}
+EXPORT_SYMBOL(qcn_cp_dequeue);
+
+/* Any other change of the backlog, e.g. a drop */
+void qcn_cp_update(struct qcn_cp *cp, int backlog)
+{
+	cp->qlen = qcn_cp_backlog(cp, backlog, 0);
+	qcn_cp_telem(cp);
+}
+EXPORT_SYMBOL(qcn_cp_update);
+
+/* The parameters, as TCA_TBF_QCN dumps them */
+void qcn_cp_dump(const struct qcn_cp *cp, struct tc_qcn_cp_opt *opt)
+{
+	int prio;
+
+	memset(opt, 0, sizeof(*opt));
+	opt->flags = TC_QCN_CP_Q_EQ | TC_QCN_CP_W | TC_QCN_CP_JITTER |
+		TC_QCN_CP_COALESCE | TC_QCN_CP_MIN_INTERVAL | TC_QCN_CP_MARK |
+		TC_QCN_CP_MARK_RATE | TC_QCN_CP_FB_PERIOD | TC_QCN_CP_HEAVY;
+	opt->prio_mask = (1 << QCN_NR_PRIO) - 1;
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		opt->q_eq[prio] = cp->q_eq;
+		opt->w[prio] = cp->w;
+	}
+	opt->cnpv = (1 << QCN_NR_PRIO) - 1;
+	opt->sample_jitter = cp->sample_jitter;
+	opt->coalesce = cp->coalesce;
+	opt->min_interval = cp->min_interval;
+	memcpy(opt->mark, cp->mark_cfg, sizeof(opt->mark));
+	opt->mark_rate = cp->mark_rate;
+	opt->fb_period = cp->fb_period;
+	opt->heavy = cp->heavy;
+	opt->enable = cp->enable;
+	opt->fb_delay = cp->fb_delay;
+	opt->fb_loss = cp->fb_loss;
+	opt->ring = cp->ring_on;
+	opt->flags |= TC_QCN_CP_ALG | TC_QCN_CP_ENABLE | TC_QCN_CP_FB_DELAY |
+		TC_QCN_CP_FB_LOSS | TC_QCN_CP_RING;
+	strlcpy(opt->alg, qcn_alg_name(cp->alg), sizeof(opt->alg));
+}
+EXPORT_SYMBOL(qcn_cp_dump);
+
+/* Adds to st, so that one tc_qcn_cp_xstats can cover a CP per priority */
+void qcn_cp_stats(const struct qcn_cp *cp, struct tc_qcn_cp_xstats *st)
+{
+	st->qlen[cp->prio] = cp->backlog;
+	st->fb[cp->prio] = cp->fb;
+	st->sample[cp->prio] = cp->sample;
+	st->cnm_generated += cp->cnm_generated;
+	st->cnm_sent += cp->cnm_tx.sent;
+	st->cnm_bypassed += cp->cnm_tx.bypassed;
+	st->cnm_failed += cp->cnm_create_failed +
+		atomic_read(&cp->cnm_tx.dropped);
+	st->cnm_fallbacks += cp->cnm_pool.fallbacks;
+	st->cnm_coalesced += cp->cnm_agg.coalesced;
+	st->cnm_suppressed += cp->cnm_filter.suppressed;
+	st->cnm_deferred += cp->hh.deferred;
+	st->cnm_lost += atomic_read(&cp->cnm_tx.lost);
+	if (cp->ring_on)
+		st->ring = cp->ring.inflight;
+}
+EXPORT_SYMBOL(qcn_cp_stats);
+
+/* The qcnfifo defaults, with q_eq and w */
+static void qcn_port_cp_opt(struct tc_qcn_cp_opt *opt, u32 q_eq, u32 w)
+{
+	static const u32 mark[QCN_MARK_STEPS] = QCN_MARK_DEFAULT;
+
+	memset(opt, 0, sizeof(*opt));
+	opt->flags = TC_QCN_CP_Q_EQ | TC_QCN_CP_W | TC_QCN_CP_JITTER |
+		TC_QCN_CP_MARK;
+	opt->prio_mask = 1;
+	opt->q_eq[0] = q_eq;
+	opt->w[0] = w;
+	opt->sample_jitter = 15;
+	memcpy(opt->mark, mark, sizeof(opt->mark));
+}
+
+/**
+ * qcn_port_cp_create - a CP for the frames the bridge sends out of dev
+ *
+ * q_eq and w passed qcn_port_cp_check(). Process context, the bridge
+ * publishes the result to its fast path itself. NULL if out of memory.
+ */
+struct qcn_port_cp *qcn_port_cp_create(struct net_device *dev, u32 q_eq,
+				       u32 w)
+{
+	struct qcn_port_cp *pcp;
+	struct tc_qcn_cp_opt def;
+
+	pcp = kmalloc(sizeof(*pcp), GFP_KERNEL);
+	if (pcp == NULL)
+		return NULL;
+	spin_lock_init(&pcp->lock);
+	qcn_port_cp_opt(&def, q_eq, w);
+	if (__qcn_cp_init(&pcp->cp, NULL, dev, 0, 0, &def, 0)) {
+		kfree(pcp);
+		return NULL;
+	}
+	pcp->cp.cnm_agg.lock = &pcp->lock;
+	return pcp;
+}
+EXPORT_SYMBOL(qcn_port_cp_create);
+
+/* Once the bridge fast path can no longer see pcp; process context */
+void qcn_port_cp_destroy(struct qcn_port_cp *pcp)
+{
+	qcn_cp_destroy(&pcp->cp);
+	kfree(pcp);
+}
+EXPORT_SYMBOL(qcn_port_cp_destroy);
+
+int qcn_port_cp_check(u32 q_eq, u32 w)
+{
+	struct tc_qcn_cp_opt opt;
+
+	if (q_eq > INT_MAX || w > INT_MAX)
+		return -EINVAL;
+	qcn_port_cp_opt(&opt, q_eq, w);
+	return qcn_cp_check(&opt);
+}
+EXPORT_SYMBOL(qcn_port_cp_check);
+
+/* q_eq and w passed qcn_port_cp_check() */
+void qcn_port_cp_change(struct qcn_port_cp *pcp, u32 q_eq, u32 w)
+{
+	struct tc_qcn_cp_opt opt;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.flags = TC_QCN_CP_Q_EQ | TC_QCN_CP_W;
+	opt.prio_mask = 1;
+	opt.q_eq[0] = q_eq;
+	opt.w[0] = w;
+	spin_lock_bh(&pcp->lock);
+	qcn_cp_change(&pcp->cp, &opt);
+	spin_unlock_bh(&pcp->lock);
+}
+EXPORT_SYMBOL(qcn_port_cp_change);
+
+/* A frame the bridge is about to queue on the port, skb->data at its MAC
+   header; under rcu_read_lock(). Frames of every CPU that go to the
+   port meet here, hence the lock. */
+void qcn_port_cp_xmit(struct qcn_port_cp *pcp, struct sk_buff *skb)
+{
+	int backlog = qcn_dev_backlog(pcp->cp.dev);
+
+	spin_lock_bh(&pcp->lock);
+	/* the port drained since the last frame */
+	if (backlog < pcp->cp.backlog)
+		qcn_cp_dequeue(&pcp->cp, backlog);
+	qcn_cp_enqueue(&pcp->cp, skb, skb->len,
+		       min_t(unsigned int, backlog + skb->len, INT_MAX));
+	spin_unlock_bh(&pcp->lock);
+}
+EXPORT_SYMBOL(qcn_port_cp_xmit);
+
+int qcn_rp_check(const struct tc_qcn_rp_opt *opt)
+{
+	if (((opt->flags & TC_QCN_RP_TIMER) && opt->timer < QCN_TIMER_MIN) ||
+	    ((opt->flags & TC_QCN_RP_BC) && opt->bc == 0) ||
+	    ((opt->flags & TC_QCN_RP_GD) && opt->gd >= 32) ||
+	    ((opt->flags & TC_QCN_RP_MIN_RATE_DEC) && opt->min_rate_dec >= 32) ||
+	    ((opt->flags & TC_QCN_RP_JITTER) && opt->timer_jitter > 100) ||
+	    ((opt->flags & TC_QCN_RP_CLASSIFY) && opt->classify > 1) ||
+	    ((opt->flags & TC_QCN_RP_EXACT) && opt->exact > 1) ||
+	    ((opt->flags & TC_QCN_RP_AGGREGATE) &&
+	     (opt->agg_src > 32 || opt->agg_dst > 32)) ||
+	    ((opt->flags & TC_QCN_RP_ALG) &&
+	     strnlen(opt->alg, QCN_ALG_NAME_MAX) == QCN_ALG_NAME_MAX) ||
+	    ((opt->flags & TC_QCN_RP_ENABLE) && opt->enable > 1) ||
+	    ((opt->flags & TC_QCN_RP_HW_VF) &&
+	     (opt->hw_vf < -1 || opt->hw_vf >= QCN_HW_VF_MAX)))
+		return -EINVAL;
+	return 0;
+}
+EXPORT_SYMBOL(qcn_rp_check);
+
+/* Called under the owner's lock, opt was checked. Readers may see a mix
+   of old and new values for one packet or feedback, which is harmless. */
+void qcn_rp_change(struct tc_qcn_rp_opt *qp, const struct tc_qcn_rp_opt *opt)
+{
+	if (opt->flags & TC_QCN_RP_TIMER)
+		qp->timer = opt->timer;
+	if (opt->flags & TC_QCN_RP_FASTREC)
+		qp->fastrec = opt->fastrec;
+	if (opt->flags & TC_QCN_RP_BC)
+		qp->bc = opt->bc;
+	if (opt->flags & TC_QCN_RP_AI)
+		qp->ai = opt->ai;
+	if (opt->flags & TC_QCN_RP_HAI)
+		qp->hai = opt->hai;
+	if (opt->flags & TC_QCN_RP_GD)
+		qp->gd = opt->gd;
+	if (opt->flags & TC_QCN_RP_MIN_RATE)
+		qp->min_rate = opt->min_rate;
+	if (opt->flags & TC_QCN_RP_MIN_RATE_DEC)
+		qp->min_rate_dec = opt->min_rate_dec;
+	if (opt->flags & TC_QCN_RP_JITTER)
+		qp->timer_jitter = opt->timer_jitter;
+	if (opt->flags & TC_QCN_RP_BACKPRESSURE)
+		qp->backpressure = opt->backpressure;
+	if (opt->flags & TC_QCN_RP_EXACT)
+		qp->exact = opt->exact;
+	/* the name only, the owner switches the algorithm itself */
+	if (opt->flags & TC_QCN_RP_ALG)
+		strlcpy(qp->alg, opt->alg[0] ? opt->alg : "qcn",
+			sizeof(qp->alg));
+	if (opt->flags & TC_QCN_RP_ENABLE)
+		qp->enable = opt->enable;
+}
+EXPORT_SYMBOL(qcn_rp_change);
+
+/* CNM reception, counted per CPU (softirq context only) */
+struct qcn_rx_stats {
+	u32	received;
+	u32	delivered;	/* handed to an RP */
+	u32	unmatched;	/* no RP on the device */
+	u32	errors;		/* truncated or malformed */
+};
+
+static DEFINE_PER_CPU(struct qcn_rx_stats, qcn_rx_stats);
+
+/* The device whose RP takes a CNM received on dev. Without the bridge
+   the RP sits on the NIC itself, which the CNM may have left through a
+   VLAN or bonding device on top of it: skb->dev is then the upper
+   device and orig_dev, or the real device of the VLAN, the NIC. */
+static struct net_device *qcn_cnm_rx_dev(struct net_device *dev,
+					 struct net_device *orig_dev)
+{
+	struct net_device *rp_dev = dev;
+
+	rcu_read_lock();
+	if (qcn_fb_dev_registered(dev))
+		goto out;
+	if (orig_dev && orig_dev != dev && qcn_fb_dev_registered(orig_dev)) {
+		rp_dev = orig_dev;
+		goto out;
+	}
+#if defined(CONFIG_VLAN_8021Q) || defined(CONFIG_VLAN_8021Q_MODULE)
+	/* QinQ: a VLAN device on top of another */
+	while (dev->priv_flags & IFF_802_1Q_VLAN) {
+		dev = vlan_dev_real_dev(dev);
+		if (qcn_fb_dev_registered(dev)) {
+			rp_dev = dev;
+			break;
+		}
+	}
+#endif
+out:
+	rcu_read_unlock();
+	return rp_dev;
+}
+
+static int qcn_cnm_rcv(struct sk_buff *skb, struct net_device *dev,
+		       struct packet_type *pt, struct net_device *orig_dev)
+{
+	struct qcn_rx_stats *st = &__get_cpu_var(qcn_rx_stats);
+	int ret;
+
+	st->received++;
+	if ((skb = skb_share_check(skb, GFP_ATOMIC)) == NULL)
+		return NET_RX_DROP;
+
+	ret = qcn_fb_deliver(qcn_cnm_rx_dev(dev, orig_dev), skb);
+	if (ret == -ENOENT)
+		st->unmatched++;
+	else if (ret == -EINVAL)
+		st->errors++;
+	else
+		st->delivered++;
+	consume_skb(skb);
+	return NET_RX_SUCCESS;
+}
+
+static struct packet_type qcn_cnm_packet_types[] __read_mostly = {
+	{
+		.type = __constant_htons(ETH_QCN),
+		.func = qcn_cnm_rcv,
+	},
+	{
+		.type = __constant_htons(ETH_QCN_AGG),
+		.func = qcn_cnm_rcv,
+	},
+	{
+		.type = __constant_htons(ETH_P_CNM),
+		.func = qcn_cnm_rcv,
+	},
+};
+
+static ssize_t qcn_rx_stats_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct qcn_rx_stats sum = { 0 };
+	char tmp[128];
+	int cpu, len;
+
+	for_each_possible_cpu(cpu) {
+		struct qcn_rx_stats *st = &per_cpu(qcn_rx_stats, cpu);
+
+		sum.received += st->received;
+		sum.delivered += st->delivered;
+		sum.unmatched += st->unmatched;
+		sum.errors += st->errors;
+	}
+	len = snprintf(tmp, sizeof(tmp),
+		       "received %u\ndelivered %u\nunmatched %u\nerrors %u\n",
+		       sum.received, sum.delivered, sum.unmatched, sum.errors);
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+static const struct file_operations qcn_rx_stats_fops = {
+	.owner	= THIS_MODULE,
+	.read	= qcn_rx_stats_read,
+};
+
+/* Strips the CN-TAG off received frames and hands them back to the
+   stack, the way the vlan code does for untagged devices. */
+static int qcn_cntag_rcv(struct sk_buff *skb, struct net_device *dev,
+			 struct packet_type *pt, struct net_device *orig_dev)
+{
+	struct qcn_cntag_hdr *tag;
+
+	if ((skb = skb_share_check(skb, GFP_ATOMIC)) == NULL)
+		return NET_RX_DROP;
+	if (!pskb_may_pull(skb, QCN_CNTAG_LEN) ||
+	    skb_cow(skb, 0))
+		goto drop;
+
+	tag = (struct qcn_cntag_hdr *)skb->data;
+	/* A tagged CNM keeps its tag, it carries the flow ID */
+	if (tag->h_encap_proto == htons(ETH_P_CNM))
+		return qcn_cnm_rcv(skb, dev, pt, orig_dev);
+	skb->protocol = tag->h_encap_proto;
+	skb_pull_rcsum(skb, QCN_CNTAG_LEN);
+
+	/* keep eth_hdr() valid for the upper layers */
+	memmove(skb->data - ETH_HLEN, skb->data - ETH_HLEN - QCN_CNTAG_LEN,
+		2 * ETH_ALEN);
+	skb->mac_header += QCN_CNTAG_LEN;
+	skb_reset_network_header(skb);
+
+	return netif_rx(skb);
+drop:
+	kfree_skb(skb);
+	return NET_RX_DROP;
+}
+
+static struct packet_type qcn_cntag_packet_type __read_mostly = {
+	.type = __constant_htons(ETH_P_CNTAG),
+	.func = qcn_cntag_rcv,
+};
+
+/* Hot path benchmark.
+   =======================================
+
+   Writing "DEV PACKETS [FLOWS [SIZE [PRIO [CNM [FB]]]]]" to qcn/bench drives
+   PACKETS synthetic UDP/IPv4 frames of SIZE bytes through the root qdisc
+   of DEV (below mq, the one of the first TX queue), a CP or an RP, the
+   way the stack does: enqueue a batch, then dequeue until the qdisc
+   holds back, all under the root lock. Reading
+   the file gives the cycles spent per packet in each. DEV has to be down,
+   so that nobody else runs the qdisc; a dummy device with rates well
+   above what the CPU can push keeps the shapers out of the way.
+
+   The frames come from FLOWS IPv4 sources (10.0.0.1 up) to 10.1.0.1, so
+   an RP with classify and auto_class spreads them over as many classes.
+   PRIO sets skb->priority: one outside the cnpv of a CP runs it with
+   QCN off. With CNM set they look received on DEV, so a CP that samples
+   them builds and sends CNMs (out of the down device, hence dropped);
+   without, they look locally generated and never get one.
+
+   With FB set, a thread on another CPU hands the RP of DEV one CNM
+   after the other for the bench flows, with Fb 1, through the same
+   path a received one takes, for as long as the run lasts. The run
+   keeps to the CPU it started on. With QCN_FB_DEFER of the RP off the
+   rate state is then written from that other CPU, and the dequeue
+   cycles show what that costs the sender; a min_rate close to the rate
+   keeps the cuts from holding the packets back. */
+
+#define QCN_BENCH_BATCH		64
+
+static DEFINE_MUTEX(qcn_bench_lock);	/* one run at a time */
+static char qcn_bench_result[256];
+
+static struct sk_buff *qcn_bench_skb(struct net_device *dev, unsigned int size,
+									 unsigned int flow, u32 prio, int cnm)
+{
+	struct sk_buff *skb;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+
+	size = max_t(unsigned int, size, ETH_HLEN + sizeof(*iph) +
+				 sizeof(struct udphdr));
+	if ((skb = alloc_skb(size + LL_RESERVED_SPACE(dev), GFP_KERNEL)) == NULL)
+		return NULL;
+	skb_reserve(skb, LL_RESERVED_SPACE(dev));
+	memset(skb_put(skb, size), 0, size);
+
+	skb_reset_mac_header(skb);
+	eth = eth_hdr(skb);
+	memcpy(eth->h_dest, dev->dev_addr, ETH_ALEN);
+	memcpy(eth->h_source, dev->dev_addr, ETH_ALEN);
+	eth->h_source[0] |= 0x02;
+	eth->h_proto = htons(ETH_P_IP);
+
+	skb_set_network_header(skb, ETH_HLEN);
+	iph = ip_hdr(skb);
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->tot_len = htons(size - ETH_HLEN);
+	iph->saddr = htonl(0x0a000001 + flow);
+	iph->daddr = htonl(0x0a010001);
+	ip_send_check(iph);
+	skb_set_transport_header(skb, ETH_HLEN + sizeof(*iph));
+
+	skb->protocol = htons(ETH_P_IP);
+	skb->dev = dev;
+	skb->priority = prio;
+	skb->skb_iif = cnm ? dev->ifindex : 0;
+	return skb;
+}
+
+struct qcn_bench_fb {
+	struct net_device *dev;
+	unsigned int flows;
+	unsigned long sent;
+};
+
+static int qcn_bench_fb_thread(void *arg)
+{
+	struct qcn_bench_fb *fb = arg;
+	struct qcn_frame frame;
+	unsigned int flow = 0;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.DA = htonl(0x0a010001);
+	frame.Fb = htonl(1);
+	while (!kthread_should_stop()) {
+		frame.SA = htonl(0x0a000001 + flow);
+		flow = flow + 1 < fb->flows ? flow + 1 : 0;
+		/* as from the packet handler, in softirq context */
+		local_bh_disable();
+		rcu_read_lock();
+		qcn_fb_recv(dev_net(fb->dev), fb->dev->ifindex, &frame);
+		rcu_read_unlock();
+		local_bh_enable();
+		if (!(++fb->sent % QCN_BENCH_BATCH))
+			cond_resched();
+	}
+	return 0;
+}
+
+static int qcn_bench_run(struct net_device *dev, unsigned int packets,
+						 unsigned int flows, unsigned int size, u32 prio,
+						 int cnm, int feedback)
+{
+	struct sk_buff *batch[QCN_BENCH_BATCH];
+	struct Qdisc *q = netdev_get_tx_queue(dev, 0)->qdisc_sleeping;
+	spinlock_t *root_lock;
+	u64 enq_cycles = 0, deq_cycles = 0, t0, t1;
+	unsigned int sent = 0, enqueued = 0, dequeued = 0, flow = 0, n, i;
+	struct qcn_bench_fb fb = { .dev = dev, .flows = flows };
+	struct task_struct *fb_task = NULL;
+	cpumask_var_t allowed;
+	struct sk_buff *skb;
+	int cpu, err = 0;
+
+	if (q == NULL || q == &noop_qdisc || !q->enqueue)
+		return -ENOENT;
+	root_lock = qdisc_lock(q);
+
+	if (feedback) {
+		if (!alloc_cpumask_var(&allowed, GFP_KERNEL))
+			return -ENOMEM;
+		cpumask_copy(allowed, &current->cpus_allowed);
+		cpu = get_cpu();
+		put_cpu();
+		set_cpus_allowed_ptr(current, cpumask_of(cpu));
+		cpu = cpumask_any_but(cpu_online_mask, cpu);
+		if (cpu >= nr_cpu_ids) {
+			err = -ENODEV;
+			goto out;
+		}
+		fb_task = kthread_create(qcn_bench_fb_thread, &fb, "qcn_bench_fb");
+		if (IS_ERR(fb_task)) {
+			err = PTR_ERR(fb_task);
+			fb_task = NULL;
+			goto out;
+		}
+		kthread_bind(fb_task, cpu);
+		wake_up_process(fb_task);
+	}
+
+	while (sent < packets) {
+		n = min_t(unsigned int, packets - sent, QCN_BENCH_BATCH);
+		for (i = 0; i < n; i++) {
+			batch[i] = qcn_bench_skb(dev, size, flow, prio, cnm);
+			if (batch[i] == NULL) {
+				while (i--)
+					kfree_skb(batch[i]);
+				err = -ENOMEM;
+				goto out;
+			}
+			flow = flow + 1 < flows ? flow + 1 : 0;
+		}
+
+		spin_lock_bh(root_lock);
+		for (i = 0; i < n; i++) {
+			t0 = get_cycles();
+			if (qdisc_enqueue_root(batch[i], q) == NET_XMIT_SUCCESS)
+				enqueued++;
+			t1 = get_cycles();
+			enq_cycles += t1 - t0;
+		}
+		for (;;) {
+			t0 = get_cycles();
+			skb = q->dequeue(q);
+			t1 = get_cycles();
+			if (skb == NULL)
+				break;
+			deq_cycles += t1 - t0;
+			dequeued++;
+			kfree_skb(skb);
+		}
+		spin_unlock_bh(root_lock);
+		sent += n;
+		cond_resched();
+	}
+
+	if (fb_task) {
+		kthread_stop(fb_task);
+		fb_task = NULL;
+	}
+	snprintf(qcn_bench_result, sizeof(qcn_bench_result),
+			 "%s %s packets %u enqueued %u dequeued %u\n"
+			 "enqueue %llu cycles/packet\n"
+			 "dequeue %llu cycles/packet\n"
+			 "feedback %lu cnms\n",
+			 dev->name, q->ops->id, packets, enqueued, dequeued,
+			 div_u64(enq_cycles, packets),
+			 dequeued ? div_u64(deq_cycles, dequeued) : 0ULL, fb.sent);
+out:
+	if (fb_task)
+		kthread_stop(fb_task);
+	if (feedback) {
+		set_cpus_allowed_ptr(current, allowed);
+		free_cpumask_var(allowed);
+	}
+	spin_lock_bh(root_lock);
+	qdisc_reset(q);
+	spin_unlock_bh(root_lock);
+	return err;
+}
+
+static ssize_t qcn_bench_write(struct file *file, const char __user *buf,
+							   size_t count, loff_t *ppos)
+{
+	char cmd[64], name[IFNAMSIZ];
+	unsigned int packets, flows = 1, size = 1514, prio = 0, cnm = 0, fb = 0;
+	struct net_device *dev;
+	int err;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+	if (sscanf(cmd, "%15s %u %u %u %u %u %u", name, &packets, &flows, &size,
+			   &prio, &cnm, &fb) < 2 || packets == 0 || flows == 0)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&qcn_bench_lock))
+		return -ERESTARTSYS;
+	/* RTNL keeps the qdisc and the device state as they are */
+	rtnl_lock();
+	dev = __dev_get_by_name(&init_net, name);
+	if (dev == NULL)
+		err = -ENODEV;
+	else if (dev->flags & IFF_UP)
+		err = -EBUSY;
+	else
+		err = qcn_bench_run(dev, packets, flows, size, prio, cnm, fb);
+	rtnl_unlock();
+	mutex_unlock(&qcn_bench_lock);
+	return err ? err : count;
+}
+
+static ssize_t qcn_bench_read(struct file *file, char __user *buf,
+							  size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&qcn_bench_lock);
+	ret = simple_read_from_buffer(buf, count, ppos, qcn_bench_result,
+								  strlen(qcn_bench_result));
+	mutex_unlock(&qcn_bench_lock);
+	return ret;
+}
+
+static const struct file_operations qcn_bench_fops = {
+	.owner	= THIS_MODULE,
+	.read	= qcn_bench_read,
+	.write	= qcn_bench_write,
+};
+
+static int __init qcn_module_init(void)
+{
+	int err, i;
+
+	err = qcn_trace_init();
+	if (err)
+		return err;
+	err = qcn_telem_init();
+	if (err) {
+		debugfs_remove_recursive(qcn_debugfs_root);
+		qcn_trace_free();
+		return err;
+	}
+	if (qcn_debugfs_root) {
+		debugfs_create_file("rx", 0400, qcn_debugfs_root, NULL,
+				    &qcn_rx_stats_fops);
+		debugfs_create_file("bench", 0600, qcn_debugfs_root, NULL,
+				    &qcn_bench_fops);
+		if (qcn_telem_area)
+			debugfs_create_file("telemetry", 0444, qcn_debugfs_root,
+					    NULL, &qcn_telem_fops);
+	}
+	qcn_events_init();
+	qcn_alg_register(&qcn_alg_dcqcn);
+	for (i = 0; i < ARRAY_SIZE(qcn_cnm_packet_types); i++)
+		dev_add_pack(&qcn_cnm_packet_types[i]);
+	dev_add_pack(&qcn_cntag_packet_type);
+	return 0;
+}
+
+static void __exit qcn_module_exit(void)
+{
+	int i;
+
+	dev_remove_pack(&qcn_cntag_packet_type);
+	for (i = 0; i < ARRAY_SIZE(qcn_cnm_packet_types); i++)
+		dev_remove_pack(&qcn_cnm_packet_types[i]);
+	debugfs_remove_recursive(qcn_debugfs_root);
+	qcn_alg_unregister(&qcn_alg_dcqcn);
+	qcn_events_free();
+	qcn_telem_free();
+	qcn_trace_free();
+}
+module_init(qcn_module_init)
+module_exit(qcn_module_exit)
+MODULE_LICENSE("GPL");
@@ -0,0 +1,633 @@
+/*
+ * qcn_tc.h	tc (rtnetlink) interface of the QCN Congestion and Reaction
+ *		Points. Shared by the kernel modules and qcnctl, so it only
+ *		depends on headers exported to userspace.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _QCN_TC_H
+#define _QCN_TC_H
+
+#include <linux/types.h>
+#include <linux/pkt_sched.h>
+
+#define QCN_NR_PRIO		8	/* 802.1p priorities */
+
+/* Netlink configuration.
+   =======================================
+
+   The module parameters only provide the defaults for new instances.
+   Each CP (tbf, qcnfifo) takes a TCA_TBF_QCN attribute in its
+   TCA_OPTIONS, each RP a TCA_HTB_QCN attribute in the htb qdisc options
+   (applies to the qdisc and all its classes) or in the options of one
+   class. Only the fields named in flags are changed, and a change
+   carrying nothing but this attribute retunes the instance live,
+   without touching its queues. Dumps report every field.
+
+   An RP can classify by itself: a leaf class given a flow (src, dst) owns
+   that IPv4 pair in the flow table the feedback is matched against, and
+   with classify set on the htb qdisc every packet is looked up there
+   before the filters run, so no u32 filter per flow is needed.
+
+   It can also create its classes by itself: with auto_class naming a leaf
+   class, the first packet or CNM of a pair that has no class yet gets a
+   sibling of that class, with its rates, parameters and kind of leaf
+   qdisc, from a pool kept filled in the background. Their minors start
+   at 0x8000. Such a class is deleted again once it has seen neither
+   packets nor feedback for auto_idle ms.
+
+   With backpressure set, a guest sending through a tap (KVM, macvtap)
+   is throttled in the guest instead of queueing in the host: the send
+   buffer of the tap is cut to backpressure us at the class's current
+   rate, so vhost or qemu stop taking its frames off the ring. Turning it
+   off leaves the buffers as they were last set.
+
+   With exact set, an RP also looks at the signs of the qoff and qdelta
+   a CNM carries (see qcn_rp_decrease_exact() in qcn_alg.h): a CP queue
+   that is already shrinking gets half the decrease its Fb asks for,
+   and one below Q_EQ lets the RP start half way into fast recovery.
+
+   A CP samples its queue every mark[Fb / 8] bytes of arrivals. When
+   mark_rate is set, the table is meant for a port of mark_rate bytes/s
+   and each CP stretches it by its own rate over mark_rate (the tbf
+   rate, the device speed for qcnfifo), which keeps the CNMs per second
+   at a given Fb the same at any link speed. mark_rate 0 takes the bytes
+   as they are.
+
+   A CP sees its queue on dequeue too: while a CNM is pending, every
+   departure recomputes Fb and drops the CNM once there is no congestion
+   left to report. With fb_period set, the backlog the derivative is
+   taken against (qlen_old) is refreshed every fb_period us on either
+   side rather than at each sample, so it follows a drain without
+   arrivals.
+
+   With ecn set, a tbf CP signals ECN capable IP packets with CE instead
+   of a CNM: TC_QCN_ECN_SAMPLE marks the sampled packet where a CNM
+   would have gone, TC_QCN_ECN_PROP every ECN capable arrival with
+   probability Fb / 64. CNMs are then left to the traffic that cannot be
+   marked.
+
+   With metric TC_QCN_METRIC_DELAY a tbf CP computes Fb from the time
+   packets spend in its queue instead of its byte backlog: target (us)
+   takes the place of Q_EQ and the change of the sojourn time that of
+   qdelta, so the latency the CP aims at does not move when its rate is
+   changed. The CNM still carries qoff and qdelta in bytes, at the tbf
+   rate. The timestamp lives in the qdisc control block, so the inner
+   qdisc must not use that itself (netem does).
+
+   With heavy set, a CP only sends CNMs to the flows with the most bytes
+   over about the last heavy bytes of traffic (see qcn_hh in qcn.h), so
+   short flows are not cut for congestion they did not cause.
+
+   With flows set, a tbf CP queues below its shaper in that many hashed
+   per flow queues served round robin by bytes (DRR) instead of one
+   bfifo, so a victim flow does not wait behind a culprit's backlog. A
+   full queue then drops from the longest flow, and CNMs only go to
+   flows holding at least their fair share of the backlog. The limit of
+   the tbf is that of all flows together; flows 0 goes back to a bfifo.
+   Changing flows starts over with an empty queue.
+
+   With bulk set, a tbf CP that finds tokens for the head packet goes on
+   taking packets off its queue for as long as the same token check
+   covers them, up to bulk bytes in all, and hands them out on the
+   following dequeues without looking at the clock again. qlen drops by
+   the whole batch at once.
+
+   With exact_rate set, a tbf CP times each packet from its rate, as
+   len / rate in ns to within 2^-31, instead of from the rate table,
+   which holds the time of the 2^cell_log byte cell a length falls in
+   rounded to whole psched ticks; a 1500 byte frame at 40 Gbit/s is
+   under 5 of those. Its bucket then counts ns rather than ticks, and
+   starts full again when exact_rate changes. The table still bounds
+   the largest packet.
+
+   With sojourn set, a tbf CP times every packet from enqueue to leaving
+   its queue and counts the time into per CPU log2 histograms, one per
+   priority, with the buckets of the latency histograms below. The
+   stats dump sums them and gives the 50th and 99th percentiles as the
+   upper bound of the bucket they fall in.
+
+   With aggregate set (htb qdisc, qcningress), an RP keys its flows by
+   the first agg_src bits of the source and agg_dst bits of the
+   destination instead of the whole pair, so e.g. 32/0 has all the
+   flows of one sender share a single class, leaf qdisc and rate
+   limiter, and a CNM for any of them cuts that one rate. 32/32 is one
+   per pair. Classes given a flow keep it under the new key, classes
+   that only learned theirs learn it again from their next packet.
+
+   Where the egress qdisc of a port is not ours to replace, qcningress
+   is an RP on its ingress side instead (parent ffff:fff1, in place of
+   the stock ingress qdisc, whose filters it keeps running). The first
+   CNM for an IPv4 pair gives that pair a policer of its own, which
+   drops what the pair sends above its current rate, from a bucket of
+   burst bytes at rate (so of burst * crate / rate at crate) before
+   the packets reach the bridge; once the pair is back at rate the
+   policer goes again. It takes the TCA_HTB_QCN attribute of an htb for
+   the rate state machine (classify, flow, auto and backpressure do not
+   apply) and a TCA_INGRESS_QCN one for rate, burst and the number of
+   pairs policed at once. The CNMs have to come in through the bridge,
+   from a CP on another host or behind another port.
+
+   qcningress can be a CP as well, for a port whose frames come in
+   faster than the bridge forwards them, e.g. a fast uplink shared by
+   guests: there is no queue to measure before the softnet backlog
+   drops them, so the CP holds a virtual one instead. Every frame let
+   in adds its length, the queue drains at cp_rate, the rate the bridge
+   keeps up with from this port, and never holds more than cp_limit;
+   the CNMs go back out of the port toward the senders. cp_rate 0 (the
+   default) turns it off. The CP takes its parameters in the
+   tc_qcn_cp_opt of a TCA_INGRESS_QCN_CP attribute, as a qcnfifo does
+   (the first priority of prio_mask counts), and cp_rate and cp_limit
+   in TCA_INGRESS_QCN.
+
+   Any CP or RP can run another congestion control algorithm than the
+   802.1Qau one, named in alg (see Algorithms in qcn_alg.h): the CP for
+   how it computes Fb, the RP for how it cuts and recovers its rate.
+   "qcn", or an empty name, is the standard; the qcn module also brings
+   "dcqcn", and other modules can register more. An htb class can run
+   another algorithm than its qdisc, whose one the classes created
+   later start with; a change of the qdisc's sets all of them. A name
+   that is not registered fails the change with ENOENT.
+
+   A tbf CP sees only its own queue, while the ports of a real switch
+   share one packet buffer, so that fan-in congests it sooner than any
+   one port's limit says. With sbuf set, a tbf CP joins the shared
+   buffer domain of that ID, together with every other CP given the
+   same one in its network namespace, e.g. all the ports of a bridge.
+   Each member publishes its backlog to the domain without a lock, and
+   its Q_EQ is capped by a dynamic threshold of sbuf_alpha / 16 of what
+   the sbuf_size bytes of the domain have left free, as switches hand
+   out their buffer, so Fb rises on every member as the domain fills.
+   sbuf_size is the domain's and the last member to set it wins; 0
+   leaves it as it is, and a domain without a size has no threshold.
+   sbuf 0 leaves the domain. The delay metric has no threshold.
+
+   With enable 0 an instance is no CP or RP at all, so the modules can
+   go on every port and QCN only runs where it is wanted: a CP just
+   queues and shapes, sampling nothing and sending no CNMs, and an RP
+   class (or a qcningress) ignores the CNMs for it and is back at its
+   configured rate at once, leaving a stock htb class. Turning a CP on
+   again starts it from its current backlog.
+
+   fb_delay and fb_loss emulate a longer or lossy feedback path without
+   a netem on the reverse path, which would delay the data as well: the
+   CP holds each CNM for fb_delay us before it leaves, and drops
+   fb_loss in a million of them at random instead of sending them.
+   Both only apply to the CNMs built after they were set.
+
+   With a deep TX ring most of the port's queue sits in the driver, and
+   a CP whose qdisc is nearly always empty sees no congestion at all.
+   With ring 1 the queue Fb is computed from, and qoff and qdelta, also
+   hold an estimate of what the driver has not sent yet: the bytes the
+   qdiscs of the device handed down, less those the driver counted as
+   sent in the device's tx_bytes, which the common NIC drivers do as
+   they reclaim descriptors. It is meant for a CP that carries all of
+   the device's traffic, the root qdisc or a tbf below mq; every
+   priority sees the same ring, and the delay metric does not look at
+   it. The estimate is bounded by the ring size the driver reports,
+   and is taken as 0 once the driver has completed nothing for 100ms,
+   so a driver that keeps its counters elsewhere reads as an empty
+   ring after that.
+
+   hw_vf hands the shaping of an htb leaf to the NIC: the TX rate limit
+   of that SR-IOV VF follows the class's crate, so the traffic the VF
+   sends straight to the wire gets the same reaction as the class, at
+   no cost to the host CPU. The limits are set from process context, at
+   most every QCN_HW_INTERVAL ms as crate moves, in whole Mbit/s and no
+   lower than 1. One class per VF; -1 lets the VF go and lifts its
+   limit. The device has to offer VF rate limits (EOPNOTSUPP otherwise),
+   and should the driver refuse a rate, the class is let go and goes on
+   shaping in software only. What passes through the host is shaped by
+   the class as before.
+
+   The attribute types sit well above the ones the kernel defines for
+   the stock qdiscs.
+*/
+
+#define TCA_TBF_QCN		16
+#define TCA_HTB_QCN		16
+#define TCA_INGRESS_QCN		17
+#define TCA_HTB_QCN_FLOWS	18	/* see Bulk provisioning below */
+#define TCA_INGRESS_QCN_CP	19	/* struct tc_qcn_cp_opt */
+
+#define TC_QCN_CP_Q_EQ		0x0001	/* q_eq[] of the prio_mask prios */
+#define TC_QCN_CP_W		0x0002	/* w[] of the prio_mask prios */
+#define TC_QCN_CP_CNPV		0x0004
+#define TC_QCN_CP_JITTER	0x0008
+#define TC_QCN_CP_FORMAT	0x0010
+#define TC_QCN_CP_COALESCE	0x0020
+#define TC_QCN_CP_MIN_INTERVAL	0x0040
+#define TC_QCN_CP_MARK		0x0080	/* mark[] */
+#define TC_QCN_CP_MARK_RATE	0x0100
+
+#define TC_QCN_CP_FB_PERIOD	0x0200
+#define TC_QCN_CP_ECN		0x0400
+#define TC_QCN_CP_METRIC	0x0800
+#define TC_QCN_CP_TARGET	0x1000
+#define TC_QCN_CP_HEAVY		0x2000
+#define TC_QCN_CP_FLOWS		0x4000
+#define TC_QCN_CP_BULK		0x8000
+#define TC_QCN_CP_EXACT_RATE	0x10000
+#define TC_QCN_CP_SOJOURN	0x20000
+#define TC_QCN_CP_ALG		0x40000
+#define TC_QCN_CP_SBUF		0x80000
+#define TC_QCN_CP_SBUF_SIZE	0x100000
+#define TC_QCN_CP_SBUF_ALPHA	0x200000
+#define TC_QCN_CP_ENABLE	0x400000
+#define TC_QCN_CP_FB_DELAY	0x800000
+#define TC_QCN_CP_FB_LOSS	0x1000000
+#define TC_QCN_CP_RING		0x2000000
+
+enum {
+	TC_QCN_ECN_OFF,
+	TC_QCN_ECN_SAMPLE,		/* CE on the sampled packet */
+	TC_QCN_ECN_PROP,		/* CE with probability Fb / 64 */
+};
+
+enum {
+	TC_QCN_METRIC_QLEN,		/* bytes queued against q_eq */
+	TC_QCN_METRIC_DELAY,		/* sojourn time against target */
+};
+
+#define QCN_MARK_STEPS		8	/* sampling table, one per Fb / 8 */
+#define QCN_FB_PERIOD_MAX	1000000	/* us, longest fb_period */
+#define QCN_TARGET_MAX		1000000	/* us, longest target delay */
+#define QCN_FLOWS_MAX		1024	/* flow queues, a power of 2 */
+#define QCN_BULK_MAX		262144	/* bytes per bulk dequeue */
+#define QCN_LAT_BUCKETS		20	/* log2 histograms, see Telemetry */
+#define QCN_ALG_NAME_MAX	16	/* NUL included */
+#define QCN_FB_DELAY_MAX	1000000	/* us, longest fb_delay */
+#define QCN_FB_LOSS_MAX		1000000	/* fb_loss of every CNM */
+
+struct tc_qcn_cp_opt {
+	__u32	flags;			/* TC_QCN_CP_* */
+	__u32	prio_mask;
+	__s32	q_eq[QCN_NR_PRIO];	/* bytes */
+	__s32	w[QCN_NR_PRIO];
+	__u32	cnpv;			/* congestion controlled priorities */
+	__u32	sample_jitter;		/* percent */
+	__u32	cnm_format;		/* 0 private, 1 802.1Qau */
+	__u32	coalesce;		/* CNM coalescing window (us), 0 off */
+	__u32	min_interval;		/* between CNMs to a flow (us), 0 off */
+	__u32	mark[QCN_MARK_STEPS];	/* bytes between samples */
+	__u32	mark_rate;		/* bytes/s mark[] is for, 0 any */
+	__u32	fb_period;		/* us between qlen_old updates, 0 at
+					   each sample */
+	__u32	ecn;			/* TC_QCN_ECN_*, tbf only */
+	__u32	metric;			/* TC_QCN_METRIC_*, tbf only */
+	__u32	target;			/* us, the delay metric's Q_EQ */
+	__u32	heavy;			/* bytes, heavy hitter window, 0 off */
+	__u32	flows;			/* flow queues, 0 one bfifo, tbf only */
+	__u32	bulk;			/* bytes per dequeue batch, 0 off, tbf
+					   only */
+	__u32	exact_rate;		/* 1 times packets from the rate rather
+					   than the rate table, tbf only */
+	__u32	sojourn;		/* 1 keeps sojourn histograms, tbf
+					   only */
+	char	alg[QCN_ALG_NAME_MAX];	/* Fb algorithm, "" the standard */
+	__u32	sbuf;			/* shared buffer domain, 0 none, tbf
+					   only */
+	__u32	sbuf_size;		/* bytes the domain holds */
+	__u32	sbuf_alpha;		/* threshold, 16ths of the free buffer */
+	__u32	enable;			/* 0 no CP, only the queue */
+	__u32	fb_delay;		/* us each CNM is held for, 0 none */
+	__u32	fb_loss;		/* CNMs dropped per million, 0 none */
+	__u32	ring;			/* 1: add what the TX ring holds */
+};
+
+#define TC_QCN_RP_TIMER		0x0001
+#define TC_QCN_RP_FASTREC	0x0002
+#define TC_QCN_RP_BC		0x0004
+#define TC_QCN_RP_AI		0x0008
+#define TC_QCN_RP_HAI		0x0010
+#define TC_QCN_RP_GD		0x0020
+#define TC_QCN_RP_MIN_RATE	0x0040
+#define TC_QCN_RP_MIN_RATE_DEC	0x0080
+#define TC_QCN_RP_JITTER	0x0100
+#define TC_QCN_RP_CLASSIFY	0x0200	/* htb qdisc only */
+#define TC_QCN_RP_FLOW		0x0400	/* htb leaf class only */
+#define TC_QCN_RP_AUTO		0x0800	/* htb qdisc only */
+#define TC_QCN_RP_AUTO_IDLE	0x1000	/* htb qdisc only */
+#define TC_QCN_RP_BACKPRESSURE	0x2000
+#define TC_QCN_RP_EXACT		0x4000
+#define TC_QCN_RP_AGGREGATE	0x8000	/* htb qdisc and qcningress */
+#define TC_QCN_RP_ALG		0x10000
+#define TC_QCN_RP_ENABLE	0x20000
+#define TC_QCN_RP_HW_VF		0x40000	/* htb leaf class only */
+
+#define QCN_TIMER_MIN		10000	/* ns, shortest TIMER accepted */
+#define QCN_HW_VF_MAX		64	/* VFs hw_vf may name */
+
+struct tc_qcn_rp_opt {
+	__u32	flags;			/* TC_QCN_RP_* */
+	__u32	timer;			/* ns, at least QCN_TIMER_MIN */
+	__u32	fastrec;		/* stages */
+	__u32	bc;			/* bytes */
+	__u32	ai;			/* bytes/s */
+	__u32	hai;			/* bytes/s */
+	__u32	gd;			/* Gd = 1 / 2^gd */
+	__u32	min_rate;		/* bytes/s */
+	__u32	min_rate_dec;		/* max decrease 1 / 2^min_rate_dec */
+	__u32	timer_jitter;		/* percent */
+	__u32	classify;		/* 1: flow table before the filters */
+	__be32	flow_src;		/* IPv4 or folded IPv6 pair the class
+					   carries, */
+	__be32	flow_dst;		/* 0/0 lets it go again */
+	__u32	auto_class;		/* classid new RPs copy, 0 off */
+	__u32	auto_idle;		/* ms before an idle one goes, 0 never */
+	__u32	backpressure;		/* us of crate a tap may queue, 0 off */
+	__u32	exact;			/* 1: react to qoff/qdelta as well */
+	__u32	agg_src;		/* prefix lengths of the flow key, */
+	__u32	agg_dst;		/* 32/32 one RP per pair */
+	__u32	flow_scope;		/* of flow_src/dst: outer VID << 12 |
+					   inner VID, 0 untagged, and
+					   QCN_SCOPE_IPV6 */
+	char	alg[QCN_ALG_NAME_MAX];	/* rate algorithm, "" the standard */
+	__u32	enable;			/* 0 no RP, CNMs are ignored */
+	__s32	hw_vf;			/* VF whose TX limit follows crate,
+					   -1 none */
+};
+
+#define QCN_SCOPE_IPV6		0x01000000	/* flow_src/dst fold IPv6
+						   addresses */
+
+#define TC_QCN_INGRESS_RATE	0x0001
+#define TC_QCN_INGRESS_BURST	0x0002
+#define TC_QCN_INGRESS_LIMIT	0x0004
+#define TC_QCN_INGRESS_CP_RATE	0x0008
+#define TC_QCN_INGRESS_CP_LIMIT	0x0010
+
+#define QCN_INGRESS_LIMIT_MAX	65536	/* pairs policed at once */
+
+struct tc_qcn_ingress_opt {
+	__u32	flags;			/* TC_QCN_INGRESS_* */
+	__u32	rate;			/* bytes/s, what a pair recovers to */
+	__u32	burst;			/* bytes at rate */
+	__u32	limit;			/* pairs policed at once */
+	__u32	cp_rate;		/* bytes/s the CP drains at, 0 off */
+	__u32	cp_limit;		/* bytes the CP backlog holds at most */
+};
+
+/* Bulk provisioning.
+   =======================================
+
+   Instead of a tc class, leaf qdisc and flow per RP, an htb qdisc
+   change may carry TCA_HTB_QCN_FLOWS in place of TCA_HTB_QCN: a
+   tc_qcn_rp_flows header and count tc_qcn_rp_flow records, all of
+   which are applied or none is.
+   TC_QCN_FLOWS_ADD makes a leaf below the root of each record, with
+   rate and ceil at rate bytes/s, buffer and cbuffer of burst bytes at
+   that rate (0: one MTU), a pfifo and, unless both are 0, the IPv4 pair
+   src/dst (untagged) as the flow it owns. TC_QCN_FLOWS_DEL deletes the
+   leaves the records name by classid or, with classid 0, by pair; only
+   leaves right below the root that no filter points to and tc does not
+   hold qualify. One message takes TC_QCN_FLOWS_MAX records at most, so that
+   it fits the 64KB of TCA_OPTIONS; "qcnctl flows" sends larger sets in
+   as many messages, each applied on its own.
+*/
+
+#define TC_QCN_FLOWS_ADD	1
+#define TC_QCN_FLOWS_DEL	2
+
+#define TC_QCN_FLOWS_MAX	3072
+
+struct tc_qcn_rp_flows {
+	__u32	op;			/* TC_QCN_FLOWS_* */
+	__u32	count;			/* records that follow */
+};
+
+struct tc_qcn_rp_flow {
+	__u32	classid;
+	__be32	src;
+	__be32	dst;
+	__u32	rate;			/* bytes/s */
+	__u32	burst;			/* bytes at rate */
+};
+
+/* Statistics.
+   =======================================
+
+   The live state of a CP is dumped as the application specific stats
+   (TCA_STATS_APP) of the tbf/qcnfifo qdisc; qcnfifo only fills in
+   priority 0. The live state of an RP is dumped with each htb class and
+   starts with the stock tc_htb_xstats, so tc keeps printing those. The
+   htb qdisc itself reports the feedback that matched no class, and
+   qcningress the sum over the pairs it polices, followed by its CP.
+   Counters wrap, rates are in bytes/s.
+*/
+
+struct tc_qcn_cp_xstats {
+	__u32	qlen[QCN_NR_PRIO];	/* bytes queued by this instance */
+	__u32	fb[QCN_NR_PRIO];	/* last quantized Fb */
+	__s32	sample[QCN_NR_PRIO];	/* bytes until the next sample */
+	__u32	cnm_generated;		/* CNMs built */
+	__u32	cnm_sent;		/* CNMs accepted by the driver */
+	__u32	cnm_failed;		/* not built, ring full or xmit error */
+	__u32	cnm_fallbacks;		/* built outside of the CNM pool */
+	__u32	cnm_coalesced;		/* CNMs that shared a frame */
+	__u32	cnm_suppressed;		/* CNMs held back, flow just notified */
+	__u32	ecn_marked;		/* packets set to CE instead */
+	__u32	delay[QCN_NR_PRIO];	/* us, sojourn of the last departure */
+	__u32	cnm_deferred;		/* CNMs held back from a small flow */
+	__u32	flows_active;		/* flow queues holding packets */
+	__u32	cnm_bypassed;		/* sent past the qdisc backlog */
+	__u32	sojourn_p50[QCN_NR_PRIO];	/* us, 0 without samples */
+	__u32	sojourn_p99[QCN_NR_PRIO];	/* us */
+	__u32	sojourn[QCN_NR_PRIO][QCN_LAT_BUCKETS];
+	__u32	sbuf_qlen;		/* bytes held in the whole domain */
+	__u32	sbuf_thresh;		/* bytes, our dynamic threshold */
+	__u32	cnm_lost;		/* dropped on purpose, fb_loss */
+	__u32	ring;			/* bytes the TX ring holds, estimate */
+};
+
+struct tc_qcn_rp_xstats {
+	struct tc_htb_xstats htb;
+	__u32	crate;			/* current rate */
+	__u32	trate;			/* target rate */
+	__u32	bcount_stg;		/* byte counter stage */
+	__u32	timer_stg;		/* timer stage */
+	__u32	cnm_received;		/* CNMs that lowered the rate */
+	__u32	burst;			/* bytes the buckets hold at crate */
+	__u32	cburst;
+	__u32	rate_est;		/* achieved bytes/s, an EWMA kept by
+					   the dequeue, see QCN_EST_INTERVAL */
+	__u32	pps_est;
+};
+
+struct tc_qcn_rp_qstats {
+	__u32	cnm_unmatched;		/* CNMs for no known class */
+	__u32	auto_classes;		/* classes created by the RP, live */
+	__u32	auto_created;
+	__u32	auto_reclaimed;		/* deleted for being idle */
+	__u32	auto_exhausted;		/* flows left in auto_class, no spare */
+	__u32	cnm_deferred;		/* applied from dequeue */
+	__u32	cnm_overflows;		/* applied on receive, queue full */
+	__u32	hw_bound;		/* classes with a VF, live */
+	__u32	hw_pushed;		/* VF limits set */
+	__u32	hw_failed;		/* refused by the driver */
+	__u32	cntag_gso;		/* GSO frames sent without a CN-TAG */
+};
+
+struct tc_qcn_ingress_xstats {
+	__u32	flows;			/* pairs policed now */
+	__u32	flows_created;
+	__u32	flows_exhausted;	/* CNMs for a new pair over limit */
+	__u32	cnm_received;		/* CNMs that lowered a rate */
+	__u32	cnm_unmatched;		/* no IPv4 pair, or Fb 0 for none */
+	__u32	policed;		/* packets dropped over crate */
+	__u32	crate_min;		/* lowest current rate, 0 none */
+	__u32	cp_overlimits;		/* frames beyond cp_limit */
+	struct tc_qcn_cp_xstats cp;	/* priority 0 only */
+};
+
+/* Telemetry.
+   =======================================
+
+   Every CP priority and every RP class owns one slot of a read-only
+   array userspace maps from <debugfs>/qcn/telemetry; the number of slots
+   is the telemetry_slots parameter of the qcn module. A slot is written
+   in place under a sequence counter: readers copy it and try again when
+   seq was odd or changed meanwhile. Free slots have type 0. CP slots
+   follow every enqueue and dequeue, RP slots every change of the rate
+   state, so the leaf qlen of an RP is the one of its last stage or CNM.
+
+   RP slots also hold two log2 histograms over the CNMs that cut the
+   rate, in units of 1024 ns: bucket 0 counts those under one unit,
+   bucket i those from 2^(i-1) to 2^i units, the last one everything
+   longer. fb_lat runs from the CP deciding on Fb to the RP cutting
+   crate, cnm_delay from the same point to the host of the RP receiving
+   the CNM; what lies between is the wait for deferred processing.
+   Private CNMs carry the time of the CP for this, so the CP and the RP
+   need the same clock, as on one host. Standard CNMs are not counted.
+*/
+
+enum {
+	QCN_TELEM_FREE,
+	QCN_TELEM_CP,			/* tbf/qcnfifo, one slot per prio */
+	QCN_TELEM_RP,			/* htb class */
+};
+
+struct qcn_telem {
+	__u32	seq;			/* odd while the slot is written */
+	__u16	type;			/* QCN_TELEM_* */
+	__u16	prio;			/* CP priority */
+	__u32	ifindex;
+	__u32	handle;			/* CP: qdisc handle, RP: classid */
+	__u32	qlen;			/* CP: bytes, RP: leaf packets */
+	__u32	fb;			/* last quantized Fb */
+	__u32	crate;			/* RP current rate */
+	__u32	trate;			/* RP target rate */
+	__u16	bcount_stg;		/* RP byte counter stage */
+	__u16	timer_stg;		/* RP timer stage */
+	__u32	cnm;			/* CP: CNMs built, RP: received */
+	__u32	cnm_sent;		/* CP only */
+	__u32	cnm_failed;		/* CP only */
+	__u32	pad[4];
+	__u32	fb_lat[QCN_LAT_BUCKETS];	/* RP: Fb decided to crate cut */
+	__u32	cnm_delay[QCN_LAT_BUCKETS];	/* RP: Fb decided to received */
+	__u32	pad2[8];		/* 256 bytes, four cache lines */
+};
+
+/* Rate events.
+   =======================================
+
+   RPs report each cut of their rate by a CNM and each return to the
+   configured rate on the "rate" multicast group of the "qcn" generic
+   netlink family. Events are collected for events_interval ms (a qcn
+   module parameter) and sent as one QCN_CMD_RATE message; at most
+   events_max of them per message, the rest only count as lost. Nothing
+   is collected while the group has no subscribers. The family works in
+   every network namespace, and a subscriber hears the RPs on the
+   devices of its own, with ifindex as that namespace numbers them.
+
+   The same family dumps the state of every RP class of a device far
+   cheaper than tc class show, which takes a netlink message and the
+   qdisc lock per class: a QCN_CMD_RP_DUMP dump request with
+   QCN_ATTR_IFINDEX answers with messages that each pack as many
+   qcn_rp_rec as fit into QCN_ATTR_RPS, and the RP only holds its lock
+   while it fills one of them. A dump resumes where its last message
+   ended, so a class added or deleted meanwhile may be missed or seen
+   twice, and one resize of the class hash can reorder the rest; every
+   other class is reported once. Records are a snapshot of each class,
+   not of the device at one time. events_max 0 turns off the events
+   only, the dump still works.
+*/
+
+#define QCN_GENL_NAME		"qcn"
+#define QCN_GENL_VERSION	1
+#define QCN_GENL_MCGRP_RATE	"rate"
+
+enum {
+	QCN_CMD_UNSPEC,
+	QCN_CMD_RATE,			/* a batch of events, to userspace */
+	QCN_CMD_RP_DUMP,		/* RP class state, dump only */
+};
+
+enum {
+	QCN_ATTR_UNSPEC,
+	QCN_ATTR_EVENTS,		/* struct qcn_rate_event[] */
+	QCN_ATTR_LOST,			/* __u32, since the last batch */
+	QCN_ATTR_IFINDEX,		/* __u32, the device to dump */
+	QCN_ATTR_RPS,			/* struct qcn_rp_rec[] */
+	__QCN_ATTR_MAX,
+};
+#define QCN_ATTR_MAX	(__QCN_ATTR_MAX - 1)
+
+enum {
+	QCN_RATE_CUT = 1,		/* a CNM lowered crate */
+	QCN_RATE_RESTORED,		/* crate is back at the rate */
+};
+
+struct qcn_rate_event {
+	__u64	ns;			/* CLOCK_MONOTONIC */
+	__u32	ifindex;
+	__u32	handle;			/* htb: classid, qcningress: qdisc */
+	__be32	src;			/* flow key, 0 if not known */
+	__be32	dst;
+	__u32	old_crate;
+	__u32	crate;
+	__u32	trate;
+	__u32	fb;			/* quantized Fb, 0 if RESTORED */
+	__u16	type;			/* QCN_RATE_* */
+	__u16	bcount_stg;
+	__u16	timer_stg;
+	__u16	pad;
+};
+
+struct qcn_rp_rec {
+	__u32	handle;			/* htb: classid */
+	__s32	queue;			/* TX queue of the RP, -1 all */
+	__u32	crate;
+	__u32	trate;
+	__u64	bytes;			/* sent by the class */
+	__u32	packets;
+	__u32	drops;
+	__u32	cnm_received;
+	__u16	bcount_stg;
+	__u16	timer_stg;
+};
+
+/* Bridge port counters.
+   =======================================
+
+   The bridge sends the sums of its per port counters in every
+   RTM_NEWLINK message about a port, as one IFLA_BRPORT_XSTATS
+   attribute. The attribute type sits well above the IFLA_ ones of the
+   kernels the bridge is built for.
+*/
+
+#define IFLA_BRPORT_XSTATS	64
+
+struct br_port_xstats {
+	__u64	forwarded;		/* to one port */
+	__u64	flooded;		/* to all or a group */
+	__u64	dropped;
+	__u64	cnm_intercepted;
+	__u64	cnm_delivered;		/* to the local RP */
+};
+
+#endif /* _QCN_TC_H */
@@ -1,6 +1,13 @@
 /*
  * net/sched/sch_fifo.c	The simplest FIFO queue.
  *
+ *		This copy is a byte FIFO with the QCN Congestion Point built
+ *		in, registered as "qcnfifo" next to the kernel's own fifos.
+ *		It can be used wherever a bfifo can, e.g. as the leaf of
+ *		prio, htb or mq, on ports that need no TBF shaping. The CP
+ *		itself is struct qcn_cp of qcn_core.c, which any other qdisc
+ *		can run the same way.
+ *
  *		This program is free software; you can redistribute it and/or
  *		modify it under the terms of the GNU General Public License
  *		as published by the Free Software Foundation; either version
@@ -10,21 +17,76 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/skbuff.h>
+#include <linux/ethtool.h>
+#include <net/netlink.h>
 #include <net/pkt_sched.h>
 
-#include <linux/ip.h>
-#include <linux/if_ether.h>
-#include <asm/msr.h>
-
-#define ETH_QCN                 0xA9A9
+#include "qcn.h"
 
 static int QCN_Q_EQ __read_mostly = 34000; /* 34KB */
 static int QCN_W    __read_mostly = 2;
+static int QCN_SAMPLE_JITTER __read_mostly = 15; /* +/- 15% */
+static int QCN_CNM_COALESCE __read_mostly = 0; /* us, 0: off */
+static int QCN_CNM_MIN_INTERVAL __read_mostly = 0; /* us, 0: off */
+static int QCN_MARK_RATE __read_mostly = 0; /* bytes/s, 0: any */
+static int QCN_FB_PERIOD __read_mostly = 0; /* us, 0: per sample */
+static int QCN_HEAVY __read_mostly = 0; /* bytes, 0: off */
+static int QCN_ENABLE __read_mostly = 1; /* 0: a plain bfifo */
+static int QCN_FB_DELAY __read_mostly = 0; /* us, 0: none */
+static int QCN_FB_LOSS __read_mostly = 0; /* per million, 0: none */
+static int QCN_RING __read_mostly = 0; /* 1: add the TX ring estimate */
+
+module_param    (QCN_Q_EQ, int, 0640);
+MODULE_PARM_DESC(QCN_Q_EQ, "QCN Congestion Point, parameter Q_EQ");
+
+module_param    (QCN_W, int, 0640);
+MODULE_PARM_DESC(QCN_W, "QCN Congestion Point, parameter W");
+
+module_param    (QCN_SAMPLE_JITTER, int, 0640);
+MODULE_PARM_DESC(QCN_SAMPLE_JITTER, "QCN Congestion Point, sampling interval "
+				 "randomization (percent), default 15");
+
+module_param    (QCN_CNM_COALESCE, int, 0640);
+MODULE_PARM_DESC(QCN_CNM_COALESCE, "QCN Congestion Point, CNM coalescing "
+				 "window (us), default 0 (off)");
+
+module_param    (QCN_CNM_MIN_INTERVAL, int, 0640);
+MODULE_PARM_DESC(QCN_CNM_MIN_INTERVAL, "QCN Congestion Point, minimum "
+				 "interval between CNMs to a flow (us), default 0 (off)");
+
+module_param    (QCN_MARK_RATE, int, 0640);
+MODULE_PARM_DESC(QCN_MARK_RATE, "QCN Congestion Point, rate the sampling "
+				 "table is for (bytes/s), default 0 (any)");
+
+module_param    (QCN_FB_PERIOD, int, 0640);
+MODULE_PARM_DESC(QCN_FB_PERIOD, "QCN Congestion Point, period of the queue "
+				 "derivative (us), default 0 (per sample)");
+
+module_param    (QCN_HEAVY, int, 0640);
+MODULE_PARM_DESC(QCN_HEAVY, "QCN Congestion Point, send CNMs to the largest "
+				 "flows of this many bytes only, default 0 (off)");
+
+module_param    (QCN_ENABLE, int, 0640);
+MODULE_PARM_DESC(QCN_ENABLE, "QCN Congestion Point, run the CP on a new "
+				 "qcnfifo, default 1; 0 leaves a plain bfifo");
+
+module_param    (QCN_FB_DELAY, int, 0640);
+MODULE_PARM_DESC(QCN_FB_DELAY, "QCN Congestion Point, us each CNM is held "
+				 "before it is sent, default 0 (none)");
+
+module_param    (QCN_FB_LOSS, int, 0640);
+MODULE_PARM_DESC(QCN_FB_LOSS, "QCN Congestion Point, CNMs dropped per "
+				 "million at random, default 0 (none)");
+
+module_param    (QCN_RING, int, 0640);
+MODULE_PARM_DESC(QCN_RING, "QCN Congestion Point, add the bytes estimated "
+				 "in the driver's TX ring to the queue, default 0");
 
 /* 1 band FIFO pseudo-"scheduler" */
 
@@ -32,347 +94,255 @@ struct fifo_sched_data
 {
 	u32 limit;
 
-	/* QCN Variables */
-	int qcn_qlen;				/* QCN Queue length */
-	int qcn_qlen_old;			/* QCN Queue length at the time we
-								   sent the last Fb */
-	int sample;
-	u32 generate_fb_frame;
-};
-
-struct qcn_frame {
-	u32 DA;
-	u32 SA;
-	u32 Fb;
-	int qoff;
-	int qdelta;
+	/* The queue length is the byte backlog, which qdisc_enqueue_tail()
+	   and friends keep in sch->qstats.backlog */
+	struct qcn_cp cp;
 };
 
-static inline void qcn_init(struct fifo_sched_data *q)
+/* Device speed as the driver reports it; called under RTNL */
+static u64 fifo_link_rate(struct net_device *dev)
 {
-	q->qcn_qlen = 0;
-	q->qcn_qlen_old = 0;
-	q->sample = 153600;
-	q->generate_fb_frame = 0;
-}
-
-static inline int qcn_mark_table(u32 qntz_Fb) {
-	switch (qntz_Fb >> 3) {
-	case 0: return 153600;
-	case 1:	return 76800;
-	case 2:	return 51200;
-	case 3:	return 38400;
-	case 4:	return 30720;
-	case 5: return 25600;
-	case 6: return 22016;
-	case 7: return 18944;
-	}
-	return 153600;
-}
-
-static struct sk_buff *qcnskb_create(struct sk_buff *skb, 
-									 struct qcn_frame *frame)
-{
-	struct ethhdr *ethh;
-	struct sk_buff *qcnskb;
-	struct net_device *indev;
-
-	memcpy(&indev, &skb->cb[24], sizeof(struct net_device *));
-	if (strlen(indev->name) != 4) {
-		printk("QCN err: qcnskb_create, indev->name size != 4");
-		return NULL;
-	}
+	struct ethtool_cmd ecmd = { .cmd = ETHTOOL_GSET };
 
-	/* Initialization */
-	if ((qcnskb = alloc_skb(64, GFP_ATOMIC)) == NULL)
-		return NULL;	
-	qcnskb->sk = NULL;
-	qcnskb->pkt_type = PACKET_OTHERHOST;
-	/* checksum: we dont need any checksum */
-	qcnskb->ip_summed = CHECKSUM_NONE;
-
-	/* eth */
-	ethh = eth_hdr(skb);
-	memcpy(skb_put(qcnskb, ETH_ALEN),ethh->h_source, ETH_ALEN);
-	memcpy(skb_put(qcnskb, ETH_ALEN),ethh->h_dest, ETH_ALEN);
-	*((__be16 *)skb_put(qcnskb, 2)) = htons(ETH_QCN);
-	/* qcn */
-	memcpy(skb_put(qcnskb, sizeof(struct qcn_frame)),
-		   frame,
-		   sizeof(struct qcn_frame));
-	memcpy(&qcnskb->dev, &skb->cb[24], sizeof(struct net_device *));	
-
-	return qcnskb;
+	if (!dev->ethtool_ops || !dev->ethtool_ops->get_settings ||
+		dev->ethtool_ops->get_settings(dev, &ecmd) ||
+		ecmd.speed == 0 || ecmd.speed == (u16)-1)
+		return 0;
+	return (u64)ecmd.speed * 125000;	/* Mbit/s */
 }
 
-static inline void qcn_algorithm(struct Qdisc* sch, struct fifo_sched_data *q,
-								 struct sk_buff *skb, unsigned int len)
+/* Module parameters are the defaults of a new CP */
+static void fifo_params_init(struct tc_qcn_cp_opt *def)
 {
-	struct sk_buff *qcnskb;		/* QCN Congestion Message skb */
-	struct qcn_frame frame;
-	struct iphdr *iph;
-	u32 qntz_Fb, qntz_Fb_sent;
-	int Fb;
-	u64 tsc64;
-
-	q->qcn_qlen += len;
-	
-	Fb = (QCN_Q_EQ - q->qcn_qlen) - QCN_W * (q->qcn_qlen - q->qcn_qlen_old);
-	if (Fb < -QCN_Q_EQ * (2 * QCN_W +1)) {
-		Fb = -QCN_Q_EQ * (2 * QCN_W +1);
-	}
-	else if (Fb > 0)
-		Fb = 0;
-	
-	/* The maximum value of -Fb determines the number of bits that Fb
-	   uses. Uniform quantization of -Fb, qntz_Fb, uses most
-	   significant bits of -Fb. Note that now qntz_Fb has positive
-	   values.  If Q_EQ = 32KB, W = 2, qcn_qlen = 160KB then the maximum
-	   value for -Fb is 457728, which can be represented using 19bits
-	   (110 1111 1100 0000 0000). To get the 6 most significant bits
-	   --- considering that -Fb will use at most 19 bits ---, we need
-	   to discard the 13 least significant bits (>> 13).
-	*/
-	qntz_Fb = 0x3F & (((u32) -Fb) >> 13);
-	
-	q->sample -= len;
-	if (q->sample < 0) {
-		if (qntz_Fb > 0) {
-			q->generate_fb_frame = 1;
-		}
-		q->qcn_qlen_old = q->qcn_qlen;
-		/* TODO: random sampling */
-		q->sample = qcn_mark_table(qntz_Fb);
-	}
-	
-	if (q->generate_fb_frame && skb && skb->network_header &&
-		(skb->protocol == __constant_htons(ETH_P_IP))) {
-		/* Since we are using IP addresses, we cant sample non-IP
-		   packets. */
-		
-		/* Filling the qcn_frame structure */
-		memset(&frame, 0, sizeof(struct qcn_frame));
-		iph = ip_hdr(skb);
-		frame.DA = iph->daddr;	/* Already in network byte order */
-		frame.SA = iph->saddr;	/* Already in network byte order */
-		frame.Fb = htonl(qntz_Fb);
-		frame.qoff = htonl(QCN_Q_EQ - q->qcn_qlen);
-		frame.qdelta = htonl(q->qcn_qlen - q->qcn_qlen_old);
-
-		if ((qcnskb = qcnskb_create(skb, &frame)) == NULL)
-			printk (KERN_ALERT "QCN err: qcnskb_create");
-		else if (dev_queue_xmit(qcnskb) != NET_XMIT_SUCCESS)
-			printk(KERN_ALERT "QCN err: dev_queue_xmit");
-		else {
-			q->generate_fb_frame = 0;
-			qntz_Fb_sent = qntz_Fb;
-		}
-	}
-	/* End QCN Algorithm */
-	else
-		qntz_Fb_sent = 0;
-
-	rdtscll(tsc64);
-	printk(KERN_INFO "%llu %s: QLEN %d Fb %u",
-		   tsc64, sch->dev_queue->dev->name, q->qcn_qlen, qntz_Fb_sent);
-
+	static const u32 mark[QCN_MARK_STEPS] = QCN_MARK_DEFAULT;
+
+	memset(def, 0, sizeof(*def));
+	def->flags = TC_QCN_CP_Q_EQ | TC_QCN_CP_W | TC_QCN_CP_JITTER |
+		TC_QCN_CP_COALESCE | TC_QCN_CP_MIN_INTERVAL | TC_QCN_CP_MARK |
+		TC_QCN_CP_MARK_RATE | TC_QCN_CP_FB_PERIOD | TC_QCN_CP_HEAVY |
+		TC_QCN_CP_ENABLE | TC_QCN_CP_FB_DELAY | TC_QCN_CP_FB_LOSS |
+		TC_QCN_CP_RING;
+	def->prio_mask = 1;
+	def->q_eq[0] = QCN_Q_EQ;
+	def->w[0] = QCN_W;
+	def->sample_jitter = QCN_SAMPLE_JITTER;
+	def->coalesce = QCN_CNM_COALESCE;
+	def->min_interval = QCN_CNM_MIN_INTERVAL;
+	memcpy(def->mark, mark, sizeof(def->mark));
+	def->mark_rate = QCN_MARK_RATE;
+	def->fb_period = QCN_FB_PERIOD;
+	def->heavy = QCN_HEAVY;
+	def->enable = QCN_ENABLE ? 1 : 0;
+	def->fb_delay = clamp(QCN_FB_DELAY, 0, QCN_FB_DELAY_MAX);
+	def->fb_loss = clamp(QCN_FB_LOSS, 0, QCN_FB_LOSS_MAX);
+	def->ring = QCN_RING ? 1 : 0;
 }
 
 static int bfifo_enqueue(struct sk_buff *skb, struct Qdisc* sch)
 {
 	struct fifo_sched_data *q = qdisc_priv(sch);
+	unsigned int len = qdisc_pkt_len(skb);
 	int ret;
 
-	if (likely(sch->qstats.backlog + qdisc_pkt_len(skb) <= q->limit)) {
-		if ((ret = qdisc_enqueue_tail(skb, sch)) == 0) {}
-			/* qcn_algorithm(sch, q, skb, qdisc_pkt_len(skb)); */
+	if (likely(sch->qstats.backlog + len <= q->limit)) {
+		if ((ret = qdisc_enqueue_tail(skb, sch)) == NET_XMIT_SUCCESS &&
+			likely(q->cp.enable))
+			qcn_cp_enqueue(&q->cp, skb, len, sch->qstats.backlog);
 		return ret;
 	}
 
 	return qdisc_reshape_fail(skb, sch);
 }
 
-static void bfifo_reset_queue(struct Qdisc *sch)
+static struct sk_buff *bfifo_dequeue(struct Qdisc *sch)
 {
-	qcn_init(qdisc_priv(sch));
-	qdisc_reset_queue(sch);
+	struct fifo_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb = qdisc_dequeue_head(sch);
+
+	if (skb && likely(q->cp.enable))
+		qcn_cp_dequeue(&q->cp, sch->qstats.backlog);
+	return skb;
 }
 
 static unsigned int bfifo_drop(struct Qdisc *sch)
 {
 	struct fifo_sched_data *q = qdisc_priv(sch);
-	unsigned int len = 0;
+	unsigned int len = qdisc_queue_drop(sch);
 
-	if ((len = qdisc_queue_drop(sch)) != 0)
-		q->qcn_qlen -= len;
+	if (len && likely(q->cp.enable))
+		qcn_cp_update(&q->cp, sch->qstats.backlog);
 	return len;
 }
 
-static struct sk_buff *bfifo_dequeue(struct Qdisc *sch)
+static void bfifo_reset_queue(struct Qdisc *sch)
 {
 	struct fifo_sched_data *q = qdisc_priv(sch);
-	struct sk_buff *skb = qdisc_peek_head(sch);
 
-	if (skb) {
-		unsigned int len = qdisc_pkt_len(skb);
-		q->qcn_qlen -= len;
-		return skb;
-	}
-	return NULL;
+	qdisc_reset_queue(sch);
+	qcn_cp_reset(&q->cp);
 }
 
+/* Besides the plain tc_fifo_qopt of the stock bfifo, qcnfifo takes
+   nested options: TCA_QCNFIFO_PARMS and the TCA_TBF_QCN retuning
+   attribute of the tbf CP (only the first priority of prio_mask is
+   looked at, there is a single congestion point). */
+enum {
+	TCA_QCNFIFO_UNSPEC,
+	TCA_QCNFIFO_PARMS,		/* struct tc_fifo_qopt */
+};
 
-static int pfifo_enqueue(struct sk_buff *skb, struct Qdisc* sch)
-{
-	struct fifo_sched_data *q = qdisc_priv(sch);
-
-	if (likely(skb_queue_len(&sch->q) < q->limit))
-		return qdisc_enqueue_tail(skb, sch);
-
-	return qdisc_reshape_fail(skb, sch);
-}
+static const struct nla_policy fifo_policy[TCA_TBF_QCN + 1] = {
+	[TCA_QCNFIFO_PARMS]	= { .len = sizeof(struct tc_fifo_qopt) },
+	[TCA_TBF_QCN]		= { .len = sizeof(struct tc_qcn_cp_opt) },
+};
 
-static int pfifo_tail_enqueue(struct sk_buff *skb, struct Qdisc* sch)
+static int fifo_change_qcn(struct Qdisc *sch, struct tc_qcn_cp_opt *qopt)
 {
-	struct sk_buff *skb_head;
 	struct fifo_sched_data *q = qdisc_priv(sch);
-
-	if (likely(skb_queue_len(&sch->q) < q->limit))
-		return qdisc_enqueue_tail(skb, sch);
-
-	/* queue full, remove one skb to fulfill the limit */
-	skb_head = qdisc_dequeue_head(sch);
-	sch->bstats.bytes -= qdisc_pkt_len(skb_head);
-	sch->bstats.packets--;
-	sch->qstats.drops++;
-	kfree_skb(skb_head);
-
-	qdisc_enqueue_tail(skb, sch);
-
-	return NET_XMIT_CN;
+	const struct qcn_alg_ops *alg = NULL;
+	int err, set_alg;
+
+	if ((err = qcn_cp_check(qopt)) != 0 ||
+		(err = set_alg = qcn_alg_opt_get(qopt->flags, TC_QCN_CP_ALG,
+										 qopt->alg, &alg)) < 0)
+		return err;
+
+	sch_tree_lock(sch);
+	qcn_cp_change(&q->cp, qopt);
+	if (set_alg)
+		qcn_cp_set_alg(&q->cp, alg);
+	sch_tree_unlock(sch);
+	return 0;
 }
 
 static int fifo_init(struct Qdisc *sch, struct nlattr *opt)
 {
 	struct fifo_sched_data *q = qdisc_priv(sch);
+	struct nlattr *tb[TCA_TBF_QCN + 1];
+	struct tc_fifo_qopt *ctl = NULL;
+	int err;
 
 	if (opt == NULL) {
 		u32 limit = qdisc_dev(sch)->tx_queue_len ? : 1;
 
-		if (sch->ops == &bfifo_qdisc_ops)
-			limit *= psched_mtu(qdisc_dev(sch));
+		limit *= psched_mtu(qdisc_dev(sch));
 
 		q->limit = limit;
-	} else {
-		struct tc_fifo_qopt *ctl = nla_data(opt);
+		qcn_cp_set_limit(&q->cp, limit);
+		return 0;
+	}
 
-		if (nla_len(opt) < sizeof(*ctl))
-			return -EINVAL;
+	if (nla_len(opt) == sizeof(*ctl)) {
+		ctl = nla_data(opt);
+	} else {
+		err = nla_parse_nested(tb, TCA_TBF_QCN, opt, fifo_policy);
+		if (err < 0)
+			return err;
+		if (tb[TCA_TBF_QCN] &&
+			(err = fifo_change_qcn(sch, nla_data(tb[TCA_TBF_QCN]))) != 0)
+			return err;
+		if (tb[TCA_QCNFIFO_PARMS])
+			ctl = nla_data(tb[TCA_QCNFIFO_PARMS]);
+	}
 
+	if (ctl) {
+		sch_tree_lock(sch);
 		q->limit = ctl->limit;
+		qcn_cp_set_limit(&q->cp, ctl->limit);
+		sch_tree_unlock(sch);
 	}
-	/* Initializing QCN CP Variables */
-	qcn_init(q);
-	printk(KERN_INFO "%s: init", sch->dev_queue->dev->name);
-
 	return 0;
 }
 
+static int bfifo_init(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct fifo_sched_data *q = qdisc_priv(sch);
+	struct tc_qcn_cp_opt def;
+	int err;
+
+	fifo_params_init(&def);
+	err = qcn_cp_init(&q->cp, sch, 0, &def, fifo_link_rate(qdisc_dev(sch)));
+	if (err)
+		return err;
+	printk(KERN_INFO "%s: init\n", sch->dev_queue->dev->name);
+
+	/* Options without a limit still get the default one */
+	if (opt != NULL)
+		fifo_init(sch, NULL);
+	err = fifo_init(sch, opt);
+	if (err)
+		qcn_cp_destroy(&q->cp);
+	return err;
+}
+
+static void bfifo_destroy(struct Qdisc *sch)
+{
+	struct fifo_sched_data *q = qdisc_priv(sch);
+
+	qcn_cp_destroy(&q->cp);
+}
+
 static int fifo_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
 	struct fifo_sched_data *q = qdisc_priv(sch);
 	struct tc_fifo_qopt opt = { .limit = q->limit };
+	struct tc_qcn_cp_opt qcnopt;
+	struct nlattr *nest;
+
+	nest = nla_nest_start(skb, TCA_OPTIONS);
+	if (nest == NULL)
+		goto nla_put_failure;
+	if (nla_put(skb, TCA_QCNFIFO_PARMS, sizeof(opt), &opt))
+		goto nla_put_failure;
+
+	qcn_cp_dump(&q->cp, &qcnopt);
+	if (nla_put(skb, TCA_TBF_QCN, sizeof(qcnopt), &qcnopt))
+		goto nla_put_failure;
 
-	NLA_PUT(skb, TCA_OPTIONS, sizeof(opt), &opt);
+	nla_nest_end(skb, nest);
 	return skb->len;
 
 nla_put_failure:
+	nla_nest_cancel(skb, nest);
 	return -1;
 }
 
-struct Qdisc_ops pfifo_qdisc_ops __read_mostly = {
-	.id		=	"pfifo",
-	.priv_size	=	sizeof(struct fifo_sched_data),
-	.enqueue	=	pfifo_enqueue,
-	.dequeue	=	qdisc_dequeue_head,
-	.peek		=	qdisc_peek_head,
-	.drop		=	qdisc_queue_drop,
-	.init		=	fifo_init,
-	.reset		=	qdisc_reset_queue,
-	.change		=	fifo_init,
-	.dump		=	fifo_dump,
-	.owner		=	THIS_MODULE,
-};
-EXPORT_SYMBOL(pfifo_qdisc_ops);
+static int fifo_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct fifo_sched_data *q = qdisc_priv(sch);
+	struct tc_qcn_cp_xstats st;
+
+	memset(&st, 0, sizeof(st));
+	qcn_cp_stats(&q->cp, &st);
+
+	return gnet_stats_copy_app(d, &st, sizeof(st));
+}
 
-struct Qdisc_ops bfifo_qdisc_ops __read_mostly = {
-	.id		=	"bfifo",
+static struct Qdisc_ops bfifo_qdisc_ops __read_mostly = {
+	.id		=	"qcnfifo",
 	.priv_size	=	sizeof(struct fifo_sched_data),
 	.enqueue	=	bfifo_enqueue,
-	.dequeue    =   bfifo_dequeue,
+	.dequeue	=	bfifo_dequeue,
 	.peek		=	qdisc_peek_head,
 	.drop		=	bfifo_drop,
-	.init		=	fifo_init,
+	.init		=	bfifo_init,
 	.reset		=	bfifo_reset_queue,
+	.destroy	=	bfifo_destroy,
 	.change		=	fifo_init,
 	.dump		=	fifo_dump,
-	.owner		=	THIS_MODULE,
-};
-EXPORT_SYMBOL(bfifo_qdisc_ops);
-
-struct Qdisc_ops pfifo_head_drop_qdisc_ops __read_mostly = {
-	.id		=	"pfifo_head_drop",
-	.priv_size	=	sizeof(struct fifo_sched_data),
-	.enqueue	=	pfifo_tail_enqueue,
-	.dequeue	=	qdisc_dequeue_head,
-	.peek		=	qdisc_peek_head,
-	.drop		=	qdisc_queue_drop_head,
-	.init		=	fifo_init,
-	.reset		=	qdisc_reset_queue,
-	.change		=	fifo_init,
-	.dump		=	fifo_dump,
+	.dump_stats	=	fifo_dump_stats,
 	.owner		=	THIS_MODULE,
 };
 
-/* Pass size change message down to embedded FIFO */
-int fifo_set_limit(struct Qdisc *q, unsigned int limit)
+static int __init fifo_module_init(void)
 {
-	struct nlattr *nla;
-	int ret = -ENOMEM;
-
-	/* Hack to avoid sending change message to non-FIFO */
-	if (strncmp(q->ops->id + 1, "fifo", 4) != 0)
-		return 0;
-
-	nla = kmalloc(nla_attr_size(sizeof(struct tc_fifo_qopt)), GFP_KERNEL);
-	if (nla) {
-		nla->nla_type = RTM_NEWQDISC;
-		nla->nla_len = nla_attr_size(sizeof(struct tc_fifo_qopt));
-		((struct tc_fifo_qopt *)nla_data(nla))->limit = limit;
-
-		ret = q->ops->change(q, nla);
-		kfree(nla);
-	}
-	return ret;
+	return register_qdisc(&bfifo_qdisc_ops);
 }
-EXPORT_SYMBOL(fifo_set_limit);
 
-struct Qdisc *fifo_create_dflt(struct Qdisc *sch, struct Qdisc_ops *ops,
-			       unsigned int limit)
+static void __exit fifo_module_exit(void)
 {
-	struct Qdisc *q;
-	int err = -ENOMEM;
-
-	q = qdisc_create_dflt(qdisc_dev(sch), sch->dev_queue,
-			      ops, TC_H_MAKE(sch->handle, 1));
-	if (q) {
-		err = fifo_set_limit(q, limit);
-		if (err < 0) {
-			qdisc_destroy(q);
-			q = NULL;
-		}
-	}
-
-	return q ? : ERR_PTR(err);
+	unregister_qdisc(&bfifo_qdisc_ops);
 }
-EXPORT_SYMBOL(fifo_create_dflt);
+module_init(fifo_module_init)
+module_exit(fifo_module_exit)
+MODULE_LICENSE("GPL");
@@ -35,13 +35,29 @@
 #include <linux/list.h>
 #include <linux/compiler.h>
 #include <linux/rbtree.h>
+#include <linux/bitmap.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/math64.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist_nulls.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/random.h>
+#include <linux/rtnetlink.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
+#include <net/sock.h>
 
 #include <linux/ip.h>
-#include <asm/msr.h>
+#include <linux/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/timex.h>
+
+#include "qcn.h"
 
 /* QCN Parameters (rates are always in bytes/sec) */
 
@@ -61,11 +77,21 @@ static int QCN_GD       __read_mostly = 7;
 static int QCN_MIN_RATE __read_mostly = 524288;
 /* #define QCN_MIN_RATE_DEC   1		 /\* = 1/2 *\/ */
 static int QCN_MIN_RATE_DEC __read_mostly = 1;
+static int QCN_TIMER_JITTER __read_mostly = 15; /* +/- 15% */
+static int QCN_BACKPRESSURE __read_mostly = 0; /* us, 0 off */
+static int QCN_EXACT __read_mostly = 0;
+static int QCN_ENABLE __read_mostly = 1;
+/* Finer grained TIMER for fast links, overrides QCN_TIMER if set */
+static int QCN_TIMER_US __read_mostly = 0;
 
 module_param    (QCN_TIMER, int, 0640);
 MODULE_PARM_DESC(QCN_TIMER, "QCN Reaction Point, parameter TIMER (ms), "
 				 "default 25");
 
+module_param    (QCN_TIMER_US, int, 0640);
+MODULE_PARM_DESC(QCN_TIMER_US, "QCN Reaction Point, parameter TIMER (us), "
+				 "overrides QCN_TIMER if not 0, default 0");
+
 module_param    (QCN_FASTREC, int, 0640);
 MODULE_PARM_DESC(QCN_FASTREC, "QCN Reaction Point, parameter FASTREC (stages), "
 				 "default 5");
@@ -94,6 +120,22 @@ module_param    (QCN_MIN_RATE_DEC, int, 0640);
 MODULE_PARM_DESC(QCN_MIN_RATE_DEC, "QCN Reaction Point, parameter "
 				 "MIN_RATE_DEC, default 1");
 
+module_param    (QCN_TIMER_JITTER, int, 0640);
+MODULE_PARM_DESC(QCN_TIMER_JITTER, "QCN Reaction Point, TIMER period "
+				 "randomization (percent), default 15");
+
+module_param    (QCN_BACKPRESSURE, int, 0640);
+MODULE_PARM_DESC(QCN_BACKPRESSURE, "QCN Reaction Point, us of the current "
+				 "rate a guest's tap may have queued, default 0 (off)");
+
+module_param    (QCN_EXACT, int, 0640);
+MODULE_PARM_DESC(QCN_EXACT, "QCN Reaction Point, also react to the qoff and "
+				 "qdelta of a CNM, default 0 (off)");
+
+module_param    (QCN_ENABLE, int, 0640);
+MODULE_PARM_DESC(QCN_ENABLE, "QCN Reaction Point, run the RP on new htb "
+				 "classes, default 1; 0 leaves stock classes");
+
 /* HTB algorithm.
     Author: devik@cdi.cz
     ========================================================================
@@ -118,6 +160,70 @@ static int htb_hysteresis __read_mostly = 0; /* whether to use mode hysteresis f
 module_param    (htb_hysteresis, int, 0640);
 MODULE_PARM_DESC(htb_hysteresis, "Hysteresis mode, less CPU load, less accurate");
 
+static int QCN_FB_DEFER __read_mostly = 1;
+module_param    (QCN_FB_DEFER, int, 0640);
+MODULE_PARM_DESC(QCN_FB_DEFER, "QCN Reaction Point, apply CNMs from the "
+				 "dequeue path rather than on receive, default 1");
+
+static int QCN_CNM_QLEN __read_mostly = 16;
+module_param    (QCN_CNM_QLEN, int, 0640);
+MODULE_PARM_DESC(QCN_CNM_QLEN, "QCN, CNMs queued ahead of the direct and "
+				 "class traffic, default 16");
+
+static int QCN_EST_INTERVAL __read_mostly = 1000;
+module_param    (QCN_EST_INTERVAL, int, 0640);
+MODULE_PARM_DESC(QCN_EST_INTERVAL, "QCN Reaction Point, interval of the leaf "
+				 "rate estimate (us), 0 off, default 1000");
+
+static int QCN_EST_EWMA __read_mostly = 3;
+module_param    (QCN_EST_EWMA, int, 0640);
+MODULE_PARM_DESC(QCN_EST_EWMA, "QCN Reaction Point, log2 of the intervals "
+				 "the leaf rate estimate averages over, default 3");
+
+static int QCN_CNTAG __read_mostly = 0;
+module_param    (QCN_CNTAG, int, 0640);
+MODULE_PARM_DESC(QCN_CNTAG, "QCN Reaction Point, tag frames with a CN-TAG "
+				 "flow ID (the class minor), GSO frames excepted, "
+				 "default 0");
+
+static int QCN_PACE __read_mostly = 0;
+module_param    (QCN_PACE, int, 0640);
+MODULE_PARM_DESC(QCN_PACE, "QCN Reaction Point, bytes a leaf the RP holds "
+				 "below its rate may send back to back, 0 for its burst, "
+				 "default 0");
+
+static int QCN_HW_INTERVAL __read_mostly = 10;
+module_param    (QCN_HW_INTERVAL, int, 0640);
+MODULE_PARM_DESC(QCN_HW_INTERVAL, "QCN Reaction Point, ms a VF rate limit "
+				 "waits for more crate changes before it is set, default 10");
+
+static int qcn_flow_ids __read_mostly = 1024;
+module_param    (qcn_flow_ids, int, 0440);
+MODULE_PARM_DESC(qcn_flow_ids, "Number of CN-TAG flow IDs (class minors "
+				 "below it get tagged), default 1024");
+
+static int qcn_flow_hash_bits __read_mostly = 9;
+module_param    (qcn_flow_hash_bits, int, 0440);
+MODULE_PARM_DESC(qcn_flow_hash_bits, "log2 of the RP flow table size, "
+				 "default 9");
+
+static int qcn_auto_pool __read_mostly = 16;
+module_param    (qcn_auto_pool, int, 0640);
+MODULE_PARM_DESC(qcn_auto_pool, "Spare classes an RP with auto_class keeps "
+				 "ready, default 16");
+
+static int qcn_auto_max __read_mostly = 4096;
+module_param    (qcn_auto_max, int, 0640);
+MODULE_PARM_DESC(qcn_auto_max, "Most classes an RP creates by itself, "
+				 "default 4096");
+
+static int qcn_class_reserve __read_mostly = 0;
+module_param    (qcn_class_reserve, int, 0640);
+MODULE_PARM_DESC(qcn_class_reserve, "Ready made leaf classes an RP keeps for "
+				 "the classes tc adds, default 0");
+
+static struct kmem_cache *htb_class_cachep __read_mostly;
+
 /* used internaly to keep status of single class */
 enum htb_cmode {
 	HTB_CANT_SEND,		/* class can't send and can't borrow */
@@ -126,13 +232,16 @@ enum htb_cmode {
 };
 
 /* interior & leaf nodes; props specific to leaves are marked L: */
+/* A class is laid out in three parts, each starting on a cache line of
+   its own (htb_class_cachep aligns the classes): what is only read once
+   set up, what the dequeue path writes for every packet under the
+   qdisc lock, and the rate state the feedback path rewrites, from
+   whichever CPU took the CNM, with QCN_FB_DEFER off or the queue full.
+   The last is split again into what only the feedback path touches and
+   what the dequeue path reads back, so that a CNM does not take the
+   shaper's lines away from the CPU that is sending. */
 struct htb_class {
 	struct Qdisc_class_common common;
-	/* general class parameters */
-	struct gnet_stats_basic_packed bstats;
-	struct gnet_stats_queue qstats;
-	struct gnet_stats_rate_est rate_est;
-	struct tc_htb_xstats xstats;	/* our special stats */
 	int refcnt;		/* usage count of this class */
 
 	/* topology */
@@ -140,9 +249,43 @@ struct htb_class {
 	unsigned int children;
 	struct htb_class *parent;	/* parent class */
 
-	int prio;		/* these two are used only by leaves... */
-	int quantum;		/* but stored for parent-to-leaf return */
+	int prio;		/* used only by leaves, but stored for
+				   parent-to-leaf return, as quantum */
+	int quantum_cfg;	/* quantum at the configured rate */
+
+	/* class attached filters */
+	struct tcf_proto *filter_list;
+	int filter_cnt;
+
+	/* token bucket parameters */
+	struct qdisc_rate_table *rate;	/* rate table of the class itself */
+	struct qdisc_rate_table *ceil;	/* ceiling rate (limits borrows too) */
+	long buffer, cbuffer;	/* token bucket depth/rate */
+	psched_tdiff_t mbuffer;	/* max wait time */
+
+	struct tc_qcn_rp_opt qp;	/* RP parameters of this class */
+	struct qcn_telem *telem;	/* Live state, mmap()ed; may be NULL */
+	int ifindex;			/* of the qdisc, for rate events */
+	struct net *net;		/* and its namespace */
+
+	/* QCN flow table linkage, see htb_flow_find() */
+	struct hlist_nulls_node flow_node;
+	__be32 flow_sa, flow_da;
+	u32 flow_scope;			/* qcn_flow_scope() */
+
+	/* RP made class, see htb_auto_claim() */
+	struct list_head auto_node;	/* on auto_free or auto_list, and on
+					   htb_reap_list once deleted */
+	struct rcu_head reap_rcu;	/* see htb_reap() */
 
+	/* L: VF whose TX limit follows crate, see htb_hw_bind() */
+	struct htb_hw *hw;		/* &q->hw while bound, else NULL */
+	int hw_vf;				/* -1 none */
+
+	struct gnet_stats_rate_est rate_est;	/* from the estimator timer,
+						   or htb_rate_est() if none */
+
+	/* Dequeue hot */
 	union {
 		struct htb_class_leaf {
 			struct Qdisc *q;
@@ -158,37 +301,94 @@ struct htb_class {
 			   last valid ptr (used when ptr is NULL). */
 			u32 last_ptr_id[TC_HTB_NUMPRIO];
 		} inner;
-	} un;
+	} un ____cacheline_aligned_in_smp;
 	struct rb_node node[TC_HTB_NUMPRIO];	/* node for self or feed tree */
-	struct rb_node pq_node;	/* node for event queue */
+	struct rb_node pq_node;	/* node for event queue, far part */
+	struct hlist_node pq_hnode;	/* node for event queue, calendar */
+	u16 pq_slot;		/* calendar slot of pq_hnode */
 	psched_time_t pq_key;
 
 	int prio_activity;	/* for which prios are we active */
 	enum htb_cmode cmode;	/* current mode of the class */
 
-	/* class attached filters */
-	struct tcf_proto *filter_list;
-	int filter_cnt;
-
-	/* token bucket parameters */
-	struct qdisc_rate_table *rate;	/* rate table of the class itself */
-	struct qdisc_rate_table *ceil;	/* ceiling rate (limits borrows too) */
-	long buffer, cbuffer;	/* token bucket depth/rate */
-	psched_tdiff_t mbuffer;	/* max wait time */
 	long tokens, ctokens;	/* current number of tokens */
 	psched_time_t t_c;	/* checkpoint time */
+	u32 bcount;		/* bytes to the next byte stage */
+	unsigned int bcount_seen;	/* bcount_gen bcount last took */
+
+	/* general class parameters */
+	struct gnet_stats_basic_packed bstats;
+	struct gnet_stats_queue qstats;
+	struct tc_htb_xstats xstats;	/* our special stats */
+	unsigned long auto_seen;	/* jiffies of the last packet or CNM */
+
+	/* L: throughput, see htb_rate_est() */
+	psched_time_t est_t;	/* start of the current interval */
+	u64 est_bytes;		/* dequeued since est_t */
+	u32 est_packets;
+	u32 est_bps, est_pps;	/* the averages */
+
+	/* QCN Variables, written by the feedback path only */
+	spinlock_t rate_lock ____cacheline_aligned_in_smp;
+							/* serializes rate writers */
+	struct tasklet_hrtimer timer;	/* Timer, runs while rate limited */
+	ktime_t timer_due;		/* stage due then, see qcn_rp_timer() */
+	__u32 cnm_received;		/* CNMs that lowered crate, under
+							   rate_lock */
+	unsigned int bcount_gen;	/* bumped when a cut reset
+							   rp.bcount_tx, see htb_bcount_sync() */
+	__u32 fb_lat[QCN_LAT_BUCKETS];	/* their latency, see qcn_tc.h */
+	__u32 cnm_delay[QCN_LAT_BUCKETS];
+
+	/* QCN Variables the dequeue path reads */
+	seqcount_t rate_seq ____cacheline_aligned_in_smp;
+							/* publishes rp to readers */
+	struct qcn_rp_state rp;	/* rates, byte counter and stages; the
+							   dequeue path counts bcount down from
+							   bcount_tx */
+	const struct qcn_alg_ops *alg;	/* runs rp, NULL: 802.1Qau */
+	int prof;				/* qcn_rp_prof() of qp */
+	int timer_lazy;			/* stopped while idle, with the next */
+	__u32 scale;			/* rate/crate in QCN_SCALE_SHIFT fixed
+							   point */
+	int quantum;			/* DRR quantum at crate */
+};
 
-	/* QCN Variables */
-	spinlock_t rate_lock;
-	__u32 trate;			/* Target rate */
-	__u32 crate;			/* Current rate */
-	__u32 n,d;				/* Numerator, Denominator (to compute 
-							   proportional rates from rtab) */
-	__u32 bcount_tx;		/* Byte counter */
-	__u16 bcount_stg;		/* Byte counter stage (si_count) */
-	psched_time_t timer;	/* Timer */
-	__u16 timer_stg;		/* Timer stage */
+/* Event queue of one row.
+   With many rate limited classes changing mode all the time an rbtree
+   costs O(log n) per event, which adds up to more than htb_do_events()
+   may spend. This is a calendar of HTB_WHEEL_SLOTS slots, each covering
+   2^HTB_WHEEL_GRAN psched ticks, starting at the slot of cur: a class
+   whose pq_key lies within it sits unsorted in the slot of pq_key, one
+   further away in the far tree as before. Adding and removing a class
+   is O(1), a slot is only looked at when it comes due, and the far
+   tree is moved into the calendar as cur advances. */
+#define HTB_WHEEL_BITS		10
+#define HTB_WHEEL_SLOTS		(1 << HTB_WHEEL_BITS)
+#define HTB_WHEEL_MASK		(HTB_WHEEL_SLOTS - 1)
+#define HTB_WHEEL_GRAN		10	/* ~65us with 64ns ticks */
+#define HTB_WHEEL_SPAN		((psched_time_t)HTB_WHEEL_SLOTS << HTB_WHEEL_GRAN)
+
+struct htb_wheel {
+	struct hlist_head *slot;
+	unsigned long used[BITS_TO_LONGS(HTB_WHEEL_SLOTS)];
+	psched_time_t cur;	/* start of the current slot, <= q->now */
+	unsigned int nr;	/* classes in the calendar */
+	struct rb_root far;	/* classes past it, sorted by pq_key */
+};
 
+/* SR-IOV VFs whose TX limits follow the crate of a leaf each. The
+   bindings change under RTNL and the root lock, the limits are set
+   from htb_hw_work() under RTNL. */
+struct htb_hw {
+	struct htb_class *cl[QCN_HW_VF_MAX];	/* bound to the VF, or NULL */
+	u32 mbps[QCN_HW_VF_MAX];	/* last limit set, 0 none */
+	unsigned long set[BITS_TO_LONGS(QCN_HW_VF_MAX)];	/* ours to lift */
+	unsigned long pending;	/* bit 0: htb_hw_work() is due */
+	struct delayed_work work;
+	u32 bound;
+	u32 pushed;
+	u32 failed;
 };
 
 struct htb_sched {
@@ -201,8 +401,11 @@ struct htb_sched {
 	struct rb_node *ptr[TC_HTB_MAXDEPTH][TC_HTB_NUMPRIO];
 	u32 last_ptr_id[TC_HTB_MAXDEPTH][TC_HTB_NUMPRIO];
 
-	/* self wait list - roots of wait PQs per row */
-	struct rb_root wait_pq[TC_HTB_MAXDEPTH];
+	/* self wait list - event queues per row, see htb_wheel */
+	struct htb_wheel wait_pq[TC_HTB_MAXDEPTH];
+	struct hlist_head *wait_slots;	/* the calendars of all rows */
+#define HTB_WAIT_SLOTS_SIZE \
+	(TC_HTB_MAXDEPTH * HTB_WHEEL_SLOTS * sizeof(struct hlist_head))
 
 	/* time of nearest event per level (row) */
 	psched_time_t near_ev_cache[TC_HTB_MAXDEPTH];
@@ -222,6 +425,9 @@ struct htb_sched {
 
 	long direct_pkts;
 
+	/* CNMs sent back out this device, ahead of everything */
+	struct sk_buff_head cnm_queue;
+
 #define HTB_WARN_TOOMANYEVENTS	0x1
 	unsigned int warned;	/* only one warning */
 	struct work_struct work;
@@ -232,33 +438,174 @@ struct htb_sched {
 	   and translate pkt size to tokens by hand using the following variable. */
 	/* __u32 clock_factor; */
 
+	/* QCN feedback for the device we are attached to */
+	struct qcn_fb_handler fb_handler;
+	atomic_t cnm_unmatched;	/* feedback for no known class */
+	struct qcn_fb_queue fb_queue;	/* see htb_qcn_fb() */
+	u32 cnm_deferred;	/* under the root lock */
+	u32 cntag_gso;		/* GSO frames left untagged, same */
+	int shard;		/* TX queue below mq, -1 standalone */
+	unsigned int nr_shards;
+
+	/* RP parameters new classes start with */
+	struct tc_qcn_rp_opt rp_defaults;
+	const struct qcn_alg_ops *alg;	/* the one rp_defaults names */
+
+	/* QCN flow table: (SA, DA) -> leaf class. RCU for the feedback
+	   path, updated under the qdisc root lock */
+	struct hlist_nulls_head *flow_hash;
+	unsigned int flow_mask;
+	u32 flow_rnd;
+	__be32 agg_src_mask;	/* the bits of SA and DA that are the key */
+	__be32 agg_dst_mask;
+
+	/* CN-TAG flow ID (class minor) -> leaf class, same rules */
+	struct htb_class **flow_ids;
+	unsigned int nr_flow_ids;
+
+	/* Classes created on demand after auto_tmpl: spares and claimed
+	   ones, both lists under the root lock. Filled and reclaimed from
+	   process context. */
+	struct htb_class *auto_tmpl;
+	struct list_head auto_free;
+	struct list_head auto_list;
+	unsigned int auto_nr_free;
+	unsigned int auto_nr_live;
+	unsigned long auto_idle;	/* jiffies, 0 never */
+	u16 auto_next;			/* next minor to try */
+	u32 auto_created;
+	u32 auto_reclaimed;
+	u32 auto_exhausted;
+	struct delayed_work auto_fill;
+	struct delayed_work auto_gc;
+
+	/* Ready made leaves for tc and the bulk adds, and the class hash
+	   growing ahead of them, see htb_class_work(); under RTNL */
+	struct list_head reserve;
+	unsigned int nr_reserve;
+	struct delayed_work class_work;
+	struct hlist_head *clhash_old;	/* classes move out of, or NULL */
+	unsigned int clhash_old_mask;
+
+	struct htb_hw hw;
 };
 
-struct qcn_frame {
-	u32 DA;
-	u32 SA;
-	u32 Fb;
-	int qoff;
-	int qdelta;
-};
+/* The rtabs from userspace are for the configured rate and shared with
+   other classes. A class charges their lookup stretched by scale, which
+   is rate/crate as a fixed point number, so that the buckets, borrowing
+   and DRR all see the rate in force. One multiply per packet is cheaper
+   than two private tables of 1KB each per class, written again on every
+   rate change.
+
+   buffer and cbuffer are times, so the burst a class may send in bytes
+   is buffer at crate: every cut shrinks it in proportion, and a
+   recovered class is back at the configured burst, never above it. */
+#define QCN_SCALE_SHIFT		16
+#define QCN_QUANTUM_MIN		1000	/* what htb_change_class() allows */
+
+/* Ticks len bytes take at crate, tab being cl->rate or cl->ceil; called
+   under the root lock, which the tables are swapped under. Feedback may
+   change scale meanwhile, under rate_lock only. */
+static inline long htb_l2t(const struct htb_class *cl,
+						   struct qdisc_rate_table *tab, unsigned int len)
+{
+	return (long)min_t(u64, ((u64)qdisc_l2t(tab, len) *
+							 ACCESS_ONCE(cl->scale)) >> QCN_SCALE_SHIFT,
+					   ~0U);
+}
+
+/* Bytes/s tab stands for at crate */
+static inline u32 htb_crate_of(const struct htb_class *cl,
+							   const struct qdisc_rate_table *tab)
+{
+	return (u32)div_u64((u64)tab->rate.rate << QCN_SCALE_SHIFT, cl->scale);
+}
+
+static inline void htb_hw_kick(struct htb_hw *hw, unsigned long delay)
+{
+	if (!test_and_set_bit(0, &hw->pending))
+		schedule_delayed_work(&hw->work, delay);
+}
+
+/* crate of cl changed: its VF follows, batched over QCN_HW_INTERVAL */
+static inline void htb_hw_note(struct htb_class *cl)
+{
+	struct htb_hw *hw = ACCESS_ONCE(cl->hw);
+
+	if (hw != NULL)
+		htb_hw_kick(hw, msecs_to_jiffies(max(QCN_HW_INTERVAL, 0)));
+}
+
+/* called under rate_lock, or before the class is visible */
+static void qcn_update_rate(struct htb_class *cl)
+{
+	int quantum;
+
+	cl->scale = (__u32)div_u64((u64)cl->rate->rate.rate << QCN_SCALE_SHIFT,
+							   cl->rp.crate);
+
+	quantum = (int)div_u64((u64)cl->quantum_cfg << QCN_SCALE_SHIFT,
+						   cl->scale);
+	cl->quantum = max(quantum, min(cl->quantum_cfg, QCN_QUANTUM_MIN));
+	htb_hw_note(cl);
+}
+
+/* Bytes a bucket of depth ticks holds at rate bytes/s */
+static u32 htb_burst_bytes(long ticks, u32 rate)
+{
+	return (u32)min_t(u64, div_u64((u64)PSCHED_TICKS2NS(ticks) * rate,
+								   NSEC_PER_SEC), ~0U);
+}
+
+/* Called wherever the rate state changed, under rate_lock or before the
+   class is visible; fb is the Fb of the CNM just applied, 0 keeps the
+   last one */
+static void htb_telem(struct htb_class *cl, u32 fb)
+{
+	struct qcn_telem *t = cl->telem;
 
-static inline u32 gcd_fn(u32 a, u32 b) {
-    for(;;) {
-        a = a % b;
-		if(a == 0)
-			return b;
-		b = b % a;
-        if(b == 0)
-			return a;
-    }
+	if (!t)
+		return;
+	qcn_telem_begin(t);
+	t->handle = cl->common.classid;
+	if (!cl->level)
+		t->qlen = cl->un.leaf.q->q.qlen;
+	if (fb)
+		t->fb = fb;
+	t->crate = cl->rp.crate;
+	t->trate = cl->rp.trate;
+	t->bcount_stg = cl->rp.bcount_stg;
+	t->timer_stg = cl->rp.timer_stg;
+	t->cnm = cl->cnm_received;
+	memcpy(t->fb_lat, cl->fb_lat, sizeof(t->fb_lat));
+	memcpy(t->cnm_delay, cl->cnm_delay, sizeof(t->cnm_delay));
+	qcn_telem_end(t);
+}
+
+/* Under rate_lock, frame having just cut crate */
+static void htb_lat_note(struct htb_class *cl, const struct qcn_frame *frame)
+{
+	u32 sent = ntohl(frame->tstamp);
+
+	if (!(frame->flags & htons(QCN_FRAME_TSTAMP)))
+		return;
+	qcn_lat_note(cl->fb_lat, (s32)(qcn_stamp() - sent));
+	qcn_lat_note(cl->cnm_delay, (s32)(frame->rx_stamp - sent));
 }
 
-/* Get qdisc handle from ip: parameters are 2 ip addresses in network
-   byte order (big endian) */
-static inline u32 gethandle(u32 src_be, u32 dst_be) {
-	u32 major = 0x00010000;
-	u32 minor = ((0x000000FF & ntohl(src_be))<<8) | (0x000000FF & ntohl(dst_be));
-	return major | minor;
+/* A class not moved to the grown hash yet, see htb_clhash_grow() */
+static struct Qdisc_class_common *htb_clhash_old_find(struct htb_sched *q,
+													  u32 handle)
+{
+	struct hlist_head *h;
+	struct Qdisc_class_common *clc;
+	struct hlist_node *n;
+
+	h = &q->clhash_old[qdisc_class_hash(handle, q->clhash_old_mask)];
+	hlist_for_each_entry(clc, n, h, hnode)
+		if (clc->classid == handle)
+			return clc;
+	return NULL;
 }
 
 /* find class in global hash table using given handle */
@@ -268,11 +615,605 @@ static inline struct htb_class *htb_find(u32 handle, struct Qdisc *sch)
 	struct Qdisc_class_common *clc;
 
 	clc = qdisc_class_find(&q->clhash, handle);
+	if (unlikely(clc == NULL && q->clhash_old != NULL))
+		clc = htb_clhash_old_find(q, handle);
 	if (clc == NULL)
 		return NULL;
 	return container_of(clc, struct htb_class, common);
 }
 
+/* QCN flow table.
+   The CP identifies a flow by its full (SA, DA) IPv4 pair. Leaves learn
+   the pair of the packets they carry on enqueue; qcn_recv_fb() then
+   finds the class in O(1) without relying on the classid layout. With
+   aggregate set the table is keyed by the pair under the agg masks, so
+   every pair of an aggregate finds the same class. */
+
+static void *htb_table_alloc(unsigned int size)
+{
+	void *t;
+
+	if (size <= PAGE_SIZE)
+		t = kmalloc(size, GFP_KERNEL);
+	else
+		t = vmalloc(size);
+	if (t != NULL)
+		memset(t, 0, size);
+	return t;
+}
+
+static void htb_table_free(void *t, unsigned int size)
+{
+	if (size <= PAGE_SIZE)
+		kfree(t);
+	else
+		vfree(t);
+}
+
+/* Every chain ends in the nulls value of its own slot, see
+   htb_flow_find() */
+static struct hlist_nulls_head *htb_flow_hash_alloc(unsigned int n)
+{
+	struct hlist_nulls_head *h;
+	unsigned int i;
+
+	h = htb_table_alloc(n * sizeof(struct hlist_nulls_head));
+	if (h != NULL)
+		for (i = 0; i < n; i++)
+			INIT_HLIST_NULLS_HEAD(&h[i], i);
+	return h;
+}
+
+static void htb_flow_hash_free(struct hlist_nulls_head *h, unsigned int n)
+{
+	htb_table_free(h, n * sizeof(struct hlist_nulls_head));
+}
+
+static inline unsigned int htb_flow_slot(const struct htb_sched *q,
+										 __be32 sa, __be32 da, u32 scope)
+{
+	return jhash_3words((__force u32)sa, (__force u32)da, scope,
+						q->flow_rnd) & q->flow_mask;
+}
+
+static inline struct hlist_nulls_head *htb_flow_bucket(struct htb_sched *q,
+													   __be32 sa, __be32 da,
+													   u32 scope)
+{
+	return &q->flow_hash[htb_flow_slot(q, sa, da, scope)];
+}
+
+/* The prefixes aggregate IPv4 pairs only; a folded IPv6 one has none */
+static inline void htb_flow_key(const struct htb_sched *q,
+								__be32 *sa, __be32 *da, u32 scope)
+{
+	if (scope & QCN_SCOPE_IPV6)
+		return;
+	*sa &= q->agg_src_mask;
+	*da &= q->agg_dst_mask;
+}
+
+/* called under rcu_read_lock; a pair is only looked for in its scope.
+   A class that learns another pair moves to the chain of that pair at
+   once, with no grace period between unlinking and relinking it, so a
+   reader that was on it goes on in the new chain and misses the rest of
+   its own. It then ends on the nulls value of another slot and looks
+   again, as the sockets and conntrack do (Documentation/RCU/
+   rculist_nulls.txt). */
+static struct htb_class *htb_flow_find(struct htb_sched *q,
+									   __be32 sa, __be32 da, u32 scope)
+{
+	struct htb_class *cl;
+	struct hlist_nulls_node *n;
+	unsigned int slot;
+
+	htb_flow_key(q, &sa, &da, scope);
+	slot = htb_flow_slot(q, sa, da, scope);
+begin:
+	hlist_nulls_for_each_entry_rcu(cl, n, &q->flow_hash[slot], flow_node)
+		if (cl->flow_sa == sa && cl->flow_da == da &&
+			cl->flow_scope == scope)
+			return cl;
+	if (get_nulls_value(n) != slot)
+		goto begin;
+	return NULL;
+}
+
+static inline void htb_flow_link(struct htb_sched *q, struct htb_class *cl)
+{
+	hlist_nulls_add_head_rcu(&cl->flow_node,
+							 htb_flow_bucket(q, cl->flow_sa, cl->flow_da,
+											 cl->flow_scope));
+}
+
+static inline void htb_flow_unlink(struct htb_class *cl)
+{
+	if (!hlist_nulls_unhashed(&cl->flow_node))
+		hlist_nulls_del_init_rcu(&cl->flow_node);
+}
+
+static inline int htb_flow_pinned(const struct htb_class *cl)
+{
+	return cl->qp.flags & TC_QCN_RP_FLOW;
+}
+
+/* The IP pair of skb and its scope, the VLAN it goes out in, as the CP
+   will see them; 0 if it has none */
+static inline int htb_flow_get(struct sk_buff *skb, __be32 *sa, __be32 *da,
+							   u32 *scope)
+{
+	struct qcn_frame frame;
+
+	if (!qcn_flow_fill(skb, &frame) ||
+		(frame.flags & htons(QCN_FRAME_FLOWID)))
+		return 0;
+	*sa = frame.SA;
+	*da = frame.DA;
+	*scope = qcn_flow_scope(&frame);
+	return 1;
+}
+
+/* called under the qdisc root lock. A class given its flow by
+   configuration keeps it, and nobody learns a pair such a class owns */
+static inline void htb_flow_learn(struct htb_sched *q, struct htb_class *cl,
+								  struct sk_buff *skb)
+{
+	struct htb_class *owner;
+	__be32 sa, da;
+	u32 scope;
+
+	if (htb_flow_pinned(cl) || cl == q->auto_tmpl ||
+		!htb_flow_get(skb, &sa, &da, &scope))
+		return;
+
+	htb_flow_key(q, &sa, &da, scope);
+	if (likely(cl->flow_sa == sa && cl->flow_da == da &&
+			   cl->flow_scope == scope &&
+			   !hlist_nulls_unhashed(&cl->flow_node)))
+		return;
+
+	owner = htb_flow_find(q, sa, da, scope);
+	if (owner != NULL && htb_flow_pinned(owner))
+		return;
+
+	htb_flow_unlink(cl);
+	cl->flow_sa = sa;
+	cl->flow_da = da;
+	cl->flow_scope = scope;
+	htb_flow_link(q, cl);
+}
+
+/* Flow given by configuration; called under RTNL, which is all that
+   changes who owns a pair by configuration */
+static int htb_flow_pin_check(struct htb_sched *q, struct htb_class *cl,
+							  const struct tc_qcn_rp_opt *qopt)
+{
+	struct htb_class *owner;
+
+	if (!(qopt->flags & TC_QCN_RP_FLOW))
+		return 0;
+	if (cl != NULL && (cl->level || cl == q->auto_tmpl))
+		return -EINVAL;		/* inner classes carry no flow */
+	if (!qopt->flow_src && !qopt->flow_dst)
+		return 0;
+
+	rcu_read_lock();
+	owner = htb_flow_find(q, qopt->flow_src, qopt->flow_dst,
+						  qopt->flow_scope);
+	if (owner != NULL && owner != cl && htb_flow_pinned(owner))
+		owner = ERR_PTR(-EEXIST);
+	rcu_read_unlock();
+	return IS_ERR(owner) ? PTR_ERR(owner) : 0;
+}
+
+/* called under sch_tree_lock, after htb_flow_pin_check() */
+static void htb_flow_pin(struct htb_sched *q, struct htb_class *cl,
+						 const struct tc_qcn_rp_opt *qopt)
+{
+	struct htb_class *owner;
+
+	if (!(qopt->flags & TC_QCN_RP_FLOW))
+		return;
+
+	htb_flow_unlink(cl);
+	cl->qp.flags &= ~TC_QCN_RP_FLOW;
+	cl->qp.flow_src = cl->qp.flow_dst = 0;
+	cl->qp.flow_scope = 0;
+	if (!qopt->flow_src && !qopt->flow_dst)
+		return;
+
+	/* a class that merely learned the pair gives it up */
+	owner = htb_flow_find(q, qopt->flow_src, qopt->flow_dst,
+						  qopt->flow_scope);
+	if (owner != NULL)
+		htb_flow_unlink(owner);
+
+	cl->qp.flags |= TC_QCN_RP_FLOW;
+	cl->qp.flow_src = cl->flow_sa = qopt->flow_src;
+	cl->qp.flow_dst = cl->flow_da = qopt->flow_dst;
+	cl->qp.flow_scope = cl->flow_scope = qopt->flow_scope;
+	htb_flow_key(q, &cl->flow_sa, &cl->flow_da, cl->flow_scope);
+	htb_flow_link(q, cl);
+}
+
+/* The leaf vf is bound to on the device. Below mq every shard has a
+   table of its own but they all set the limits of the same VFs, so
+   the tables of the other shards count too; under RTNL, which all
+   bindings change under. */
+static struct htb_class *htb_hw_owner(struct Qdisc *sch, int vf)
+{
+	struct htb_sched *q = qdisc_priv(sch), *other;
+	struct net_device *dev = qdisc_dev(sch);
+	struct Qdisc *qdisc;
+	unsigned int i;
+
+	if (q->hw.cl[vf] != NULL || q->shard < 0)
+		return q->hw.cl[vf];
+	for (i = 0; i < dev->num_tx_queues; i++) {
+		qdisc = netdev_get_tx_queue(dev, i)->qdisc_sleeping;
+		if (qdisc == sch || qdisc->ops != sch->ops)
+			continue;
+		other = qdisc_priv(qdisc);
+		if (other->hw.cl[vf] != NULL)
+			return other->hw.cl[vf];
+	}
+	return NULL;
+}
+
+/* VF given by configuration; called under RTNL like the flows */
+static int htb_hw_check(struct Qdisc *sch, struct htb_class *cl,
+						const struct tc_qcn_rp_opt *qopt)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_class *owner;
+
+	if (!(qopt->flags & TC_QCN_RP_HW_VF) || qopt->hw_vf < 0)
+		return 0;
+	if (cl != NULL && (cl->level || cl == q->auto_tmpl))
+		return -EINVAL;		/* a VF sends for a leaf */
+	if (qdisc_dev(sch)->netdev_ops->ndo_set_vf_tx_rate == NULL)
+		return -EOPNOTSUPP;
+	owner = htb_hw_owner(sch, qopt->hw_vf);
+	return owner != NULL && owner != cl ? -EBUSY : 0;
+}
+
+/* called under RTNL and sch_tree_lock; htb_hw_work() lifts the limit */
+static void htb_hw_unbind(struct htb_hw *hw, struct htb_class *cl)
+{
+	if (cl->hw_vf < 0)
+		return;
+	hw->cl[cl->hw_vf] = NULL;
+	hw->bound--;
+	cl->hw = NULL;
+	cl->hw_vf = -1;
+	cl->qp.flags &= ~TC_QCN_RP_HW_VF;
+	cl->qp.hw_vf = -1;
+	htb_hw_kick(hw, 0);
+}
+
+/* called under RTNL and sch_tree_lock, after htb_hw_check() */
+static void htb_hw_bind(struct htb_sched *q, struct htb_class *cl,
+						const struct tc_qcn_rp_opt *qopt)
+{
+	struct htb_hw *hw = &q->hw;
+
+	if (!(qopt->flags & TC_QCN_RP_HW_VF) || qopt->hw_vf == cl->hw_vf)
+		return;
+	htb_hw_unbind(hw, cl);
+	if (qopt->hw_vf < 0)
+		return;
+
+	hw->cl[qopt->hw_vf] = cl;
+	hw->bound++;
+	__set_bit(qopt->hw_vf, hw->set);
+	cl->hw_vf = cl->qp.hw_vf = qopt->hw_vf;
+	cl->qp.flags |= TC_QCN_RP_HW_VF;
+	cl->hw = hw;
+	htb_hw_kick(hw, 0);
+}
+
+/* under RTNL; 0 lifts the limit */
+static int htb_hw_push(struct htb_hw *hw, struct net_device *dev, int vf,
+					   u32 mbps)
+{
+	int err = dev->netdev_ops->ndo_set_vf_tx_rate(dev, vf, mbps);
+
+	if (err) {
+		hw->failed++;
+		return err;
+	}
+	hw->mbps[vf] = mbps;
+	hw->pushed++;
+	return 0;
+}
+
+/* Brings the VF limits in line with the bindings, under RTNL. A class
+   whose rate the driver refuses is let go and shapes in software only,
+   as it would without a VF. */
+static void htb_hw_sync(struct Qdisc *sch)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_hw *hw = &q->hw;
+	struct net_device *dev = qdisc_dev(sch);
+	struct htb_class *cl;
+	u32 mbps;
+	int vf;
+
+	for_each_set_bit(vf, hw->set, QCN_HW_VF_MAX) {
+		cl = hw->cl[vf];
+		/* the VF takes whole Mbit/s, and 0 is no limit at all */
+		mbps = cl ? max_t(u32, ACCESS_ONCE(cl->rp.crate) / 125000, 1) : 0;
+		if (mbps != hw->mbps[vf] && htb_hw_push(hw, dev, vf, mbps) &&
+			cl != NULL) {
+			sch_tree_lock(sch);
+			htb_hw_unbind(hw, cl);
+			sch_tree_unlock(sch);
+			cl = NULL;
+			htb_hw_push(hw, dev, vf, 0);
+		}
+		if (cl == NULL)
+			__clear_bit(vf, hw->set);
+	}
+}
+
+static void htb_hw_work(struct work_struct *work)
+{
+	struct htb_sched *q = container_of(work, struct htb_sched,
+									   hw.work.work);
+
+	if (!rtnl_trylock()) {
+		schedule_delayed_work(&q->hw.work, 1);
+		return;
+	}
+	/* a crate changing from here on runs us again */
+	clear_bit(0, &q->hw.pending);
+	smp_mb__after_clear_bit();
+	htb_hw_sync(q->watchdog.qdisc);
+	rtnl_unlock();
+}
+
+/* The key masks, from the prefix lengths in rp_defaults */
+static void htb_flow_agg_set(struct htb_sched *q)
+{
+	q->agg_src_mask = qcn_prefix_mask(q->rp_defaults.agg_src);
+	q->agg_dst_mask = qcn_prefix_mask(q->rp_defaults.agg_dst);
+}
+
+/* called under sch_tree_lock after the masks changed. Learned pairs are
+   learned again from the next packet; a configured flow moves to its
+   new key unless another configured one got there first. */
+static void htb_flow_rekey(struct htb_sched *q, struct Qdisc_class_hash *clhash)
+{
+	struct htb_class *cl;
+	struct hlist_node *n;
+	unsigned int i;
+
+	for (i = 0; i < clhash->hashsize; i++)
+		hlist_for_each_entry(cl, n, &clhash->hash[i], common.hnode)
+			htb_flow_unlink(cl);
+
+	for (i = 0; i < clhash->hashsize; i++) {
+		hlist_for_each_entry(cl, n, &clhash->hash[i], common.hnode) {
+			if (!htb_flow_pinned(cl) ||
+				htb_flow_find(q, cl->qp.flow_src, cl->qp.flow_dst,
+							  cl->qp.flow_scope))
+				continue;
+			cl->flow_sa = cl->qp.flow_src;
+			cl->flow_da = cl->qp.flow_dst;
+			cl->flow_scope = cl->qp.flow_scope;
+			htb_flow_key(q, &cl->flow_sa, &cl->flow_da,
+						 cl->flow_scope);
+			htb_flow_link(q, cl);
+		}
+	}
+}
+
+/* CN-TAG flow IDs.
+   With QCN_CNTAG set, a leaf tags its frames with its class minor; the
+   CP echoes it and qcn_recv_fb() indexes flow_ids[] with it, whatever
+   the ethertype of the flow. Below mq every TX queue has its own htb
+   with the same minors, so there the tag is offset by shard *
+   nr_flow_ids and the shard a CNM echoes it to is known.
+   A GSO skb goes untagged: its segments are cut behind the qdisc by
+   the stack or the NIC, which know nothing of a CN-TAG ethertype, and
+   segmenting it here would cost what GSO saves. The CP then echoes
+   the IP pair of such a frame instead, which the flow table finds as
+   long as the leaf learned it; cntag_gso counts them, so that a flow
+   only ever seen in GSO frames is told from a lost tag. */
+
+static inline void htb_flowid_set(struct htb_sched *q, struct htb_class *cl,
+								  struct htb_class *val)
+{
+	u32 id = TC_H_MIN(cl->common.classid);
+
+	if (id < q->nr_flow_ids)
+		rcu_assign_pointer(q->flow_ids[id], val);
+}
+
+/* called under rcu_read_lock */
+static inline struct htb_class *htb_flowid_find(struct htb_sched *q, u16 id)
+{
+	return id < q->nr_flow_ids ? rcu_dereference(q->flow_ids[id]) : NULL;
+}
+
+/* The tag of a leaf, 0 if it has none */
+static inline u32 htb_flowid_tag(const struct htb_sched *q,
+								 const struct htb_class *cl)
+{
+	u32 id = TC_H_MIN(cl->common.classid);
+
+	if (id >= q->nr_flow_ids)
+		return 0;
+	if (q->shard > 0)
+		id += q->shard * q->nr_flow_ids;
+	return id <= 0xffff ? id : 0;
+}
+
+/* called under the qdisc root lock, skb->data at the mac header */
+static void htb_cntag_push(struct htb_sched *q, struct htb_class *cl,
+						   struct sk_buff *skb)
+{
+	u32 id = htb_flowid_tag(q, cl);
+	struct qcn_cntag_hdr *tag;
+
+	if (id != 0 && skb_is_gso(skb)) {
+		q->cntag_gso++;
+		return;
+	}
+	if (id == 0 || skb->dev->type != ARPHRD_ETHER ||
+		skb->protocol == __constant_htons(ETH_P_CNTAG))
+		return;
+	/* Nobody can offload the checksum behind an unknown ethertype */
+	if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb))
+		return;
+	if (skb_cow_head(skb, QCN_CNTAG_LEN))
+		return;
+
+	skb_push(skb, QCN_CNTAG_LEN);
+	memmove(skb->data, skb->data + QCN_CNTAG_LEN, 2 * ETH_ALEN);
+	skb_reset_mac_header(skb);
+	/* the encapsulated ethertype is the original one, already there */
+	eth_hdr(skb)->h_proto = htons(ETH_P_CNTAG);
+	tag = (struct qcn_cntag_hdr *)(skb->data + ETH_HLEN);
+	tag->h_flow_id = htons(id);
+	skb->protocol = htons(ETH_P_CNTAG);
+	qdisc_skb_cb(skb)->pkt_len += QCN_CNTAG_LEN;
+}
+
+/* Classes the RP creates by itself.
+   A packet or CNM for a pair no class carries claims a spare and turns
+   it into a sibling of the auto_class template carrying that pair. The
+   spares are made after the template in process context, since the
+   leaf qdisc and the rtab references want GFP_KERNEL and RTNL; claimed
+   classes idle for auto_idle are deleted again the same way. */
+#define HTB_AUTO_MINOR_BASE	0x8000
+#define HTB_AUTO_MINORS		0x7fff
+
+static inline unsigned long htb_auto_period(const struct htb_sched *q)
+{
+	return max(q->auto_idle >> 2, (unsigned long)HZ / 10);
+}
+
+static void htb_auto_kick(struct htb_sched *q)
+{
+	if (q->auto_tmpl != NULL && (int)q->auto_nr_free < qcn_auto_pool)
+		schedule_delayed_work(&q->auto_fill, 0);
+	if (q->auto_idle && q->auto_nr_live)
+		schedule_delayed_work(&q->auto_gc, htb_auto_period(q));
+}
+
+static u32 htb_auto_classid(struct Qdisc *sch)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	unsigned int i;
+	u32 classid;
+
+	for (i = 0; i < HTB_AUTO_MINORS; i++) {
+		classid = TC_H_MAKE(sch->handle, HTB_AUTO_MINOR_BASE +
+							q->auto_next++ % HTB_AUTO_MINORS);
+		if (htb_find(classid, sch) == NULL)
+			return classid;
+	}
+	return 0;
+}
+
+/* called under the qdisc root lock, no class carries (sa, da) in scope */
+static struct htb_class *htb_auto_claim(struct Qdisc *sch,
+										__be32 sa, __be32 da, u32 scope)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_class *cl, *tmpl = q->auto_tmpl;
+	u32 classid;
+
+	htb_flow_key(q, &sa, &da, scope);
+	if (list_empty(&q->auto_free) || (classid = htb_auto_classid(sch)) == 0) {
+		q->auto_exhausted++;
+		htb_auto_kick(q);
+		return NULL;
+	}
+	cl = list_first_entry(&q->auto_free, struct htb_class, auto_node);
+	list_move_tail(&cl->auto_node, &q->auto_list);
+	q->auto_nr_free--;
+	q->auto_nr_live++;
+
+	cl->common.classid = classid;
+	cl->un.leaf.q->parent = classid;
+	cl->parent = tmpl->parent;
+	cl->prio = tmpl->prio;
+	cl->quantum = cl->quantum_cfg = tmpl->quantum_cfg;
+	cl->buffer = cl->tokens = tmpl->buffer;
+	cl->cbuffer = cl->ctokens = tmpl->cbuffer;
+	cl->mbuffer = tmpl->mbuffer;
+	cl->t_c = psched_get_time();
+	cl->qp = tmpl->qp;
+	cl->prof = tmpl->prof;
+
+	cl->rp.crate = cl->rp.trate = cl->rate->rate.rate;
+	htb_alg_set(cl, tmpl->alg);
+	qcn_update_rate(cl);
+	htb_telem(cl, 0);
+	cl->auto_seen = jiffies;
+
+	cl->flow_sa = sa;
+	cl->flow_da = da;
+	cl->flow_scope = scope;
+	htb_flow_link(q, cl);
+	htb_flowid_set(q, cl, cl);
+
+	/* complete before the dumps, which only hold RTNL, can see it */
+	hlist_add_head_rcu(&cl->common.hnode,
+					   &q->clhash.hash[qdisc_class_hash(classid,
+														q->clhash.hashmask)]);
+	q->clhash.hashelems++;
+	if (cl->parent)
+		cl->parent->children++;
+
+	q->auto_created++;
+	htb_auto_kick(q);
+	return cl;
+}
+
+/* called under the qdisc root lock, skb went to the template */
+static struct htb_class *htb_auto_get(struct Qdisc *sch, struct htb_class *tmpl,
+									  struct sk_buff *skb)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_class *cl;
+	__be32 sa, da;
+	u32 scope;
+
+	if (!htb_flow_get(skb, &sa, &da, &scope))
+		return tmpl;
+	if ((cl = htb_flow_find(q, sa, da, scope)) != NULL ||
+		(cl = htb_auto_claim(sch, sa, da, scope)) != NULL)
+		return cl;
+	return tmpl;
+}
+
+/* called under sch_tree_lock */
+static inline void htb_auto_forget(struct htb_sched *q, struct htb_class *cl)
+{
+	if (!list_empty(&cl->auto_node)) {
+		list_del_init(&cl->auto_node);
+		q->auto_nr_live--;
+	}
+}
+
+/* called under sch_tree_lock */
+static void htb_auto_set(struct htb_sched *q, struct htb_class *tmpl)
+{
+	q->auto_tmpl = tmpl;
+	if (tmpl != NULL) {
+		/* the template only carries what nobody claimed */
+		htb_flow_unlink(tmpl);
+		q->rp_defaults.auto_class = tmpl->common.classid;
+		q->rp_defaults.flags |= TC_QCN_RP_AUTO;
+	} else {
+		q->rp_defaults.auto_class = 0;
+		q->rp_defaults.flags &= ~TC_QCN_RP_AUTO;
+	}
+}
+
 /**
  * htb_classify - classify a packet into class
  *
@@ -294,6 +1235,8 @@ static struct htb_class *htb_classify(struct sk_buff *skb, struct Qdisc *sch,
 	struct htb_class *cl;
 	struct tcf_result res;
 	struct tcf_proto *tcf;
+	__be32 sa, da;
+	u32 scope;
 	int result;
 
 	/* allow to select class by setting skb->priority to valid classid;
@@ -304,6 +1247,12 @@ static struct htb_class *htb_classify(struct sk_buff *skb, struct Qdisc *sch,
 	if ((cl = htb_find(skb->priority, sch)) != NULL && cl->level == 0)
 		return cl;
 
+	/* QCN classification: one hash lookup of the IPv4 pair instead
+	   of a filter per flow; the filters still see everything else */
+	if (q->rp_defaults.classify && htb_flow_get(skb, &sa, &da, &scope) &&
+		(cl = htb_flow_find(q, sa, da, scope)) != NULL)
+		return cl;
+
 	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
 	tcf = q->filter_list;
 	while (tcf && (result = tc_classify(skb, tcf, &res)) >= 0) {
@@ -360,6 +1309,109 @@ static void htb_add_to_id_tree(struct rb_root *root,
 	rb_insert_color(&cl->node[prio], root);
 }
 
+static inline unsigned int htb_wheel_idx(psched_time_t t)
+{
+	return (t >> HTB_WHEEL_GRAN) & HTB_WHEEL_MASK;
+}
+
+static void htb_wheel_reset(struct htb_wheel *w, struct hlist_head *slot)
+{
+	unsigned int i;
+
+	w->slot = slot;
+	for (i = 0; i < HTB_WHEEL_SLOTS; i++)
+		INIT_HLIST_HEAD(&slot[i]);
+	bitmap_zero(w->used, HTB_WHEEL_SLOTS);
+	w->cur = 0;
+	w->nr = 0;
+	w->far = RB_ROOT;
+}
+
+static void htb_wheel_insert(struct htb_wheel *w, struct htb_class *cl)
+{
+	struct rb_node **p = &w->far.rb_node, *parent = NULL;
+
+	/* one that is due already goes to the current slot */
+	if (cl->pq_key < w->cur + HTB_WHEEL_SPAN) {
+		cl->pq_slot = htb_wheel_idx(max(cl->pq_key, w->cur));
+		hlist_add_head(&cl->pq_hnode, &w->slot[cl->pq_slot]);
+		__set_bit(cl->pq_slot, w->used);
+		w->nr++;
+		return;
+	}
+
+	while (*p) {
+		struct htb_class *c;
+		parent = *p;
+		c = rb_entry(parent, struct htb_class, pq_node);
+		if (cl->pq_key >= c->pq_key)
+			p = &parent->rb_right;
+		else
+			p = &parent->rb_left;
+	}
+	rb_link_node(&cl->pq_node, parent, p);
+	rb_insert_color(&cl->pq_node, &w->far);
+}
+
+static void htb_wheel_remove(struct htb_wheel *w, struct htb_class *cl)
+{
+	if (!hlist_unhashed(&cl->pq_hnode)) {
+		hlist_del_init(&cl->pq_hnode);
+		if (hlist_empty(&w->slot[cl->pq_slot]))
+			__clear_bit(cl->pq_slot, w->used);
+		w->nr--;
+	} else if (!RB_EMPTY_NODE(&cl->pq_node)) {
+		rb_erase(&cl->pq_node, &w->far);
+		RB_CLEAR_NODE(&cl->pq_node);
+	} else
+		WARN_ON(1);	/* a bug in this code, see htb_safe_rb_erase */
+}
+
+/* Moves cur to the slot of t, no class may wait in a slot before it.
+   Whatever the calendar covers then comes over from the far tree. */
+static void htb_wheel_advance(struct htb_wheel *w, psched_time_t t)
+{
+	struct rb_node *p;
+	struct htb_class *cl;
+
+	w->cur = t & ~(((psched_time_t)1 << HTB_WHEEL_GRAN) - 1);
+	while ((p = rb_first(&w->far)) != NULL) {
+		cl = rb_entry(p, struct htb_class, pq_node);
+		if (cl->pq_key >= w->cur + HTB_WHEEL_SPAN)
+			break;
+		rb_erase(p, &w->far);
+		RB_CLEAR_NODE(p);
+		htb_wheel_insert(w, cl);
+	}
+}
+
+/* First used slot from cur on and the time it starts at */
+static unsigned int htb_wheel_next(const struct htb_wheel *w,
+								   psched_time_t *start)
+{
+	unsigned int idx = htb_wheel_idx(w->cur), off;
+
+	off = find_next_bit(w->used, HTB_WHEEL_SLOTS, idx);
+	if (off >= HTB_WHEEL_SLOTS)
+		off = find_first_bit(w->used, HTB_WHEEL_SLOTS);
+	*start = w->cur + ((psched_time_t)((off - idx) & HTB_WHEEL_MASK) <<
+					   HTB_WHEEL_GRAN);
+	return off;
+}
+
+static psched_time_t htb_wheel_slot_min(const struct htb_wheel *w,
+										unsigned int idx)
+{
+	psched_time_t min = ~(psched_time_t)0;
+	struct htb_class *cl;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(cl, n, &w->slot[idx], pq_hnode)
+		if (cl->pq_key < min)
+			min = cl->pq_key;
+	return min;
+}
+
 /**
  * htb_add_to_wait_tree - adds class to the event queue with delay
  *
@@ -370,7 +1422,7 @@ static void htb_add_to_id_tree(struct rb_root *root,
 static void htb_add_to_wait_tree(struct htb_sched *q,
 				 struct htb_class *cl, long delay)
 {
-	struct rb_node **p = &q->wait_pq[cl->level].rb_node, *parent = NULL;
+	struct htb_wheel *w = &q->wait_pq[cl->level];
 
 	cl->pq_key = q->now + delay;
 	if (cl->pq_key == q->now)
@@ -380,17 +1432,16 @@ static void htb_add_to_wait_tree(struct htb_sched *q,
 	if (q->near_ev_cache[cl->level] > cl->pq_key)
 		q->near_ev_cache[cl->level] = cl->pq_key;
 
-	while (*p) {
-		struct htb_class *c;
-		parent = *p;
-		c = rb_entry(parent, struct htb_class, pq_node);
-		if (cl->pq_key >= c->pq_key)
-			p = &parent->rb_right;
-		else
-			p = &parent->rb_left;
-	}
-	rb_link_node(&cl->pq_node, parent, p);
-	rb_insert_color(&cl->pq_node, &q->wait_pq[cl->level]);
+	/* an empty calendar starts over at now */
+	if (!w->nr)
+		htb_wheel_advance(w, q->now);
+	htb_wheel_insert(w, cl);
+}
+
+static inline void htb_remove_from_wait_tree(struct htb_sched *q,
+											 struct htb_class *cl)
+{
+	htb_wheel_remove(&q->wait_pq[cl->level], cl);
 }
 
 /**
@@ -534,8 +1585,29 @@ static void htb_deactivate_prios(struct htb_sched *q, struct htb_class *cl)
 		htb_remove_class_from_row(q, cl, mask);
 }
 
+/* A leaf the RP holds below its rate leaves the bucket no more than
+   QCN_PACE bytes deep at crate, so that after a cut the packets go out
+   len/crate apart, one per watchdog event, rather than as bursts of the
+   configured buffer the CP takes for new congestion. The watchdog is an
+   hrtimer set to the exact pq_key, see htb_wheel_slot_min(). */
+static inline int htb_paced(const struct htb_class *cl)
+{
+	return QCN_PACE > 0 && !cl->level &&
+		cl->rp.crate < cl->rate->rate.rate;
+}
+
+static inline long htb_depth(const struct htb_class *cl,
+							 struct qdisc_rate_table *tab, long buffer)
+{
+	if (!htb_paced(cl))
+		return buffer;
+	return min_t(long, buffer, htb_l2t(cl, tab, QCN_PACE));
+}
+
 static inline long htb_lowater(const struct htb_class *cl)
 {
+	if (htb_paced(cl))
+		return 0;
 	if (htb_hysteresis)
 		return cl->cmode != HTB_CANT_SEND ? -cl->cbuffer : 0;
 	else
@@ -543,6 +1615,8 @@ static inline long htb_lowater(const struct htb_class *cl)
 }
 static inline long htb_hiwater(const struct htb_class *cl)
 {
+	if (htb_paced(cl))
+		return 0;
 	if (htb_hysteresis)
 		return cl->cmode == HTB_CAN_SEND ? -cl->buffer : 0;
 	else
@@ -639,12 +1713,50 @@ static inline void htb_deactivate(struct htb_sched *q, struct htb_class *cl)
 	list_del_init(&cl->un.leaf.drop_list);
 }
 
+/* Credit based backpressure.
+   Frames a guest sends through a tap are charged to a socket of the tap
+   until the NIC is done with them, and vhost or qemu stop taking frames
+   off the guest's ring while its send buffer is full, so the guest keeps
+   the excess in its own socket buffers. Sizing that buffer to what the
+   class drains in backpressure us bounds the host side queue of the
+   guest by the same time, whatever the rate. Tap sockets are the only
+   AF_UNSPEC ones; local sockets and Xen netback, which frees its frames
+   from the guest at once, are left alone. */
+static void htb_backpressure(const struct htb_class *cl, struct sk_buff *skb)
+{
+	struct sock *sk = skb->sk;
+	int credit;
+
+	if (sk == NULL || sk->sk_family != AF_UNSPEC)
+		return;
+	credit = min_t(u64, div_u64((u64)cl->rp.crate * cl->qp.backpressure,
+								  USEC_PER_SEC), INT_MAX);
+	credit = max_t(int, credit, SOCK_MIN_SNDBUF);
+	/* read racily by the sender, as when the tap owner sets it */
+	if (sk->sk_sndbuf != credit)
+		sk->sk_sndbuf = credit;
+}
+
+static void qcn_rp_wake(struct htb_class *cl);
+
 static int htb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 {
-	int uninitialized_var(ret);
+	int ret = NET_XMIT_SUCCESS;
 	struct htb_sched *q = qdisc_priv(sch);
-	struct htb_class *cl = htb_classify(skb, sch, &ret);
+	struct htb_class *cl;
+
+	/* CNMs of a CP on this host: not ours to shape, nor to hold up */
+	if (unlikely(qcn_is_cnm_tx(skb))) {
+		if (q->cnm_queue.qlen >= QCN_CNM_QLEN) {
+			kfree_skb(skb);
+			sch->qstats.drops++;
+			return NET_XMIT_DROP;
+		}
+		__skb_queue_tail(&q->cnm_queue, skb);
+		goto queued;
+	}
 
+	cl = htb_classify(skb, sch, &ret);
 	if (cl == HTB_DIRECT) {
 		/* enqueue to helper queue */
 		if (q->direct_queue.qlen < q->direct_qlen) {
@@ -662,127 +1774,328 @@ static int htb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 		kfree_skb(skb);
 		return ret;
 #endif
-	} else if ((ret = qdisc_enqueue(skb, cl->un.leaf.q)) != NET_XMIT_SUCCESS) {
-		if (net_xmit_drop_count(ret)) {
-			sch->qstats.drops++;
-			cl->qstats.drops++;
-		}
-		return ret;
 	} else {
+		if (cl == q->auto_tmpl)
+			cl = htb_auto_get(sch, cl, skb);
+		/* learn before the tag hides the IP header */
+		htb_flow_learn(q, cl, skb);
+		if (QCN_CNTAG)
+			htb_cntag_push(q, cl, skb);
+
+		if ((ret = qdisc_enqueue(skb, cl->un.leaf.q)) != NET_XMIT_SUCCESS) {
+			if (net_xmit_drop_count(ret)) {
+				sch->qstats.drops++;
+				cl->qstats.drops++;
+			}
+			return ret;
+		}
 		cl->bstats.packets +=
 			skb_is_gso(skb)?skb_shinfo(skb)->gso_segs:1;
 		cl->bstats.bytes += qdisc_pkt_len(skb);
+		cl->auto_seen = jiffies;
+		if (unlikely(cl->timer_lazy))
+			qcn_rp_wake(cl);
+		if (cl->qp.backpressure)
+			htb_backpressure(cl, skb);
 		htb_activate(q, cl);
 	}
 
-	sch->q.qlen++;
-	sch->bstats.packets += skb_is_gso(skb)?skb_shinfo(skb)->gso_segs:1;
-	sch->bstats.bytes += qdisc_pkt_len(skb);
-	return NET_XMIT_SUCCESS;
+queued:
+	sch->q.qlen++;
+	sch->bstats.packets += skb_is_gso(skb)?skb_shinfo(skb)->gso_segs:1;
+	sch->bstats.bytes += qdisc_pkt_len(skb);
+	return NET_XMIT_SUCCESS;
+}
+
+/* Module parameters are the defaults of a new RP */
+static void qcn_rp_params_init(struct tc_qcn_rp_opt *qp)
+{
+	memset(qp, 0, sizeof(*qp));
+	/* Kept in ns, the timer stages run off hrtimers */
+	if (QCN_TIMER_US > 0)
+		qp->timer = (u32)min_t(u64, (u64)QCN_TIMER_US * NSEC_PER_USEC,
+							   ~0U);
+	else
+		qp->timer = (u32)min_t(u64, (u64)QCN_TIMER * NSEC_PER_MSEC, ~0U);
+	qp->fastrec = QCN_FASTREC;
+	qp->bc = QCN_BC;
+	qp->ai = QCN_AI;
+	qp->hai = QCN_HAI;
+	qp->gd = QCN_GD;
+	qp->min_rate = QCN_MIN_RATE;
+	qp->min_rate_dec = QCN_MIN_RATE_DEC;
+	qp->timer_jitter = QCN_TIMER_JITTER;
+	qp->backpressure = max(QCN_BACKPRESSURE, 0);
+	qp->exact = QCN_EXACT ? 1 : 0;
+	qp->agg_src = qp->agg_dst = 32;
+	strlcpy(qp->alg, qcn_alg_name(NULL), sizeof(qp->alg));
+	qp->enable = QCN_ENABLE ? 1 : 0;
+	qp->hw_vf = -1;
+}
+
+static int qcn_rp_params_dump(struct sk_buff *skb,
+							  const struct tc_qcn_rp_opt *qp)
+{
+	struct tc_qcn_rp_opt opt = *qp;
+
+	/* classify and flow are only reported where they are in force */
+	opt.flags = TC_QCN_RP_TIMER | TC_QCN_RP_FASTREC | TC_QCN_RP_BC |
+		TC_QCN_RP_AI | TC_QCN_RP_HAI | TC_QCN_RP_GD | TC_QCN_RP_MIN_RATE |
+		TC_QCN_RP_MIN_RATE_DEC | TC_QCN_RP_JITTER | TC_QCN_RP_BACKPRESSURE |
+		TC_QCN_RP_EXACT | TC_QCN_RP_ALG | TC_QCN_RP_ENABLE |
+		(qp->flags & (TC_QCN_RP_CLASSIFY | TC_QCN_RP_FLOW |
+					  TC_QCN_RP_AUTO | TC_QCN_RP_AUTO_IDLE |
+					  TC_QCN_RP_AGGREGATE | TC_QCN_RP_HW_VF));
+	return nla_put(skb, TCA_HTB_QCN, sizeof(opt), &opt);
+}
+
+/* Consistent copy of the RP rate state for the dequeue path */
+struct qcn_rate_snap {
+	u32 crate;
+	u32 trate;
+	u16 bcount_stg;
+	u16 timer_stg;
+};
+
+static inline void qcn_read_rate(const struct htb_class *cl,
+								 struct qcn_rate_snap *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&cl->rate_seq);
+		snap->crate = cl->rp.crate;
+		snap->trate = cl->rp.trate;
+		snap->bcount_stg = cl->rp.bcount_stg;
+		snap->timer_stg = cl->rp.timer_stg;
+	} while (read_seqcount_retry(&cl->rate_seq, seq));
+}
+
+/* The byte counter belongs to the dequeue path, which counts bcount
+   down without a lock. A cut that resets rp.bcount_tx bumps bcount_gen
+   after it, under rate_lock; the next packet takes the new value. */
+static inline void htb_bcount_sync(struct htb_class *cl)
+{
+	unsigned int gen = ACCESS_ONCE(cl->bcount_gen);
+
+	if (unlikely(gen != cl->bcount_seen)) {
+		smp_rmb();	/* pairs with the smp_wmb() in qcn_recv_fb() */
+		cl->bcount = ACCESS_ONCE(cl->rp.bcount_tx);
+		cl->bcount_seen = gen;
+	}
+}
+
+/* Byte counter stages, only taken when the counter expires. A GSO skb
+   of segs segments advances one stage per threshold it crosses, as its
+   segments would have one by one, but never more than one per segment;
+   bytes past the last stage taken are not carried over. */
+static void qcn_rp_advance(struct htb_class *cl, int bytes, int segs)
+{
+	int stages = 0;
+
+	spin_lock(&cl->rate_lock);
+	write_seqcount_begin(&cl->rate_seq);
+
+	/* a cut may have reset the counter since the caller looked */
+	htb_bcount_sync(cl);
+	while (cl->bcount <= bytes && segs-- > 0) {
+		bytes -= cl->bcount;
+		qcn_alg_byte_stage(cl->alg, cl->prof, &cl->rp, &cl->qp);
+		cl->bcount = cl->rp.bcount_tx;
+		stages++;
+	}
+	if (cl->bcount > bytes)
+		cl->bcount -= bytes;
+	if (stages) {
+		qcn_update_rate(cl);
+		htb_telem(cl, 0);
+	}
+
+	write_seqcount_end(&cl->rate_seq);
+	spin_unlock(&cl->rate_lock);
+}
+
+/* Cuts and restores for the rate event subscribers, under rate_lock */
+static void htb_rate_event(struct htb_class *cl, u16 type, u32 old_crate,
+						   u32 fb)
+{
+	struct qcn_rate_event ev;
+
+	qcn_rate_event_fill(&ev, type, cl->ifindex, cl->common.classid,
+						old_crate, &cl->rp, fb);
+	ev.src = cl->flow_sa;
+	ev.dst = cl->flow_da;
+	qcn_rate_notify(cl->net, &ev);
 }
 
-static inline void qcn_self_increase (struct htb_class *cl) {
-	u32 rate_increase;
-	u32 gcd;
+/* Randomized timer period: TIMER during fast recovery, TIMER/2 after */
+static inline ktime_t qcn_timer_period(const struct htb_class *cl)
+{
+	return ns_to_ktime(qcn_randomize(qcn_rp_timer_period(&cl->rp, &cl->qp),
+									 cl->qp.timer_jitter));
+}
 
-	if (cl->bcount_stg > QCN_FASTREC ||
-		cl->timer_stg > QCN_FASTREC) {
-		if (cl->bcount_stg > QCN_FASTREC &&
-				cl->timer_stg > QCN_FASTREC)
-			/* Hyperactive increase */
-			rate_increase = QCN_HAI;
-		else
-			rate_increase = QCN_AI;
+/* Timer stages follow the wall clock rather than packet departures, so
+   that starved classes recover too. Runs in softirq context. A class
+   with nothing queued stops its timer instead of firing on while idle;
+   its next packet or CNM catches up on the stages missed meanwhile,
+   see qcn_rp_catch_up(). */
+static enum hrtimer_restart qcn_rp_timer(struct hrtimer *timer)
+{
+	struct htb_class *cl = container_of(timer, struct htb_class,
+										timer.timer);
+	int limited, idle;
+	u32 old_crate;
+
+	spin_lock(&cl->rate_lock);
+	write_seqcount_begin(&cl->rate_seq);
+	old_crate = cl->rp.crate;
+	qcn_alg_timer_stage(cl->alg, cl->prof, &cl->rp, &cl->qp);
+	qcn_update_rate(cl);
+	htb_telem(cl, 0);
+	write_seqcount_end(&cl->rate_seq);
+	limited = cl->rp.crate < cl->rate->rate.rate;
+	if (!limited)
+		htb_rate_event(cl, QCN_RATE_RESTORED, old_crate, 0);
+	idle = limited && !cl->level && !cl->un.leaf.q->q.qlen;
+	if (idle) {
+		cl->timer_due = ktime_add_ns(hrtimer_get_expires(timer),
+									 qcn_rp_timer_period(&cl->rp, &cl->qp));
+		cl->timer_lazy = 1;
 	}
+	spin_unlock(&cl->rate_lock);
+
+	if (!limited || idle)
+		return HRTIMER_NORESTART;	/* fully recovered or idle */
+
+	hrtimer_forward_now(timer, qcn_timer_period(cl));
+	return HRTIMER_RESTART;
+}
+
+/* All the timer stages due since the timer of cl stopped, in one
+   closed form update, and the timer restarted for the next one. Jitter
+   is left out, the stages are counted at the mean period. Under
+   rate_lock and rate_seq. */
+static void qcn_rp_catch_up(struct htb_class *cl)
+{
+	ktime_t now = ktime_get();
+	u32 old_crate = cl->rp.crate;
+	u64 left;
+	u32 n;
+
+	cl->timer_lazy = 0;
+	if (ktime_to_ns(now) < ktime_to_ns(cl->timer_due)) {
+		left = ktime_to_ns(ktime_sub(cl->timer_due, now));
+	} else {
+		n = qcn_rp_timer_due(&cl->rp, &cl->qp,
+							 ktime_to_ns(ktime_sub(now, cl->timer_due)),
+							 &left);
+		qcn_alg_timer_stages(cl->alg, cl->prof, &cl->rp, &cl->qp, n);
+		qcn_update_rate(cl);
+		htb_telem(cl, 0);
+	}
+	if (cl->rp.crate < cl->rate->rate.rate)
+		tasklet_hrtimer_start(&cl->timer, ns_to_ktime(left),
+							  HRTIMER_MODE_REL);
 	else
-		rate_increase = 0;
-	
-	/* At the end of the first cycle of recovery */
-	if ((cl->bcount_stg == 1 || cl->timer_stg == 1) &&
-		cl->trate > 10 * cl->crate)
-		cl->trate = cl->trate >> 3;
-	else
-		cl->trate += rate_increase;
-	
-	cl->crate = (cl->trate + cl->crate) >> 1;
+		htb_rate_event(cl, QCN_RATE_RESTORED, old_crate, 0);
+}
+
+/* The first packet of a class since its timer stopped */
+static void qcn_rp_wake(struct htb_class *cl)
+{
+	spin_lock(&cl->rate_lock);
+	write_seqcount_begin(&cl->rate_seq);
+	if (cl->timer_lazy)
+		qcn_rp_catch_up(cl);
+	write_seqcount_end(&cl->rate_seq);
+	spin_unlock(&cl->rate_lock);
+}
+
+/* cl had its RP turned off: it goes back to its configured rate and
+   stays there, which leaves the dequeue path that of a stock class.
+   Under sch_tree_lock; a running timer stops at its next stage. */
+static void htb_rp_off(struct htb_class *cl)
+{
+	u32 old_crate;
+
+	spin_lock(&cl->rate_lock);
+	write_seqcount_begin(&cl->rate_seq);
+	old_crate = cl->rp.crate;
+	cl->timer_lazy = 0;
+	cl->rp.crate = cl->rp.trate = cl->rate->rate.rate;
+	cl->rp.bcount_stg = cl->rp.timer_stg = 0;
+	qcn_alg_init(cl->alg, &cl->rp, &cl->qp);
+	qcn_update_rate(cl);
+	htb_telem(cl, 0);
+	write_seqcount_end(&cl->rate_seq);
+	if (old_crate != cl->rp.crate)
+		htb_rate_event(cl, QCN_RATE_RESTORED, old_crate, 0);
+	spin_unlock(&cl->rate_lock);
+}
 
-	gcd = gcd_fn(cl->rate->rate.rate, cl->crate);
-	cl->n = cl->rate->rate.rate/gcd;
-	cl->d = cl->crate/gcd;
+/* cl runs alg from now on, with a reference of its own, and starts it
+   from the rate it is at; under sch_tree_lock or before cl is seen */
+static void htb_alg_set(struct htb_class *cl, const struct qcn_alg_ops *alg)
+{
+	const struct qcn_alg_ops *old = cl->alg;
 
+	if (alg == old)
+		return;
+	qcn_alg_hold(alg);
+	spin_lock(&cl->rate_lock);
+	write_seqcount_begin(&cl->rate_seq);
+	cl->alg = alg;
+	qcn_alg_init(alg, &cl->rp, &cl->qp);
+	write_seqcount_end(&cl->rate_seq);
+	spin_unlock(&cl->rate_lock);
+	qcn_alg_put(old);
 }
 
-static inline void htb_accnt_tokens(struct htb_class *cl, int bytes, 
-									long diff)
+static inline void htb_accnt_tokens(struct htb_class *cl, int bytes,
+									int segs, long diff)
 {
 	long toks = diff + cl->tokens;
+	long depth = htb_depth(cl, cl->rate, cl->buffer);
 	long pkt2toks;
-	psched_time_t now;
-	u64 tsc64;
-	u32 new_crate, new_trate, bs, ts;
-	u32 handle;
+	struct qcn_trace_rec rec;
+	struct qcn_rate_snap snap;
 
-	if (toks > cl->buffer)
-		toks = cl->buffer;
-
-	pkt2toks = (long) qdisc_l2t(cl->rate, bytes);
+	if (toks > depth)
+		toks = depth;
 
 	/* QCN Reaction Point Algorithm */
-	if (cl->crate < cl->rate->rate.rate) {
-		spin_lock(&cl->rate_lock);
-
-		pkt2toks = (pkt2toks * cl->n)/cl->d;
-
-		/* Updating timer */
-		now = psched_get_time();
-		if (now > cl->timer) {
-			cl->timer_stg++;
-			qcn_self_increase(cl);
-			if (cl->timer_stg < QCN_FASTREC)
-				cl->timer = now + QCN_TIMER; /* TODO: "Randomize" */
-			else
-				cl->timer = now + (QCN_TIMER >> 1);
-		}
-		
-		/* Updating byte counter */
-		if (cl->bcount_tx <= bytes) {
-			cl->bcount_stg++;
-			if (cl->bcount_stg < QCN_FASTREC)
-				cl->bcount_tx = QCN_BC; /* TODO: "Randomize" */
-			else
-				cl->bcount_tx = QCN_BC >> 1;
-			qcn_self_increase(cl);
-		}
+	if (cl->rp.crate < cl->rate->rate.rate) {
+		/* Updating byte counter; timer stages run from qcn_rp_timer() */
+		htb_bcount_sync(cl);
+		if (cl->bcount <= bytes)
+			qcn_rp_advance(cl, bytes, segs);
 		else
-			cl->bcount_tx -= bytes;
-
-		new_crate = cl->crate;
-		new_trate = cl->trate;
-		bs = cl->bcount_stg;
-		ts = cl->timer_stg;
-		spin_unlock(&cl->rate_lock);
-	} else {
-		new_crate = cl->rate->rate.rate;
-		new_trate = cl->rate->rate.rate;
-		bs = 0;
-		ts = 0;
+			cl->bcount -= bytes;
 	}
 
+	/* after the stage above, which may have raised crate */
+	pkt2toks = htb_l2t(cl, cl->rate, bytes);
 	toks -= pkt2toks;
 
 	if (toks <= -cl->mbuffer)
 		toks = 1 - cl->mbuffer;
 
-	handle = cl->un.leaf.q->handle >> 16;
-	rdtscll(tsc64);
-	printk(KERN_INFO "htb %llu %x: QLEN %d TOKS %ld CR %d TR %d Fb 0 "
-		   "BS %d TS %d\n",
-		   tsc64, cl->un.leaf.q->handle >> 16,
-		   cl->un.leaf.q->q.qlen, toks, new_crate*8/1000/1000,
-		   new_trate*8/1000/1000, bs, ts);
-	/*printk(KERN_INFO "htb %llu %x: QLEN %d\n",
-		   tsc64, handle,
-		   cl->un.leaf.q->q.qlen);*/
+	if (qcn_trace_enabled) {
+		qcn_read_rate(cl, &snap);
+		rec.tsc = get_cycles();
+		rec.type = QCN_TRACE_RP_TX;
+		rec.id = cl->un.leaf.q->handle >> 16;
+		rec.qlen = cl->un.leaf.q->q.qlen;
+		rec.fb = 0;
+		rec.toks = toks;
+		rec.crate = snap.crate;
+		rec.trate = snap.trate;
+		rec.bcount_stg = snap.bcount_stg;
+		rec.timer_stg = snap.timer_stg;
+		rec.pad = 0;
+		__qcn_trace(&rec);
+	}
 
 	cl->tokens = toks;
 }
@@ -791,15 +2104,13 @@ static inline void htb_accnt_ctokens(struct htb_class *cl, int bytes,
 									 long diff)
 {
 	long toks = diff + cl->ctokens;
+	long depth = htb_depth(cl, cl->ceil, cl->cbuffer);
 	long pkt2toks;
 
-	if (toks > cl->cbuffer)
-		toks = cl->cbuffer;
+	if (toks > depth)
+		toks = depth;
 
-	pkt2toks = (long) qdisc_l2t(cl->ceil, bytes);
-	if (cl->crate < cl->rate->rate.rate)
-		/* Spinlock, where are you? */
-		pkt2toks = (pkt2toks * cl->n)/cl->d;
+	pkt2toks = htb_l2t(cl, cl->ceil, bytes);
 
 	toks -= pkt2toks;	
 
@@ -809,6 +2120,63 @@ static inline void htb_accnt_ctokens(struct htb_class *cl, int bytes,
 	cl->ctokens = toks;
 }
 
+/* avg of weight 2^-ewma after n more intervals of sample s each */
+static u32 htb_ewma(u32 avg, u32 s, u64 n, int ewma)
+{
+	s64 d = (s64)avg - s;
+
+	if (n >= 64)
+		return s;
+	while (n-- && d)
+		d -= d >> ewma ? d >> ewma : (d > 0 ? 1 : -1);
+	return (u32)(s + d);
+}
+
+/* The throughput of class cl, what gen_estimator would measure but
+   with neither its timer nor its lock: the charge counts what went
+   through the class, and once per QCN_EST_INTERVAL folds the interval
+   into an average of weight 2^-QCN_EST_EWMA. An idle class is only
+   looked at again when it sends or is dumped, with every interval it
+   missed taken as an empty one. Under the qdisc lock, as the charge
+   and the class dumps are. */
+static void htb_rate_fold(struct htb_class *cl, psched_time_t now)
+{
+	u64 interval, n;
+	s64 elapsed;
+	int ewma = clamp_t(int, QCN_EST_EWMA, 0, 16);
+
+	if (QCN_EST_INTERVAL <= 0)
+		return;
+	interval = PSCHED_NS2TICKS((u64)QCN_EST_INTERVAL * NSEC_PER_USEC);
+	/* a dump may have folded up to a later time than q->now */
+	elapsed = now - cl->est_t;
+	if (!interval || elapsed < (s64)interval)
+		return;
+
+	/* what was sent is averaged over all of the intervals since */
+	n = div64_u64(elapsed, interval);
+	cl->est_bps = htb_ewma(cl->est_bps, (u32)min_t(u64,
+						   div64_u64(cl->est_bytes * PSCHED_TICKS_PER_SEC,
+									 n * interval), ~0U), n, ewma);
+	cl->est_pps = htb_ewma(cl->est_pps, (u32)min_t(u64,
+						   div64_u64((u64)cl->est_packets *
+									 PSCHED_TICKS_PER_SEC, n * interval),
+						   ~0U), n, ewma);
+	cl->est_t += n * interval;
+	cl->est_bytes = 0;
+	cl->est_packets = 0;
+}
+
+static inline void htb_rate_est(struct htb_sched *q, struct htb_class *cl,
+								int bytes, int segs)
+{
+	if (QCN_EST_INTERVAL <= 0)
+		return;
+	cl->est_bytes += bytes;
+	cl->est_packets += segs;
+	htb_rate_fold(cl, q->now);
+}
+
 /**
  * htb_charge_class - charges amount "bytes" to leaf and ancestors
  *
@@ -824,15 +2192,17 @@ static void htb_charge_class(struct htb_sched *q, struct htb_class *cl,
 			     int level, struct sk_buff *skb)
 {
 	int bytes = qdisc_pkt_len(skb);
+	int segs = skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
 	enum htb_cmode old_mode;
 	long diff;
 
 	while (cl) {
+		htb_rate_est(q, cl, bytes, segs);
 		diff = psched_tdiff_bounded(q->now, cl->t_c, cl->mbuffer);
 		if (cl->level >= level) {
 			if (cl->level == level)
 				cl->xstats.lends++;
-			htb_accnt_tokens(cl, bytes, diff); /*, q->clock_factor);*/
+			htb_accnt_tokens(cl, bytes, segs, diff); /*, q->clock_factor);*/
 		} else {
 			cl->xstats.borrows++;
 			cl->tokens += diff;	/* we moved t_c; update tokens */
@@ -845,7 +2215,7 @@ static void htb_charge_class(struct htb_sched *q, struct htb_class *cl,
 		htb_change_class_mode(q, cl, &diff);
 		if (old_mode != cl->cmode) {
 			if (old_mode != HTB_CAN_SEND)
-				htb_safe_rb_erase(&cl->pq_node, q->wait_pq + cl->level);
+				htb_remove_from_wait_tree(q, cl);
 			if (cl->cmode != HTB_CAN_SEND)
 				htb_add_to_wait_tree(q, cl, diff);
 		}
@@ -853,8 +2223,7 @@ static void htb_charge_class(struct htb_sched *q, struct htb_class *cl,
 		/* update byte stats except for leaves which are already updated */
 		if (cl->level) {
 			cl->bstats.bytes += bytes;
-			cl->bstats.packets += skb_is_gso(skb)?
-					skb_shinfo(skb)->gso_segs:1;
+			cl->bstats.packets += segs;
 		}
 		cl = cl->parent;
 	}
@@ -865,32 +2234,62 @@ static void htb_charge_class(struct htb_sched *q, struct htb_class *cl,
  *
  * Scans event queue for pending events and applies them. Returns time of
  * next pending event (0 for no event in pq, q->now for too many events).
- * Note: Applied are events whose have cl->pq_key <= q->now.
+ * Note: Applied are events whose have cl->pq_key <= q->now. The queue
+ * is worked slot by slot, a class put back goes to a later time.
  */
 static psched_time_t htb_do_events(struct htb_sched *q, int level,
 				   unsigned long start)
 {
+	struct htb_wheel *w = &q->wait_pq[level];
 	/* don't run for longer than 2 jiffies; 2 is used instead of
 	   1 to simplify things when jiffy is going to be incremented
 	   too soon */
 	unsigned long stop_at = start + 2;
 	while (time_before(jiffies, stop_at)) {
 		struct htb_class *cl;
+		struct hlist_node *n, *next;
+		HLIST_HEAD(due);
+		psched_time_t t;
+		unsigned int idx;
+		int ran = 0;
 		long diff;
-		struct rb_node *p = rb_first(&q->wait_pq[level]);
 
-		if (!p)
-			return 0;
+		if (!w->nr) {
+			struct rb_node *p = rb_first(&w->far);
 
-		cl = rb_entry(p, struct htb_class, pq_node);
-		if (cl->pq_key > q->now)
-			return cl->pq_key;
+			if (!p)
+				return 0;
+			cl = rb_entry(p, struct htb_class, pq_node);
+			if (cl->pq_key > q->now)
+				return cl->pq_key;
+			htb_wheel_advance(w, q->now);
+			continue;
+		}
 
-		htb_safe_rb_erase(p, q->wait_pq + level);
-		diff = psched_tdiff_bounded(q->now, cl->t_c, cl->mbuffer);
-		htb_change_class_mode(q, cl, &diff);
-		if (cl->cmode != HTB_CAN_SEND)
-			htb_add_to_wait_tree(q, cl, diff);
+		idx = htb_wheel_next(w, &t);
+		if (t > q->now)
+			return htb_wheel_slot_min(w, idx);
+		if (t != w->cur)
+			htb_wheel_advance(w, t);
+
+		hlist_move_list(&w->slot[idx], &due);
+		__clear_bit(idx, w->used);
+		hlist_for_each_entry_safe(cl, n, next, &due, pq_hnode) {
+			hlist_del_init(&cl->pq_hnode);
+			w->nr--;
+			if (cl->pq_key > q->now) {
+				htb_wheel_insert(w, cl);
+				continue;
+			}
+			diff = psched_tdiff_bounded(q->now, cl->t_c, cl->mbuffer);
+			htb_change_class_mode(q, cl, &diff);
+			if (cl->cmode != HTB_CAN_SEND)
+				htb_add_to_wait_tree(q, cl, diff);
+			ran = 1;
+		}
+		/* nothing in the slot was due yet, cur is still at it */
+		if (!ran)
+			return htb_wheel_slot_min(w, idx);
 	}
 
 	/* too much load - let's continue after a break for scheduling */
@@ -924,74 +2323,240 @@ static struct rb_node *htb_id_find_next_upper(int prio, struct rb_node *n,
 	return r;
 }
 
-static int qcn_recv_fb(struct Qdisc *sch, struct nlattr *opt)
+/* The shard below mq a pair hashes to */
+static inline int htb_pair_shard(const struct htb_sched *q, __be32 sa,
+								 __be32 da, u32 scope)
+{
+	htb_flow_key(q, &sa, &da, scope);
+	return jhash_2words((__force u32)sa, (__force u32)da, 0) %
+		q->nr_shards;
+}
+
+/* Below mq, feedback for a pair no shard knows yet is the business of
+   the shard the pair hashes to: only that one creates its class or
+   counts it as unmatched. The bridge sends the pair's packets to that
+   shard as well, see htb_qcn_home(). */
+static inline int htb_fb_home(const struct htb_sched *q,
+							  const struct qcn_frame *frame)
+{
+	if (q->shard < 0 || (frame->flags & htons(QCN_FRAME_FLOWID)))
+		return 1;
+	return htb_pair_shard(q, frame->SA, frame->DA,
+						  qcn_flow_scope(frame)) == q->shard;
+}
+
+/* qcn_tx_queue(): the shard of skb's pair, so that its packets and its
+   feedback meet in the same htb */
+static int htb_qcn_home(struct qcn_fb_handler *h, struct sk_buff *skb)
+{
+	struct htb_sched *q = qdisc_priv((struct Qdisc *)h->priv);
+	__be32 sa, da;
+	u32 scope;
+
+	if (!htb_flow_get(skb, &sa, &da, &scope))
+		return -1;
+	return htb_pair_shard(q, sa, da, scope);
+}
+
+/* called under rcu_read_lock */
+/* The class of frame, NULL if none, -ENOENT for the flow ID of another
+   TX queue. Under rcu_read_lock. */
+static struct htb_class *htb_fb_class(struct htb_sched *q,
+									  const struct qcn_frame *frame)
+{
+	if (frame->flags & htons(QCN_FRAME_FLOWID)) {
+		u32 id = ntohs(frame->flow_id);
+
+		if (q->shard >= 0) {
+			if (id / q->nr_flow_ids != q->shard)
+				return ERR_PTR(-ENOENT);
+			id %= q->nr_flow_ids;
+		}
+		return htb_flowid_find(q, id);
+	}
+	return htb_flow_find(q, frame->SA, frame->DA, qcn_flow_scope(frame));
+}
+
+/* Whether the first CNM of an unknown flow creates its RP here */
+static inline int htb_fb_creates(struct htb_sched *q,
+								 const struct qcn_frame *frame)
+{
+	return !(frame->flags & htons(QCN_FRAME_LOOKUP)) &&
+		q->auto_tmpl != NULL &&
+		!(frame->flags & htons(QCN_FRAME_FLOWID)) && htb_fb_home(q, frame);
+}
+
+/* locked: the root lock is held, see htb_fb_drain() */
+static int qcn_recv_fb(struct Qdisc *sch, struct qcn_frame *frame,
+					   int locked)
 {
-	struct qcn_frame *frame = (struct qcn_frame *)opt;
+	struct htb_sched *q = qdisc_priv(sch);
+	int lookup = frame->flags & htons(QCN_FRAME_LOOKUP);
 	struct htb_class *cl;
-	u32 dec_factor;
-	u32 new_crate, new_trate, bs, ts;
-	u32 gcd;
-	u64 tsc64;
+	u32 new_crate, new_trate, bs, ts, old_crate, id, qlen;
+	int restart_timer;
+	struct qcn_trace_rec rec;
 
 	/* printk(KERN_EMERG "%8x; qntz_Fb %8x; qdelta %8x; qoff %8x\n",
 		   psched_get_time(), ntohl(frame->Fb), ntohl(frame->qdelta),
 		   ntohl(frame->qoff)); */
 		
-	if ((cl = htb_find(gethandle(frame->SA, frame->DA), sch)) != NULL) {
+	cl = htb_fb_class(q, frame);
+	if (IS_ERR(cl))
+		return PTR_ERR(cl);
+
+	/* the first CNM of a flow can be what creates its RP */
+	if (cl == NULL && htb_fb_creates(q, frame)) {
+		spinlock_t *root_lock = qdisc_root_sleeping_lock(sch);
+
+		if (!locked)
+			spin_lock(root_lock);
+		if (q->auto_tmpl != NULL &&
+			(cl = htb_flow_find(q, frame->SA, frame->DA,
+								qcn_flow_scope(frame))) == NULL)
+			cl = htb_auto_claim(sch, frame->SA, frame->DA,
+								qcn_flow_scope(frame));
+		if (!locked)
+			spin_unlock(root_lock);
+	}
+
+	if (cl != NULL) {
+		cl->auto_seen = jiffies;
 		frame->Fb = ntohl(frame->Fb);
 		frame->qoff = ntohl(frame->qoff);
-		if (frame->Fb != 0) {
+		frame->qdelta = ntohl(frame->qdelta);
+		/* ours, but with the RP off nothing to do */
+		if (frame->Fb != 0 && cl->qp.enable) {
 			spin_lock(&cl->rate_lock);
-			/* Use the current rate as the next target rate
-			   In the first cycle of fast recovery, the Fb
-			   signal would not reset the target rate */
-			if (cl->bcount_stg != 0) {
-				cl->trate = min(cl->crate, cl->rate->rate.rate);
-				cl->bcount_tx = QCN_BC;
-				cl->timer = psched_get_time() + QCN_TIMER;
+			write_seqcount_begin(&cl->rate_seq);
+			/* the decrease starts from where recovery got to */
+			if (cl->timer_lazy)
+				qcn_rp_catch_up(cl);
+			old_crate = cl->rp.crate;
+			restart_timer = qcn_alg_decrease(cl->alg, cl->prof, &cl->rp,
+							&cl->qp, frame->Fb, cl->rate->rate.rate,
+							frame->qoff, frame->qdelta);
+			/* a cut that restarts the stages reset the byte counter
+			   too, see qcn_rp_cut(); the dequeue path takes it */
+			if (restart_timer) {
+				smp_wmb();
+				cl->bcount_gen++;
 			}
-			
-			/* Set the stage counters */
-			cl->bcount_stg = 0;
-			cl->timer_stg = 0;
-			
-			/* Update the current rate, multiplicative decrease */
-			/* Changing the expression to avoid the use of floating
-			   point values */
-			dec_factor = (cl->crate * frame->Fb) >> QCN_GD;
-			dec_factor = max(cl->crate >> QCN_MIN_RATE_DEC, dec_factor);
-			cl->crate = max(cl->crate - dec_factor, (u32) QCN_MIN_RATE);
-
-			gcd = gcd_fn(cl->rate->rate.rate, cl->crate);
-			cl->n = cl->rate->rate.rate/gcd;
-			cl->d = cl->crate/gcd;
-
-			new_crate = cl->crate;
-			new_trate = cl->trate;
-			bs = cl->bcount_stg;
-			ts = cl->timer_stg;
+
+			/* (Re)start the timer stages */
+			if (restart_timer || !hrtimer_active(&cl->timer.timer))
+				tasklet_hrtimer_start(&cl->timer,
+									  qcn_timer_period(cl),
+									  HRTIMER_MODE_REL);
+
+			qcn_update_rate(cl);
+			cl->cnm_received++;
+			htb_lat_note(cl, frame);
+			htb_telem(cl, frame->Fb);
+			htb_rate_event(cl, QCN_RATE_CUT, old_crate, frame->Fb);
+
+			new_crate = cl->rp.crate;
+			new_trate = cl->rp.trate;
+			bs = cl->rp.bcount_stg;
+			ts = cl->rp.timer_stg;
+			/* the leaf may go once rate_lock is dropped */
+			id = cl->un.leaf.q->handle >> 16;
+			qlen = cl->un.leaf.q->q.qlen;
+			write_seqcount_end(&cl->rate_seq);
 			spin_unlock(&cl->rate_lock);
-			/* printk(KERN_EMERG "%s rp: new crate %d, dec_factor %d, Fb %08x", 
-				   sch->dev_queue->dev->name, new_crate, dec_factor, 
-				   frame->Fb); */
-
-			rdtscll(tsc64);
-			printk(KERN_INFO "htb %llu %x: QLEN %d TOKS %ld CR %d"
-				   " TR %d Fb %d BS %d TS %d\n", tsc64, 
-				   cl->un.leaf.q->handle >> 16, 
-				   cl->un.leaf.q->q.qlen, cl->tokens, 
-				   new_crate*8/1000/1000, new_trate*8/1000/1000,
-				   frame->Fb, bs, ts);
+			/* printk(KERN_EMERG "%s rp: new crate %d, Fb %08x",
+				   sch->dev_queue->dev->name, new_crate, frame->Fb); */
+
+			if (qcn_trace_enabled) {
+				rec.tsc = get_cycles();
+				rec.type = QCN_TRACE_RP_FB;
+				rec.id = id;
+				rec.qlen = qlen;
+				rec.fb = frame->Fb;
+				rec.toks = cl->tokens;
+				rec.crate = new_crate;
+				rec.trate = new_trate;
+				rec.bcount_stg = bs;
+				rec.timer_stg = ts;
+				rec.pad = 0;
+				__qcn_trace(&rec);
+			}
 
 			return 1;
 		}
 		return -1;
 	}
-	printk(KERN_INFO "Class not found!\n");
-	return -2;
+	if (!lookup && htb_fb_home(q, frame)) {
+		atomic_inc(&q->cnm_unmatched);
+		if (net_ratelimit())
+			printk(KERN_INFO "Class not found!\n");
+	}
+	return -ENOENT;
 	
 }
 
+/* Decides at once whether frame is ours, so that the other RPs below mq
+   are asked in time, but leaves the rate update to the next dequeue,
+   which a queue going non-empty schedules. A full queue or
+   QCN_FB_DEFER off has the record applied here. */
+static int htb_qcn_fb(struct qcn_fb_handler *h, struct qcn_frame *frame)
+{
+	struct Qdisc *sch = h->priv;
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_class *cl;
+	struct qcn_frame rec;
+	int ret;
+
+	if (!QCN_FB_DEFER)
+		return qcn_recv_fb(sch, frame, 0);
+
+	cl = htb_fb_class(q, frame);
+	if (IS_ERR(cl))
+		return PTR_ERR(cl);
+	if (cl == NULL && !htb_fb_creates(q, frame))
+		return qcn_recv_fb(sch, frame, 0);	/* counts it */
+	if (cl != NULL && (frame->Fb == 0 || !cl->qp.enable)) {
+		cl->auto_seen = jiffies;
+		return -1;
+	}
+
+	/* the record is ours now, whatever happens to the lookup pass */
+	rec = *frame;
+	rec.flags &= ~htons(QCN_FRAME_LOOKUP);
+	ret = qcn_fb_queue_add(&q->fb_queue, &rec);
+	if (ret < 0)
+		return qcn_recv_fb(sch, &rec, 0);
+	if (ret && !test_bit(__QDISC_STATE_DEACTIVATED,
+						 &qdisc_root(sch)->state))
+		__netif_schedule(qdisc_root(sch));
+	return frame->Fb ? 1 : -1;
+}
+
+#define HTB_FB_BATCH	8
+
+/* The feedback htb_qcn_fb() queued, from the dequeue path once kicked.
+   At most one queue's worth per call; what is left, or still being
+   added, has us kicked and scheduled again. */
+static void htb_fb_drain(struct Qdisc *sch)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct qcn_frame frames[HTB_FB_BATCH];
+	unsigned int n, i, total = 0;
+
+	rcu_read_lock();
+	do {
+		n = qcn_fb_queue_drain(&q->fb_queue, frames, HTB_FB_BATCH);
+		for (i = 0; i < n; i++)
+			qcn_recv_fb(sch, &frames[i], 1);
+		total += n;
+	} while (n == HTB_FB_BATCH && total < QCN_FB_QUEUE_LEN);
+	rcu_read_unlock();
+	q->cnm_deferred += total;
+
+	if (qcn_fb_queue_rearm(&q->fb_queue))
+		__netif_schedule(qdisc_root(sch));
+}
+
 /**
  * htb_lookup_leaf - returns next leaf class in DRR order
  *
@@ -1123,10 +2688,15 @@ static struct sk_buff *htb_dequeue(struct Qdisc *sch)
 	psched_time_t next_event;
 	unsigned long start_at;
 
+	if (unlikely(qcn_fb_queue_kicked(&q->fb_queue)))
+		htb_fb_drain(sch);
+
 	/* try to dequeue direct packets as high prio (!) to minimize cpu work */
-	skb = __skb_dequeue(&q->direct_queue);
+	skb = __skb_dequeue(&q->cnm_queue);
+	if (skb == NULL)
+		skb = __skb_dequeue(&q->direct_queue);
 	if (skb != NULL) {
-		sch->flags &= ~TCQ_F_THROTTLED;
+		qcn_qdisc_unthrottled(sch);
 		sch->q.qlen--;
 		return skb;
 	}
@@ -1161,7 +2731,7 @@ static struct sk_buff *htb_dequeue(struct Qdisc *sch)
 			skb = htb_dequeue_tree(q, prio, level);
 			if (likely(skb != NULL)) {
 				sch->q.qlen--;
-				sch->flags &= ~TCQ_F_THROTTLED;
+				qcn_qdisc_unthrottled(sch);
 				goto fin;
 			}
 		}
@@ -1196,49 +2766,416 @@ static unsigned int htb_drop(struct Qdisc *sch)
 			}
 		}
 	}
-	return 0;
+	return 0;
+}
+
+/* reset all classes */
+/* always caled under BH & queue lock */
+static void htb_reset(struct Qdisc *sch)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_class *cl;
+	struct hlist_node *n;
+	unsigned int i;
+
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry(cl, n, &q->clhash.hash[i], common.hnode) {
+			if (cl->level)
+				memset(&cl->un.inner, 0, sizeof(cl->un.inner));
+			else {
+				if (cl->un.leaf.q)
+					qdisc_reset(cl->un.leaf.q);
+				INIT_LIST_HEAD(&cl->un.leaf.drop_list);
+			}
+			cl->prio_activity = 0;
+			cl->cmode = HTB_CAN_SEND;
+			RB_CLEAR_NODE(&cl->pq_node);
+			INIT_HLIST_NODE(&cl->pq_hnode);
+		}
+	}
+	qdisc_watchdog_cancel(&q->watchdog);
+	__skb_queue_purge(&q->cnm_queue);
+	__skb_queue_purge(&q->direct_queue);
+	sch->q.qlen = 0;
+	memset(q->row, 0, sizeof(q->row));
+	memset(q->row_mask, 0, sizeof(q->row_mask));
+	for (i = 0; i < TC_HTB_MAXDEPTH; i++)
+		htb_wheel_reset(&q->wait_pq[i],
+						q->wait_slots + i * HTB_WHEEL_SLOTS);
+	memset(q->ptr, 0, sizeof(q->ptr));
+	for (i = 0; i < TC_HTB_NUMPRIO; i++)
+		INIT_LIST_HEAD(q->drops + i);
+}
+
+static const struct nla_policy htb_policy[TCA_HTB_QCN_FLOWS + 1] = {
+	[TCA_HTB_PARMS]	= { .len = sizeof(struct tc_htb_opt) },
+	[TCA_HTB_INIT]	= { .len = sizeof(struct tc_htb_glob) },
+	[TCA_HTB_CTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+	[TCA_HTB_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+	[TCA_HTB_QCN]	= { .len = sizeof(struct tc_qcn_rp_opt) },
+	[TCA_HTB_QCN_FLOWS] = { .type = NLA_BINARY },
+};
+
+static int htb_qdisc_params_check(const struct tc_qcn_rp_opt *qopt)
+{
+	if (qopt->flags & (TC_QCN_RP_FLOW | TC_QCN_RP_HW_VF))
+		return -EINVAL;		/* a flow or VF belongs to one class */
+	return qcn_rp_check(qopt);
+}
+
+/* auto_class names an existing leaf, resolved under RTNL */
+static int htb_auto_check(struct Qdisc *sch, const struct tc_qcn_rp_opt *qopt,
+						  struct htb_class **tmpl)
+{
+	struct htb_class *cl;
+
+	*tmpl = NULL;
+	if (!(qopt->flags & TC_QCN_RP_AUTO) || !qopt->auto_class)
+		return 0;
+	cl = htb_find(qopt->auto_class, sch);
+	if (cl == NULL || cl->level || htb_flow_pinned(cl) || cl->hw != NULL ||
+		!list_empty(&cl->auto_node))
+		return -EINVAL;
+	*tmpl = cl;
+	return 0;
+}
+
+/* called under sch_tree_lock (or before the qdisc is visible) */
+static void htb_qdisc_params_change(struct htb_sched *q,
+									const struct tc_qcn_rp_opt *qopt)
+{
+	qcn_rp_change(&q->rp_defaults, qopt);
+	if (qopt->flags & TC_QCN_RP_CLASSIFY) {
+		q->rp_defaults.classify = qopt->classify;
+		if (qopt->classify)
+			q->rp_defaults.flags |= TC_QCN_RP_CLASSIFY;
+		else
+			q->rp_defaults.flags &= ~TC_QCN_RP_CLASSIFY;
+	}
+	if (qopt->flags & TC_QCN_RP_AUTO_IDLE) {
+		q->rp_defaults.auto_idle = qopt->auto_idle;
+		q->rp_defaults.flags |= TC_QCN_RP_AUTO_IDLE;
+		q->auto_idle = msecs_to_jiffies(qopt->auto_idle);
+	}
+	if (qopt->flags & TC_QCN_RP_AGGREGATE) {
+		q->rp_defaults.agg_src = qopt->agg_src;
+		q->rp_defaults.agg_dst = qopt->agg_dst;
+		if (qopt->agg_src < 32 || qopt->agg_dst < 32)
+			q->rp_defaults.flags |= TC_QCN_RP_AGGREGATE;
+		else
+			q->rp_defaults.flags &= ~TC_QCN_RP_AGGREGATE;
+		htb_flow_agg_set(q);
+	}
+}
+
+/* What every class starts with before it is configured */
+static void htb_class_init(struct Qdisc *sch, struct htb_class *cl)
+{
+	int prio;
+
+	cl->refcnt = 1;
+	cl->children = 0;
+	INIT_LIST_HEAD(&cl->un.leaf.drop_list);
+	RB_CLEAR_NODE(&cl->pq_node);
+	INIT_HLIST_NODE(&cl->pq_hnode);
+	for (prio = 0; prio < TC_HTB_NUMPRIO; prio++)
+		RB_CLEAR_NODE(&cl->node[prio]);
+	cl->flow_node.pprev = NULL;		/* hlist_nulls_unhashed() */
+	INIT_LIST_HEAD(&cl->auto_node);
+	cl->hw_vf = -1;
+	cl->cmode = HTB_CAN_SEND;
+
+	/* QCN RP Initialization */
+	spin_lock_init(&cl->rate_lock);
+	seqcount_init(&cl->rate_seq);
+	tasklet_hrtimer_init(&cl->timer, qcn_rp_timer,
+						 CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	/* best effort, the handle is filled in by htb_telem() */
+	cl->telem = qcn_telem_get(QCN_TELEM_RP, qdisc_dev(sch)->ifindex, 0, 0);
+	cl->ifindex = qdisc_dev(sch)->ifindex;
+	cl->net = dev_net(qdisc_dev(sch));
+}
+
+static void htb_destroy_class(struct Qdisc *sch, struct htb_class *cl);
+static void htb_reap(struct Qdisc *sch, struct htb_class *cl);
+
+/* Class creation off the hot path.
+   A new leaf from tc or a bulk add is taken ready made, with its pfifo
+   and QCN state set up, from a reserve of qcn_class_reserve that a work
+   item refills behind it; with the reserve empty it is made on the
+   spot as before. The same work grows the class hash ahead of the
+   classes, the ones in the reserve and the auto spares counted, so
+   that no creation pays for qdisc_class_hash_grow(). Growing moves the
+   classes a few buckets per hold of the tree lock, and htb_find() and
+   htb_qcn_dump() look in the old table for the ones not moved yet;
+   everything else that walks the hash holds RTNL, as the work does
+   until it is done. */
+#define HTB_CLHASH_BATCH	64	/* buckets moved per hold of the lock */
+
+/* As qdisc_class_hash_destroy() frees them */
+static struct hlist_head *htb_clhash_alloc(unsigned int n)
+{
+	unsigned int size = n * sizeof(struct hlist_head), i;
+	struct hlist_head *h;
+
+	if (size <= PAGE_SIZE)
+		h = kmalloc(size, GFP_KERNEL);
+	else
+		h = (struct hlist_head *)
+			__get_free_pages(GFP_KERNEL, get_order(size));
+	if (h != NULL)
+		for (i = 0; i < n; i++)
+			INIT_HLIST_HEAD(&h[i]);
+	return h;
+}
+
+static void htb_clhash_free(struct hlist_head *h, unsigned int n)
+{
+	unsigned int size = n * sizeof(struct hlist_head);
+
+	if (size <= PAGE_SIZE)
+		kfree(h);
+	else
+		free_pages((unsigned long)h, get_order(size));
+}
+
+/* called under RTNL, see above */
+static void htb_clhash_grow(struct Qdisc *sch)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	unsigned int want = q->clhash.hashelems + q->nr_reserve +
+		q->auto_nr_free;
+	unsigned int osize = q->clhash.hashsize, nsize = osize, i, j;
+	struct Qdisc_class_common *clc;
+	struct hlist_head *ohash, *nhash;
+	struct hlist_node *n, *next;
+
+	/* the load qdisc_class_hash_grow() keeps, from the same sizes */
+	while (want * 4 > nsize * 3 && nsize < (1U << 20))
+		nsize <<= 1;
+	if (nsize == osize || (nhash = htb_clhash_alloc(nsize)) == NULL)
+		return;
+
+	sch_tree_lock(sch);
+	ohash = q->clhash.hash;
+	q->clhash_old = ohash;
+	q->clhash_old_mask = osize - 1;
+	q->clhash.hash = nhash;
+	q->clhash.hashsize = nsize;
+	q->clhash.hashmask = nsize - 1;
+	sch_tree_unlock(sch);
+
+	for (i = 0; i < osize; i += HTB_CLHASH_BATCH) {
+		sch_tree_lock(sch);
+		for (j = i; j < min(i + HTB_CLHASH_BATCH, osize); j++)
+			hlist_for_each_entry_safe(clc, n, next, &ohash[j], hnode) {
+				hlist_del(&clc->hnode);
+				hlist_add_head(&clc->hnode,
+							   &nhash[qdisc_class_hash(clc->classid,
+													   nsize - 1)]);
+			}
+		sch_tree_unlock(sch);
+		cond_resched();
+	}
+
+	sch_tree_lock(sch);
+	q->clhash_old = NULL;
+	sch_tree_unlock(sch);
+	htb_clhash_free(ohash, osize);
+}
+
+/* A leaf for the reserve; called under RTNL */
+static struct htb_class *htb_reserve_alloc(struct Qdisc *sch)
+{
+	struct htb_class *cl;
+
+	if ((cl = kmem_cache_zalloc(htb_class_cachep, GFP_KERNEL)) == NULL)
+		return NULL;
+	cl->un.leaf.q = qdisc_create_dflt(qdisc_dev(sch), sch->dev_queue,
+									  &pfifo_qdisc_ops, sch->handle);
+	if (cl->un.leaf.q == NULL) {
+		kmem_cache_free(htb_class_cachep, cl);
+		return NULL;
+	}
+	htb_class_init(sch, cl);
+	return cl;
+}
+
+static inline void htb_class_kick(struct htb_sched *q)
+{
+	if ((int)q->nr_reserve < qcn_class_reserve ||
+		q->clhash.hashelems * 4 > q->clhash.hashsize * 3)
+		schedule_delayed_work(&q->class_work, 0);
+}
+
+/* A ready made leaf for classid, NULL if there is none; under RTNL */
+static struct htb_class *htb_reserve_get(struct htb_sched *q, u32 classid)
+{
+	struct htb_class *cl;
+
+	if (list_empty(&q->reserve))
+		return NULL;
+	cl = list_first_entry(&q->reserve, struct htb_class, auto_node);
+	list_del_init(&cl->auto_node);
+	q->nr_reserve--;
+	cl->un.leaf.q->parent = classid;
+	htb_class_kick(q);
+	return cl;
+}
+
+/* Gives back a leaf htb_reserve_get() handed out and nobody saw */
+static void htb_reserve_put(struct htb_sched *q, struct htb_class *cl)
+{
+	list_add(&cl->auto_node, &q->reserve);
+	q->nr_reserve++;
+}
+
+static void htb_class_work(struct work_struct *work)
+{
+	struct htb_sched *q = container_of(work, struct htb_sched,
+									   class_work.work);
+	struct Qdisc *sch = q->watchdog.qdisc;
+	struct htb_class *cl;
+
+	/* htb_destroy() waits for us holding RTNL */
+	if (!rtnl_trylock()) {
+		schedule_delayed_work(&q->class_work, 1);
+		return;
+	}
+	while ((int)q->nr_reserve < qcn_class_reserve &&
+		   (cl = htb_reserve_alloc(sch)) != NULL) {
+		list_add_tail(&cl->auto_node, &q->reserve);
+		q->nr_reserve++;
+	}
+	htb_clhash_grow(sch);
+	rtnl_unlock();
+}
+
+/* A spare made after tmpl; called under RTNL */
+static struct htb_class *htb_auto_alloc(struct Qdisc *sch,
+										struct htb_class *tmpl)
+{
+	struct Qdisc_ops *ops = &pfifo_qdisc_ops;
+	struct htb_class *cl;
+
+	if ((cl = kmem_cache_zalloc(htb_class_cachep, GFP_KERNEL)) == NULL)
+		return NULL;
+
+	/* same kind of leaf as the template, with its defaults */
+	if (tmpl->un.leaf.q != &noop_qdisc)
+		ops = tmpl->un.leaf.q->ops;
+	cl->un.leaf.q = qdisc_create_dflt(qdisc_dev(sch), sch->dev_queue, ops,
+									  tmpl->common.classid);
+	if (cl->un.leaf.q == NULL && ops != &pfifo_qdisc_ops)
+		cl->un.leaf.q = qdisc_create_dflt(qdisc_dev(sch), sch->dev_queue,
+										  &pfifo_qdisc_ops,
+										  tmpl->common.classid);
+	if (cl->un.leaf.q == NULL) {
+		kmem_cache_free(htb_class_cachep, cl);
+		return NULL;
+	}
+
+	htb_class_init(sch, cl);
+	cl->rate = tmpl->rate;
+	cl->rate->refcnt++;
+	cl->ceil = tmpl->ceil;
+	cl->ceil->refcnt++;
+	return cl;
+}
+
+/* Drops the spares, e.g. when the template changed; called under RTNL */
+static void htb_auto_flush(struct Qdisc *sch)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_class *cl, *next;
+	LIST_HEAD(spares);
+
+	sch_tree_lock(sch);
+	list_splice_init(&q->auto_free, &spares);
+	q->auto_nr_free = 0;
+	sch_tree_unlock(sch);
+
+	list_for_each_entry_safe(cl, next, &spares, auto_node)
+		htb_destroy_class(sch, cl);
+}
+
+static void htb_auto_fill_work(struct work_struct *work)
+{
+	struct htb_sched *q = container_of(work, struct htb_sched,
+									   auto_fill.work);
+	struct Qdisc *sch = q->watchdog.qdisc;
+	struct htb_class *cl;
+
+	/* htb_destroy() waits for us holding RTNL */
+	if (!rtnl_trylock()) {
+		schedule_delayed_work(&q->auto_fill, 1);
+		return;
+	}
+	while (q->auto_tmpl != NULL && (int)q->auto_nr_free < qcn_auto_pool &&
+		   q->auto_nr_free + q->auto_nr_live <
+		   (unsigned int)clamp(qcn_auto_max, 0, HTB_AUTO_MINORS)) {
+		if ((cl = htb_auto_alloc(sch, q->auto_tmpl)) == NULL)
+			break;
+		sch_tree_lock(sch);
+		list_add_tail(&cl->auto_node, &q->auto_free);
+		q->auto_nr_free++;
+		sch_tree_unlock(sch);
+	}
+	htb_clhash_grow(sch);
+	rtnl_unlock();
 }
 
-/* reset all classes */
-/* always caled under BH & queue lock */
-static void htb_reset(struct Qdisc *sch)
+/* called under sch_tree_lock; htb_delete() for a class that is not
+   its parent's last child and holds no packets */
+static void htb_auto_unlink(struct htb_sched *q, struct htb_class *cl)
 {
-	struct htb_sched *q = qdisc_priv(sch);
-	struct htb_class *cl;
-	struct hlist_node *n;
-	unsigned int i;
+	qdisc_class_hash_remove(&q->clhash, &cl->common);
+	htb_flow_unlink(cl);
+	htb_flowid_set(q, cl, NULL);
+	htb_hw_unbind(&q->hw, cl);
+	if (cl->parent)
+		cl->parent->children--;
+	if (cl->prio_activity)
+		htb_deactivate(q, cl);
+	if (cl->cmode != HTB_CAN_SEND)
+		htb_remove_from_wait_tree(q, cl);
+	htb_auto_forget(q, cl);
+}
 
-	for (i = 0; i < q->clhash.hashsize; i++) {
-		hlist_for_each_entry(cl, n, &q->clhash.hash[i], common.hnode) {
-			if (cl->level)
-				memset(&cl->un.inner, 0, sizeof(cl->un.inner));
-			else {
-				if (cl->un.leaf.q)
-					qdisc_reset(cl->un.leaf.q);
-				INIT_LIST_HEAD(&cl->un.leaf.drop_list);
-			}
-			cl->prio_activity = 0;
-			cl->cmode = HTB_CAN_SEND;
+static void htb_auto_gc_work(struct work_struct *work)
+{
+	struct htb_sched *q = container_of(work, struct htb_sched,
+									   auto_gc.work);
+	struct Qdisc *sch = q->watchdog.qdisc;
+	struct htb_class *cl, *next;
+	LIST_HEAD(idle);
 
-		}
+	if (!rtnl_trylock()) {
+		schedule_delayed_work(&q->auto_gc, 1);
+		return;
 	}
-	qdisc_watchdog_cancel(&q->watchdog);
-	__skb_queue_purge(&q->direct_queue);
-	sch->q.qlen = 0;
-	memset(q->row, 0, sizeof(q->row));
-	memset(q->row_mask, 0, sizeof(q->row_mask));
-	memset(q->wait_pq, 0, sizeof(q->wait_pq));
-	memset(q->ptr, 0, sizeof(q->ptr));
-	for (i = 0; i < TC_HTB_NUMPRIO; i++)
-		INIT_LIST_HEAD(q->drops + i);
-}
 
-static const struct nla_policy htb_policy[TCA_HTB_MAX + 1] = {
-	[TCA_HTB_PARMS]	= { .len = sizeof(struct tc_htb_opt) },
-	[TCA_HTB_INIT]	= { .len = sizeof(struct tc_htb_glob) },
-	[TCA_HTB_CTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
-	[TCA_HTB_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
-};
+	sch_tree_lock(sch);
+	list_for_each_entry_safe(cl, next, &q->auto_list, auto_node) {
+		/* tc holding or filtering to it, or in use: not ours to drop */
+		if (!q->auto_idle ||
+			time_before(jiffies, cl->auto_seen + q->auto_idle) ||
+			cl->level || cl->un.leaf.q->q.qlen || cl->filter_cnt ||
+			cl->refcnt != 1 ||
+			(cl->parent != NULL && cl->parent->children < 2))
+			continue;
+		htb_auto_unlink(q, cl);
+		list_add(&cl->auto_node, &idle);
+		q->auto_reclaimed++;
+	}
+	if (q->auto_idle && q->auto_nr_live)
+		schedule_delayed_work(&q->auto_gc, htb_auto_period(q));
+	sch_tree_unlock(sch);
+
+	list_for_each_entry_safe(cl, next, &idle, auto_node)
+		htb_reap(sch, cl);
+	rtnl_unlock();
+}
 
 static void htb_work_func(struct work_struct *work)
 {
@@ -1248,10 +3185,101 @@ static void htb_work_func(struct work_struct *work)
 	__netif_schedule(qdisc_root(sch));
 }
 
+/* The TX queue an htb grafted right below the mq root serves, -1 for
+   any other place. mq keeps a child per queue at major:queue+1, and the
+   stack spreads the flows over them, so each one is a shard of the RP
+   taking the lock of its own queue only. */
+static int htb_mq_queue(struct Qdisc *sch)
+{
+	struct Qdisc *root = qdisc_dev(sch)->qdisc;
+
+	if (root == NULL || root == sch || strcmp(root->ops->id, "mq") ||
+		TC_H_MAJ(sch->parent) != root->handle ||
+		TC_H_MIN(sch->parent) == 0)
+		return -1;
+	return TC_H_MIN(sch->parent) - 1;
+}
+
+/* QCN_CMD_RP_DUMP, see qcn_tc.h: the leaves from bucket pos[0] of the
+   class hash on, past the first pos[1] of it, n at most per call and
+   the tree lock held for those only. The dump holds no RTNL, so a grow
+   of the hash (see htb_clhash_grow()) may run under it: the classes
+   still in the old table go first, then those in the new one, and
+   pos[0] keeps above HTB_DUMP_SHIFT the order of the table the walk is
+   in. A walk whose table has grown since goes on at the same bucket of
+   the one it grew into, where all of its classes are at that bucket or
+   past it; it may see a class twice, but misses none. */
+#define HTB_DUMP_SHIFT		24
+
+static int htb_qcn_dump(struct qcn_fb_handler *h, struct qcn_rp_rec *rec,
+						int n, unsigned long *pos)
+{
+	struct Qdisc *sch = h->priv;
+	struct htb_sched *q = qdisc_priv(sch);
+	spinlock_t *root_lock = qdisc_root_sleeping_lock(sch);
+	struct qcn_rate_snap snap;
+	struct htb_class *cl;
+	struct hlist_head *hash;
+	struct hlist_node *node;
+	unsigned long i = pos[0] & ((1UL << HTB_DUMP_SHIFT) - 1);
+	unsigned long order = pos[0] >> HTB_DUMP_SHIFT, skip = pos[1], k;
+	unsigned int size;
+	int nr = 0;
+
+	spin_lock_bh(root_lock);
+	if (q->clhash_old != NULL &&
+		(!order || 1UL << (order - 1) != q->clhash.hashsize)) {
+		hash = q->clhash_old;
+		size = q->clhash_old_mask + 1;
+	} else {
+		hash = q->clhash.hash;
+		size = q->clhash.hashsize;
+	}
+	if (order && 1UL << (order - 1) != size)
+		skip = 0;	/* not the table the walk was in */
+next:
+	for (; i < size; i++, skip = 0) {
+		k = 0;
+		hlist_for_each_entry(cl, node, &hash[i], common.hnode) {
+			if (k++ < skip || cl->level)
+				continue;
+			if (nr == n) {
+				skip = k - 1;
+				goto out;
+			}
+			qcn_read_rate(cl, &snap);
+			rec[nr].handle = cl->common.classid;
+			rec[nr].queue = q->shard;
+			rec[nr].crate = snap.crate;
+			rec[nr].trate = snap.trate;
+			rec[nr].bytes = cl->bstats.bytes;
+			rec[nr].packets = cl->bstats.packets;
+			rec[nr].drops = cl->qstats.drops;
+			rec[nr].cnm_received = cl->cnm_received;
+			rec[nr].bcount_stg = snap.bcount_stg;
+			rec[nr].timer_stg = snap.timer_stg;
+			nr++;
+		}
+	}
+	if (hash != q->clhash.hash) {
+		hash = q->clhash.hash;
+		size = q->clhash.hashsize;
+		i = 0;
+		goto next;
+	}
+	skip = 0;
+out:
+	spin_unlock_bh(root_lock);
+	pos[0] = i | (unsigned long)(ilog2(size) + 1) << HTB_DUMP_SHIFT;
+	pos[1] = skip;
+	return nr;
+}
+
 static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 {
 	struct htb_sched *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_HTB_INIT + 1];
+	struct nlattr *tb[TCA_HTB_QCN + 1];
+	struct tc_qcn_rp_opt *qopt = NULL;
 	struct tc_htb_glob *gopt;
 	int err;
 	int i;
@@ -1259,10 +3287,25 @@ static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 	if (!opt)
 		return -EINVAL;
 
-	err = nla_parse_nested(tb, TCA_HTB_INIT, opt, htb_policy);
+	err = nla_parse_nested(tb, TCA_HTB_QCN, opt, htb_policy);
 	if (err < 0)
 		return err;
 
+	qcn_rp_params_init(&q->rp_defaults);
+	htb_flow_agg_set(q);
+	INIT_LIST_HEAD(&q->auto_free);
+	INIT_LIST_HEAD(&q->auto_list);
+	if (tb[TCA_HTB_QCN]) {
+		qopt = nla_data(tb[TCA_HTB_QCN]);
+
+		/* there is no class to be the template yet */
+		if ((qopt->flags & TC_QCN_RP_AUTO) && qopt->auto_class)
+			return -EINVAL;
+		if ((err = htb_qdisc_params_check(qopt)) != 0)
+			return err;
+		htb_qdisc_params_change(q, qopt);
+	}
+
 	if (tb[TCA_HTB_INIT] == NULL) {
 		printk(KERN_ERR "HTB: hey probably you have bad tc tool ?\n");
 		return -EINVAL;
@@ -1278,12 +3321,48 @@ static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 	err = qdisc_class_hash_init(&q->clhash);
 	if (err < 0)
 		return err;
+
+	q->flow_mask = (1 << clamp(qcn_flow_hash_bits, 4, 24)) - 1;
+	q->flow_hash = htb_flow_hash_alloc(q->flow_mask + 1);
+	if (q->flow_hash == NULL) {
+		qdisc_class_hash_destroy(&q->clhash);
+		return -ENOMEM;
+	}
+	get_random_bytes(&q->flow_rnd, sizeof(q->flow_rnd));
+
+	q->nr_flow_ids = clamp(qcn_flow_ids, 1, 1 << 16);
+	q->flow_ids = htb_table_alloc(q->nr_flow_ids * sizeof(*q->flow_ids));
+	if (q->flow_ids == NULL) {
+		htb_flow_hash_free(q->flow_hash, q->flow_mask + 1);
+		qdisc_class_hash_destroy(&q->clhash);
+		return -ENOMEM;
+	}
+	q->wait_slots = htb_table_alloc(HTB_WAIT_SLOTS_SIZE);
+	if (q->wait_slots == NULL) {
+		err = -ENOMEM;
+		goto err_slots;
+	}
+	/* last, there is nothing to undo past it */
+	if (qopt && (err = qcn_alg_opt_get(qopt->flags, TC_QCN_RP_ALG,
+									   qopt->alg, &q->alg)) < 0) {
+		htb_table_free(q->wait_slots, HTB_WAIT_SLOTS_SIZE);
+		goto err_slots;
+	}
+	for (i = 0; i < TC_HTB_MAXDEPTH; i++)
+		htb_wheel_reset(&q->wait_pq[i],
+						q->wait_slots + i * HTB_WHEEL_SLOTS);
 	for (i = 0; i < TC_HTB_NUMPRIO; i++)
 		INIT_LIST_HEAD(q->drops + i);
 
 	qdisc_watchdog_init(&q->watchdog, sch);
 	INIT_WORK(&q->work, htb_work_func);
+	INIT_DELAYED_WORK(&q->auto_fill, htb_auto_fill_work);
+	INIT_DELAYED_WORK(&q->auto_gc, htb_auto_gc_work);
+	INIT_LIST_HEAD(&q->reserve);
+	INIT_DELAYED_WORK(&q->class_work, htb_class_work);
+	INIT_DELAYED_WORK(&q->hw.work, htb_hw_work);
 	skb_queue_head_init(&q->direct_queue);
+	skb_queue_head_init(&q->cnm_queue);
 
 	q->direct_qlen = qdisc_dev(sch)->tx_queue_len;
 	if (q->direct_qlen < 2)	/* some devices have zero tx_queue_len */
@@ -1298,15 +3377,359 @@ static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 	/* q->clock_factor = ((u32)NSEC_PER_USEC * 1000000) / 
 		(u32)PSCHED_TICKS2NS(1); */
 	printk(KERN_ALERT "%s rp: init\n"
-		   "%s rp: QCN_TIMER %d; QCN_FASTREC %d; QCN_BC %d;\n"
+		   "%s rp: QCN_TIMER %u ns; QCN_FASTREC %d; QCN_BC %d;\n"
 		   "%s rp: QCN_AI %d; QCN_HAI %d; QCN_GD %d, QCN_MIN_RATE %d;\n"
 		   "%s rp: QCN_MIN_RATE_DEC %d\n",
 		   sch->dev_queue->dev->name,
-		   sch->dev_queue->dev->name, QCN_TIMER, QCN_FASTREC, QCN_BC,
-		   sch->dev_queue->dev->name, QCN_AI, QCN_HAI, QCN_GD, QCN_MIN_RATE,
-		   sch->dev_queue->dev->name, QCN_MIN_RATE_DEC);
+		   sch->dev_queue->dev->name, q->rp_defaults.timer,
+		   q->rp_defaults.fastrec, q->rp_defaults.bc,
+		   sch->dev_queue->dev->name, q->rp_defaults.ai, q->rp_defaults.hai,
+		   q->rp_defaults.gd, q->rp_defaults.min_rate,
+		   sch->dev_queue->dev->name, q->rp_defaults.min_rate_dec);
+
+	/* Only the root RP, or one per TX queue below mq, receives the
+	   feedback sent to this device */
+	INIT_HLIST_NODE(&q->fb_handler.hnode);
+	atomic_set(&q->cnm_unmatched, 0);
+	qcn_fb_queue_init(&q->fb_queue);
+	q->shard = htb_mq_queue(sch);
+	q->nr_shards = max_t(unsigned int, qdisc_dev(sch)->real_num_tx_queues,
+						 q->shard + 1);
+	if (sch->parent == TC_H_ROOT || q->shard >= 0) {
+		q->fb_handler.queue = q->shard;
+		q->fb_handler.ifindex = qdisc_dev(sch)->ifindex;
+		q->fb_handler.net = dev_net(qdisc_dev(sch));
+		q->fb_handler.recv = htb_qcn_fb;
+		q->fb_handler.home = q->shard >= 0 ? htb_qcn_home : NULL;
+		q->fb_handler.dump = htb_qcn_dump;
+		q->fb_handler.priv = sch;
+		err = qcn_fb_register(&q->fb_handler);
+		if (err)
+			printk(KERN_WARNING "%s rp: feedback handler busy (%d)\n",
+				   sch->dev_queue->dev->name, err);
+	}
+	htb_class_kick(q);
+	return 0;
+
+err_slots:
+	htb_table_free(q->flow_ids, q->nr_flow_ids * sizeof(*q->flow_ids));
+	htb_flow_hash_free(q->flow_hash, q->flow_mask + 1);
+	qdisc_class_hash_destroy(&q->clhash);
+	return err;
+}
+
+/* Bulk provisioning, see TCA_HTB_QCN_FLOWS in qcn_tc.h */
+
+struct htb_bulk_tab {
+	struct nlattr	nla;
+	u32		data[256];
+};
+
+/* The rate table tc computes for rate bytes/s at an MTU of 2047, so
+   that classes of one rate get to share a single table */
+static void htb_bulk_rtab(struct tc_ratespec *r, struct htb_bulk_tab *tab,
+						  u32 rate)
+{
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	r->cell_log = 3;
+	r->cell_align = -1;
+	r->rate = rate;
+	tab->nla.nla_len = nla_attr_size(TC_RTAB_SIZE);
+	tab->nla.nla_type = TCA_HTB_RTAB;
+	for (i = 0; i < 256; i++)
+		tab->data[i] = (u32)min_t(u64,
+								  div_u64((u64)((i + 1) << r->cell_log) *
+										  PSCHED_TICKS_PER_SEC, rate), ~0U);
+}
+
+/* A leaf as htb_change_class() makes one for tc without TCA_RATE;
+   called under RTNL, the class is not visible yet */
+static struct htb_class *htb_bulk_alloc(struct Qdisc *sch,
+										const struct tc_qcn_rp_flow *f,
+										struct tc_ratespec *r,
+										struct htb_bulk_tab *tab)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_class *cl;
+	u32 burst;
+
+	if ((cl = htb_reserve_get(q, f->classid)) == NULL) {
+		if ((cl = kmem_cache_zalloc(htb_class_cachep, GFP_KERNEL)) == NULL)
+			return NULL;
+		cl->un.leaf.q = qdisc_create_dflt(qdisc_dev(sch), sch->dev_queue,
+										  &pfifo_qdisc_ops, f->classid);
+		if (cl->un.leaf.q == NULL) {
+			kmem_cache_free(htb_class_cachep, cl);
+			return NULL;
+		}
+		htb_class_init(sch, cl);
+	}
+	cl->common.classid = f->classid;
+	cl->rate = qdisc_get_rtab(r, &tab->nla);
+	cl->ceil = qdisc_get_rtab(r, &tab->nla);
+	if (cl->rate == NULL || cl->ceil == NULL) {
+		htb_destroy_class(sch, cl);
+		return NULL;
+	}
+
+	cl->qp = q->rp_defaults;
+	cl->qp.flags = 0;
+	cl->qp.classify = 0;
+	cl->qp.auto_class = cl->qp.auto_idle = 0;
+	cl->prof = qcn_rp_prof(&cl->qp);
+	htb_alg_set(cl, q->alg);
+
+	burst = f->burst ? f->burst : psched_mtu(qdisc_dev(sch));
+	cl->buffer = cl->cbuffer = (long)min_t(u64, div_u64((u64)burst *
+										   PSCHED_TICKS_PER_SEC, f->rate),
+										   LONG_MAX);
+	cl->tokens = cl->buffer;
+	cl->ctokens = cl->cbuffer;
+	cl->mbuffer = 60 * PSCHED_TICKS_PER_SEC;	/* 1min */
+	cl->t_c = psched_get_time();
+	cl->cmode = HTB_CAN_SEND;
+	cl->quantum = clamp_t(u32, f->rate / q->rate2quantum, 1000, 200000);
+	cl->quantum_cfg = cl->quantum;
+
+	cl->rp.crate = cl->rate->rate.rate;
+	cl->rp.trate = cl->rate->rate.rate;
+	qcn_update_rate(cl);
+	htb_telem(cl, 0);
+	return cl;
+}
+
+/* called under RTNL. Every class is made first; then, in one hold of
+   the tree lock, they go in one by one, and are all taken out again if
+   one of them finds its classid or pair taken. A class that had only
+   learned a pair is given it back then, see htb_flow_pin(). */
+static int htb_flows_add(struct Qdisc *sch, const struct tc_qcn_rp_flow *f,
+						 unsigned int n)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_class **cls, **owners, *cl, *owner;
+	struct htb_bulk_tab *tab;
+	struct tc_qcn_rp_opt pin;
+	struct tc_ratespec r;
+	unsigned int i, made = 0, linked = 0;
+	int err = -ENOMEM;
+
+	cls = htb_table_alloc(2 * n * sizeof(*cls));
+	tab = kmalloc(sizeof(*tab), GFP_KERNEL);
+	if (cls == NULL || tab == NULL)
+		goto out;
+	owners = cls + n;
+
+	err = -ENOBUFS;
+	for (made = 0; made < n; made++) {
+		if (!made || f[made].rate != f[made - 1].rate)
+			htb_bulk_rtab(&r, tab, f[made].rate);
+		if ((cls[made] = htb_bulk_alloc(sch, &f[made], &r, tab)) == NULL)
+			goto out;
+	}
+
+	memset(&pin, 0, sizeof(pin));
+	pin.flags = TC_QCN_RP_FLOW;
+	err = 0;
+	sch_tree_lock(sch);
+	for (i = 0; i < n; i++) {
+		if (htb_find(f[i].classid, sch) != NULL) {
+			err = -EEXIST;
+			break;
+		}
+		owner = NULL;
+		if (f[i].src || f[i].dst) {
+			owner = htb_flow_find(q, f[i].src, f[i].dst, 0);
+			if (owner != NULL && htb_flow_pinned(owner)) {
+				err = -EEXIST;
+				break;
+			}
+		}
+		owners[i] = owner;
+		cl = cls[i];
+		qdisc_class_hash_insert(&q->clhash, &cl->common);
+		htb_flowid_set(q, cl, cl);
+		pin.flow_src = f[i].src;
+		pin.flow_dst = f[i].dst;
+		htb_flow_pin(q, cl, &pin);
+	}
+	if (err) {
+		linked = i;
+		while (i--) {
+			cl = cls[i];
+			qdisc_class_hash_remove(&q->clhash, &cl->common);
+			htb_flow_unlink(cl);
+			htb_flowid_set(q, cl, NULL);
+			if (owners[i] != NULL)
+				htb_flow_link(q, owners[i]);
+		}
+	}
+	sch_tree_unlock(sch);
+
+	if (err) {
+		/* feedback may have found those that went in, see htb_delete() */
+		for (i = 0; i < linked; i++)
+			htb_reap(sch, cls[i]);
+		goto out;
+	}
+	made = 0;	/* the classes are the qdisc's now */
+	htb_class_kick(q);
+out:
+	while (made > linked)
+		htb_destroy_class(sch, cls[--made]);
+	kfree(tab);
+	if (cls != NULL)
+		htb_table_free(cls, 2 * n * sizeof(*cls));
+	return err;
+}
+
+/* called under RTNL; all or nothing as htb_flows_add() */
+static int htb_flows_del(struct Qdisc *sch, const struct tc_qcn_rp_flow *f,
+						 unsigned int n)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_class **cls, *cl;
+	unsigned int i, qlen;
+	int err = 0;
+
+	if ((cls = htb_table_alloc(n * sizeof(*cls))) == NULL)
+		return -ENOMEM;
+
+	sch_tree_lock(sch);
+	for (i = 0; i < n; i++) {
+		cl = f[i].classid ? htb_find(f[i].classid, sch) :
+			htb_flow_find(q, f[i].src, f[i].dst, 0);
+		if (cl == NULL) {
+			err = -ENOENT;
+			break;
+		}
+		/* what htb_delete() would refuse or have to rebuild the tree
+		   for; a record repeated finds its class held by the first */
+		if (cl->level || cl->parent || cl->filter_cnt ||
+			cl->refcnt != 1 || cl == q->auto_tmpl) {
+			err = -EBUSY;
+			break;
+		}
+		cl->refcnt++;
+		cls[i] = cl;
+	}
+	if (err) {
+		while (i--)
+			cls[i]->refcnt--;
+		sch_tree_unlock(sch);
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		cl = cls[i];
+		cl->refcnt--;
+		qlen = cl->un.leaf.q->q.qlen;
+		qdisc_reset(cl->un.leaf.q);
+		qdisc_tree_decrease_qlen(cl->un.leaf.q, qlen);
+
+		qdisc_class_hash_remove(&q->clhash, &cl->common);
+		htb_flow_unlink(cl);
+		htb_flowid_set(q, cl, NULL);
+		htb_hw_unbind(&q->hw, cl);
+		htb_auto_forget(q, cl);
+		if (cl->prio_activity)
+			htb_deactivate(q, cl);
+		if (cl->cmode != HTB_CAN_SEND)
+			htb_remove_from_wait_tree(q, cl);
+	}
+	sch_tree_unlock(sch);
+
+	for (i = 0; i < n; i++)
+		htb_reap(sch, cls[i]);
+out:
+	htb_table_free(cls, n * sizeof(*cls));
+	return err;
+}
+
+static int htb_flows_change(struct Qdisc *sch, const struct nlattr *nla)
+{
+	const struct tc_qcn_rp_flows *hdr = nla_data(nla);
+	const struct tc_qcn_rp_flow *f = (const struct tc_qcn_rp_flow *)(hdr + 1);
+	unsigned int i;
+
+	if (nla_len(nla) < sizeof(*hdr) || !hdr->count ||
+		hdr->count > TC_QCN_FLOWS_MAX ||
+		nla_len(nla) < sizeof(*hdr) + hdr->count * sizeof(*f))
+		return -EINVAL;
+
+	switch (hdr->op) {
+	case TC_QCN_FLOWS_ADD:
+		for (i = 0; i < hdr->count; i++)
+			if (!TC_H_MIN(f[i].classid) ||
+				TC_H_MAJ(f[i].classid ^ sch->handle) || !f[i].rate)
+				return -EINVAL;
+		return htb_flows_add(sch, f, hdr->count);
+	case TC_QCN_FLOWS_DEL:
+		return htb_flows_del(sch, f, hdr->count);
+	}
+	return -EINVAL;
+}
+
+/* QCN retuning, defaults and every class of this qdisc, and bulk
+   provisioning of classes */
+static int htb_change(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct nlattr *tb[TCA_HTB_QCN_FLOWS + 1];
+	struct tc_qcn_rp_opt *qopt;
+	const struct qcn_alg_ops *alg = NULL;
+	struct htb_class *cl, *tmpl;
+	struct hlist_node *n;
+	unsigned int i;
+	int err, flush = 0, set_alg;
+
+	if (!opt)
+		return -EINVAL;
+	err = nla_parse_nested(tb, TCA_HTB_QCN_FLOWS, opt, htb_policy);
+	if (err < 0)
+		return err;
+	/* one or the other, each applied in full or not at all */
+	if (tb[TCA_HTB_QCN_FLOWS] != NULL)
+		return tb[TCA_HTB_QCN] == NULL ?
+			htb_flows_change(sch, tb[TCA_HTB_QCN_FLOWS]) : -EINVAL;
+	if (tb[TCA_HTB_QCN] == NULL)
+		return -EINVAL;
+
+	qopt = nla_data(tb[TCA_HTB_QCN]);
+	if ((err = htb_qdisc_params_check(qopt)) != 0 ||
+		(err = htb_auto_check(sch, qopt, &tmpl)) != 0 ||
+		(err = set_alg = qcn_alg_opt_get(qopt->flags, TC_QCN_RP_ALG,
+										 qopt->alg, &alg)) < 0)
+		return err;
+
+	sch_tree_lock(sch);
+	htb_qdisc_params_change(q, qopt);
+	if ((qopt->flags & TC_QCN_RP_AUTO) && tmpl != q->auto_tmpl) {
+		htb_auto_set(q, tmpl);
+		flush = 1;
+	}
+	if (set_alg) {
+		qcn_alg_put(q->alg);
+		q->alg = alg;		/* takes over our reference */
+	}
+	for (i = 0; i < q->clhash.hashsize; i++)
+		hlist_for_each_entry(cl, n, &q->clhash.hash[i], common.hnode) {
+			qcn_rp_change(&cl->qp, qopt);
+			cl->prof = qcn_rp_prof(&cl->qp);
+			if (set_alg)
+				htb_alg_set(cl, alg);
+			if (!cl->qp.enable)
+				htb_rp_off(cl);
+		}
+	if (qopt->flags & TC_QCN_RP_AGGREGATE)
+		htb_flow_rekey(q, &q->clhash);
+	sch_tree_unlock(sch);
 
-	QCN_TIMER = QCN_TIMER * PSCHED_TICKS_PER_SEC/1000;
+	/* spares made after the old template */
+	if (flush)
+		htb_auto_flush(sch);
+	htb_auto_kick(q);
 	return 0;
 }
 
@@ -1328,7 +3751,10 @@ static int htb_dump(struct Qdisc *sch, struct sk_buff *skb)
 	nest = nla_nest_start(skb, TCA_OPTIONS);
 	if (nest == NULL)
 		goto nla_put_failure;
-	NLA_PUT(skb, TCA_HTB_INIT, sizeof(gopt), &gopt);
+	if (nla_put(skb, TCA_HTB_INIT, sizeof(gopt), &gopt))
+		goto nla_put_failure;
+	if (qcn_rp_params_dump(skb, &q->rp_defaults) < 0)
+		goto nla_put_failure;
 	nla_nest_end(skb, nest);
 
 	spin_unlock_bh(root_lock);
@@ -1340,6 +3766,26 @@ nla_put_failure:
 	return -1;
 }
 
+static int htb_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct tc_qcn_rp_qstats st = {
+		.cnm_unmatched = atomic_read(&q->cnm_unmatched),
+		.auto_classes = q->auto_nr_live,
+		.auto_created = q->auto_created,
+		.auto_reclaimed = q->auto_reclaimed,
+		.auto_exhausted = q->auto_exhausted,
+		.cnm_deferred = q->cnm_deferred,
+		.cnm_overflows = atomic_read(&q->fb_queue.overflows),
+		.hw_bound = q->hw.bound,
+		.hw_pushed = q->hw.pushed,
+		.hw_failed = q->hw.failed,
+		.cntag_gso = q->cntag_gso,
+	};
+
+	return gnet_stats_copy_app(d, &st, sizeof(st));
+}
+
 static int htb_dump_class(struct Qdisc *sch, unsigned long arg,
 			  struct sk_buff *skb, struct tcmsg *tcm)
 {
@@ -1364,10 +3810,13 @@ static int htb_dump_class(struct Qdisc *sch, unsigned long arg,
 	opt.buffer = cl->buffer;
 	opt.ceil = cl->ceil->rate;
 	opt.cbuffer = cl->cbuffer;
-	opt.quantum = cl->quantum;
+	opt.quantum = cl->quantum_cfg;
 	opt.prio = cl->prio;
 	opt.level = cl->level;
-	NLA_PUT(skb, TCA_HTB_PARMS, sizeof(opt), &opt);
+	if (nla_put(skb, TCA_HTB_PARMS, sizeof(opt), &opt))
+		goto nla_put_failure;
+	if (qcn_rp_params_dump(skb, &cl->qp) < 0)
+		goto nla_put_failure;
 
 	nla_nest_end(skb, nest);
 	spin_unlock_bh(root_lock);
@@ -1383,18 +3832,38 @@ static int
 htb_dump_class_stats(struct Qdisc *sch, unsigned long arg, struct gnet_dump *d)
 {
 	struct htb_class *cl = (struct htb_class *)arg;
+	struct tc_qcn_rp_xstats st;
+	struct qcn_rate_snap snap;
 
 	if (!cl->level && cl->un.leaf.q)
 		cl->qstats.qlen = cl->un.leaf.q->q.qlen;
 	cl->xstats.tokens = cl->tokens;
 	cl->xstats.ctokens = cl->ctokens;
+	htb_rate_fold(cl, psched_get_time());
+	if (!gen_estimator_active(&cl->bstats, &cl->rate_est)) {
+		cl->rate_est.bps = cl->est_bps;
+		cl->rate_est.pps = cl->est_pps;
+	}
 
 	if (gnet_stats_copy_basic(d, &cl->bstats) < 0 ||
 	    gnet_stats_copy_rate_est(d, NULL, &cl->rate_est) < 0 ||
 	    gnet_stats_copy_queue(d, &cl->qstats) < 0)
 		return -1;
 
-	return gnet_stats_copy_app(d, &cl->xstats, sizeof(cl->xstats));
+	/* The RP state follows the htb xstats, which tc still prints */
+	qcn_read_rate(cl, &snap);
+	st.htb = cl->xstats;
+	st.crate = snap.crate;
+	st.trate = snap.trate;
+	st.bcount_stg = snap.bcount_stg;
+	st.timer_stg = snap.timer_stg;
+	st.cnm_received = cl->cnm_received;
+	st.burst = htb_burst_bytes(cl->buffer, snap.crate);
+	st.cburst = htb_burst_bytes(cl->cbuffer, htb_crate_of(cl, cl->ceil));
+	st.rate_est = cl->est_bps;
+	st.pps_est = cl->est_pps;
+
+	return gnet_stats_copy_app(d, &st, sizeof(st));
 }
 
 static int htb_graft(struct Qdisc *sch, unsigned long arg, struct Qdisc *new,
@@ -1461,7 +3930,7 @@ static void htb_parent_to_leaf(struct htb_sched *q, struct htb_class *cl,
 	WARN_ON(cl->level || !cl->un.leaf.q || cl->prio_activity);
 
 	if (parent->cmode != HTB_CAN_SEND)
-		htb_safe_rb_erase(&parent->pq_node, q->wait_pq + parent->level);
+		htb_remove_from_wait_tree(q, parent);
 
 	parent->level = 0;
 	memset(&parent->un.inner, 0, sizeof(parent->un.inner));
@@ -1475,6 +3944,8 @@ static void htb_parent_to_leaf(struct htb_sched *q, struct htb_class *cl,
 
 static void htb_destroy_class(struct Qdisc *sch, struct htb_class *cl)
 {
+	tasklet_hrtimer_cancel(&cl->timer);
+
 	if (!cl->level) {
 		WARN_ON(!cl->un.leaf.q);
 		qdisc_destroy(cl->un.leaf.q);
@@ -1484,16 +3955,122 @@ static void htb_destroy_class(struct Qdisc *sch, struct htb_class *cl)
 	qdisc_put_rtab(cl->ceil);
 
 	tcf_destroy_chain(&cl->filter_list);
-	kfree(cl);
+	qcn_telem_put(cl->telem);
+	qcn_alg_put(cl->alg);
+	kmem_cache_free(htb_class_cachep, cl);
+}
+
+/* Class teardown in bulk.
+   A class being deleted is taken out of sight of the data path and of
+   feedback under the tree lock as before. htb_reap() then stops at once
+   all that still ties it to the qdisc: its timer, its estimator, its
+   filters and its leaf qdisc. The leaf goes with qdisc_destroy() there
+   and then, since it and any qdisc below it sit on the tc list of the
+   root and take the root's lock in their estimators, and the root may
+   go before the class is freed. What is left, the rate tables and the
+   class itself, goes to a work item that frees HTB_REAP_BATCH classes
+   per hold of RTNL after an RCU grace period. Deleting classes thus no
+   longer waits for a grace period each. */
+#define HTB_REAP_BATCH		256
+
+static LIST_HEAD(htb_reap_list);
+static DEFINE_SPINLOCK(htb_reap_lock);
+
+static void htb_reap_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(htb_reap_dwork, htb_reap_work);
+
+/* qcn_recv_fb() is done with the class; in softirq context */
+static void htb_reap_rcu(struct rcu_head *head)
+{
+	struct htb_class *cl = container_of(head, struct htb_class, reap_rcu);
+
+	spin_lock(&htb_reap_lock);
+	list_add_tail(&cl->auto_node, &htb_reap_list);
+	spin_unlock(&htb_reap_lock);
+	schedule_delayed_work(&htb_reap_dwork, 0);
+}
+
+/* called under RTNL for a class off the hash and lists of the qdisc and
+   held by nobody; sch may be gone before the class is freed */
+static void htb_reap(struct Qdisc *sch, struct htb_class *cl)
+{
+	struct Qdisc *leaf;
+
+	/* a CNM still in flight may start the timer again, which the free
+	   cancels once more */
+	tasklet_hrtimer_cancel(&cl->timer);
+	gen_kill_estimator(&cl->bstats, &cl->rate_est);
+	tcf_destroy_chain(&cl->filter_list);
+	if (!cl->level) {
+		/* that timer and qcn_recv_fb() look at the leaf under
+		   rate_lock only; once it is swapped out under the lock,
+		   none of them sees the old one, which qdisc_destroy()
+		   frees right away */
+		spin_lock_bh(&cl->rate_lock);
+		leaf = cl->un.leaf.q;
+		cl->un.leaf.q = &noop_qdisc;
+		spin_unlock_bh(&cl->rate_lock);
+		qdisc_destroy(leaf);
+	}
+	call_rcu(&cl->reap_rcu, htb_reap_rcu);
+}
+
+/* Frees up to n reaped classes under RTNL, nonzero if more are left */
+static int htb_reap_run(unsigned int n)
+{
+	struct htb_class *cl, *next;
+	LIST_HEAD(batch);
+	int more;
+
+	spin_lock_bh(&htb_reap_lock);
+	list_for_each_entry_safe(cl, next, &htb_reap_list, auto_node) {
+		if (!n--)
+			break;
+		list_move_tail(&cl->auto_node, &batch);
+	}
+	more = !list_empty(&htb_reap_list);
+	spin_unlock_bh(&htb_reap_lock);
+
+	list_for_each_entry_safe(cl, next, &batch, auto_node)
+		htb_destroy_class(NULL, cl);
+	return more;
+}
+
+static void htb_reap_work(struct work_struct *work)
+{
+	int more;
+
+	/* qdisc_put_rtab() wants RTNL */
+	if (!rtnl_trylock()) {
+		schedule_delayed_work(&htb_reap_dwork, 1);
+		return;
+	}
+	more = htb_reap_run(HTB_REAP_BATCH);
+	rtnl_unlock();
+	if (more)
+		schedule_delayed_work(&htb_reap_dwork, 0);
 }
 
 static void htb_destroy(struct Qdisc *sch)
 {
 	struct htb_sched *q = qdisc_priv(sch);
 	struct hlist_node *n, *next;
-	struct htb_class *cl;
+	struct htb_class *cl, *next_cl;
 	unsigned int i;
 
+	/* No feedback may reach the classes we are about to free */
+	if (!hlist_unhashed(&q->fb_handler.hnode))
+		qcn_fb_unregister(&q->fb_handler);
+	qcn_fb_queue_destroy(&q->fb_queue);
+
+	cancel_delayed_work_sync(&q->auto_fill);
+	cancel_delayed_work_sync(&q->auto_gc);
+	list_for_each_entry_safe(cl, next_cl, &q->auto_free, auto_node)
+		htb_reap(sch, cl);
+	cancel_delayed_work_sync(&q->class_work);
+	list_for_each_entry_safe(cl, next_cl, &q->reserve, auto_node)
+		htb_reap(sch, cl);
+
 	cancel_work_sync(&q->work);
 	qdisc_watchdog_cancel(&q->watchdog);
 	/* This line used to be after htb_destroy_class call below
@@ -1509,9 +4086,21 @@ static void htb_destroy(struct Qdisc *sch)
 	for (i = 0; i < q->clhash.hashsize; i++) {
 		hlist_for_each_entry_safe(cl, n, next, &q->clhash.hash[i],
 					  common.hnode)
-			htb_destroy_class(sch, cl);
+			htb_reap(sch, cl);
 	}
 	qdisc_class_hash_destroy(&q->clhash);
+
+	/* the classes are stopped, and with their timers the crate
+	   changes: lift what the VFs were left with */
+	cancel_delayed_work_sync(&q->hw.work);
+	memset(q->hw.cl, 0, sizeof(q->hw.cl));
+	htb_hw_sync(sch);
+
+	htb_flow_hash_free(q->flow_hash, q->flow_mask + 1);
+	htb_table_free(q->flow_ids, q->nr_flow_ids * sizeof(*q->flow_ids));
+	htb_table_free(q->wait_slots, HTB_WAIT_SLOTS_SIZE);
+	qcn_alg_put(q->alg);
+	__skb_queue_purge(&q->cnm_queue);
 	__skb_queue_purge(&q->direct_queue);
 }
 
@@ -1521,7 +4110,7 @@ static int htb_delete(struct Qdisc *sch, unsigned long arg)
 	struct htb_class *cl = (struct htb_class *)arg;
 	unsigned int qlen;
 	struct Qdisc *new_q = NULL;
-	int last_child = 0;
+	int last_child = 0, tmpl = 0;
 
 	// TODO: why don't allow to delete subtree ? references ? does
 	// tc subsys quarantee us that in htb_destroy it holds no class
@@ -1545,6 +4134,14 @@ static int htb_delete(struct Qdisc *sch, unsigned long arg)
 
 	/* delete from hash and active; remainder in destroy_class */
 	qdisc_class_hash_remove(&q->clhash, &cl->common);
+	htb_flow_unlink(cl);
+	htb_flowid_set(q, cl, NULL);
+	htb_hw_unbind(&q->hw, cl);
+	htb_auto_forget(q, cl);
+	if (cl == q->auto_tmpl) {
+		htb_auto_set(q, NULL);
+		tmpl = 1;
+	}
 	if (cl->parent)
 		cl->parent->children--;
 
@@ -1552,10 +4149,12 @@ static int htb_delete(struct Qdisc *sch, unsigned long arg)
 		htb_deactivate(q, cl);
 
 	if (cl->cmode != HTB_CAN_SEND)
-		htb_safe_rb_erase(&cl->pq_node, q->wait_pq + cl->level);
+		htb_remove_from_wait_tree(q, cl);
 
-	if (last_child)
+	if (last_child) {
 		htb_parent_to_leaf(q, cl, new_q);
+		htb_flowid_set(q, cl->parent, cl->parent);
+	}
 
 	BUG_ON(--cl->refcnt == 0);
 	/*
@@ -1564,6 +4163,11 @@ static int htb_delete(struct Qdisc *sch, unsigned long arg)
 	 */
 
 	sch_tree_unlock(sch);
+
+	/* qcn_recv_fb() may still be using the class it found in the flow
+	   table; cops->put() has htb_reap() free it after a grace period */
+	if (tmpl)
+		htb_auto_flush(sch);
 	return 0;
 }
 
@@ -1572,7 +4176,7 @@ static void htb_put(struct Qdisc *sch, unsigned long arg)
 	struct htb_class *cl = (struct htb_class *)arg;
 
 	if (--cl->refcnt == 0)
-		htb_destroy_class(sch, cl);
+		htb_reap(sch, cl);
 }
 
 static int htb_change_class(struct Qdisc *sch, u32 classid,
@@ -1584,17 +4188,49 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 	struct htb_class *cl = (struct htb_class *)*arg, *parent;
 	struct nlattr *opt = tca[TCA_OPTIONS];
 	struct qdisc_rate_table *rtab = NULL, *ctab = NULL;
-	struct nlattr *tb[TCA_HTB_RTAB + 1];
+	struct nlattr *tb[TCA_HTB_QCN + 1];
 	struct tc_htb_opt *hopt;
+	struct tc_qcn_rp_opt *qopt = NULL;
+	const struct qcn_alg_ops *alg = NULL;
+	int flush = 0, set_alg = 0;
 
 	/* extract all subattrs from opt attr */
 	if (!opt)
 		goto failure;
 
-	err = nla_parse_nested(tb, TCA_HTB_RTAB, opt, htb_policy);
+	err = nla_parse_nested(tb, TCA_HTB_QCN, opt, htb_policy);
 	if (err < 0)
 		goto failure;
 
+	if (tb[TCA_HTB_QCN]) {
+		qopt = nla_data(tb[TCA_HTB_QCN]);
+		err = -EINVAL;
+		if ((qopt->flags & (TC_QCN_RP_CLASSIFY | TC_QCN_RP_AUTO |
+							TC_QCN_RP_AUTO_IDLE | TC_QCN_RP_AGGREGATE)) ||
+			(err = qcn_rp_check(qopt)) != 0 ||
+			(err = htb_flow_pin_check(q, cl, qopt)) != 0 ||
+			(err = htb_hw_check(sch, cl, qopt)) != 0 ||
+			(err = set_alg = qcn_alg_opt_get(qopt->flags, TC_QCN_RP_ALG,
+											 qopt->alg, &alg)) < 0)
+			goto failure;
+	}
+
+	/* QCN retuning only: rates, stages and queue stay as they are */
+	if (cl && qopt && tb[TCA_HTB_PARMS] == NULL) {
+		sch_tree_lock(sch);
+		qcn_rp_change(&cl->qp, qopt);
+		cl->prof = qcn_rp_prof(&cl->qp);
+		htb_flow_pin(q, cl, qopt);
+		htb_hw_bind(q, cl, qopt);
+		if (set_alg)
+			htb_alg_set(cl, alg);
+		if (!cl->qp.enable)
+			htb_rp_off(cl);
+		sch_tree_unlock(sch);
+		qcn_alg_put(alg);
+		return 0;
+	}
+
 	err = -EINVAL;
 	if (tb[TCA_HTB_PARMS] == NULL)
 		goto failure;
@@ -1609,22 +4245,8 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 		goto failure;
 
 	if (!cl) {		/* new class */
+		struct htb_class *spare;
 		struct Qdisc *new_q;
-		int prio;
-		struct {
-			struct nlattr		nla;
-			struct gnet_estimator	opt;
-		} est = {
-			.nla = {
-				.nla_len	= nla_attr_size(sizeof(est.opt)),
-				.nla_type	= TCA_RATE,
-			},
-			.opt = {
-				/* 4s interval, 16s averaging constant */
-				.interval	= 2,
-				.ewma_log	= 2,
-			},
-		};
 
 		/* check for valid classid */
 		if (!classid || TC_H_MAJ(classid ^ sch->handle) ||
@@ -1637,30 +4259,39 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 			goto failure;
 		}
 		err = -ENOBUFS;
-		if ((cl = kzalloc(sizeof(*cl), GFP_KERNEL)) == NULL)
+		if ((cl = spare = htb_reserve_get(q, classid)) == NULL &&
+			(cl = kmem_cache_zalloc(htb_class_cachep, GFP_KERNEL)) == NULL)
 			goto failure;
 
-		err = gen_new_estimator(&cl->bstats, &cl->rate_est,
-					qdisc_root_sleeping_lock(sch),
-					tca[TCA_RATE] ? : &est.nla);
-		if (err) {
-			kfree(cl);
-			goto failure;
+		/* only on request, htb_rate_est() covers every class */
+		if (tca[TCA_RATE]) {
+			err = gen_new_estimator(&cl->bstats, &cl->rate_est,
+						qdisc_root_sleeping_lock(sch),
+						tca[TCA_RATE]);
+			if (err) {
+				if (spare)
+					htb_reserve_put(q, spare);
+				else
+					kmem_cache_free(htb_class_cachep, cl);
+				goto failure;
+			}
 		}
 
-		cl->refcnt = 1;
-		cl->children = 0;
-		INIT_LIST_HEAD(&cl->un.leaf.drop_list);
-		RB_CLEAR_NODE(&cl->pq_node);
-
-		for (prio = 0; prio < TC_HTB_NUMPRIO; prio++)
-			RB_CLEAR_NODE(&cl->node[prio]);
+		if (!spare)
+			htb_class_init(sch, cl);
+		cl->qp = q->rp_defaults;
+		cl->qp.flags = 0;
+		cl->qp.classify = 0;
+		cl->qp.auto_class = cl->qp.auto_idle = 0;
+		cl->prof = qcn_rp_prof(&cl->qp);
+		htb_alg_set(cl, q->alg);
 
 		/* create leaf qdisc early because it uses kmalloc(GFP_KERNEL)
 		   so that can't be used inside of sch_tree_lock
 		   -- thanks to Karlis Peisenieks */
-		new_q = qdisc_create_dflt(qdisc_dev(sch), sch->dev_queue,
-								  &pfifo_qdisc_ops, classid);
+		new_q = spare ? spare->un.leaf.q :
+			qdisc_create_dflt(qdisc_dev(sch), sch->dev_queue,
+							  &pfifo_qdisc_ops, classid);
 		sch_tree_lock(sch);
 		if (parent && !parent->level) {
 			unsigned int qlen = parent->un.leaf.q->q.qlen;
@@ -1674,9 +4305,21 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 
 			/* remove from evt list because of level change */
 			if (parent->cmode != HTB_CAN_SEND) {
-				htb_safe_rb_erase(&parent->pq_node, q->wait_pq);
+				htb_remove_from_wait_tree(q, parent);
 				parent->cmode = HTB_CAN_SEND;
 			}
+			/* inner nodes carry no flow */
+			htb_flow_unlink(parent);
+			parent->qp.flags &= ~TC_QCN_RP_FLOW;
+			parent->qp.flow_src = parent->qp.flow_dst = 0;
+			parent->qp.flow_scope = 0;
+			htb_flowid_set(q, parent, NULL);
+			htb_hw_unbind(&q->hw, parent);
+			htb_auto_forget(q, parent);
+			if (parent == q->auto_tmpl) {
+				htb_auto_set(q, NULL);
+				flush = 1;
+			}
 			parent->level = (parent->parent ? parent->parent->level
 					 : TC_HTB_MAXDEPTH) - 1;
 			memset(&parent->un.inner, 0, sizeof(parent->un.inner));
@@ -1694,16 +4337,9 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 		cl->t_c = psched_get_time();
 		cl->cmode = HTB_CAN_SEND;
 
-		/* QCN RP Initialization */
-		spin_lock_init(&cl->rate_lock);
-		cl->bcount_stg = 0;
-		cl->timer_stg = 0;
-		cl->bcount_tx = 0;
-		cl->timer = 0;
-
-		
 		/* attach to the hash list and parent's family */
 		qdisc_class_hash_insert(&q->clhash, &cl->common);
+		htb_flowid_set(q, cl, cl);
 		if (parent)
 			parent->children++;
 	} /* new class end */
@@ -1716,6 +4352,8 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 				return err;
 		}
 		sch_tree_lock(sch);
+		/* spares carry the rates they were made with */
+		flush = cl == q->auto_tmpl;
 	}
 
 	/* it used to be a nasty bug here, we have to check that node
@@ -1736,41 +4374,58 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 		}
 		if (hopt->quantum)
 			cl->quantum = hopt->quantum;
+		cl->quantum_cfg = cl->quantum;
 		if ((cl->prio = hopt->prio) >= TC_HTB_NUMPRIO)
 			cl->prio = TC_HTB_NUMPRIO - 1;
 	}
 
 	cl->buffer = hopt->buffer;
 	cl->cbuffer = hopt->cbuffer;
-	if (cl->rate)
-		qdisc_put_rtab(cl->rate);
-	cl->rate = rtab;
-	if (cl->ceil)
-		qdisc_put_rtab(cl->ceil);
-	cl->ceil = ctab;
 
-	/* QCN RP Rates Initialization */
-	cl->crate = cl->rate->rate.rate;
-	cl->trate = cl->rate->rate.rate;
-    cl->n = 1;
-	cl->d = 1;
+	if (qopt) {
+		qcn_rp_change(&cl->qp, qopt);
+		cl->prof = qcn_rp_prof(&cl->qp);
+		htb_flow_pin(q, cl, qopt);
+		htb_hw_bind(q, cl, qopt);
+	}
 
-	/*gcd = gcd_fn(cl->rate->rate.rate, cl->crate);
-	cl->n = cl->rate->rate.rate/gcd;
-	cl->d = cl->crate/gcd;*/
+	/* The RP timer and feedback only hold rate_lock when they look at
+	   the rate tables; the old ones go once they can no longer */
+	spin_lock(&cl->rate_lock);
+	write_seqcount_begin(&cl->rate_seq);
+	swap(cl->rate, rtab);
+	swap(cl->ceil, ctab);
+	/* QCN RP Rates Initialization */
+	cl->rp.crate = cl->rate->rate.rate;
+	cl->rp.trate = cl->rate->rate.rate;
+	qcn_update_rate(cl);
+	write_seqcount_end(&cl->rate_seq);
+	spin_unlock(&cl->rate_lock);
+	if (rtab)
+		qdisc_put_rtab(rtab);
+	if (ctab)
+		qdisc_put_rtab(ctab);
+	if (set_alg)
+		htb_alg_set(cl, alg);
+	htb_telem(cl, 0);
 
 	/* printk(KERN_EMERG "%s rp: crate is %d, and rate is %d\n", 
-		   sch->dev_queue->dev->name, cl->crate, cl->rate->rate.rate);
+		   sch->dev_queue->dev->name, cl->rp.crate, cl->rate->rate.rate);
 
 
 	printk(KERN_EMERG "%s rp: l2t %d, l2t_prop %d, l2t_clock_factor %d\n",
 		   sch->dev_queue->dev->name, qdisc_l2t(cl->rate, 60),
-		   qdisc_l2t(cl->rate, 60) * (cl->rate->rate.rate / cl->crate),
+		   qdisc_l2t(cl->rate, 60) * (cl->rate->rate.rate / cl->rp.crate),
 		   (60>>3)/(q->clock_factor/(cl->rate->rate.rate>>3))); */
 
 	sch_tree_unlock(sch);
 
-	qdisc_class_hash_grow(sch, &q->clhash);
+	qcn_alg_put(alg);
+	htb_class_kick(q);
+	if (flush) {
+		htb_auto_flush(sch);
+		htb_auto_kick(q);
+	}
 
 	*arg = (unsigned long)cl;
 	return 0;
@@ -1780,6 +4435,7 @@ failure:
 		qdisc_put_rtab(rtab);
 	if (ctab)
 		qdisc_put_rtab(ctab);
+	qcn_alg_put(alg);
 	return err;
 }
 
@@ -1872,18 +4528,36 @@ static struct Qdisc_ops htb_qdisc_ops __read_mostly = {
 	.init		=	htb_init,
 	.reset		=	htb_reset,
 	.destroy	=	htb_destroy,
-	.change     =   qcn_recv_fb,
+	.change		=	htb_change,
 	.dump		=	htb_dump,
+	.dump_stats	=	htb_dump_stats,
 	.owner		=	THIS_MODULE,
 };
 
 static int __init htb_module_init(void)
 {
-	return register_qdisc(&htb_qdisc_ops);
+	int err;
+
+	htb_class_cachep = kmem_cache_create("htb_class",
+										 sizeof(struct htb_class), 0,
+										 SLAB_HWCACHE_ALIGN, NULL);
+	if (htb_class_cachep == NULL)
+		return -ENOMEM;
+	err = register_qdisc(&htb_qdisc_ops);
+	if (err)
+		kmem_cache_destroy(htb_class_cachep);
+	return err;
 }
 static void __exit htb_module_exit(void)
 {
 	unregister_qdisc(&htb_qdisc_ops);
+	/* the last classes reaped may still be on their way */
+	rcu_barrier();
+	cancel_delayed_work_sync(&htb_reap_dwork);
+	rtnl_lock();
+	htb_reap_run(UINT_MAX);
+	rtnl_unlock();
+	kmem_cache_destroy(htb_class_cachep);
 }
 
 module_init(htb_module_init)
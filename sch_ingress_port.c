@@ -0,0 +1,925 @@
+/*
+ * net/sched/sch_ingress.c - Ingress qdisc
+ *
+ *		This copy is a QCN Reaction Point on the receive side of a
+ *		port, registered as "qcningress". It runs the filters of the
+ *		stock ingress qdisc and then polices each IPv4 pair QCN has
+ *		cut at the current rate of its own RP, so that a host whose
+ *		egress qdisc belongs to somebody else can still react, and
+ *		frames that would only be held back never enter the bridge.
+ *		With a cp_rate it is also a Congestion Point for what comes
+ *		in faster than the bridge forwards it.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Authors:	Jamal Hadi Salim 1999
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/list.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/workqueue.h>
+#include <linux/ip.h>
+#include <linux/if_ether.h>
+#include <net/netlink.h>
+#include <net/pkt_sched.h>
+
+#include "qcn.h"
+
+static int QCN_TIMER    __read_mostly = 25;
+static int QCN_FASTREC  __read_mostly = 5;
+static int QCN_BC       __read_mostly = 153600;
+static int QCN_AI       __read_mostly = 524288;
+static int QCN_HAI      __read_mostly = 5242880;
+static int QCN_GD       __read_mostly = 7;
+static int QCN_MIN_RATE __read_mostly = 524288;
+static int QCN_MIN_RATE_DEC __read_mostly = 1;
+static int QCN_TIMER_JITTER __read_mostly = 15; /* +/- 15% */
+static int QCN_EXACT __read_mostly = 0;
+static int QCN_TIMER_US __read_mostly = 0;
+static int QCN_RATE     __read_mostly = 125000000; /* 1Gbit/s */
+static int QCN_BURST    __read_mostly = 1536000; /* 1500KB */
+static int QCN_LIMIT    __read_mostly = 256;
+static int QCN_CP_RATE  __read_mostly = 0; /* bytes/s, 0: off */
+static int QCN_CP_LIMIT __read_mostly = 1500000; /* 1000 frames */
+static int QCN_Q_EQ     __read_mostly = 34000; /* 34KB */
+static int QCN_W        __read_mostly = 2;
+static int QCN_SAMPLE_JITTER __read_mostly = 15; /* +/- 15% */
+
+module_param    (QCN_TIMER, int, 0640);
+MODULE_PARM_DESC(QCN_TIMER, "QCN Reaction Point, parameter TIMER (ms), "
+				 "default 25");
+
+module_param    (QCN_TIMER_US, int, 0640);
+MODULE_PARM_DESC(QCN_TIMER_US, "QCN Reaction Point, parameter TIMER (us), "
+				 "overrides QCN_TIMER if not 0, default 0");
+
+module_param    (QCN_FASTREC, int, 0640);
+MODULE_PARM_DESC(QCN_FASTREC, "QCN Reaction Point, parameter FASTREC (stages), "
+				 "default 5");
+
+module_param    (QCN_BC, int, 0640);
+MODULE_PARM_DESC(QCN_BC, "QCN Reaction Point, parameter BC (bytes), "
+				 "default 153600");
+
+module_param    (QCN_AI, int, 0640);
+MODULE_PARM_DESC(QCN_AI, "QCN Reaction Point, parameter AI (bytes/s), "
+				 "default 524288");
+
+module_param    (QCN_HAI, int, 0640);
+MODULE_PARM_DESC(QCN_HAI, "QCN Reaction Point, parameter HAI (bytes/s), "
+				 "default 5242880");
+
+module_param    (QCN_GD, int, 0640);
+MODULE_PARM_DESC(QCN_GD, "QCN Reaction Point, parameter GD (Gain Dec.), "
+				 "default 7");
+
+module_param    (QCN_MIN_RATE, int, 0640);
+MODULE_PARM_DESC(QCN_MIN_RATE, "QCN Reaction Point, parameter MIN_RATE "
+				 "(bytes/s), default 524288");
+
+module_param    (QCN_MIN_RATE_DEC, int, 0640);
+MODULE_PARM_DESC(QCN_MIN_RATE_DEC, "QCN Reaction Point, parameter "
+				 "MIN_RATE_DEC, default 1");
+
+module_param    (QCN_TIMER_JITTER, int, 0640);
+MODULE_PARM_DESC(QCN_TIMER_JITTER, "QCN Reaction Point, TIMER period "
+				 "randomization (percent), default 15");
+
+module_param    (QCN_EXACT, int, 0640);
+MODULE_PARM_DESC(QCN_EXACT, "QCN Reaction Point, also react to the qoff and "
+				 "qdelta of a CNM, default 0 (off)");
+
+module_param    (QCN_RATE, int, 0640);
+MODULE_PARM_DESC(QCN_RATE, "QCN ingress Reaction Point, rate a pair "
+				 "recovers to (bytes/s), default 125000000");
+
+module_param    (QCN_BURST, int, 0640);
+MODULE_PARM_DESC(QCN_BURST, "QCN ingress Reaction Point, bucket of a pair "
+				 "at that rate (bytes), default 1536000");
+
+module_param    (QCN_LIMIT, int, 0640);
+MODULE_PARM_DESC(QCN_LIMIT, "QCN ingress Reaction Point, pairs policed at "
+				 "once, default 256");
+
+module_param    (QCN_CP_RATE, int, 0640);
+MODULE_PARM_DESC(QCN_CP_RATE, "QCN ingress Congestion Point, rate the port "
+				 "is drained at (bytes/s), default 0 (off)");
+
+module_param    (QCN_CP_LIMIT, int, 0640);
+MODULE_PARM_DESC(QCN_CP_LIMIT, "QCN ingress Congestion Point, most the "
+				 "backlog holds (bytes), default 1500000");
+
+module_param    (QCN_Q_EQ, int, 0640);
+MODULE_PARM_DESC(QCN_Q_EQ, "QCN ingress Congestion Point, parameter Q_EQ");
+
+module_param    (QCN_W, int, 0640);
+MODULE_PARM_DESC(QCN_W, "QCN ingress Congestion Point, parameter W");
+
+module_param    (QCN_SAMPLE_JITTER, int, 0640);
+MODULE_PARM_DESC(QCN_SAMPLE_JITTER, "QCN ingress Congestion Point, sampling "
+				 "interval randomization (percent), default 15");
+
+/* Ingress Reaction Point.
+   =======================================
+
+   There is no queue on the receive side, so the rate of an RP can only
+   be enforced by dropping: each pair a CNM was sent for gets a token
+   bucket filled at its crate, and what it sends beyond that is dropped
+   before netif_receive_skb() hands it to the bridge. Pairs nobody
+   complained about are not looked at beyond one hash lookup, and a pair
+   whose rate recovered is forgotten by the next garbage collection.
+
+   The rate state machine is the one of qcn_alg.h, as in htb: CNMs
+   decrease crate, the byte counter stages follow the bytes let through
+   and the timer stages run off an hrtimer. Everything, packets,
+   feedback and timers, runs under the qdisc lock.
+*/
+
+/* Ingress Congestion Point.
+   =======================================
+
+   The bridge forwards in the softirq of the receiving CPU; when a port
+   brings in more than that keeps up with, the frames wait in the NIC
+   ring or the softnet backlog and are dropped there, where no qdisc
+   sees them. The CP of qcn_core.c runs on a virtual queue instead: the
+   frames let in fill it, it drains at cp_rate and holds at most
+   cp_limit, and its backlog is what the CP samples. It is the
+   arithmetic of a bfifo served at cp_rate, so the CNMs start as soon as
+   the arrivals outrun that rate and before anything is lost.
+*/
+
+#define INGRESS_HASH_BITS	8
+#define INGRESS_HASH_SIZE	(1 << INGRESS_HASH_BITS)
+
+struct ingress_flow {
+	struct hlist_node	hnode;
+	struct list_head	gc_node;
+	__be32			src, dst;
+	struct qcn_rp_state	rp;
+	long			tokens;		/* bytes */
+	psched_time_t		t_c;		/* checkpoint time */
+	struct tasklet_hrtimer	timer;
+	struct Qdisc		*sch;
+	int			dead;		/* unlinked, timer must stop */
+};
+
+struct ingress_qdisc_data {
+	struct tcf_proto	*filter_list;
+
+	struct tc_qcn_rp_opt	qp;
+	const struct qcn_alg_ops *alg;		/* of every pair, NULL 802.1Qau */
+	int			prof;		/* qcn_rp_prof() of qp */
+	u32			rate;		/* bytes/s */
+	u32			burst;		/* bytes at rate */
+	u32			limit;		/* pairs */
+	__be32			src_mask;	/* the bits of a pair that */
+	__be32			dst_mask;	/* are its key, see aggregate */
+
+	struct hlist_head	hash[INGRESS_HASH_SIZE];
+	struct delayed_work	gc;
+	struct Qdisc		*sch;
+	struct qcn_fb_handler	fb_handler;
+
+	u32			nr_flows;
+	u32			flows_created;
+	u32			flows_exhausted;
+	u32			cnm_received;
+	u32			cnm_unmatched;
+	u32			policed;
+
+	struct qcn_cp		cp;
+	u32			cp_rate;	/* bytes/s, 0 off */
+	u32			cp_limit;	/* bytes */
+	u32			cp_backlog;	/* bytes in the virtual queue */
+	psched_time_t		cp_t;		/* drained up to */
+	u32			cp_overlimits;
+};
+
+/* Module parameters are the defaults of a new RP */
+static void ingress_params_init(struct ingress_qdisc_data *p)
+{
+	struct tc_qcn_rp_opt *qp = &p->qp;
+
+	memset(qp, 0, sizeof(*qp));
+	if (QCN_TIMER_US > 0)
+		qp->timer = (u32)min_t(u64, (u64)QCN_TIMER_US * NSEC_PER_USEC, ~0U);
+	else
+		qp->timer = (u32)min_t(u64, (u64)QCN_TIMER * NSEC_PER_MSEC, ~0U);
+	qp->fastrec = QCN_FASTREC;
+	qp->bc = QCN_BC;
+	qp->ai = QCN_AI;
+	qp->hai = QCN_HAI;
+	qp->gd = QCN_GD;
+	qp->min_rate = QCN_MIN_RATE;
+	qp->min_rate_dec = QCN_MIN_RATE_DEC;
+	qp->timer_jitter = QCN_TIMER_JITTER;
+	qp->exact = QCN_EXACT ? 1 : 0;
+	qp->agg_src = qp->agg_dst = 32;
+	strlcpy(qp->alg, qcn_alg_name(NULL), sizeof(qp->alg));
+	qp->enable = 1;
+	p->prof = qcn_rp_prof(qp);
+	p->src_mask = p->dst_mask = qcn_prefix_mask(32);
+
+	p->rate = QCN_RATE > 0 ? QCN_RATE : 125000000;
+	p->burst = QCN_BURST > 0 ? QCN_BURST : 1536000;
+	p->limit = clamp(QCN_LIMIT, 1, QCN_INGRESS_LIMIT_MAX);
+	p->cp_rate = max(QCN_CP_RATE, 0);
+	p->cp_limit = QCN_CP_LIMIT > 0 ? QCN_CP_LIMIT : 1500000;
+}
+
+/* Module parameters are the defaults of the CP as well */
+static void ingress_cp_params_init(struct tc_qcn_cp_opt *def)
+{
+	static const u32 mark[QCN_MARK_STEPS] = QCN_MARK_DEFAULT;
+
+	memset(def, 0, sizeof(*def));
+	def->flags = TC_QCN_CP_Q_EQ | TC_QCN_CP_W | TC_QCN_CP_JITTER |
+		TC_QCN_CP_MARK;
+	def->prio_mask = 1;
+	def->q_eq[0] = QCN_Q_EQ;
+	def->w[0] = QCN_W;
+	def->sample_jitter = QCN_SAMPLE_JITTER;
+	memcpy(def->mark, mark, sizeof(def->mark));
+}
+
+static inline struct hlist_head *ingress_bucket(struct ingress_qdisc_data *p,
+												__be32 src, __be32 dst)
+{
+	return &p->hash[jhash_2words((__force u32)src, (__force u32)dst, 0) &
+					(INGRESS_HASH_SIZE - 1)];
+}
+
+static struct ingress_flow *ingress_flow_find(struct ingress_qdisc_data *p,
+											  __be32 src, __be32 dst)
+{
+	struct ingress_flow *f;
+	struct hlist_node *n;
+
+	src &= p->src_mask;
+	dst &= p->dst_mask;
+	hlist_for_each_entry(f, n, ingress_bucket(p, src, dst), hnode)
+		if (f->src == src && f->dst == dst)
+			return f;
+	return NULL;
+}
+
+/* Bytes the bucket of f holds at its crate, at least one frame */
+static inline long ingress_depth(const struct ingress_qdisc_data *p,
+								 const struct ingress_flow *f)
+{
+	u64 depth = div_u64((u64)p->burst * f->rp.crate, p->rate);
+
+	return max_t(u64, depth, psched_mtu(qdisc_dev(f->sch)));
+}
+
+/* Tokens earned at crate since the last checkpoint */
+static void ingress_refill(const struct ingress_qdisc_data *p,
+						   struct ingress_flow *f, psched_time_t now)
+{
+	long depth = ingress_depth(p, f);
+	u64 ns = PSCHED_TICKS2NS(now - f->t_c);
+
+	f->t_c = now;
+	if (ns > NSEC_PER_SEC)
+		ns = NSEC_PER_SEC;
+	f->tokens += (long)div_u64(ns * f->rp.crate, NSEC_PER_SEC);
+	if (f->tokens > depth)
+		f->tokens = depth;
+}
+
+static inline ktime_t ingress_timer_period(const struct ingress_flow *f,
+										   const struct tc_qcn_rp_opt *qp)
+{
+	return ns_to_ktime(qcn_randomize(qcn_rp_timer_period(&f->rp, qp),
+									 qp->timer_jitter));
+}
+
+/* Cuts and restores for the rate event subscribers, under the qdisc
+   lock */
+static void ingress_rate_event(const struct ingress_flow *f, u16 type,
+							   u32 old_crate, u32 fb)
+{
+	struct qcn_rate_event ev;
+
+	qcn_rate_event_fill(&ev, type, qdisc_dev(f->sch)->ifindex,
+						f->sch->handle, old_crate, &f->rp, fb);
+	ev.src = f->src;
+	ev.dst = f->dst;
+	qcn_rate_notify(dev_net(qdisc_dev(f->sch)), &ev);
+}
+
+/* Timer stages, in softirq context; see qcn_rp_timer() in htb */
+static enum hrtimer_restart ingress_timer(struct hrtimer *timer)
+{
+	struct ingress_flow *f = container_of(timer, struct ingress_flow,
+										  timer.timer);
+	struct ingress_qdisc_data *p = qdisc_priv(f->sch);
+	spinlock_t *lock = qdisc_lock(f->sch);
+	int limited;
+	u32 old_crate;
+
+	spin_lock(lock);
+	if (f->dead) {
+		spin_unlock(lock);
+		return HRTIMER_NORESTART;
+	}
+	ingress_refill(p, f, psched_get_time());
+	old_crate = f->rp.crate;
+	qcn_alg_timer_stage(p->alg, p->prof, &f->rp, &p->qp);
+	limited = f->rp.crate < p->rate;
+	if (!limited)
+		ingress_rate_event(f, QCN_RATE_RESTORED, old_crate, 0);
+	spin_unlock(lock);
+
+	if (!limited)
+		return HRTIMER_NORESTART;	/* fully recovered */
+
+	hrtimer_forward_now(timer, ingress_timer_period(f, &p->qp));
+	return HRTIMER_RESTART;
+}
+
+/* The policer of a pair that just got its first CNM, under the qdisc
+   lock */
+static struct ingress_flow *ingress_flow_new(struct Qdisc *sch,
+											 __be32 src, __be32 dst)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	struct ingress_flow *f;
+
+	if (p->nr_flows >= p->limit) {
+		p->flows_exhausted++;
+		return NULL;
+	}
+	f = kzalloc(sizeof(*f), GFP_ATOMIC);
+	if (f == NULL) {
+		p->flows_exhausted++;
+		return NULL;
+	}
+
+	f->src = src & p->src_mask;
+	f->dst = dst & p->dst_mask;
+	f->sch = sch;
+	f->rp.crate = f->rp.trate = p->rate;
+	f->rp.bcount_tx = p->qp.bc;
+	qcn_alg_init(p->alg, &f->rp, &p->qp);
+	f->tokens = ingress_depth(p, f);
+	f->t_c = psched_get_time();
+	INIT_LIST_HEAD(&f->gc_node);
+	tasklet_hrtimer_init(&f->timer, ingress_timer,
+						 CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hlist_add_head(&f->hnode, ingress_bucket(p, f->src, f->dst));
+
+	if (p->nr_flows++ == 0)
+		schedule_delayed_work(&p->gc, HZ);
+	p->flows_created++;
+	return f;
+}
+
+/* Frees what was unlinked; f->dead keeps the timer from coming back */
+static void ingress_flow_free(struct ingress_flow *f)
+{
+	tasklet_hrtimer_cancel(&f->timer);
+	kfree(f);
+}
+
+/* Forgets the pairs that are back at rate, once a second */
+static void ingress_gc_work(struct work_struct *work)
+{
+	struct ingress_qdisc_data *p = container_of(work,
+										struct ingress_qdisc_data, gc.work);
+	spinlock_t *lock = qdisc_lock(p->sch);
+	struct ingress_flow *f, *next;
+	struct hlist_node *n, *tmp;
+	LIST_HEAD(idle);
+	unsigned int i;
+
+	spin_lock_bh(lock);
+	for (i = 0; i < INGRESS_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(f, n, tmp, &p->hash[i], hnode) {
+			if (f->rp.crate < p->rate || hrtimer_active(&f->timer.timer))
+				continue;
+			hlist_del(&f->hnode);
+			f->dead = 1;
+			list_add(&f->gc_node, &idle);
+			p->nr_flows--;
+		}
+	}
+	if (p->nr_flows)
+		schedule_delayed_work(&p->gc, HZ);
+	spin_unlock_bh(lock);
+
+	list_for_each_entry_safe(f, next, &idle, gc_node)
+		ingress_flow_free(f);
+}
+
+/* Softirq context under rcu_read_lock, see qcn_fb_deliver() */
+static int ingress_qcn_fb(struct qcn_fb_handler *h, struct qcn_frame *frame)
+{
+	struct Qdisc *sch = h->priv;
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	spinlock_t *lock = qdisc_lock(sch);
+	struct ingress_flow *f;
+	u32 Fb = ntohl(frame->Fb);
+	u32 old_crate;
+	int restart_timer;
+
+	spin_lock(lock);
+	if (frame->flags & htons(QCN_FRAME_FLOWID | QCN_FRAME_IPV6)) {
+		/* only an htb RP hands out flow IDs, or knows IPv6 pairs */
+		p->cnm_unmatched++;
+		spin_unlock(lock);
+		return -ENOENT;
+	}
+
+	/* off, the pairs still policed recover as usual and go */
+	f = ingress_flow_find(p, frame->SA, frame->DA);
+	if (Fb == 0 || !p->qp.enable) {
+		if (f == NULL)
+			p->cnm_unmatched++;
+		spin_unlock(lock);
+		return f ? -1 : -ENOENT;
+	}
+	if (f == NULL &&
+		(f = ingress_flow_new(sch, frame->SA, frame->DA)) == NULL) {
+		spin_unlock(lock);
+		return -ENOENT;
+	}
+
+	/* what was earned at the old rate is kept, up to the new depth */
+	ingress_refill(p, f, psched_get_time());
+	old_crate = f->rp.crate;
+	restart_timer = qcn_alg_decrease(p->alg, p->prof, &f->rp, &p->qp, Fb,
+									 p->rate,
+						(int)ntohl(frame->qoff), (int)ntohl(frame->qdelta));
+	f->tokens = min(f->tokens, ingress_depth(p, f));
+	ingress_rate_event(f, QCN_RATE_CUT, old_crate, Fb);
+
+	if (restart_timer || !hrtimer_active(&f->timer.timer))
+		tasklet_hrtimer_start(&f->timer, ingress_timer_period(f, &p->qp),
+							  HRTIMER_MODE_REL);
+	p->cnm_received++;
+	spin_unlock(lock);
+	return 1;
+}
+
+/* Byte counter stages for len bytes let through, as qcn_rp_advance() */
+static void ingress_advance(struct ingress_qdisc_data *p,
+							struct ingress_flow *f, int bytes, int segs)
+{
+	while (f->rp.bcount_tx <= bytes && segs-- > 0) {
+		bytes -= f->rp.bcount_tx;
+		qcn_alg_byte_stage(p->alg, p->prof, &f->rp, &p->qp);
+	}
+	if (f->rp.bcount_tx > bytes)
+		f->rp.bcount_tx -= bytes;
+}
+
+/* Whether skb is over the rate of its pair, under the qdisc lock */
+static int ingress_police(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	unsigned int len = qdisc_pkt_len(skb);
+	struct ingress_flow *f;
+	struct iphdr *iph;
+
+	if (!p->nr_flows || skb->protocol != htons(ETH_P_IP) ||
+		!pskb_may_pull(skb, sizeof(struct iphdr)))
+		return 0;
+	iph = ip_hdr(skb);
+	if ((f = ingress_flow_find(p, iph->saddr, iph->daddr)) == NULL)
+		return 0;
+
+	ingress_refill(p, f, psched_get_time());
+	if (f->tokens < (long)len) {
+		p->policed++;
+		return 1;
+	}
+	f->tokens -= len;
+	ingress_advance(p, f, len,
+					skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1);
+	return 0;
+}
+
+/* A frame let in, under the qdisc lock; see Ingress Congestion Point */
+static void ingress_cp(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	unsigned int len = qdisc_pkt_len(skb);
+	psched_time_t now = psched_get_time();
+	u64 ns = PSCHED_TICKS2NS(now - p->cp_t);
+	int mac_len = skb->data - skb_mac_header(skb);
+	u64 drained;
+
+	if (ns > NSEC_PER_SEC)
+		ns = NSEC_PER_SEC;
+	/* what is left of a byte waits for the next frame */
+	drained = div_u64(ns * p->cp_rate, NSEC_PER_SEC);
+	if (drained) {
+		p->cp_t = now;
+		p->cp_backlog = drained < p->cp_backlog ?
+			p->cp_backlog - (u32)drained : 0;
+	}
+	if ((u64)p->cp_backlog + len > p->cp_limit) {
+		p->cp_overlimits++;
+		p->cp_backlog = p->cp_limit;
+	} else
+		p->cp_backlog += len;
+
+	/* qcn_flow_fill() reads VLAN tags from the MAC header on, which the
+	   receive path has already pulled */
+	if (likely(p->cp.enable)) {
+		__skb_push(skb, mac_len);
+		qcn_cp_enqueue(&p->cp, skb, len, p->cp_backlog);
+		__skb_pull(skb, mac_len);
+	}
+}
+
+static struct Qdisc *ingress_leaf(struct Qdisc *sch, unsigned long arg)
+{
+	return NULL;
+}
+
+static unsigned long ingress_get(struct Qdisc *sch, u32 classid)
+{
+	return TC_H_MIN(classid) + 1;
+}
+
+static unsigned long ingress_bind_filter(struct Qdisc *sch,
+					 unsigned long parent, u32 classid)
+{
+	return ingress_get(sch, classid);
+}
+
+static void ingress_put(struct Qdisc *sch, unsigned long cl)
+{
+}
+
+static void ingress_walk(struct Qdisc *sch, struct qdisc_walker *walker)
+{
+	return;
+}
+
+static struct tcf_proto **ingress_find_tcf(struct Qdisc *sch, unsigned long cl)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+
+	return &p->filter_list;
+}
+
+/* --------------------------- Qdisc operations ---------------------------- */
+
+static int ingress_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	struct tcf_result res;
+	int result;
+
+	result = tc_classify(skb, p->filter_list, &res);
+
+	sch->bstats.packets++;
+	sch->bstats.bytes += qdisc_pkt_len(skb);
+	switch (result) {
+	case TC_ACT_SHOT:
+		result = TC_ACT_SHOT;
+		sch->qstats.drops++;
+		break;
+	case TC_ACT_STOLEN:
+	case TC_ACT_QUEUED:
+		result = TC_ACT_STOLEN;
+		break;
+	case TC_ACT_RECLASSIFY:
+	case TC_ACT_OK:
+		skb->tc_index = TC_H_MIN(res.classid);
+	default:
+		result = TC_ACT_OK;
+		if (ingress_police(sch, skb)) {
+			result = TC_ACT_SHOT;
+			sch->qstats.drops++;
+			sch->qstats.overlimits++;
+		} else if (p->cp_rate)
+			ingress_cp(sch, skb);
+		break;
+	}
+
+	return result;
+}
+
+/* ------------------------------------------------------------- */
+
+static const struct nla_policy ingress_policy[TCA_INGRESS_QCN_CP + 1] = {
+	[TCA_HTB_QCN]		= { .len = sizeof(struct tc_qcn_rp_opt) },
+	[TCA_INGRESS_QCN]	= { .len = sizeof(struct tc_qcn_ingress_opt) },
+	[TCA_INGRESS_QCN_CP]	= { .len = sizeof(struct tc_qcn_cp_opt) },
+};
+
+static int ingress_opt_check(const struct tc_qcn_ingress_opt *iopt)
+{
+	if (((iopt->flags & TC_QCN_INGRESS_RATE) && iopt->rate == 0) ||
+		((iopt->flags & TC_QCN_INGRESS_BURST) && iopt->burst == 0) ||
+		((iopt->flags & TC_QCN_INGRESS_LIMIT) &&
+		 (iopt->limit == 0 || iopt->limit > QCN_INGRESS_LIMIT_MAX)) ||
+		((iopt->flags & TC_QCN_INGRESS_CP_LIMIT) && iopt->cp_limit == 0))
+		return -EINVAL;
+	return 0;
+}
+
+/* Retuning only; pairs above a lowered rate are brought down to it.
+   A new aggregate key applies to the pairs policed from then on, the
+   ones already policed keep theirs until they recover. */
+static int ingress_change(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	struct nlattr *tb[TCA_INGRESS_QCN_CP + 1];
+	struct tc_qcn_ingress_opt *iopt = NULL;
+	struct tc_qcn_rp_opt *qopt = NULL;
+	struct tc_qcn_cp_opt *cpopt = NULL;
+	const struct qcn_alg_ops *alg = NULL, *cp_alg = NULL;
+	struct ingress_flow *f;
+	struct hlist_node *n;
+	unsigned int i;
+	int err, set_alg = 0, set_cp_alg = 0;
+
+	if (opt == NULL)
+		return 0;
+	err = nla_parse_nested(tb, TCA_INGRESS_QCN_CP, opt, ingress_policy);
+	if (err < 0)
+		return err;
+	if (tb[TCA_HTB_QCN]) {
+		qopt = nla_data(tb[TCA_HTB_QCN]);
+		/* htb only: there are no classes and no tap to hold back */
+		if (qopt->flags & (TC_QCN_RP_CLASSIFY | TC_QCN_RP_FLOW |
+						   TC_QCN_RP_AUTO | TC_QCN_RP_AUTO_IDLE |
+						   TC_QCN_RP_BACKPRESSURE | TC_QCN_RP_HW_VF))
+			return -EINVAL;
+		if ((err = qcn_rp_check(qopt)) != 0)
+			return err;
+	}
+	if (tb[TCA_INGRESS_QCN]) {
+		iopt = nla_data(tb[TCA_INGRESS_QCN]);
+		if ((err = ingress_opt_check(iopt)) != 0)
+			return err;
+	}
+	if (tb[TCA_INGRESS_QCN_CP]) {
+		cpopt = nla_data(tb[TCA_INGRESS_QCN_CP]);
+		/* frames arriving never pass a TX ring of ours */
+		if ((cpopt->flags & TC_QCN_CP_RING) && cpopt->ring)
+			return -EINVAL;
+		if ((err = qcn_cp_check(cpopt)) != 0)
+			return err;
+	}
+	if (qopt && (err = set_alg = qcn_alg_opt_get(qopt->flags, TC_QCN_RP_ALG,
+												 qopt->alg, &alg)) < 0)
+		return err;
+	if (cpopt &&
+		(err = set_cp_alg = qcn_alg_opt_get(cpopt->flags, TC_QCN_CP_ALG,
+											cpopt->alg, &cp_alg)) < 0) {
+		qcn_alg_put(alg);
+		return err;
+	}
+
+	sch_tree_lock(sch);
+	if (qopt) {
+		qcn_rp_change(&p->qp, qopt);
+		p->prof = qcn_rp_prof(&p->qp);
+	}
+	if (set_alg && alg != p->alg) {
+		qcn_alg_put(p->alg);
+		p->alg = alg;		/* takes over our reference */
+		for (i = 0; i < INGRESS_HASH_SIZE; i++)
+			hlist_for_each_entry(f, n, &p->hash[i], hnode)
+				qcn_alg_init(alg, &f->rp, &p->qp);
+	} else
+		qcn_alg_put(alg);
+	if (qopt && (qopt->flags & TC_QCN_RP_AGGREGATE)) {
+		p->qp.agg_src = qopt->agg_src;
+		p->qp.agg_dst = qopt->agg_dst;
+		p->src_mask = qcn_prefix_mask(qopt->agg_src);
+		p->dst_mask = qcn_prefix_mask(qopt->agg_dst);
+	}
+	if (iopt && (iopt->flags & TC_QCN_INGRESS_RATE))
+		p->rate = iopt->rate;
+	if (iopt && (iopt->flags & TC_QCN_INGRESS_BURST))
+		p->burst = iopt->burst;
+	if (iopt && (iopt->flags & TC_QCN_INGRESS_LIMIT))
+		p->limit = iopt->limit;
+	if (iopt && (iopt->flags & TC_QCN_INGRESS_CP_RATE))
+		p->cp_rate = iopt->cp_rate;
+	if (iopt && (iopt->flags & TC_QCN_INGRESS_CP_LIMIT))
+		p->cp_limit = iopt->cp_limit;
+	if (cpopt)
+		qcn_cp_change(&p->cp, cpopt);
+	if (set_cp_alg)
+		qcn_cp_set_alg(&p->cp, cp_alg);
+	if (iopt && (iopt->flags & (TC_QCN_INGRESS_CP_RATE |
+								TC_QCN_INGRESS_CP_LIMIT))) {
+		/* the sampling table follows the rate, see qcn_cp_scale() */
+		p->cp.rate = p->cp_rate;
+		qcn_cp_set_limit(&p->cp, p->cp_limit);
+		p->cp_backlog = 0;
+		p->cp_t = psched_get_time();
+		qcn_cp_reset(&p->cp);
+	}
+	for (i = 0; i < INGRESS_HASH_SIZE; i++) {
+		hlist_for_each_entry(f, n, &p->hash[i], hnode) {
+			f->rp.crate = min(f->rp.crate, p->rate);
+			f->rp.trate = min(f->rp.trate, p->rate);
+			f->tokens = min(f->tokens, ingress_depth(p, f));
+		}
+	}
+	sch_tree_unlock(sch);
+	return 0;
+}
+
+static int ingress_init(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	struct tc_qcn_cp_opt def;
+	unsigned int i;
+	int err;
+
+	if (sch->parent != TC_H_INGRESS)
+		return -EOPNOTSUPP;
+
+	ingress_params_init(p);
+	for (i = 0; i < INGRESS_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&p->hash[i]);
+	p->sch = sch;
+	INIT_DELAYED_WORK(&p->gc, ingress_gc_work);
+
+	ingress_cp_params_init(&def);
+	if ((err = qcn_cp_init(&p->cp, sch, 0, &def, p->cp_rate)) != 0)
+		return err;
+	qcn_cp_set_limit(&p->cp, p->cp_limit);
+	p->cp_t = psched_get_time();
+	if ((err = ingress_change(sch, opt)) != 0)
+		goto err_cp;
+
+	/* The CNMs for the senders behind this port are ours now */
+	INIT_HLIST_NODE(&p->fb_handler.hnode);
+	p->fb_handler.ifindex = qdisc_dev(sch)->ifindex;
+	p->fb_handler.net = dev_net(qdisc_dev(sch));
+	p->fb_handler.queue = -1;
+	p->fb_handler.ingress = 1;
+	p->fb_handler.recv = ingress_qcn_fb;
+	p->fb_handler.priv = sch;
+	err = qcn_fb_register(&p->fb_handler);
+	if (err) {
+		printk(KERN_WARNING "%s rp: feedback handler busy (%d)\n",
+			   qdisc_dev(sch)->name, err);
+		goto err_cp;
+	}
+	printk(KERN_INFO "%s rp: ingress, rate %u burst %u limit %u "
+		   "cp_rate %u\n", qdisc_dev(sch)->name, p->rate, p->burst,
+		   p->limit, p->cp_rate);
+	return 0;
+
+err_cp:
+	qcn_cp_destroy(&p->cp);
+	qcn_alg_put(p->alg);
+	return err;
+}
+
+static void ingress_destroy(struct Qdisc *sch)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	struct ingress_flow *f;
+	struct hlist_node *n, *tmp;
+	unsigned int i;
+
+	/* No feedback may reach the pairs we are about to free */
+	qcn_fb_unregister(&p->fb_handler);
+	cancel_delayed_work_sync(&p->gc);
+	qcn_cp_destroy(&p->cp);
+
+	spin_lock_bh(qdisc_lock(sch));
+	for (i = 0; i < INGRESS_HASH_SIZE; i++)
+		hlist_for_each_entry(f, n, &p->hash[i], hnode)
+			f->dead = 1;
+	spin_unlock_bh(qdisc_lock(sch));
+
+	for (i = 0; i < INGRESS_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(f, n, tmp, &p->hash[i], hnode) {
+			hlist_del(&f->hnode);
+			ingress_flow_free(f);
+		}
+	}
+	tcf_destroy_chain(&p->filter_list);
+	qcn_alg_put(p->alg);
+}
+
+static int ingress_dump(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	spinlock_t *root_lock = qdisc_root_sleeping_lock(sch);
+	struct tc_qcn_ingress_opt iopt;
+	struct tc_qcn_rp_opt opt;
+	struct tc_qcn_cp_opt cpopt;
+	struct nlattr *nest;
+
+	spin_lock_bh(root_lock);
+	opt = p->qp;
+	opt.flags = TC_QCN_RP_TIMER | TC_QCN_RP_FASTREC | TC_QCN_RP_BC |
+		TC_QCN_RP_AI | TC_QCN_RP_HAI | TC_QCN_RP_GD | TC_QCN_RP_MIN_RATE |
+		TC_QCN_RP_MIN_RATE_DEC | TC_QCN_RP_JITTER | TC_QCN_RP_EXACT |
+		TC_QCN_RP_AGGREGATE | TC_QCN_RP_ALG | TC_QCN_RP_ENABLE;
+	iopt.flags = TC_QCN_INGRESS_RATE | TC_QCN_INGRESS_BURST |
+		TC_QCN_INGRESS_LIMIT | TC_QCN_INGRESS_CP_RATE |
+		TC_QCN_INGRESS_CP_LIMIT;
+	iopt.rate = p->rate;
+	iopt.burst = p->burst;
+	iopt.limit = p->limit;
+	iopt.cp_rate = p->cp_rate;
+	iopt.cp_limit = p->cp_limit;
+	qcn_cp_dump(&p->cp, &cpopt);
+	spin_unlock_bh(root_lock);
+
+	nest = nla_nest_start(skb, TCA_OPTIONS);
+	if (nest == NULL)
+		goto nla_put_failure;
+	if (nla_put(skb, TCA_HTB_QCN, sizeof(opt), &opt) ||
+		nla_put(skb, TCA_INGRESS_QCN, sizeof(iopt), &iopt) ||
+		nla_put(skb, TCA_INGRESS_QCN_CP, sizeof(cpopt), &cpopt))
+		goto nla_put_failure;
+	nla_nest_end(skb, nest);
+	return skb->len;
+
+nla_put_failure:
+	nla_nest_cancel(skb, nest);
+	return -1;
+}
+
+/* called under the qdisc lock, see gnet_stats_start_copy() */
+static int ingress_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	struct tc_qcn_ingress_xstats st = {
+		.flows = p->nr_flows,
+		.flows_created = p->flows_created,
+		.flows_exhausted = p->flows_exhausted,
+		.cnm_received = p->cnm_received,
+		.cnm_unmatched = p->cnm_unmatched,
+		.policed = p->policed,
+		.cp_overlimits = p->cp_overlimits,
+	};
+	struct ingress_flow *f;
+	struct hlist_node *n;
+	unsigned int i;
+
+	for (i = 0; i < INGRESS_HASH_SIZE; i++)
+		hlist_for_each_entry(f, n, &p->hash[i], hnode)
+			if (st.crate_min == 0 || f->rp.crate < st.crate_min)
+				st.crate_min = f->rp.crate;
+	qcn_cp_stats(&p->cp, &st.cp);
+
+	return gnet_stats_copy_app(d, &st, sizeof(st));
+}
+
+static const struct Qdisc_class_ops ingress_class_ops = {
+	.leaf		=	ingress_leaf,
+	.get		=	ingress_get,
+	.put		=	ingress_put,
+	.walk		=	ingress_walk,
+	.tcf_chain	=	ingress_find_tcf,
+	.bind_tcf	=	ingress_bind_filter,
+	.unbind_tcf	=	ingress_put,
+};
+
+static struct Qdisc_ops ingress_qdisc_ops __read_mostly = {
+	.cl_ops		=	&ingress_class_ops,
+	.id		=	"qcningress",
+	.priv_size	=	sizeof(struct ingress_qdisc_data),
+	.enqueue	=	ingress_enqueue,
+	.init		=	ingress_init,
+	.change		=	ingress_change,
+	.destroy	=	ingress_destroy,
+	.dump		=	ingress_dump,
+	.dump_stats	=	ingress_dump_stats,
+	.owner		=	THIS_MODULE,
+};
+
+static int __init ingress_module_init(void)
+{
+	return register_qdisc(&ingress_qdisc_ops);
+}
+
+static void __exit ingress_module_exit(void)
+{
+	unregister_qdisc(&ingress_qdisc_ops);
+}
+
+module_init(ingress_module_init)
+module_exit(ingress_module_exit)
+MODULE_LICENSE("GPL");
@@ -17,18 +17,25 @@
 #include <linux/kernel.h>
 #include <linux/string.h>
 #include <linux/errno.h>
+#include <linux/math64.h>
 #include <linux/skbuff.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/slab.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 
 #include <linux/ip.h>
 #include <linux/if_ether.h>
-#include <asm/msr.h>
+#include <linux/ipv6.h>
+#include <net/inet_ecn.h>
+#include <linux/timex.h>
 
-#define ETH_QCN                 0xA9A9
+#include "qcn.h"
 
 static int QCN_Q_EQ __read_mostly = 33792; /* 33KB */
 static int QCN_W    __read_mostly = 2;
+static int QCN_SAMPLE_JITTER __read_mostly = 15; /* +/- 15% */
 
 module_param    (QCN_Q_EQ, int, 0640);
 MODULE_PARM_DESC(QCN_Q_EQ, "QCN Congestion Point, parameter Q_EQ");
@@ -36,6 +43,167 @@ MODULE_PARM_DESC(QCN_Q_EQ, "QCN Congestion Point, parameter Q_EQ");
 module_param    (QCN_W, int, 0640);
 MODULE_PARM_DESC(QCN_W, "QCN Congestion Point, parameter W");
 
+/* Congestion controlled priorities (CNPV), one bit per 802.1p priority.
+   Other priorities are accounted for but never sampled. A zero entry in
+   QCN_Q_EQ_PRIO/QCN_W_PRIO falls back to QCN_Q_EQ/QCN_W. Like all CP
+   parameters these are the defaults of new instances, see TCA_TBF_QCN
+   for changing a running one. */
+static int QCN_CNPV __read_mostly = 0xFF;
+static int QCN_Q_EQ_PRIO[QCN_NR_PRIO] __read_mostly;
+static int QCN_W_PRIO[QCN_NR_PRIO] __read_mostly;
+
+module_param    (QCN_CNPV, int, 0640);
+MODULE_PARM_DESC(QCN_CNPV, "QCN Congestion Point, bitmask of the congestion "
+				 "controlled priorities, default 0xFF");
+
+module_param_array(QCN_Q_EQ_PRIO, int, NULL, 0640);
+MODULE_PARM_DESC(QCN_Q_EQ_PRIO, "QCN Congestion Point, per priority Q_EQ "
+				 "(0: use QCN_Q_EQ)");
+
+module_param_array(QCN_W_PRIO, int, NULL, 0640);
+MODULE_PARM_DESC(QCN_W_PRIO, "QCN Congestion Point, per priority W "
+				 "(0: use QCN_W)");
+
+/* 0: private ETH_QCN frames (our HTB RP only), 1: 802.1Qau CNMs,
+   which NIC based RPs understand as well */
+static int QCN_CNM_FORMAT __read_mostly = 0;
+
+module_param    (QCN_CNM_FORMAT, int, 0640);
+MODULE_PARM_DESC(QCN_CNM_FORMAT, "QCN Congestion Point, CNM format: 0 private "
+				 "(0xA9A9), 1 802.1Qau (0x22E7), default 0");
+
+module_param    (QCN_SAMPLE_JITTER, int, 0640);
+MODULE_PARM_DESC(QCN_SAMPLE_JITTER, "QCN Congestion Point, sampling interval "
+				 "randomization (percent), default 15");
+
+/* Private CNMs to the same host are coalesced for up to this long, see
+   qcn_cnm_agg_add(). 0 sends every CNM on its own. */
+static int QCN_CNM_COALESCE __read_mostly = 0;
+
+module_param    (QCN_CNM_COALESCE, int, 0640);
+MODULE_PARM_DESC(QCN_CNM_COALESCE, "QCN Congestion Point, CNM coalescing "
+				 "window (us), default 0 (off)");
+
+/* Minimum time between two CNMs to the same flow, see qcn_cnm_suppress().
+   0 lets every sample through. */
+static int QCN_CNM_MIN_INTERVAL __read_mostly = 0;
+
+module_param    (QCN_CNM_MIN_INTERVAL, int, 0640);
+MODULE_PARM_DESC(QCN_CNM_MIN_INTERVAL, "QCN Congestion Point, minimum "
+				 "interval between CNMs to a flow (us), default 0 (off)");
+
+/* Rate (bytes/s) the sampling table is meant for; a CP shaping at
+   another rate stretches it accordingly. 0 keeps the bytes fixed. */
+static int QCN_MARK_RATE __read_mostly = 0;
+
+module_param    (QCN_MARK_RATE, int, 0640);
+MODULE_PARM_DESC(QCN_MARK_RATE, "QCN Congestion Point, rate the sampling "
+				 "table is for (bytes/s), default 0 (any)");
+
+/* Time slot of the queue derivative, see qcn_cp_period(). 0 takes it
+   from sample to sample, as 802.1Qau does. */
+static int QCN_FB_PERIOD __read_mostly = 0;
+
+module_param    (QCN_FB_PERIOD, int, 0640);
+MODULE_PARM_DESC(QCN_FB_PERIOD, "QCN Congestion Point, period of the queue "
+				 "derivative (us), default 0 (per sample)");
+
+/* ECN capable IP packets get CE instead of a CNM; TC_QCN_ECN_* */
+static int QCN_ECN __read_mostly = 0;
+
+module_param    (QCN_ECN, int, 0640);
+MODULE_PARM_DESC(QCN_ECN, "QCN Congestion Point, mark ECN capable packets "
+				 "instead of CNMs: 0 off, 1 sampled, 2 proportional to Fb");
+
+/* What Fb is computed from, TC_QCN_METRIC_*, and the target of the delay
+   metric; about Q_EQ at 1G by default */
+static int QCN_METRIC __read_mostly = 0;
+static int QCN_TARGET __read_mostly = 250;
+
+module_param    (QCN_METRIC, int, 0640);
+MODULE_PARM_DESC(QCN_METRIC, "QCN Congestion Point, congestion metric: "
+				 "0 queue length, 1 queueing delay");
+
+module_param    (QCN_TARGET, int, 0640);
+MODULE_PARM_DESC(QCN_TARGET, "QCN Congestion Point, target queueing delay "
+				 "of the delay metric (us), default 250");
+
+/* Bytes over which heavy hitters are counted, see qcn_hh_add() */
+static int QCN_HEAVY __read_mostly = 0;
+
+module_param    (QCN_HEAVY, int, 0640);
+MODULE_PARM_DESC(QCN_HEAVY, "QCN Congestion Point, send CNMs to the largest "
+				 "flows of this many bytes only, default 0 (off)");
+
+/* Per flow queues below the shaper, see tbf_fq_enqueue(); 0 is a bfifo */
+static int QCN_FLOWS __read_mostly = 0;
+
+module_param    (QCN_FLOWS, int, 0640);
+MODULE_PARM_DESC(QCN_FLOWS, "QCN Congestion Point, number of flow queues "
+				 "(a power of 2), default 0 (one bfifo)");
+
+/* Bytes one token check may release, see tbf_dequeue_bulk(); 0 takes
+   the packets one by one */
+static int QCN_BULK __read_mostly = 0;
+
+module_param    (QCN_BULK, int, 0640);
+MODULE_PARM_DESC(QCN_BULK, "QCN Congestion Point, bytes per bulk dequeue, "
+				 "default 0 (off)");
+
+/* Packet times from the rate in ns rather than from the rate table,
+   see tbf_l2t() */
+static int QCN_EXACT_RATE __read_mostly = 0;
+
+module_param    (QCN_EXACT_RATE, int, 0640);
+MODULE_PARM_DESC(QCN_EXACT_RATE, "QCN Congestion Point, time packets from "
+				 "the rate in ns, default 0 (rate table)");
+
+/* Sojourn time histograms, see tbf_sojourn_note() */
+static int QCN_SOJOURN __read_mostly = 0;
+
+module_param    (QCN_SOJOURN, int, 0640);
+MODULE_PARM_DESC(QCN_SOJOURN, "QCN Congestion Point, keep sojourn time "
+				 "histograms, default 0 (off)");
+
+/* 0 makes a new tbf a plain shaper, see tbf_enqueue() */
+static int QCN_ENABLE __read_mostly = 1;
+
+module_param    (QCN_ENABLE, int, 0640);
+MODULE_PARM_DESC(QCN_ENABLE, "QCN Congestion Point, run the CP on a new "
+				 "tbf, default 1; 0 leaves a plain shaper");
+
+/* Feedback path emulation, see qcn_cnm_send() */
+static int QCN_FB_DELAY __read_mostly = 0;
+static int QCN_FB_LOSS __read_mostly = 0;
+
+module_param    (QCN_FB_DELAY, int, 0640);
+MODULE_PARM_DESC(QCN_FB_DELAY, "QCN Congestion Point, us each CNM is held "
+				 "before it is sent, default 0 (none)");
+module_param    (QCN_FB_LOSS, int, 0640);
+MODULE_PARM_DESC(QCN_FB_LOSS, "QCN Congestion Point, CNMs dropped per "
+				 "million at random, default 0 (none)");
+
+/* Driver TX ring, see qcn_port_qlen() */
+static int QCN_RING __read_mostly = 0;
+module_param    (QCN_RING, int, 0640);
+MODULE_PARM_DESC(QCN_RING, "QCN Congestion Point, add the bytes estimated "
+				 "in the driver's TX ring to the queue, default 0");
+
+/* Shared buffer domain, see qcn_cp_eq() */
+static int QCN_SBUF __read_mostly = 0;
+static int QCN_SBUF_SIZE __read_mostly = 0;
+static int QCN_SBUF_ALPHA __read_mostly = 16;
+
+module_param    (QCN_SBUF, int, 0640);
+MODULE_PARM_DESC(QCN_SBUF, "QCN Congestion Point, shared buffer domain "
+				 "to join, default 0 (none)");
+module_param    (QCN_SBUF_SIZE, int, 0640);
+MODULE_PARM_DESC(QCN_SBUF_SIZE, "QCN Congestion Point, bytes of the shared "
+				 "buffer, default 0 (no threshold)");
+module_param    (QCN_SBUF_ALPHA, int, 0640);
+MODULE_PARM_DESC(QCN_SBUF_ALPHA, "QCN Congestion Point, shared buffer "
+				 "threshold in 16ths of the free buffer, default 16");
+
 /*	Simple Token Bucket Filter.
 	=======================================
 
@@ -108,17 +276,18 @@ MODULE_PARM_DESC(QCN_W, "QCN Congestion Point, parameter W");
 
 	With classful TBF, limit is just kept for backwards compatibility.
 	It is passed to the default bfifo qdisc - if the inner qdisc is
-	changed the limit is not effective anymore.
+	changed the limit is not effective anymore. With qp.flows the
+	default is the flow queued child below instead, which takes the
+	limit for all of its flows.
 */
 
-struct qcn_frame {
-	u32 DA;
-	u32 SA;
-	u32 Fb;
-	int qoff;
-	int qdelta;
-};
-
+/* Read mostly parameters first, then the shaper, then the congestion
+   point, then the CNM machinery the tasklets and timers of qcn_core
+   run, each from a cache line of its own so that the enqueue side of
+   the CP, the dequeue side of the shaper and the CNM tasklet do not
+   write into each other's lines. qdisc_priv() is only QDISC_ALIGNTO
+   aligned, so a part may still share its first line with the last
+   bytes of the one before, but no more than that. */
 struct tbf_sched_data {
     /* Parameters */
 	u32		limit;		/* Maximal length of backlog: bytes */
@@ -127,145 +296,1121 @@ struct tbf_sched_data {
 	u32		max_size;
 	struct qdisc_rate_table	*R_tab;
 	struct qdisc_rate_table	*P_tab;
+	struct Qdisc	*qdisc;		/* Inner qdisc, default - bfifo queue */
+	struct tc_qcn_cp_opt qp;		/* Parameters of this CP */
+	const struct qcn_alg_ops *alg;	/* the one qp.alg names, NULL 802.1Qau */
+	struct qcn_cp_group *cp_group;	/* Port view, only below mq */
+	struct qcn_cp_slot *cp_slot;	/* Our TX queue's slot in cp_group */
+	struct qcn_sbuf *sbuf;			/* Shared buffer domain, qp.sbuf */
+	struct qcn_sbuf_slot *sbuf_slot;	/* Our slot in it */
+	struct qcn_telem *telem[QCN_NR_PRIO];	/* Live state, mmap()ed */
+	u32 mark[QCN_MARK_STEPS];		/* qp.mark at our rate */
+	struct tbf_sojourn {			/* per CPU, qp.sojourn */
+		u32 hist[QCN_NR_PRIO][QCN_LAT_BUCKETS];
+	} *sojourn;
+	struct tbf_ratecfg {		/* R_tab and P_tab for qp.exact_rate */
+		u32	mult;
+		u16	mpu;
+		u8	shift;
+	} rate, prate;
 
     /* Variables */
-	long	tokens;			/* Current number of B tokens */
-	long	ptokens;		/* Current number of P tokens */
+	s64	tokens ____cacheline_aligned_in_smp;
+					/* Current number of B tokens */
+	s64	ptokens;		/* Current number of P tokens */
 	psched_time_t	t_c;		/* Time check-point */
-	struct Qdisc	*qdisc;		/* Inner qdisc, default - bfifo queue */
+					/* (all three in ns with qp.exact_rate) */
 	struct qdisc_watchdog watchdog;	/* Watchdog timer */
+	struct sk_buff_head bulk;	/* Paid for, not handed out yet */
+	unsigned long	sent;		/* Bytes handed to the driver */
 
-	/* QCN Variables */
-	int qcn_qlen;				/* QCN Queue length */
-	int qcn_qlen_old;			/* QCN Queue length at the time we
+	/* QCN Variables, one congestion point per priority */
+	struct qcn_cp_prio {
+		int qcn_qlen;			/* QCN Queue length */
+		int qcn_qlen_old;		/* QCN Queue length at the time we
 								   sent the last Fb */
-	int sample;
-	u32 generate_fb_frame;
+		int sample;
+		u32 generate_fb_frame;
+		u32 fb;					/* Last quantized Fb */
+		u32 fb_max;				/* -Fb clamp, see qcn_fb_scale() */
+		int fb_shift;			/* -Fb bits below the 6 sent */
+		int prof;				/* qcn_cp_prof() of w */
+		psched_time_t fb_next;	/* next qlen_old update, fb_period */
+		u32 delay;				/* us, sojourn of the last departure;
+								   qlen_old is one too with the delay
+								   metric */
+	} cp[QCN_NR_PRIO] ____cacheline_aligned_in_smp;
+	struct qcn_cnm_filter cnm_filter;	/* Recently notified flows */
+	struct qcn_hh hh;				/* Heavy hitters, qp.heavy */
+	u32 cnm_generated;				/* CNMs built */
+	u32 cnm_create_failed;			/* CNMs we could not build */
+	u32 ecn_marked;					/* CE instead of a CNM */
+	struct qcn_ring ring;			/* Below us in the driver, qp.ring */
+
+	/* CNM machinery */
+	struct qcn_cnm_sender cnm_tx ____cacheline_aligned_in_smp;
+									/* Deferred CNM transmission */
+	struct qcn_cnm_pool cnm_pool;	/* Preallocated CNM skbs */
+	struct qcn_cnm_agg cnm_agg;		/* CNM coalescing */
 };
 
 #define L2T(q,L)   qdisc_l2t((q)->R_tab,L)
 #define L2T_P(q,L) qdisc_l2t((q)->P_tab,L)
 
-static inline int qcn_mark_table(u32 qntz_Fb)
+/* Exact rate.
+   =======================================
+
+   The rate table gives a packet the time of the 2^cell_log byte cell
+   its length falls in, rounded to a whole psched tick, which at 10G
+   and above is a good part of a short frame's time. With qp.exact_rate
+   the bucket runs in ns instead and a packet costs len * mult >> shift
+   ns, mult being NSEC_PER_SEC << shift / rate for the largest shift
+   that keeps it in 32 bits, as the rate itself has it to 2^-31. The
+   helpers below hide which of the two units the bucket is in. */
+
+static void tbf_ratecfg_set(struct tbf_ratecfg *r,
+							const struct tc_ratespec *rs)
 {
-	switch (qntz_Fb >> 3) {
-	case 0: return 153600;
-	case 1:	return 76800;
-	case 2:	return 51200;
-	case 3:	return 38400;
-	case 4:	return 30720;
-	case 5: return 25600;
-	case 6: return 22016;
-	case 7: return 18944;
+	u64 factor = NSEC_PER_SEC;
+	u32 rate = rs->rate ? rs->rate : 1;
+
+	r->mpu = rs->mpu;
+	r->shift = 0;
+	for (;;) {
+		r->mult = div64_u64(factor, rate);
+		if (r->mult & (1U << 31) || factor & (1ULL << 63))
+			break;
+		factor <<= 1;
+		r->shift++;
 	}
-	return 153600;
+}
+
+static inline s64 tbf_ratecfg_l2t(const struct tbf_ratecfg *r,
+								  unsigned int len)
+{
+	if (len < r->mpu)
+		len = r->mpu;
+	return ((u64)len * r->mult) >> r->shift;
+}
+
+static inline s64 tbf_l2t(const struct tbf_sched_data *q, unsigned int len)
+{
+	return q->qp.exact_rate ? tbf_ratecfg_l2t(&q->rate, len) : L2T(q, len);
+}
+
+static inline s64 tbf_l2t_p(const struct tbf_sched_data *q, unsigned int len)
+{
+	return q->qp.exact_rate ? tbf_ratecfg_l2t(&q->prate, len) :
+		L2T_P(q, len);
+}
+
+/* Bucket depths, buffer and mtu being in ticks */
+static inline s64 tbf_depth(const struct tbf_sched_data *q)
+{
+	return q->qp.exact_rate ? (s64)PSCHED_TICKS2NS(q->buffer) : q->buffer;
+}
+
+static inline s64 tbf_pdepth(const struct tbf_sched_data *q)
+{
+	return q->qp.exact_rate ? (s64)PSCHED_TICKS2NS(q->mtu) : q->mtu;
+}
+
+/* The bucket's clock; *now is psched time for the QCN side either way */
+static inline u64 tbf_clock(const struct tbf_sched_data *q,
+							psched_time_t *now)
+{
+	u64 ns;
+
+	if (!q->qp.exact_rate)
+		return *now = psched_get_time();
+	ns = ktime_to_ns(ktime_get());
+	*now = PSCHED_NS2TICKS(ns);
+	return ns;
+}
+
+/* A time of the bucket's clock as psched time, rounded up */
+static inline psched_time_t tbf_ticks(const struct tbf_sched_data *q,
+									  u64 t)
+{
+	return q->qp.exact_rate ? PSCHED_NS2TICKS(t) + 1 : t;
+}
+
+/* t * from / to, for a bucket's worth of t at up to 32 bit rates */
+static s64 tbf_time_scale(s64 t, u32 from, u32 to)
+{
+	u32 rem;
+	u64 n = div_u64_rem(t, to, &rem);
+
+	return n * from + div_u64((u64)rem * from, to);
+}
+
+static void tbf_bucket_fill(struct tbf_sched_data *q)
+{
+	psched_time_t now;
+
+	q->t_c = tbf_clock(q, &now);
+	q->tokens = tbf_depth(q);
+	q->ptokens = tbf_pdepth(q);
+}
+
+/* Enqueue time, for the delay metric, and the queue the flow queued
+   child put the packet in */
+struct tbf_skb_cb {
+	psched_time_t	enqueue;
+	u32		flow;
+};
+
+static inline struct tbf_skb_cb *tbf_skb_cb(struct sk_buff *skb)
+{
+	BUILD_BUG_ON(sizeof(skb->cb) <
+		sizeof(struct qdisc_skb_cb) + sizeof(struct tbf_skb_cb));
+	return (struct tbf_skb_cb *)qdisc_skb_cb(skb)->data;
+}
+
+/* 802.1p priority, as set by SO_PRIORITY or the vlan egress map */
+static inline int qcn_prio(const struct sk_buff *skb)
+{
+	return skb->priority & (QCN_NR_PRIO - 1);
+}
+
+/* The time skb spent in the queue, leaving at now, into this CPU's
+   histogram of its priority; enqueue stamped it with qp.sojourn set.
+   Lock free, the dequeue runs with BHs off. */
+static inline void tbf_sojourn_note(struct tbf_sched_data *q,
+									struct sk_buff *skb, psched_time_t now)
+{
+	u64 ns;
+
+	if (!q->qp.sojourn)
+		return;
+	ns = PSCHED_TICKS2NS(now - tbf_skb_cb(skb)->enqueue);
+	qcn_lat_note(this_cpu_ptr(q->sojourn)->hist[qcn_prio(skb)],
+				 (s32)min_t(u64, ns, 0x7FFFFFFF));
+}
+
+/* Module parameters are the defaults of a new CP, copied so that a
+   later write to one does not reach the CPs already running; the per
+   priority ones included */
+static void qcn_params_init(struct tc_qcn_cp_opt *qp)
+{
+	static const u32 mark[QCN_MARK_STEPS] = QCN_MARK_DEFAULT;
+	int prio;
+
+	memset(qp, 0, sizeof(*qp));
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		qp->q_eq[prio] = QCN_Q_EQ_PRIO[prio] ? QCN_Q_EQ_PRIO[prio] : QCN_Q_EQ;
+		qp->w[prio] = QCN_W_PRIO[prio] ? QCN_W_PRIO[prio] : QCN_W;
+	}
+	qp->cnpv = QCN_CNPV;
+	qp->sample_jitter = QCN_SAMPLE_JITTER;
+	qp->cnm_format = QCN_CNM_FORMAT;
+	qp->coalesce = QCN_CNM_COALESCE;
+	qp->min_interval = QCN_CNM_MIN_INTERVAL;
+	memcpy(qp->mark, mark, sizeof(qp->mark));
+	qp->mark_rate = QCN_MARK_RATE;
+	qp->fb_period = QCN_FB_PERIOD;
+	qp->ecn = QCN_ECN;
+	qp->metric = QCN_METRIC;
+	qp->target = QCN_TARGET;
+	qp->heavy = QCN_HEAVY;
+	qp->flows = QCN_FLOWS;
+	qp->bulk = QCN_BULK;
+	qp->exact_rate = QCN_EXACT_RATE;
+	qp->sojourn = QCN_SOJOURN;
+	qp->sbuf = QCN_SBUF;
+	qp->sbuf_size = QCN_SBUF_SIZE;
+	qp->sbuf_alpha = QCN_SBUF_ALPHA;
+	qp->enable = QCN_ENABLE ? 1 : 0;
+	qp->fb_delay = clamp(QCN_FB_DELAY, 0, QCN_FB_DELAY_MAX);
+	qp->fb_loss = clamp(QCN_FB_LOSS, 0, QCN_FB_LOSS_MAX);
+	qp->ring = QCN_RING ? 1 : 0;
+	strlcpy(qp->alg, qcn_alg_name(NULL), sizeof(qp->alg));
+}
+
+static int qcn_params_check(const struct tc_qcn_cp_opt *new)
+{
+	int prio, i;
+
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		if (!(new->prio_mask & (1 << prio)))
+			continue;
+		if ((new->flags & TC_QCN_CP_Q_EQ) && new->q_eq[prio] <= 0)
+			return -EINVAL;
+		if ((new->flags & TC_QCN_CP_W) && new->w[prio] < 0)
+			return -EINVAL;
+	}
+	if ((new->flags & TC_QCN_CP_JITTER) && new->sample_jitter > 100)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_FORMAT) && new->cnm_format > 1)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_COALESCE) &&
+		new->coalesce > QCN_CNM_COALESCE_MAX)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_MIN_INTERVAL) &&
+		new->min_interval > QCN_CNM_MIN_INTERVAL_MAX)
+		return -EINVAL;
+	if (new->flags & TC_QCN_CP_MARK) {
+		for (i = 0; i < QCN_MARK_STEPS; i++)
+			if (new->mark[i] == 0 || new->mark[i] > 0x7FFFFFFF)
+				return -EINVAL;
+	}
+	if ((new->flags & TC_QCN_CP_FB_PERIOD) &&
+		new->fb_period > QCN_FB_PERIOD_MAX)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_ECN) && new->ecn > TC_QCN_ECN_PROP)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_METRIC) && new->metric > TC_QCN_METRIC_DELAY)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_TARGET) &&
+		(new->target == 0 || new->target > QCN_TARGET_MAX))
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_FLOWS) && (new->flows > QCN_FLOWS_MAX ||
+		(new->flows & (new->flows - 1))))
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_BULK) && new->bulk > QCN_BULK_MAX)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_EXACT_RATE) && new->exact_rate > 1)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_SOJOURN) && new->sojourn > 1)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_SBUF_SIZE) && new->sbuf_size > INT_MAX)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_SBUF_ALPHA) &&
+		(new->sbuf_alpha == 0 || new->sbuf_alpha > 1024))
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_ENABLE) && new->enable > 1)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_FB_DELAY) &&
+		new->fb_delay > QCN_FB_DELAY_MAX)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_FB_LOSS) && new->fb_loss > QCN_FB_LOSS_MAX)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_RING) && new->ring > 1)
+		return -EINVAL;
+	if ((new->flags & TC_QCN_CP_ALG) &&
+		strnlen(new->alg, QCN_ALG_NAME_MAX) == QCN_ALG_NAME_MAX)
+		return -EINVAL;
+	return 0;
+}
+
+/* called under sch_tree_lock, new was checked */
+static void qcn_params_change(struct tc_qcn_cp_opt *qp,
+							  const struct tc_qcn_cp_opt *new)
+{
+	int prio;
+
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		if (!(new->prio_mask & (1 << prio)))
+			continue;
+		if (new->flags & TC_QCN_CP_Q_EQ)
+			qp->q_eq[prio] = new->q_eq[prio];
+		if (new->flags & TC_QCN_CP_W)
+			qp->w[prio] = new->w[prio];
+	}
+	if (new->flags & TC_QCN_CP_CNPV)
+		qp->cnpv = new->cnpv;
+	if (new->flags & TC_QCN_CP_JITTER)
+		qp->sample_jitter = new->sample_jitter;
+	if (new->flags & TC_QCN_CP_FORMAT)
+		qp->cnm_format = new->cnm_format;
+	if (new->flags & TC_QCN_CP_COALESCE)
+		qp->coalesce = new->coalesce;
+	if (new->flags & TC_QCN_CP_MIN_INTERVAL)
+		qp->min_interval = new->min_interval;
+	if (new->flags & TC_QCN_CP_MARK)
+		memcpy(qp->mark, new->mark, sizeof(qp->mark));
+	if (new->flags & TC_QCN_CP_MARK_RATE)
+		qp->mark_rate = new->mark_rate;
+	if (new->flags & TC_QCN_CP_FB_PERIOD)
+		qp->fb_period = new->fb_period;
+	if (new->flags & TC_QCN_CP_ECN)
+		qp->ecn = new->ecn;
+	if (new->flags & TC_QCN_CP_METRIC)
+		qp->metric = new->metric;
+	if (new->flags & TC_QCN_CP_TARGET)
+		qp->target = new->target;
+	if (new->flags & TC_QCN_CP_HEAVY)
+		qp->heavy = new->heavy;
+	if (new->flags & TC_QCN_CP_ALG)
+		strlcpy(qp->alg, new->alg[0] ? new->alg : qcn_alg_name(NULL),
+				sizeof(qp->alg));
+	if (new->flags & TC_QCN_CP_FLOWS)
+		qp->flows = new->flows;
+	if (new->flags & TC_QCN_CP_BULK)
+		qp->bulk = new->bulk;
+	if (new->flags & TC_QCN_CP_EXACT_RATE)
+		qp->exact_rate = new->exact_rate;
+	if (new->flags & TC_QCN_CP_SOJOURN)
+		qp->sojourn = new->sojourn;
+	if (new->flags & TC_QCN_CP_SBUF)
+		qp->sbuf = new->sbuf;
+	if (new->flags & TC_QCN_CP_SBUF_SIZE)
+		qp->sbuf_size = new->sbuf_size;
+	if (new->flags & TC_QCN_CP_SBUF_ALPHA)
+		qp->sbuf_alpha = new->sbuf_alpha;
+	if (new->flags & TC_QCN_CP_ENABLE)
+		qp->enable = new->enable;
+	if (new->flags & TC_QCN_CP_FB_DELAY)
+		qp->fb_delay = new->fb_delay;
+	if (new->flags & TC_QCN_CP_FB_LOSS)
+		qp->fb_loss = new->fb_loss;
+	if (new->flags & TC_QCN_CP_RING)
+		qp->ring = new->ring;
+}
+
+/* Fb resolution follows Q_EQ, W and the limit; called under
+   sch_tree_lock whenever one of them changed. Below mq Fb is computed
+   from the backlog of the whole port, which can hold every queue's
+   limit. */
+static void qcn_fb_scale(struct tbf_sched_data *q)
+{
+	u32 limit = q->limit;
+	int prio;
+
+	if (q->qp.metric == TC_QCN_METRIC_DELAY) {
+		/* the longest sojourn is a full queue at our rate */
+		limit = q->R_tab ? min_t(u64, div_u64((u64)limit * USEC_PER_SEC,
+								 q->R_tab->rate.rate), ~0U) : 0;
+		for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+			q->cp[prio].fb_max = qcn_fb_max(q->qp.target, q->qp.w[prio],
+											limit);
+			q->cp[prio].fb_shift = qcn_fb_shift(q->cp[prio].fb_max);
+			q->cp[prio].prof = qcn_cp_prof(q->qp.w[prio]);
+		}
+		return;
+	}
+
+	if (q->cp_group)
+		limit = min_t(u64, (u64)limit * q->cp_group->nr_slots, ~0U);
+	if (q->qp.ring)
+		limit = min_t(u64, (u64)limit + q->ring.limit, ~0U);
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		q->cp[prio].fb_max = qcn_fb_max(q->qp.q_eq[prio], q->qp.w[prio],
+										limit);
+		q->cp[prio].fb_shift = qcn_fb_shift(q->cp[prio].fb_max);
+		q->cp[prio].prof = qcn_cp_prof(q->qp.w[prio]);
+	}
+}
+
+/* The sampling table at the rate we shape to; the interval is in bytes
+   of the port, so below mq that is every queue's rate. Called under
+   sch_tree_lock once R_tab is set. */
+static void qcn_mark_update(struct tbf_sched_data *q)
+{
+	u64 rate = q->R_tab->rate.rate;
+
+	if (q->cp_group)
+		rate *= q->cp_group->nr_slots;
+	qcn_mark_scale(q->mark, q->qp.mark, q->qp.mark_rate, rate);
+}
+
+/* Below mq, the local backlog is also published to the port view, and
+   in a shared buffer domain to that */
+static inline void qcn_qlen_add(struct tbf_sched_data *q, int prio, int len)
+{
+	q->cp[prio].qcn_qlen += len;
+	if (q->cp_slot)
+		q->cp_slot->qlen[prio] = q->cp[prio].qcn_qlen;
+	if (q->sbuf_slot)
+		q->sbuf_slot->qlen += len;
+}
+
+/* Runs wherever qcn_qlen or the CNM counters change, under the qdisc
+   lock; slots we could not get are never written */
+static inline void qcn_telem_cp(struct tbf_sched_data *q, int prio)
+{
+	struct qcn_telem *t = q->telem[prio];
+
+	if (!t)
+		return;
+	qcn_telem_begin(t);
+	t->qlen = q->cp[prio].qcn_qlen;
+	t->fb = q->cp[prio].fb;
+	t->cnm = q->cnm_generated;
+	t->cnm_sent = q->cnm_tx.sent;
+	t->cnm_failed = q->cnm_create_failed +
+		atomic_read(&q->cnm_tx.dropped);
+	qcn_telem_end(t);
+}
+
+/* Backlog the congestion signal is computed from: the whole port (the
+   sum over all TX queues) below mq, our own queue otherwise. With
+   qp.ring, the port's TX ring in front of every priority as well. */
+static inline int qcn_port_qlen(struct tbf_sched_data *q, int prio)
+{
+	int qlen = q->cp_group ? qcn_cp_group_qlen(q->cp_group, prio) :
+		q->cp[prio].qcn_qlen;
+
+	if (q->qp.ring)
+		qlen += qcn_ring_inflight(&q->ring, q->cp_group ?
+								  qcn_cp_group_sent(q->cp_group) :
+								  q->sent);
+	return qlen;
+}
+
+/* skb goes to the driver */
+static inline void tbf_sent(struct tbf_sched_data *q, struct sk_buff *skb)
+{
+	q->sent += qdisc_pkt_len(skb);
+	if (q->cp_slot)
+		q->cp_slot->sent = q->sent;
+}
+
+/* What Fb is computed from, and what it is held against. The delay is
+   that of our own queue, below mq too. */
+static inline int qcn_cp_metric(struct tbf_sched_data *q, int prio)
+{
+	return q->qp.metric == TC_QCN_METRIC_DELAY ? q->cp[prio].delay :
+		qcn_port_qlen(q, prio);
+}
+
+/* In a shared buffer domain Q_EQ is capped by our dynamic threshold,
+   which sums the slots of every member, so only ask when Fb is due */
+static inline int qcn_cp_eq(struct tbf_sched_data *q, int prio)
+{
+	if (q->qp.metric == TC_QCN_METRIC_DELAY)
+		return q->qp.target;
+	if (q->sbuf)
+		return min(q->qp.q_eq[prio],
+				   qcn_sbuf_thresh(q->sbuf, q->qp.sbuf_alpha));
+	return q->qp.q_eq[prio];
+}
+
+/* The bytes the queue drains in us at our rate, for a CNM's qoff and
+   qdelta under the delay metric */
+static inline int qcn_us2bytes(struct tbf_sched_data *q, int us)
+{
+	return (int)div_s64((s64)us * q->R_tab->rate.rate, USEC_PER_SEC);
 }
 
 static inline void qcn_init(struct tbf_sched_data *q)
 {
-	q->qcn_qlen = 0;
-	q->qcn_qlen_old = 0;
-	q->sample = 153600;
-	q->generate_fb_frame = 0;
+	int prio;
+
+	qcn_ring_reset(&q->ring);
+	if (q->sbuf_slot)
+		q->sbuf_slot->qlen = 0;
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		q->cp[prio].qcn_qlen = 0;
+		if (q->cp_slot)
+			q->cp_slot->qlen[prio] = 0;
+		q->cp[prio].qcn_qlen_old = 0;
+		q->cp[prio].sample = qcn_randomize(q->mark[0], q->qp.sample_jitter);
+		q->cp[prio].generate_fb_frame = 0;
+		q->cp[prio].fb = 0;
+		q->cp[prio].fb_next = 0;
+		q->cp[prio].delay = 0;
+		qcn_telem_cp(q, prio);
+	}
 }
 
-static struct sk_buff *qcnskb_create(struct sk_buff *skb, 
-									 struct qcn_frame *frame)
+/* The CP was turned on or off. The backlog is counted either way, the
+   congestion state starts over from it. Under sch_tree_lock. */
+static void qcn_restart(struct tbf_sched_data *q)
 {
-	struct ethhdr *ethh;
-	struct sk_buff *qcnskb;
-	struct net_device *indev;
+	int prio;
+
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		q->cp[prio].qcn_qlen_old = q->cp[prio].qcn_qlen;
+		q->cp[prio].sample = qcn_randomize(q->mark[0], q->qp.sample_jitter);
+		q->cp[prio].generate_fb_frame = 0;
+		q->cp[prio].fb = 0;
+		q->cp[prio].fb_next = 0;
+		q->cp[prio].delay = 0;
+		qcn_telem_cp(q, prio);
+	}
+}
 
-	memcpy(&indev, &skb->cb[24], sizeof(struct net_device *));
-	if (indev->name[4] != '\0') {
-		printk("QCN err: qcnskb_create, indev->name size != 4");
-		return NULL;
+/* With fb_period, qlen_old is the backlog of one period ago rather than
+   that of the last sample, so the derivative also follows a queue that
+   drains without arrivals. Called under the qdisc lock from both sides;
+   a pending CNM is dropped once Fb is 0. */
+static void qcn_cp_period(struct tbf_sched_data *q, int prio,
+						  psched_time_t now)
+{
+	struct qcn_cp_prio *cp = &q->cp[prio];
+	int m;
+
+	if (now < cp->fb_next)
+		return;
+	m = qcn_cp_metric(q, prio);
+	cp->fb = qcn_alg_fb(q->alg, cp->prof, qcn_cp_eq(q, prio), q->qp.w[prio],
+						m, cp->qcn_qlen_old, cp->fb_max, cp->fb_shift);
+	cp->qcn_qlen_old = m;
+	cp->fb_next = now + PSCHED_NS2TICKS((u64)q->qp.fb_period *
+										  NSEC_PER_USEC);
+	if (cp->fb == 0)
+		cp->generate_fb_frame = 0;
+}
+
+/* Dequeue side of the CP. Without departures being looked at, a CNM
+   decided on while the queue built up would go out with the next
+   arrival even after the queue is gone. */
+static inline void qcn_cp_dequeue(struct tbf_sched_data *q,
+								  struct sk_buff *skb, psched_time_t now)
+{
+	int prio = qcn_prio(skb);
+	struct qcn_cp_prio *cp = &q->cp[prio];
+
+	if (!q->qp.enable || !(q->qp.cnpv & (1 << prio)))
+		return;
+	/* An empty queue has no delay, however long the last packet
+	   waited */
+	if (q->qp.metric == TC_QCN_METRIC_DELAY)
+		cp->delay = cp->qcn_qlen == 0 ? 0 :
+			(u32)div_u64(PSCHED_TICKS2NS(now - tbf_skb_cb(skb)->enqueue),
+						 NSEC_PER_USEC);
+	if (q->qp.fb_period)
+		qcn_cp_period(q, prio, now);
+	else if (cp->generate_fb_frame) {
+		cp->fb = qcn_alg_fb(q->alg, cp->prof, qcn_cp_eq(q, prio),
+							q->qp.w[prio], qcn_cp_metric(q, prio),
+							cp->qcn_qlen_old, cp->fb_max, cp->fb_shift);
+		if (cp->fb == 0)
+			cp->generate_fb_frame = 0;
 	}
+}
 
-	/* Initialization */
-	if ((qcnskb = alloc_skb(64, GFP_ATOMIC)) == NULL)
-		return NULL;	
-	qcnskb->sk = NULL;
-	qcnskb->pkt_type = PACKET_OTHERHOST;
-	/* checksum: we dont need any checksum */
-	qcnskb->ip_summed = CHECKSUM_NONE;
+/* An IP packet that INET_ECN_set_ce() could mark */
+static inline int qcn_ecn_capable(struct sk_buff *skb)
+{
+	if (!skb->network_header)
+		return 0;
+	switch (skb->protocol) {
+	case __constant_htons(ETH_P_IP):
+		if (skb_network_header(skb) + sizeof(struct iphdr) >
+			skb_tail_pointer(skb))
+			return 0;
+		return INET_ECN_is_capable(ip_hdr(skb)->tos);
+	case __constant_htons(ETH_P_IPV6):
+		if (skb_network_header(skb) + sizeof(struct ipv6hdr) >
+			skb_tail_pointer(skb))
+			return 0;
+		return INET_ECN_is_capable(ipv6_get_dsfield(ipv6_hdr(skb)));
+	}
+	return 0;
+}
+
+/* INET_ECN_set_ce() on a packet qcn_ecn_capable() passed. A clone,
+   e.g. of a bridge flood or a tap, shares its header with the other
+   copies, which get a private one first; with no memory for it, or on
+   a shared skb, the packet goes unmarked. */
+static inline int qcn_ecn_set_ce(struct sk_buff *skb)
+{
+	unsigned int len = skb_network_offset(skb) +
+		(skb->protocol == htons(ETH_P_IP) ? sizeof(struct iphdr) :
+		 sizeof(struct ipv6hdr));
+
+	if (skb_shared(skb) ||
+		(skb_cloned(skb) && !skb_clone_writable(skb, len) &&
+		 pskb_expand_head(skb, 0, 0, GFP_ATOMIC)))
+		return 0;
+	return INET_ECN_set_ce(skb);
+}
+
+/* 802.1Qau CNM: PDU plus the head of the sampled MSDU, from its
+   ethertype on. Frames that carried a CN-TAG get it echoed. */
+static void qcnskb_fill_std(struct Qdisc *sch, struct sk_buff *qcnskb,
+							struct sk_buff *skb, struct qcn_frame *frame,
+							int prio)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct qcn_cntag_hdr *tag;
+	struct qcn_cnm_pdu *cnm;
+	unsigned int queue;
+	int off, len;
+
+	if (frame->flags & htons(QCN_FRAME_FLOWID)) {
+		eth_hdr(qcnskb)->h_proto = htons(ETH_P_CNTAG);
+		tag = (struct qcn_cntag_hdr *)skb_put(qcnskb, QCN_CNTAG_LEN);
+		tag->h_flow_id = frame->flow_id;
+		tag->h_encap_proto = htons(ETH_P_CNM);
+	} else
+		eth_hdr(qcnskb)->h_proto = htons(ETH_P_CNM);
+
+	cnm = (struct qcn_cnm_pdu *)skb_put(qcnskb, sizeof(*cnm));
+	cnm->ver_fb = htons((QCN_CNM_VERSION << 12) |
+						(ntohl(frame->Fb) & QCN_CNM_FB_MASK));
+	/* CPID: our port address, TX queue and priority */
+	queue = sch->dev_queue - netdev_get_tx_queue(dev, 0);
+	memcpy(cnm->cpid, dev->dev_addr, ETH_ALEN);
+	*(__be16 *)&cnm->cpid[ETH_ALEN] = htons((queue << 3) | prio);
+	cnm->qoffset = htons(clamp_t(int, (int)ntohl(frame->qoff) >>
+								 QCN_CNM_QUNIT_SHIFT, -32768, 32767));
+	cnm->qdelta = htons(clamp_t(int, (int)ntohl(frame->qdelta) >>
+								QCN_CNM_QUNIT_SHIFT, -32768, 32767));
+	cnm->encap_prio = htons(prio);
+	memcpy(cnm->encap_da, eth_hdr(skb)->h_dest, ETH_ALEN);
+
+	off = skb_mac_header(skb) + 2 * ETH_ALEN - skb->data;
+	len = min_t(int, skb->len - off, QCN_CNM_MSDU_MAX);
+	if (off < 0 || len < 0 ||
+		skb_copy_bits(skb, off, skb_put(qcnskb, len), len))
+		len = 0;
+	cnm->encap_len = htons(len);
+}
+
+/* The CNM goes back out indev, the device skb was received on */
+static struct sk_buff *qcnskb_create(struct Qdisc *sch,
+									 struct tbf_sched_data *q,
+									 struct sk_buff *skb,
+									 struct net_device *indev,
+									 struct qcn_frame *frame, int prio)
+{
+	struct ethhdr *ethh, *cnmh;
+	struct sk_buff *qcnskb;
+
+	/* Initialization: pooled skb, ethertype already in place */
+	if ((qcnskb = qcn_cnm_alloc(&q->cnm_pool)) == NULL)
+		return NULL;
 
 	/* eth */
 	ethh = eth_hdr(skb);
-	memcpy(skb_put(qcnskb, ETH_ALEN),ethh->h_source, ETH_ALEN);
-	memcpy(skb_put(qcnskb, ETH_ALEN),ethh->h_dest, ETH_ALEN);
-	*((__be16 *)skb_put(qcnskb, 2)) = htons(ETH_QCN);
-	/* qcn */
-	memcpy(skb_put(qcnskb, sizeof(struct qcn_frame)),
-		   frame,
-		   sizeof(struct qcn_frame));
-	memcpy(&qcnskb->dev, &skb->cb[24], sizeof(struct net_device *));
+	skb_reset_mac_header(qcnskb);
+	cnmh = (struct ethhdr *)skb_put(qcnskb, ETH_HLEN);
+	memcpy(cnmh->h_dest, ethh->h_source, ETH_ALEN);
+	if (q->qp.cnm_format) {
+		memcpy(cnmh->h_source, qdisc_dev(sch)->dev_addr, ETH_ALEN);
+		qcnskb_fill_std(sch, qcnskb, skb, frame, prio);
+	} else {
+		memcpy(cnmh->h_source, ethh->h_dest, ETH_ALEN);
+		cnmh->h_proto = htons(ETH_QCN);
+		/* qcn */
+		qcn_cnm_put_frame(qcnskb, frame);
+	}
+	qcn_cnm_put_vlan(qcnskb, frame);
+	qcnskb->dev = indev;
 
 	return qcnskb;
 }
 
+/* Private CNM, coalesced with others to the same host */
+static int qcnskb_coalesce(struct tbf_sched_data *q, struct sk_buff *skb,
+						   struct net_device *indev, struct qcn_frame *frame)
+{
+	struct ethhdr *ethh = eth_hdr(skb);
+
+	return qcn_cnm_agg_add(&q->cnm_agg, indev, ethh->h_source,
+						   ethh->h_dest, frame, q->qp.coalesce);
+}
+
+/*	Flow queued child.
+	=======================================
+
+	With qp.flows set, the queue below the shaper is not a bfifo but
+	nr_flows hashed per flow queues, served by deficit round robin a
+	quantum of bytes at a time. The flows are those CNMs are addressed
+	to (qcn_flow_fill()), so the backlog of each is the share of the
+	congestion its RP is responsible for. Traffic we cannot address
+	shares queue 0. The hash is seeded per child, so a sender cannot
+	pick addresses that pile onto one queue.
+
+	The child is only ever created by tbf_change(), is never registered
+	and reaches into its parent: packets it drops to make room for a
+	shorter flow are taken off the tbf's qcn_qlen right away.
+*/
+
+struct tbf_fq_flow {
+	struct sk_buff_head	q;
+	struct list_head	node;		/* on active while not empty */
+	u32			backlog;	/* bytes */
+	int			deficit;
+};
+
+struct tbf_fq_sched_data {
+	struct Qdisc		*tbf;		/* our parent */
+	u32			limit;		/* bytes, all flows */
+	u32			quantum;
+	u32			nr_flows;	/* a power of 2 */
+	u32			flow_rnd;	/* hash seed */
+	u32			nr_active;
+	struct list_head	active;
+	struct tbf_fq_flow	*flows;
+};
+
+static struct Qdisc_ops tbf_fq_qdisc_ops;
+
+static inline int tbf_is_fq(struct Qdisc *child)
+{
+	return child->ops == &tbf_fq_qdisc_ops;
+}
+
+static inline u32 tbf_fq_hash(struct tbf_fq_sched_data *fq,
+							  struct sk_buff *skb)
+{
+	struct qcn_frame frame;
+
+	if (!qcn_flow_fill(skb, &frame))
+		return 0;
+	return jhash_3words((__force u32)frame.SA, (__force u32)frame.DA,
+						(__force u32)frame.flow_id,
+						qcn_vlan_key(&frame) ^ fq->flow_rnd) &
+		(fq->nr_flows - 1);
+}
+
+/* The flow queue with the most bytes, NULL if all are empty */
+static struct tbf_fq_flow *tbf_fq_longest(struct tbf_fq_sched_data *fq)
+{
+	struct tbf_fq_flow *f, *max = NULL;
+
+	list_for_each_entry(f, &fq->active, node)
+		if (max == NULL || f->backlog > max->backlog)
+			max = f;
+	return max;
+}
+
+static struct sk_buff *tbf_fq_unlink(struct Qdisc *sch, struct tbf_fq_flow *f,
+									 int head)
+{
+	struct tbf_fq_sched_data *fq = qdisc_priv(sch);
+	struct sk_buff *skb;
+
+	skb = head ? __skb_dequeue(&f->q) : __skb_dequeue_tail(&f->q);
+	f->backlog -= qdisc_pkt_len(skb);
+	sch->qstats.backlog -= qdisc_pkt_len(skb);
+	sch->q.qlen--;
+	if (skb_queue_empty(&f->q)) {
+		list_del_init(&f->node);
+		fq->nr_active--;
+	}
+	return skb;
+}
+
+/* Over the limit: the head of the longest flow goes, unless that is
+   the flow of the arrival, which is then dropped instead. The tbf
+   learns of each drop here, not from its return value. */
+static int tbf_fq_make_room(struct Qdisc *sch, struct tbf_fq_flow *mine,
+							unsigned int len)
+{
+	struct tbf_fq_sched_data *fq = qdisc_priv(sch);
+	struct tbf_sched_data *q = qdisc_priv(fq->tbf);
+	struct tbf_fq_flow *f;
+	struct sk_buff *skb;
+	int prio;
+
+	while (sch->qstats.backlog + len > fq->limit) {
+		f = tbf_fq_longest(fq);
+		if (f == NULL || f == mine)
+			return 0;
+		skb = tbf_fq_unlink(sch, f, 1);
+		prio = qcn_prio(skb);
+		qcn_qlen_add(q, prio, -qdisc_pkt_len(skb));
+		qcn_telem_cp(q, prio);
+		sch->qstats.drops++;
+		kfree_skb(skb);
+		qdisc_tree_decrease_qlen(sch, 1);
+	}
+	return 1;
+}
+
+static int tbf_fq_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	struct tbf_fq_sched_data *fq = qdisc_priv(sch);
+	unsigned int len = qdisc_pkt_len(skb);
+	u32 idx = tbf_fq_hash(fq, skb);
+	struct tbf_fq_flow *f = &fq->flows[idx];
+
+	if (sch->qstats.backlog + len > fq->limit &&
+		!tbf_fq_make_room(sch, f, len))
+		return qdisc_drop(skb, sch);
+
+	tbf_skb_cb(skb)->flow = idx;
+	__skb_queue_tail(&f->q, skb);
+	f->backlog += len;
+	if (list_empty(&f->node)) {
+		f->deficit = fq->quantum;
+		list_add_tail(&f->node, &fq->active);
+		fq->nr_active++;
+	}
+	sch->qstats.backlog += len;
+	sch->q.qlen++;
+	sch->bstats.bytes += len;
+	sch->bstats.packets += skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+	return NET_XMIT_SUCCESS;
+}
+
+static struct sk_buff *tbf_fq_dequeue(struct Qdisc *sch)
+{
+	struct tbf_fq_sched_data *fq = qdisc_priv(sch);
+	struct tbf_fq_flow *f;
+	struct sk_buff *skb;
+
+	while (!list_empty(&fq->active)) {
+		f = list_first_entry(&fq->active, struct tbf_fq_flow, node);
+		if (f->deficit <= 0) {
+			f->deficit += fq->quantum;
+			list_move_tail(&f->node, &fq->active);
+			continue;
+		}
+		skb = tbf_fq_unlink(sch, f, 1);
+		f->deficit -= qdisc_pkt_len(skb);
+		return skb;
+	}
+	return NULL;
+}
+
+/* The tail of the longest flow; tbf_drop() takes the priority to
+   charge from tbf_fq_drop_prio() first */
+static unsigned int tbf_fq_drop(struct Qdisc *sch)
+{
+	struct tbf_fq_sched_data *fq = qdisc_priv(sch);
+	struct tbf_fq_flow *f = tbf_fq_longest(fq);
+	struct sk_buff *skb;
+	unsigned int len;
+
+	if (f == NULL)
+		return 0;
+	skb = tbf_fq_unlink(sch, f, 0);
+	len = qdisc_pkt_len(skb);
+	sch->qstats.drops++;
+	kfree_skb(skb);
+	return len;
+}
+
+static int tbf_fq_drop_prio(struct Qdisc *sch)
+{
+	struct tbf_fq_flow *f = tbf_fq_longest(qdisc_priv(sch));
+
+	return f ? qcn_prio(skb_peek_tail(&f->q)) : 0;
+}
+
+static void tbf_fq_reset(struct Qdisc *sch)
+{
+	struct tbf_fq_sched_data *fq = qdisc_priv(sch);
+	struct tbf_fq_flow *f, *n;
+
+	list_for_each_entry_safe(f, n, &fq->active, node) {
+		__skb_queue_purge(&f->q);
+		f->backlog = 0;
+		list_del_init(&f->node);
+	}
+	fq->nr_active = 0;
+	sch->qstats.backlog = 0;
+	sch->q.qlen = 0;
+}
+
+/* Set up by tbf_fq_create(), there are no options of its own */
+static int tbf_fq_init(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct tbf_fq_sched_data *fq = qdisc_priv(sch);
+
+	INIT_LIST_HEAD(&fq->active);
+	return 0;
+}
+
+static void tbf_fq_destroy(struct Qdisc *sch)
+{
+	struct tbf_fq_sched_data *fq = qdisc_priv(sch);
+
+	tbf_fq_reset(sch);
+	kfree(fq->flows);
+}
+
+static int tbf_fq_dump(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct tbf_fq_sched_data *fq = qdisc_priv(sch);
+	struct tc_fifo_qopt opt = { .limit = fq->limit };
+
+	if (nla_put(skb, TCA_OPTIONS, sizeof(opt), &opt))
+		goto nla_put_failure;
+	return skb->len;
+
+nla_put_failure:
+	return -1;
+}
+
+/* No owner: qdisc_create_dflt() takes no module reference for it to
+   drop, and the child never outlives the tbf that pins us */
+static struct Qdisc_ops tbf_fq_qdisc_ops __read_mostly = {
+	.id		=	"qcnfq",
+	.priv_size	=	sizeof(struct tbf_fq_sched_data),
+	.enqueue	=	tbf_fq_enqueue,
+	.dequeue	=	tbf_fq_dequeue,
+	.peek		=	qdisc_peek_dequeued,
+	.drop		=	tbf_fq_drop,
+	.init		=	tbf_fq_init,
+	.reset		=	tbf_fq_reset,
+	.destroy	=	tbf_fq_destroy,
+	.dump		=	tbf_fq_dump,
+};
+
+static struct Qdisc *tbf_fq_create(struct Qdisc *sch, u32 limit, u32 nr_flows)
+{
+	struct tbf_fq_sched_data *fq;
+	struct Qdisc *child;
+	u32 i;
+
+	child = qdisc_create_dflt(qdisc_dev(sch), sch->dev_queue,
+							  &tbf_fq_qdisc_ops, TC_H_MAKE(sch->handle, 1));
+	if (child == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	fq = qdisc_priv(child);
+	fq->flows = kcalloc(nr_flows, sizeof(*fq->flows), GFP_KERNEL);
+	if (fq->flows == NULL) {
+		qdisc_destroy(child);
+		return ERR_PTR(-ENOMEM);
+	}
+	for (i = 0; i < nr_flows; i++) {
+		skb_queue_head_init(&fq->flows[i].q);
+		INIT_LIST_HEAD(&fq->flows[i].node);
+	}
+	fq->tbf = sch;
+	fq->limit = limit;
+	fq->nr_flows = nr_flows;
+	get_random_bytes(&fq->flow_rnd, sizeof(fq->flow_rnd));
+	fq->quantum = psched_mtu(qdisc_dev(sch));
+	return child;
+}
+
+/* The default child: flow queues with qp.flows, a bfifo otherwise */
+static struct Qdisc *tbf_child_create(struct Qdisc *sch, u32 limit,
+									  u32 nr_flows)
+{
+	return nr_flows ? tbf_fq_create(sch, limit, nr_flows) :
+		fifo_create_dflt(sch, &bfifo_qdisc_ops, limit);
+}
+
+/* A CNM goes to a flow that holds at least its fair share of the
+   backlog; the others are victims of it. Always 1 without flow queues. */
+static inline int tbf_fq_culprit(struct tbf_sched_data *q, struct sk_buff *skb)
+{
+	struct tbf_fq_sched_data *fq;
+	struct tbf_fq_flow *f;
+
+	if (!tbf_is_fq(q->qdisc))
+		return 1;
+	fq = qdisc_priv(q->qdisc);
+	f = &fq->flows[tbf_skb_cb(skb)->flow];
+	if ((u64)f->backlog * fq->nr_active >= q->qdisc->qstats.backlog)
+		return 1;
+	qcn_hh_defer(&q->hh);
+	return 0;
+}
+
 static inline void qcn_algorithm(struct Qdisc* sch, struct tbf_sched_data *q,
 								 struct sk_buff *skb, unsigned int len)
 {
 	struct sk_buff *qcnskb;		/* QCN Congestion Message skb */
+	struct net_device *indev;
 	struct qcn_frame frame;
-	struct iphdr *iph;
-	u32 qntz_Fb, qntz_Fb_sent;
-	int Fb;
-	u64 tsc64;
-
-	q->qcn_qlen += len;
-	
-	Fb = (QCN_Q_EQ - q->qcn_qlen) - QCN_W * (q->qcn_qlen - q->qcn_qlen_old);
-	if (Fb < -QCN_Q_EQ * (2 * QCN_W +1)) {
-		Fb = -QCN_Q_EQ * (2 * QCN_W +1);
+	struct qcn_trace_rec rec;
+	struct qcn_cp_prio *cp;
+	u32 qntz_Fb = 0, qntz_Fb_sent = 0;
+	u32 interval;
+	int qlen = 0, m = 0, q_eq = 0, w, err, segs, ect;
+	int prio = qcn_prio(skb);
+
+	qcn_qlen_add(q, prio, len);
+
+	/* Priorities outside of the CNPV set never slow anybody down */
+	if (!(q->qp.cnpv & (1 << prio)))
+		goto trace;
+
+	cp = &q->cp[prio];
+	w = q->qp.w[prio];
+	cp->sample -= len;
+	if (q->qp.fb_period)
+		qcn_cp_period(q, prio, psched_get_time());
+
+	/* Heavy hitters count the traffic of the CNPV priorities */
+	if (q->qp.heavy && qcn_flow_fill(skb, &frame))
+		qcn_hh_add(&q->hh, &frame, len, q->qp.heavy);
+
+	/* ECN capable packets are marked, never sent a CNM */
+	ect = q->qp.ecn && qcn_ecn_capable(skb);
+
+	/* Fb is only looked at when a sample is due, a CNM is pending or
+	   a mark may be. Below mq that means reading the slots of every
+	   TX queue, so do not do it for every packet otherwise. */
+	if (cp->sample < 0 || cp->generate_fb_frame ||
+		(ect && q->qp.ecn == TC_QCN_ECN_PROP)) {
+		qlen = qcn_port_qlen(q, prio);
+		q_eq = qcn_cp_eq(q, prio);
+		m = q->qp.metric == TC_QCN_METRIC_DELAY ? cp->delay : qlen;
+		qntz_Fb = qcn_alg_fb(q->alg, cp->prof, q_eq, w, m, cp->qcn_qlen_old,
+							 cp->fb_max, cp->fb_shift);
+		cp->fb = qntz_Fb;
+		/* a pending CNM only goes while there is still congestion */
+		if (qntz_Fb == 0)
+			cp->generate_fb_frame = 0;
 	}
-	else if (Fb > 0)
-		Fb = 0;
-	
-	/* The maximum value of -Fb determines the number of bits that Fb
-	   uses. Uniform quantization of -Fb, qntz_Fb, uses most
-	   significant bits of -Fb. Note that now qntz_Fb has positive
-	   values.  If Q_EQ = 32KB, W = 2, qcn_qlen = 160KB then the maximum
-	   value for -Fb is 457728, which can be represented using 19bits
-	   (110 1111 1100 0000 0000). To get the 6 most significant bits
-	   --- considering that -Fb will use at most 19 bits ---, we need
-	   to discard the 13 least significant bits (>> 13).
-	*/
-	qntz_Fb = 0x3F & (((u32) -Fb) >> 13);
-	
-	q->sample -= len;
-	if (q->sample < 0) {
+
+	/* DCTCP style: the more congestion, the more marks */
+	if (ect && q->qp.ecn == TC_QCN_ECN_PROP && qntz_Fb &&
+		(net_random() & QCN_FB_MASK) < qntz_Fb && qcn_ecn_set_ce(skb))
+		q->ecn_marked++;
+
+	/* A GSO skb passes as many sampling points as its segments would
+	   have one by one, but no more than one per segment. Its segments
+	   arrive at the same instant, so all samples see the same Fb. */
+	segs = skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+	while (cp->sample < 0 && segs-- > 0) {
 		if (qntz_Fb > 0) {
-			q->generate_fb_frame = 1;
+			if (!cp->generate_fb_frame)
+				qcn_hh_pending(&q->hh);
+			cp->generate_fb_frame = 1;
 		}
-		q->qcn_qlen_old = q->qcn_qlen;
-		/* TODO: random sampling */
-		q->sample = qcn_mark_table(qntz_Fb);
-		if (q->generate_fb_frame == 1)
-			printk("New sample: %d\tFb %u\n", q->sample, qntz_Fb);
+		if (!q->qp.fb_period)
+			cp->qcn_qlen_old = m;
+
+		/* The sampling interval is meant in bytes arriving at the
+		   port. Below mq each queue only sees its share of the
+		   arrivals, which under congestion is about its share of the
+		   port backlog, so it samples that much more often. */
+		interval = qcn_mark_table(q->mark, qntz_Fb);
+		if (q->cp_group && qlen > cp->qcn_qlen)
+			interval = div_u64((u64)interval * cp->qcn_qlen, qlen);
+
+		/* Randomized so that synchronized senders do not get their
+		   CNMs in lockstep. The overshoot counts towards the next
+		   interval. */
+		cp->sample += qcn_randomize(interval, q->qp.sample_jitter);
 	}
 	
-	if (q->generate_fb_frame && skb && skb->network_header &&
-		(skb->protocol == __constant_htons(ETH_P_IP))) {
-		/* Since we are using IP addresses, we cant sample non-IP
-		   packets. */
-		
-		/* Filling the qcn_frame structure */
-		memset(&frame, 0, sizeof(struct qcn_frame));
-		iph = ip_hdr(skb);
-		frame.DA = iph->daddr;	/* Already in network byte order */
-		frame.SA = iph->saddr;	/* Already in network byte order */
+	/* The sampled packet carries the signal itself. Proportional
+	   marking leaves the pending CNM to the next packet that cannot. */
+	if (cp->generate_fb_frame && ect) {
+		if (q->qp.ecn == TC_QCN_ECN_SAMPLE && qcn_ecn_set_ce(skb)) {
+			q->ecn_marked++;
+			cp->generate_fb_frame = 0;
+		}
+	}
+	/* Locally generated traffic has no way back, and no CNM */
+	else if (cp->generate_fb_frame && skb &&
+		(indev = qcn_ingress_dev(dev_net(qdisc_dev(sch)), skb)) != NULL &&
+		qcn_flow_fill(skb, &frame) &&
+		qcn_hh_heavy(&q->hh, &frame, q->qp.heavy) &&
+		tbf_fq_culprit(q, skb) &&
+		!qcn_cnm_suppress(&q->cnm_filter, &frame, q->qp.min_interval)) {
+		int qoff = q_eq - m, qdelta = m - cp->qcn_qlen_old;
+
+		if (q->qp.metric == TC_QCN_METRIC_DELAY) {
+			qoff = qcn_us2bytes(q, qoff);
+			qdelta = qcn_us2bytes(q, qdelta);
+		}
 		frame.Fb = htonl(qntz_Fb);
-		frame.qoff = htonl(QCN_Q_EQ - q->qcn_qlen);
-		frame.qdelta = htonl(q->qcn_qlen - q->qcn_qlen_old);
-
-		if ((qcnskb = qcnskb_create(skb, &frame)) == NULL)
-			printk(KERN_ALERT "QCN err: qcnskb_create");
-		else if (dev_queue_xmit(qcnskb) != NET_XMIT_SUCCESS)
-			printk(KERN_ALERT "QCN err: dev_queue_xmit");
-		else {
-			q->generate_fb_frame = 0;
+		frame.qoff = htonl(qoff);
+		frame.qdelta = htonl(qdelta);
+
+		if (q->qp.coalesce && !q->qp.cnm_format &&
+			!(frame.flags & htons(QCN_FRAME_VLAN)))
+			err = qcnskb_coalesce(q, skb, indev, &frame);
+		else if ((qcnskb = qcnskb_create(sch, q, skb, indev, &frame,
+										 prio)) == NULL)
+			err = -ENOMEM;
+		else
+			err = qcn_cnm_send(&q->cnm_tx, qcnskb);
+
+		if (err == -ENOMEM)
+			q->cnm_create_failed++;
+		else
+			q->cnm_generated++;
+		if (err == 0) {
+			/* a full ring is counted in cnm_tx.dropped */
+			qcn_cnm_filter_note(&q->cnm_filter, &frame,
+								q->qp.min_interval);
+			cp->generate_fb_frame = 0;
 			qntz_Fb_sent = qntz_Fb;
 		}
 	}
@@ -273,10 +1418,18 @@ static inline void qcn_algorithm(struct Qdisc* sch, struct tbf_sched_data *q,
 	else
 		qntz_Fb_sent = 0;
 
-	rdtscll(tsc64);
-	printk(KERN_INFO "tbf %llu %s: QLEN %d TOKS %ld Fb %u\n",
-		   tsc64, sch->dev_queue->dev->name, q->qcn_qlen,
-		   q->tokens, qntz_Fb_sent);
+trace:
+	qcn_telem_cp(q, prio);
+	if (qcn_trace_enabled) {
+		memset(&rec, 0, sizeof(rec));
+		rec.tsc = get_cycles();
+		rec.type = QCN_TRACE_CP;
+		rec.id = qdisc_dev(sch)->ifindex;
+		rec.qlen = q->cp[prio].qcn_qlen;
+		rec.toks = q->tokens;
+		rec.fb = qntz_Fb_sent;
+		__qcn_trace(&rec);
+	}
 
 }
 
@@ -289,6 +1442,9 @@ static int tbf_enqueue(struct sk_buff *skb, struct Qdisc* sch)
 	if (len > q->max_size)
 		return qdisc_reshape_fail(skb, sch);
 
+	if (q->qp.metric == TC_QCN_METRIC_DELAY || q->qp.sojourn)
+		tbf_skb_cb(skb)->enqueue = psched_get_time();
+
 	ret = qdisc_enqueue(skb, q->qdisc);
 	if (ret != 0) {
 		if (net_xmit_drop_count(ret))
@@ -296,12 +1452,15 @@ static int tbf_enqueue(struct sk_buff *skb, struct Qdisc* sch)
 		return ret;
 	}
 
-	/* QCN */
-	qcn_algorithm(sch, q, skb, len);
+	/* QCN; off, only the backlog is kept up to date */
+	if (likely(q->qp.enable))
+		qcn_algorithm(sch, q, skb, len);
+	else
+		qcn_qlen_add(q, qcn_prio(skb), len);
 
 	sch->q.qlen++;
 	sch->bstats.bytes += qdisc_pkt_len(skb);
-	sch->bstats.packets++;
+	sch->bstats.packets += skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
 	return 0;
 }
 
@@ -310,58 +1469,131 @@ static unsigned int tbf_drop(struct Qdisc* sch)
 	struct tbf_sched_data *q = qdisc_priv(sch);
 	unsigned int len = 0;
 
+	struct sk_buff *tail;
+	int prio = 0;
+
+	/* The default bfifo drops its tail, the flow queues that of the
+	   longest flow; for other inner qdiscs we cannot tell, and charge
+	   priority 0 */
+	if (tbf_is_fq(q->qdisc))
+		prio = tbf_fq_drop_prio(q->qdisc);
+	else if ((tail = skb_peek_tail(&q->qdisc->q)) != NULL)
+		prio = qcn_prio(tail);
+
 	if (q->qdisc->ops->drop && (len = q->qdisc->ops->drop(q->qdisc)) != 0) {
-		q->qcn_qlen -= len;
+		qcn_qlen_add(q, prio, -len);
+		qcn_telem_cp(q, prio);
 		sch->q.qlen--;
 		sch->qstats.drops++;
 	}
 	return len;
 }
 
+/* The head packet just left with tokens to spare: take more off the
+   child while toks and ptoks cover them, up to qp.bulk bytes counting
+   the head's len, into q->bulk. They are still ours, so sch->q.qlen
+   keeps them, but they count as gone for QCN, one update per priority
+   for the whole batch. */
+static void tbf_dequeue_bulk(struct tbf_sched_data *q, psched_time_t now,
+							 s64 *toks, s64 *ptoks, unsigned int done)
+{
+	struct sk_buff *last[QCN_NR_PRIO] = { NULL };
+	int gone[QCN_NR_PRIO] = { 0 };
+	struct sk_buff *skb;
+	unsigned int len;
+	s64 t, pt = 0;
+	int prio;
+
+	while (done < q->qp.bulk &&
+		   (skb = q->qdisc->ops->peek(q->qdisc)) != NULL) {
+		len = qdisc_pkt_len(skb);
+		t = *toks - tbf_l2t(q, len);
+		if (q->P_tab)
+			pt = *ptoks - tbf_l2t_p(q, len);
+		if ((t|pt) < 0)
+			break;
+		skb = qdisc_dequeue_peeked(q->qdisc);
+		if (unlikely(!skb))
+			break;
+		tbf_sojourn_note(q, skb, now);
+		*toks = t;
+		*ptoks = pt;
+		__skb_queue_tail(&q->bulk, skb);
+		prio = qcn_prio(skb);
+		gone[prio] += len;
+		last[prio] = skb;
+		done += len;
+	}
+
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		if (!last[prio])
+			continue;
+		qcn_qlen_add(q, prio, -gone[prio]);
+		qcn_cp_dequeue(q, last[prio], now);
+		qcn_telem_cp(q, prio);
+	}
+}
+
 static struct sk_buff *tbf_dequeue(struct Qdisc* sch)
 {
 	struct tbf_sched_data *q = qdisc_priv(sch);
 	struct sk_buff *skb;
 
+	/* Left from the last bulk dequeue, tokens already taken */
+	if ((skb = __skb_dequeue(&q->bulk)) != NULL) {
+		sch->q.qlen--;
+		tbf_sent(q, skb);
+		return skb;
+	}
+
 	skb = q->qdisc->ops->peek(q->qdisc);
 
 	if (skb) {
 		psched_time_t now;
-		long toks;
-		long ptoks = 0;
+		u64 clock;
+		s64 toks;
+		s64 ptoks = 0;
 		unsigned int len = qdisc_pkt_len(skb);
 
-		now = psched_get_time();
-		toks = psched_tdiff_bounded(now, q->t_c, q->buffer);
+		clock = tbf_clock(q, &now);
+		toks = min_t(s64, clock - q->t_c, tbf_depth(q));
 
 		if (q->P_tab) {
 			ptoks = toks + q->ptokens;
-			if (ptoks > (long)q->mtu)
-				ptoks = q->mtu;
-			ptoks -= L2T_P(q, len);
+			if (ptoks > tbf_pdepth(q))
+				ptoks = tbf_pdepth(q);
+			ptoks -= tbf_l2t_p(q, len);
 		}
 		toks += q->tokens;
-		if (toks > (long)q->buffer)
-			toks = q->buffer;
-		toks -= L2T(q, len);
+		if (toks > tbf_depth(q))
+			toks = tbf_depth(q);
+		toks -= tbf_l2t(q, len);
 
 		if ((toks|ptoks) >= 0) {
 			skb = qdisc_dequeue_peeked(q->qdisc);
 			if (unlikely(!skb))
 				return NULL;
 
-			q->t_c = now;
+			qcn_qdisc_unthrottled(sch);
+			sch->q.qlen--;
+			tbf_sojourn_note(q, skb, now);
+			qcn_qlen_add(q, qcn_prio(skb), -len);
+			qcn_cp_dequeue(q, skb, now);
+			qcn_telem_cp(q, qcn_prio(skb));
+
+			if (q->qp.bulk)
+				tbf_dequeue_bulk(q, now, &toks, &ptoks, len);
+			q->t_c = clock;
 			q->tokens = toks;
 			q->ptokens = ptoks;
-			sch->flags &= ~TCQ_F_THROTTLED;
-			sch->q.qlen--;
-			q->qcn_qlen -= len;
 
+			tbf_sent(q, skb);
 			return skb;
 		}
 
 		qdisc_watchdog_schedule(&q->watchdog,
-								now + max_t(long, -toks, -ptoks));
+								tbf_ticks(q, clock +
+										  max_t(s64, -toks, -ptoks)));
 
 		/* Maybe we have a shorter packet in the queue,
 		   which can be sent now. It sounds cool,
@@ -384,35 +1616,126 @@ static void tbf_reset(struct Qdisc* sch)
 	struct tbf_sched_data *q = qdisc_priv(sch);
 
 	qdisc_reset(q->qdisc);
+	__skb_queue_purge(&q->bulk);
 	sch->q.qlen = 0;
 	qcn_init(q);
-	q->t_c = psched_get_time();
-	q->tokens = q->buffer;
-	q->ptokens = q->mtu;
+	tbf_bucket_fill(q);
 	qdisc_watchdog_cancel(&q->watchdog);
 }
 
-static const struct nla_policy tbf_policy[TCA_TBF_MAX + 1] = {
+static const struct nla_policy tbf_policy[TCA_TBF_QCN + 1] = {
 	[TCA_TBF_PARMS]	= { .len = sizeof(struct tc_tbf_qopt) },
 	[TCA_TBF_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
 	[TCA_TBF_PTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+	[TCA_TBF_QCN]	= { .len = sizeof(struct tc_qcn_cp_opt) },
 };
 
+/* Under sch_tree_lock, after qcn_params_change(). With set, moves our
+   backlog over to the domain in *b and leaves the one we were in there
+   for qcn_sbuf_put(); a size given, or ours on joining, is the
+   domain's from now on. */
+static void tbf_sbuf_change(struct tbf_sched_data *q,
+							const struct tc_qcn_cp_opt *new, int set,
+							struct qcn_sbuf **b,
+							struct qcn_sbuf_slot **slot)
+{
+	int prio, qlen = 0;
+
+	if (set) {
+		for (prio = 0; prio < QCN_NR_PRIO; prio++)
+			qlen += q->cp[prio].qcn_qlen;
+		if (q->sbuf_slot)
+			q->sbuf_slot->qlen = 0;
+		swap(q->sbuf, *b);
+		swap(q->sbuf_slot, *slot);
+		if (q->sbuf_slot)
+			q->sbuf_slot->qlen = qlen;
+	}
+	if (q->sbuf && q->qp.sbuf_size &&
+		(set || (new && (new->flags & TC_QCN_CP_SBUF_SIZE))))
+		ACCESS_ONCE(q->sbuf->size) = q->qp.sbuf_size;
+}
+
 static int tbf_change(struct Qdisc* sch, struct nlattr *opt)
 {
 	int err;
 	struct tbf_sched_data *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_TBF_PTAB + 1];
+	struct nlattr *tb[TCA_TBF_QCN + 1];
 	struct tc_tbf_qopt *qopt;
+	struct tc_qcn_cp_opt *qcnopt = NULL;
 	struct qdisc_rate_table *rtab = NULL;
 	struct qdisc_rate_table *ptab = NULL;
 	struct Qdisc *child = NULL;
+	const struct qcn_alg_ops *alg = NULL;
+	struct qcn_sbuf *sbuf = NULL;
+	struct qcn_sbuf_slot *sbuf_slot = NULL;
 	int max_size,n;
+	int keep, exact, enable, set_alg = 0, set_sbuf = 0;
+	u32 id;
 
-	err = nla_parse_nested(tb, TCA_TBF_PTAB, opt, tbf_policy);
+	err = nla_parse_nested(tb, TCA_TBF_QCN, opt, tbf_policy);
 	if (err < 0)
 		return err;
 
+	if (tb[TCA_TBF_QCN]) {
+		qcnopt = nla_data(tb[TCA_TBF_QCN]);
+		if ((err = qcn_params_check(qcnopt)) != 0 ||
+			(err = set_alg = qcn_alg_opt_get(qcnopt->flags, TC_QCN_CP_ALG,
+											 qcnopt->alg, &alg)) < 0)
+			return err;
+	}
+
+	/* Joining a domain may sleep, so it is done up front; the first
+	   change, from tbf_init(), joins the default one */
+	id = qcnopt && (qcnopt->flags & TC_QCN_CP_SBUF) ? qcnopt->sbuf :
+		q->qp.sbuf;
+	if (id != (q->sbuf ? q->sbuf->id : 0)) {
+		sbuf = qcn_sbuf_get(dev_net(qdisc_dev(sch)), id, &sbuf_slot);
+		if (IS_ERR(sbuf)) {
+			qcn_alg_put(alg);
+			return PTR_ERR(sbuf);
+		}
+		set_sbuf = 1;
+	}
+
+	/* QCN retuning only: leave the bucket and the queue alone, unless
+	   the flow queues change */
+	if (tb[TCA_TBF_PARMS] == NULL && qcnopt && q->R_tab) {
+		if ((qcnopt->flags & TC_QCN_CP_FLOWS) &&
+			qcnopt->flows != q->qp.flows && q->limit > 0) {
+			child = tbf_child_create(sch, q->limit, qcnopt->flows);
+			if (IS_ERR(child)) {
+				qcn_sbuf_put(sbuf, sbuf_slot);
+				qcn_alg_put(alg);
+				return PTR_ERR(child);
+			}
+		}
+		sch_tree_lock(sch);
+		if (child) {
+			qdisc_tree_decrease_qlen(q->qdisc, q->qdisc->q.qlen);
+			qdisc_destroy(q->qdisc);
+			q->qdisc = child;
+			qcn_init(q);
+		}
+		exact = q->qp.exact_rate;
+		enable = q->qp.enable;
+		qcn_params_change(&q->qp, qcnopt);
+		if (set_alg)
+			swap(q->alg, alg);
+		tbf_sbuf_change(q, qcnopt, set_sbuf, &sbuf, &sbuf_slot);
+		if (q->qp.exact_rate != exact)
+			tbf_bucket_fill(q);
+		qcn_fb_scale(q);
+		qcn_mark_update(q);
+		qcn_cnm_sender_set(&q->cnm_tx, q->qp.fb_delay, q->qp.fb_loss);
+		if (q->qp.enable != enable)
+			qcn_restart(q);
+		sch_tree_unlock(sch);
+		qcn_sbuf_put(sbuf, sbuf_slot);	/* the ones replaced, if any */
+		qcn_alg_put(alg);
+		return 0;
+	}
+
 	err = -EINVAL;
 	if (tb[TCA_TBF_PARMS] == NULL)
 		goto done;
@@ -443,8 +1766,20 @@ static int tbf_change(struct Qdisc* sch, struct nlattr *opt)
 	if (max_size < 0)
 		goto done;
 
-	if (qopt->limit > 0) {
-		child = fifo_create_dflt(sch, &bfifo_qdisc_ops, qopt->limit);
+	/* A rate or burst step of a running CP keeps the child, with the
+	   packets in it and the congestion state that describes them; only
+	   a new number of flow queues needs a new one */
+	keep = q->R_tab && q->qdisc != &noop_qdisc && qopt->limit > 0 &&
+		!(qcnopt && (qcnopt->flags & TC_QCN_CP_FLOWS) &&
+		  qcnopt->flows != q->qp.flows);
+	if (keep) {
+		if (!tbf_is_fq(q->qdisc) &&
+			(err = fifo_set_limit(q->qdisc, qopt->limit)) != 0)
+			goto done;
+	} else if (qopt->limit > 0) {
+		child = tbf_child_create(sch, qopt->limit,
+								 qcnopt && (qcnopt->flags & TC_QCN_CP_FLOWS) ?
+								 qcnopt->flows : q->qp.flows);
 		if (IS_ERR(child)) {
 			err = PTR_ERR(child);
 			goto done;
@@ -458,16 +1793,42 @@ static int tbf_change(struct Qdisc* sch, struct nlattr *opt)
 		q->qdisc = child;
 		/* Reinitializing QCN CP Variables */
 		qcn_init(q);
+	} else if (keep && tbf_is_fq(q->qdisc)) {
+		((struct tbf_fq_sched_data *)qdisc_priv(q->qdisc))->limit =
+			qopt->limit;
 	}
 	q->limit = qopt->limit;
 	q->mtu = qopt->mtu;
 	q->max_size = max_size;
 	q->buffer = qopt->buffer;
-	q->tokens = q->buffer;
-	q->ptokens = q->mtu;
+	exact = q->qp.exact_rate;
+	enable = q->qp.enable;
+	if (qcnopt)
+		qcn_params_change(&q->qp, qcnopt);
+	if (set_alg)
+		swap(q->alg, alg);
+	tbf_sbuf_change(q, qcnopt, set_sbuf, &sbuf, &sbuf_slot);
+	keep = keep && q->qp.exact_rate == exact;
+	if (keep) {
+		/* the bytes left in the bucket, in time at the new rate */
+		q->tokens = q->tokens <= 0 ? 0 :
+			min_t(s64, tbf_time_scale(q->tokens, q->R_tab->rate.rate,
+									  rtab->rate.rate), tbf_depth(q));
+		q->ptokens = min_t(s64, q->ptokens, tbf_pdepth(q));
+	}
 
 	swap(q->R_tab, rtab);
 	swap(q->P_tab, ptab);
+	tbf_ratecfg_set(&q->rate, &q->R_tab->rate);
+	if (q->P_tab)
+		tbf_ratecfg_set(&q->prate, &q->P_tab->rate);
+	if (!keep)
+		tbf_bucket_fill(q);
+	qcn_fb_scale(q);
+	qcn_mark_update(q);
+	qcn_cnm_sender_set(&q->cnm_tx, q->qp.fb_delay, q->qp.fb_loss);
+	if (q->qp.enable != enable)
+		qcn_restart(q);
 
 	sch_tree_unlock(sch);
 	err = 0;
@@ -476,12 +1837,43 @@ done:
 		qdisc_put_rtab(rtab);
 	if (ptab)
 		qdisc_put_rtab(ptab);
+	qcn_sbuf_put(sbuf, sbuf_slot);
+	qcn_alg_put(alg);
 	return err;
 }
 
+/* One instance per TX queue, grafted below an mq root */
+static struct qcn_cp_slot *tbf_mq_slot(struct Qdisc *sch,
+									   struct qcn_cp_group *g)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	unsigned int i = sch->dev_queue - netdev_get_tx_queue(dev, 0);
+
+	return i < g->nr_slots ? &g->slot[i] : NULL;
+}
+
+static int tbf_under_mq(struct Qdisc *sch)
+{
+	struct net_device *dev = qdisc_dev(sch);
+
+	return dev->num_tx_queues > 1 && sch->parent != TC_H_ROOT &&
+		dev->qdisc && !strcmp(dev->qdisc->ops->id, "mq");
+}
+
+static void tbf_telem_put(struct tbf_sched_data *q)
+{
+	int prio;
+
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		qcn_telem_put(q->telem[prio]);
+		q->telem[prio] = NULL;
+	}
+}
+
 static int tbf_init(struct Qdisc* sch, struct nlattr *opt)
 {
 	struct tbf_sched_data *q = qdisc_priv(sch);
+	int err, prio;
 
 	if (opt == NULL)
 		return -EINVAL;
@@ -489,12 +1881,68 @@ static int tbf_init(struct Qdisc* sch, struct nlattr *opt)
 	q->t_c = psched_get_time();
 	qdisc_watchdog_init(&q->watchdog, sch);
 	q->qdisc = &noop_qdisc;
+	skb_queue_head_init(&q->bulk);
 
 	/* Initializing QCN CP Variables */
+	qcn_params_init(&q->qp);
+	/* The module parameters stay writable; what this CP took of them
+	   is checked as a request setting all of them would be */
+	q->qp.flags = ~0U;
+	q->qp.prio_mask = (1 << QCN_NR_PRIO) - 1;
+	err = qcn_params_check(&q->qp);
+	q->qp.flags = q->qp.prio_mask = 0;
+	if (err)
+		return err;
+	qcn_mark_scale(q->mark, q->qp.mark, 0, 0);
+	qcn_ring_init(&q->ring, qdisc_dev(sch));
 	qcn_init(q);
-	printk(KERN_INFO "%s: init\n", sch->dev_queue->dev->name);
-
-	return tbf_change(sch, opt);
+	q->sojourn = alloc_percpu(struct tbf_sojourn);
+	if (q->sojourn == NULL)
+		return -ENOMEM;
+	err = qcn_cnm_pool_init(&q->cnm_pool);
+	if (err)
+		goto err_pool;
+	qcn_cnm_sender_init(&q->cnm_tx);
+	qcn_cnm_agg_init(&q->cnm_agg, sch, &q->cnm_pool, &q->cnm_tx);
+
+	if (tbf_under_mq(sch)) {
+		q->cp_group = qcn_cp_group_get(qdisc_dev(sch));
+		if (q->cp_group == NULL) {
+			err = -ENOMEM;
+			goto err_group;
+		}
+		q->cp_slot = tbf_mq_slot(sch, q->cp_group);
+		if (q->cp_slot == NULL) {
+			err = -EINVAL;
+			goto err_slot;
+		}
+	}
+	printk(KERN_INFO "%s: init%s\n", sch->dev_queue->dev->name,
+		   q->cp_group ? " (mq)" : "");
+
+	/* Telemetry is best effort, a CP without slots works the same */
+	for (prio = 0; prio < QCN_NR_PRIO; prio++)
+		q->telem[prio] = qcn_telem_get(QCN_TELEM_CP,
+									   qdisc_dev(sch)->ifindex,
+									   sch->handle, prio);
+
+	err = tbf_change(sch, opt);
+	if (err == 0)
+		return 0;
+
+	tbf_telem_put(q);
+	q->cp_slot = NULL;
+err_slot:
+	if (q->cp_group)
+		qcn_cp_group_put(q->cp_group);
+	q->cp_group = NULL;
+err_group:
+	qcn_cnm_agg_destroy(&q->cnm_agg);
+	qcn_cnm_sender_destroy(&q->cnm_tx);
+	qcn_cnm_pool_destroy(&q->cnm_pool);
+err_pool:
+	free_percpu(q->sojourn);
+	return err;
 }
 
 static void tbf_destroy(struct Qdisc *sch)
@@ -509,6 +1957,18 @@ static void tbf_destroy(struct Qdisc *sch)
 		qdisc_put_rtab(q->R_tab);
 
 	qdisc_destroy(q->qdisc);
+	__skb_queue_purge(&q->bulk);
+	if (q->cp_group) {
+		memset(q->cp_slot, 0, sizeof(*q->cp_slot));
+		qcn_cp_group_put(q->cp_group);
+	}
+	tbf_telem_put(q);
+	qcn_cnm_agg_destroy(&q->cnm_agg);
+	qcn_cnm_sender_destroy(&q->cnm_tx);
+	qcn_cnm_pool_destroy(&q->cnm_pool);
+	free_percpu(q->sojourn);
+	qcn_sbuf_put(q->sbuf, q->sbuf_slot);
+	qcn_alg_put(q->alg);
 }
 
 static int tbf_dump(struct Qdisc *sch, struct sk_buff *skb)
@@ -516,8 +1976,9 @@ static int tbf_dump(struct Qdisc *sch, struct sk_buff *skb)
 	struct tbf_sched_data *q = qdisc_priv(sch);
 	struct nlattr *nest;
 	struct tc_tbf_qopt opt;
+	struct tc_qcn_cp_opt qcnopt;
 
-	/* printk(KERN_ALERT "QCN: qcn_qlen %d\n", q->qcn_qlen); */
+	/* printk(KERN_ALERT "QCN: qcn_qlen %d\n", q->cp[0].qcn_qlen); */
 	
 	nest = nla_nest_start(skb, TCA_OPTIONS);
 	if (nest == NULL)
@@ -531,7 +1992,24 @@ static int tbf_dump(struct Qdisc *sch, struct sk_buff *skb)
 		memset(&opt.peakrate, 0, sizeof(opt.peakrate));
 	opt.mtu = q->mtu;
 	opt.buffer = q->buffer;
-	NLA_PUT(skb, TCA_TBF_PARMS, sizeof(opt), &opt);
+	if (nla_put(skb, TCA_TBF_PARMS, sizeof(opt), &opt))
+		goto nla_put_failure;
+
+	qcnopt = q->qp;
+	qcnopt.flags = TC_QCN_CP_Q_EQ | TC_QCN_CP_W | TC_QCN_CP_CNPV |
+		TC_QCN_CP_JITTER | TC_QCN_CP_FORMAT | TC_QCN_CP_COALESCE |
+		TC_QCN_CP_MIN_INTERVAL | TC_QCN_CP_MARK | TC_QCN_CP_MARK_RATE |
+		TC_QCN_CP_FB_PERIOD | TC_QCN_CP_ECN | TC_QCN_CP_METRIC |
+		TC_QCN_CP_TARGET | TC_QCN_CP_HEAVY | TC_QCN_CP_FLOWS |
+		TC_QCN_CP_BULK | TC_QCN_CP_EXACT_RATE | TC_QCN_CP_SOJOURN |
+		TC_QCN_CP_ALG | TC_QCN_CP_SBUF | TC_QCN_CP_SBUF_SIZE |
+		TC_QCN_CP_SBUF_ALPHA | TC_QCN_CP_ENABLE | TC_QCN_CP_FB_DELAY |
+		TC_QCN_CP_FB_LOSS | TC_QCN_CP_RING;
+	qcnopt.prio_mask = (1 << QCN_NR_PRIO) - 1;
+	if (q->sbuf)
+		qcnopt.sbuf_size = ACCESS_ONCE(q->sbuf->size);
+	if (nla_put(skb, TCA_TBF_QCN, sizeof(qcnopt), &qcnopt))
+		goto nla_put_failure;
 
 	nla_nest_end(skb, nest);
 	return skb->len;
@@ -541,6 +2019,54 @@ nla_put_failure:
 	return -1;
 }
 
+static int tbf_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct tbf_sched_data *q = qdisc_priv(sch);
+	struct tc_qcn_cp_xstats st;
+	int prio, cpu, b;
+
+	memset(&st, 0, sizeof(st));
+	for_each_possible_cpu(cpu) {
+		const struct tbf_sojourn *s = per_cpu_ptr(q->sojourn, cpu);
+
+		for (prio = 0; prio < QCN_NR_PRIO; prio++)
+			for (b = 0; b < QCN_LAT_BUCKETS; b++)
+				st.sojourn[prio][b] += s->hist[prio][b];
+	}
+	for (prio = 0; prio < QCN_NR_PRIO; prio++) {
+		st.sojourn_p50[prio] =
+			qcn_lat_percentile(st.sojourn[prio], 50) / NSEC_PER_USEC;
+		st.sojourn_p99[prio] =
+			qcn_lat_percentile(st.sojourn[prio], 99) / NSEC_PER_USEC;
+		st.qlen[prio] = q->cp[prio].qcn_qlen;
+		st.fb[prio] = q->cp[prio].fb;
+		st.sample[prio] = q->cp[prio].sample;
+		st.delay[prio] = q->cp[prio].delay;
+	}
+	st.cnm_generated = q->cnm_generated;
+	st.cnm_sent = q->cnm_tx.sent;
+	st.cnm_bypassed = q->cnm_tx.bypassed;
+	st.cnm_failed = q->cnm_create_failed +
+		atomic_read(&q->cnm_tx.dropped);
+	st.cnm_fallbacks = q->cnm_pool.fallbacks;
+	st.cnm_coalesced = q->cnm_agg.coalesced;
+	st.cnm_suppressed = q->cnm_filter.suppressed;
+	st.ecn_marked = q->ecn_marked;
+	st.cnm_deferred = q->hh.deferred;
+	st.cnm_lost = atomic_read(&q->cnm_tx.lost);
+	if (q->qp.ring)
+		st.ring = q->ring.inflight;
+	if (tbf_is_fq(q->qdisc))
+		st.flows_active =
+			((struct tbf_fq_sched_data *)qdisc_priv(q->qdisc))->nr_active;
+	if (q->sbuf) {
+		st.sbuf_qlen = qcn_sbuf_qlen(q->sbuf);
+		st.sbuf_thresh = qcn_sbuf_thresh(q->sbuf, q->qp.sbuf_alpha);
+	}
+
+	return gnet_stats_copy_app(d, &st, sizeof(st));
+}
+
 static int tbf_dump_class(struct Qdisc *sch, unsigned long cl,
 						  struct sk_buff *skb, struct tcmsg *tcm)
 {
@@ -621,6 +2147,7 @@ static struct Qdisc_ops tbf_qdisc_ops __read_mostly = {
 	.destroy	=	tbf_destroy,
 	.change		=	tbf_change,
 	.dump		=	tbf_dump,
+	.dump_stats	=	tbf_dump_stats,
 	.owner		=	THIS_MODULE,
 };
 
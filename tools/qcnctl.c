@@ -0,0 +1,1653 @@
+/*
+ * qcnctl.c	Retune running QCN Congestion and Reaction Points.
+ *
+ *		tc does not know the TCA_TBF_QCN/TCA_HTB_QCN attributes (see
+ *		qcn_tc.h), so this sends the change request itself. Only the
+ *		parameters given on the command line are changed, queues and
+ *		rates of the instance are left alone.
+ *
+ *		qcnctl cp DEV [parent ID] [prio P] [q_eq N] [w N] [cnpv MASK]
+ *			  [jitter PCT] [format 0|1] [coalesce US]
+ *			  [min_interval US] [mark N,...] [mark_rate BPS]
+ *			  [fb_period US] [ecn 0|1|2] [metric qlen|delay]
+ *			  [target US] [heavy BYTES] [flows N] [bulk BYTES]
+ *			  [exact_rate 0|1] [sojourn 0|1] [alg NAME]
+ *			  [sbuf ID] [sbuf_size BYTES] [sbuf_alpha N]
+ *			  [enable 0|1] [fb_delay US] [fb_loss PPM] [ring 0|1]
+ *		qcnctl rp DEV [parent ID] [classid ID] [timer TIME]
+ *			  [fastrec N] [bc BYTES] [ai BPS] [hai BPS]
+ *			  [gd N] [min_rate BPS] [min_rate_dec N]
+ *			  [jitter PCT] [classify 0|1]
+ *			  [src IP dst IP] [vlan VID[.VID]] [auto ID] [idle MS]
+ *			  [backpressure US] [exact 0|1]
+ *			  [aggregate pair|src|dst|S/D]
+ *			  [rate BPS] [burst BYTES] [limit N]
+ *			  [cp_rate BPS] [cp_limit BYTES] [alg NAME]
+ *			  [enable 0|1] [hw_vf N|none]
+ *
+ *		qcnctl flows DEV add|del FILE [parent ID]
+ *		qcnctl stats DEV
+ *		qcnctl telemetry DEV [interval TIME]
+ *		qcnctl events DEV
+ *		qcnctl classes DEV
+ *		qcnctl tune DEV [parent ID] [target US] [interval TIME]
+ *			  [util PCT] [rate BPS] [q_eq_min BYTES]
+ *			  [q_eq_max BYTES] [rp ID|root] [dry 0|1]
+ *
+ *		"prio" may be repeated and defaults to all priorities. Without
+ *		"parent" (the parent class of the CP or htb, e.g. 1:3 below
+ *		mq) the root qdisc is changed; without "classid" the htb qdisc
+ *		and all its classes are. TIME takes a ns, us, ms or s suffix
+ *		and defaults to ms. "alg" has the CP compute Fb, or the RP cut
+ *		and recover its rate, by the algorithm registered as NAME with
+ *		the qcn module, "qcn" the 802.1Qau one; "dcqcn" comes with the
+ *		module. "enable 0" turns the CP or RP off, the qdisc or class
+ *		then only queues and shapes as the stock one does.
+ *
+ *		cp: "mark" takes the 8 bytes between samples, one per eighth
+ *		of the Fb range, and "mark_rate" the rate in bytes/s they are
+ *		for, 0 for any. "fb_period" has the CP take the queue
+ *		derivative over US rather than from sample to sample. "ecn"
+ *		(tbf only) marks ECN capable packets with CE instead of
+ *		sending CNMs: 1 the sampled packet, 2 each one with
+ *		probability Fb / 64. "metric delay" (tbf only) has the CP hold
+ *		the time packets wait against "target" instead of the backlog
+ *		against q_eq. "heavy" sends CNMs only to the largest flows of
+ *		about the last BYTES, 0 to any. "flows" (tbf only) queues in N
+ *		hashed per flow queues served round robin, a power of 2, 0 for
+ *		one fifo. "bulk" (tbf only) lets one token check release up to
+ *		BYTES of packets, 0 one at a time. "exact_rate 1" (tbf only)
+ *		times packets from the rate in ns rather than from the rate
+ *		table. "sojourn 1" (tbf only) keeps histograms of the time
+ *		packets spend queued, which "stats" prints with their median
+ *		and 99th percentile in us. "sbuf" (tbf only) has the CP share
+ *		a buffer of "sbuf_size" BYTES with every CP given the same ID,
+ *		0 for none, and cap q_eq at "sbuf_alpha" 16ths of what is left
+ *		free of it. "fb_delay" holds each CNM of the CP for US before
+ *		it is sent and "fb_loss" drops PPM in a million of them, to
+ *		try a longer or lossy feedback path. "ring 1" has the CP count
+ *		what the driver's TX ring is estimated to hold as queued too,
+ *		for devices whose qdisc is nearly always empty.
+ *
+ *		rp: "classify 1" (qdisc only) makes the RP look packets up by
+ *		their IPv4 pair before running the filters, "src"/"dst" (class
+ *		only) give a leaf class the pair it carries; 0.0.0.0 for both
+ *		releases it. Two IPv6 addresses make an IPv6 pair, which the
+ *		RP keys by the addresses folded to 32 bits, as the CP folds
+ *		them; a pair may not mix the two families. "vlan" puts that
+ *		pair in VLAN VID, or in the inner VID of the outer one for
+ *		QinQ; learned pairs are in the VLAN they are sent in. "auto"
+ *		(qdisc only) has the RP create a copy of leaf class ID for
+ *		every new pair, 0 stops it, and "idle" deletes those again
+ *		after MS without traffic or feedback, 0 never. "backpressure"
+ *		limits what a guest behind a tap may queue in the host to US
+ *		at the current rate, 0 stops limiting. "exact 1" has the RP
+ *		weigh the decrease by the qoff and qdelta of each CNM.
+ *		"aggregate" (qdisc only) has one RP for all the flows of a
+ *		source ("src"), of a destination ("dst") or of the prefixes
+ *		S/D of the two, "pair" one per flow. "rate", "burst" and
+ *		"limit" (qcningress only, parent ffff:fff1) give the rate a
+ *		policed pair recovers to, its bucket at that rate and how many
+ *		pairs are policed at once. "cp_rate" (qcningress only) makes
+ *		it a CP as well, whose backlog drains at BPS and holds at most
+ *		"cp_limit" BYTES, 0 stops it; "qcnctl cp DEV parent ffff:fff1"
+ *		tunes that CP. "hw_vf" (leaf class only) has the NIC hold
+ *		SR-IOV VF N of DEV to the rate of the class, "none" lifts it
+ *		again.
+ *
+ *		flows: adds or deletes many RP classes of the htb on DEV at
+ *		once, one per line of FILE ("-" for stdin) of the form
+ *		"CLASSID SRC DST RATE [BURST]", RATE in bytes/s and BURST in
+ *		bytes; "del" only needs the CLASSID, or "- SRC DST" to name
+ *		the class by its pair. Each batch of up to TC_QCN_FLOWS_MAX
+ *		lines is applied in full or not at all.
+ *
+ *		stats: prints the live state of every CP and RP on DEV, one
+ *		line per qdisc or class.
+ *
+ *		telemetry: reads the same from the page the modules keep in
+ *		debugfs, without a syscall per sample, and with "interval"
+ *		keeps printing it every TIME. Below an RP class it adds the
+ *		fb_lat and cnm_delay histograms of qcn_tc.h, bucket 0 first,
+ *		when they hold anything.
+ *
+ *		events: prints the rate cuts and restores of the RPs on DEV as
+ *		the qcn module reports them, until interrupted.
+ *
+ *		classes: prints the rate state of every RP class on DEV, one
+ *		line each, from the bulk dump of the qcn module, which is far
+ *		cheaper than "stats" with many classes.
+ *
+ *		tune: keeps retuning the tbf or qcnfifo CP below "parent"
+ *		until interrupted. Every "interval" (100ms) it takes the
+ *		utilization of the port rate ("rate", else that of the tbf or
+ *		the link speed), the mean and swing of the backlog from the
+ *		telemetry page, and the CNMs generated. When the backlog
+ *		stands more than "target" (100us) at that rate, it lowers q_eq
+ *		by an eighth and raises w if the swing is past q_eq; when the
+ *		port is below "util" (95) percent busy under CNMs with little
+ *		queued, it raises q_eq and lowers w again. q_eq stays within
+ *		"q_eq_min" (3028) and "q_eq_max", by default what drains in
+ *		"target", and a step is only taken after 3 intervals agree.
+ *		"rp" names the parent of an htb RP on DEV as well, whose ai
+ *		and hai are then scaled to the port rate and whose gd is moved
+ *		once q_eq is at a bound. "dry 1" prints the steps without
+ *		taking them.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/genetlink.h>
+#include <linux/gen_stats.h>
+#include <linux/pkt_sched.h>
+
+#include "../qcn_tc.h"
+
+#define NLMSG_TAIL(n) \
+	((struct rtattr *)(((char *)(n)) + NLMSG_ALIGN((n)->nlmsg_len)))
+
+#define TELEM_PATH	"/sys/kernel/debug/qcn/telemetry"
+#define TELEM_SLOTS	"/sys/module/qcn/parameters/telemetry_slots"
+
+struct req {
+	struct nlmsghdr	n;
+	struct tcmsg	t;
+	char		buf[1024];
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: qcnctl cp DEV [parent ID] [prio P] [q_eq N] [w N]\n"
+		"                 [cnpv MASK] [jitter PCT] [format 0|1]\n"
+		"                 [coalesce US] [min_interval US]\n"
+		"                 [mark N,...] [mark_rate BPS] [fb_period US]\n"
+		"                 [ecn 0|1|2] [metric qlen|delay] [target US]\n"
+		"                 [flows N] [bulk BYTES] [exact_rate 0|1]\n"
+		"                 [heavy BYTES] [sojourn 0|1] [alg NAME]\n"
+		"                 [sbuf ID] [sbuf_size BYTES] [sbuf_alpha N]\n"
+		"                 [enable 0|1] [fb_delay US] [fb_loss PPM]\n"
+		"                 [ring 0|1]\n"
+		"       qcnctl rp DEV [parent ID] [classid ID] [timer TIME]\n"
+		"                 [fastrec N] [bc BYTES] [ai BPS] [hai BPS]\n"
+		"                 [gd N] [min_rate BPS] [min_rate_dec N]\n"
+		"                 [jitter PCT] [classify 0|1] [src IP dst IP]\n"
+		"                 [vlan VID[.VID]] [auto ID] [idle MS]\n"
+		"                 [backpressure US] [exact 0|1]\n"
+		"                 [aggregate pair|src|dst|S/D]\n"
+		"                 [rate BPS] [burst BYTES] [limit N]\n"
+		"                 [cp_rate BPS] [cp_limit BYTES] [alg NAME]\n"
+		"                 [enable 0|1] [hw_vf N|none]\n"
+		"       qcnctl flows DEV add|del FILE [parent ID]\n"
+		"       qcnctl stats DEV\n"
+		"       qcnctl telemetry DEV [interval TIME]\n"
+		"       qcnctl events DEV\n"
+		"       qcnctl classes DEV\n"
+		"       qcnctl tune DEV [parent ID] [target US]\n"
+		"                 [interval TIME] [util PCT] [rate BPS]\n"
+		"                 [q_eq_min BYTES] [q_eq_max BYTES]\n"
+		"                 [rp ID|root] [dry 0|1]\n");
+	exit(1);
+}
+
+static __u32 get_u32(const char *arg)
+{
+	char *end;
+	unsigned long v = strtoul(arg, &end, 0);
+
+	if (*arg == '\0' || *end != '\0') {
+		fprintf(stderr, "qcnctl: bad number \"%s\"\n", arg);
+		exit(1);
+	}
+	return v;
+}
+
+/* ns; a plain number is in ms, like the QCN_TIMER module parameter */
+static __u32 get_time_ns(const char *arg)
+{
+	static const struct {
+		const char	*unit;
+		double		scale;
+	} units[] = {
+		{ "ns", 1 }, { "us", 1e3 }, { "ms", 1e6 }, { "s", 1e9 },
+		{ "", 1e6 },
+	};
+	char *end;
+	double v = strtod(arg, &end);
+	unsigned int i;
+
+	for (i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+		if (end != arg && !strcmp(end, units[i].unit) && v >= 0 &&
+		    v * units[i].scale < 4294967296.0)
+			return v * units[i].scale;
+	fprintf(stderr, "qcnctl: bad time \"%s\"\n", arg);
+	exit(1);
+}
+
+/* An algorithm name, as the modules register them */
+static void get_alg(const char *arg, char *alg)
+{
+	if (strlen(arg) >= QCN_ALG_NAME_MAX) {
+		fprintf(stderr, "qcnctl: bad algorithm \"%s\"\n", arg);
+		exit(1);
+	}
+	strcpy(alg, arg);
+}
+
+/* tc style "major:minor", both hex */
+static __u32 get_handle(const char *arg)
+{
+	unsigned int maj, min = 0;
+
+	if (sscanf(arg, "%x:%x", &maj, &min) < 1) {
+		fprintf(stderr, "qcnctl: bad handle \"%s\"\n", arg);
+		exit(1);
+	}
+	return TC_H_MAKE(maj << 16, min);
+}
+
+static void addattr(struct nlmsghdr *n, int type, const void *data, int len)
+{
+	struct rtattr *rta = NLMSG_TAIL(n);
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static int talk(struct nlmsghdr *n)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	char buf[4096];
+	struct nlmsghdr *h;
+	struct nlmsgerr *err;
+	int fd, len;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+		perror("qcnctl: socket");
+		return -1;
+	}
+	if (sendto(fd, n, n->nlmsg_len, 0, (struct sockaddr *)&nladdr,
+		   sizeof(nladdr)) < 0) {
+		perror("qcnctl: sendto");
+		close(fd);
+		return -1;
+	}
+	len = recv(fd, buf, sizeof(buf), 0);
+	close(fd);
+	if (len < 0) {
+		perror("qcnctl: recv");
+		return -1;
+	}
+
+	/* an error echoes the request, which need not fit */
+	h = (struct nlmsghdr *)buf;
+	if (len < (int)NLMSG_LENGTH(sizeof(*err)) ||
+	    h->nlmsg_type != NLMSG_ERROR)
+		return 0;
+	err = NLMSG_DATA(h);
+	if (err->error) {
+		fprintf(stderr, "qcnctl: %s\n", strerror(-err->error));
+		return -1;
+	}
+	return 0;
+}
+
+static void print_handle(const char *what, __u32 h)
+{
+	printf("%s %x:%x ", what, TC_H_MAJ(h) >> 16, TC_H_MIN(h));
+}
+
+/* A QCN_LAT_BUCKETS histogram, nothing if it is empty */
+static void print_lat(const char *name, const __u32 *hist)
+{
+	int i, last = -1;
+
+	for (i = 0; i < QCN_LAT_BUCKETS; i++)
+		if (hist[i])
+			last = i;
+	if (last < 0)
+		return;
+	printf("  %s", name);
+	for (i = 0; i <= last; i++)
+		printf(" %u", hist[i]);
+	printf("\n");
+}
+
+static void print_cp(const struct tc_qcn_cp_xstats *st)
+{
+	int p;
+
+	for (p = 0; p < QCN_NR_PRIO; p++)
+		if (st->qlen[p] || st->fb[p] || st->delay[p])
+			printf("prio %d qlen %u delay %u fb %u sample %d ", p,
+			       st->qlen[p], st->delay[p], st->fb[p],
+			       st->sample[p]);
+	printf("cnm generated %u sent %u bypassed %u failed %u fallbacks %u "
+	       "coalesced %u suppressed %u deferred %u ecn_marked %u "
+	       "flows %u\n", st->cnm_generated, st->cnm_sent,
+	       st->cnm_bypassed, st->cnm_failed, st->cnm_fallbacks,
+	       st->cnm_coalesced, st->cnm_suppressed, st->cnm_deferred,
+	       st->ecn_marked, st->flows_active);
+	if (st->cnm_lost)
+		printf("  cnm lost %u\n", st->cnm_lost);
+	if (st->ring)
+		printf("  ring %u\n", st->ring);
+	if (st->sbuf_qlen || st->sbuf_thresh)
+		printf("  sbuf qlen %u thresh %u\n", st->sbuf_qlen,
+		       st->sbuf_thresh);
+	for (p = 0; p < QCN_NR_PRIO; p++)
+		if (st->sojourn_p50[p] || st->sojourn_p99[p]) {
+			printf("  prio %d sojourn p50 %u p99 %u us\n", p,
+			       st->sojourn_p50[p], st->sojourn_p99[p]);
+			print_lat("sojourn", st->sojourn[p]);
+		}
+}
+
+static void print_rp(const struct tc_qcn_rp_xstats *st)
+{
+	printf("crate %u trate %u bcount_stg %u timer_stg %u cnm %u "
+	       "burst %u cburst %u\n",
+	       st->crate, st->trate, st->bcount_stg, st->timer_stg,
+	       st->cnm_received, st->burst, st->cburst);
+	printf("rate_est %u pps_est %u\n", st->rate_est, st->pps_est);
+}
+
+/* A consistent copy of slot t, 0 if it is free */
+static int telem_read(const volatile struct qcn_telem *t, struct qcn_telem *c)
+{
+	__u32 seq;
+
+	do {
+		while ((seq = t->seq) & 1)
+			;
+		__sync_synchronize();
+		memcpy(c, (const void *)t, sizeof(*c));
+		__sync_synchronize();
+	} while (t->seq != seq);
+	return c->type != QCN_TELEM_FREE;
+}
+
+/* The telemetry page of the qcn module, NULL if it is not there */
+static const struct qcn_telem *telem_map(int *slots)
+{
+	const struct qcn_telem *area;
+	FILE *f;
+	int fd;
+
+	*slots = 0;
+	if ((f = fopen(TELEM_SLOTS, "r")) == NULL ||
+	    fscanf(f, "%d", slots) != 1 || *slots <= 0) {
+		fprintf(stderr, "qcnctl: cannot read " TELEM_SLOTS "\n");
+		if (f)
+			fclose(f);
+		return NULL;
+	}
+	fclose(f);
+
+	if ((fd = open(TELEM_PATH, O_RDONLY)) < 0 ||
+	    (area = mmap(NULL, *slots * sizeof(struct qcn_telem), PROT_READ,
+			 MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("qcnctl: " TELEM_PATH);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	close(fd);
+	return area;
+}
+
+static int telemetry(int ifindex, __u32 interval)
+{
+	const struct qcn_telem *area;
+	struct qcn_telem c;
+	struct timespec ts;
+	int slots, i;
+
+	if ((area = telem_map(&slots)) == NULL)
+		return 1;
+
+	ts.tv_sec = interval / 1000000000;
+	ts.tv_nsec = interval % 1000000000;
+	do {
+		for (i = 0; i < slots; i++) {
+			if (!telem_read(&area[i], &c) ||
+			    (int)c.ifindex != ifindex)
+				continue;
+			if (c.type == QCN_TELEM_CP) {
+				print_handle("cp", c.handle);
+				printf("prio %u qlen %u fb %u cnm generated %u "
+				       "sent %u failed %u\n", c.prio, c.qlen,
+				       c.fb, c.cnm, c.cnm_sent, c.cnm_failed);
+			} else if (c.type == QCN_TELEM_RP) {
+				print_handle("rp class", c.handle);
+				printf("qlen %u fb %u crate %u trate %u "
+				       "bcount_stg %u timer_stg %u cnm %u\n",
+				       c.qlen, c.fb, c.crate, c.trate,
+				       c.bcount_stg, c.timer_stg, c.cnm);
+				print_lat("fb_lat", c.fb_lat);
+				print_lat("cnm_delay", c.cnm_delay);
+			}
+		}
+		fflush(stdout);
+	} while (interval && nanosleep(&ts, NULL) == 0);
+
+	munmap((void *)area, slots * sizeof(struct qcn_telem));
+	return 0;
+}
+
+/* One RTM_NEWQDISC/RTM_NEWTCLASS of a dump */
+#ifndef SOL_NETLINK
+#define SOL_NETLINK	270
+#endif
+
+#define GENL_ATTR(g)	((struct rtattr *)((char *)(g) + GENL_HDRLEN))
+
+/* The id of the rate group of the qcn family, 0 if it is not there;
+   the id of the family in *family, 0 if that is not there */
+static __u32 events_group(int fd, __u16 *family)
+{
+	struct {
+		struct nlmsghdr		n;
+		struct genlmsghdr	g;
+		char			buf[64];
+	} req;
+	char buf[4096];
+	struct nlmsghdr *h;
+	struct rtattr *rta, *grp, *a;
+	int len, rlen, glen, alen;
+	__u32 id;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	req.n.nlmsg_type = GENL_ID_CTRL;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.g.cmd = CTRL_CMD_GETFAMILY;
+	req.g.version = 1;
+	addattr(&req.n, CTRL_ATTR_FAMILY_NAME, QCN_GENL_NAME,
+		sizeof(QCN_GENL_NAME));
+	*family = 0;
+
+	if (send(fd, &req, req.n.nlmsg_len, 0) < 0 ||
+	    (len = recv(fd, buf, sizeof(buf), 0)) < 0) {
+		perror("qcnctl: netlink");
+		return 0;
+	}
+	h = (struct nlmsghdr *)buf;
+	if (!NLMSG_OK(h, (unsigned int)len) || h->nlmsg_type != GENL_ID_CTRL)
+		return 0;
+
+	rlen = h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	for (rta = GENL_ATTR(NLMSG_DATA(h)); RTA_OK(rta, rlen);
+	     rta = RTA_NEXT(rta, rlen)) {
+		if (rta->rta_type == CTRL_ATTR_FAMILY_ID)
+			*family = *(__u16 *)RTA_DATA(rta);
+		if (rta->rta_type != CTRL_ATTR_MCAST_GROUPS)
+			continue;
+		glen = RTA_PAYLOAD(rta);
+		for (grp = RTA_DATA(rta); RTA_OK(grp, glen);
+		     grp = RTA_NEXT(grp, glen)) {
+			id = 0;
+			alen = RTA_PAYLOAD(grp);
+			for (a = RTA_DATA(grp); RTA_OK(a, alen);
+			     a = RTA_NEXT(a, alen)) {
+				if (a->rta_type == CTRL_ATTR_MCAST_GRP_ID)
+					id = *(__u32 *)RTA_DATA(a);
+				if (a->rta_type != CTRL_ATTR_MCAST_GRP_NAME)
+					continue;
+				if (strcmp(RTA_DATA(a), QCN_GENL_MCGRP_RATE))
+					break;
+			}
+			if (!RTA_OK(a, alen) && id)
+				return id;
+		}
+	}
+	return 0;
+}
+
+static void print_event(const struct qcn_rate_event *ev)
+{
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &ev->src, src, sizeof(src));
+	inet_ntop(AF_INET, &ev->dst, dst, sizeof(dst));
+	printf("%llu.%06llu ", (unsigned long long)ev->ns / 1000000000,
+	       (unsigned long long)ev->ns / 1000 % 1000000);
+	print_handle(ev->type == QCN_RATE_CUT ? "cut" : "restored",
+		     ev->handle);
+	printf("src %s dst %s crate %u -> %u trate %u fb %u "
+	       "bcount_stg %u timer_stg %u\n", src, dst, ev->old_crate,
+	       ev->crate, ev->trate, ev->fb, ev->bcount_stg, ev->timer_stg);
+}
+
+static int events(int ifindex)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	char buf[65536];
+	struct nlmsghdr *h;
+	struct rtattr *rta;
+	const struct qcn_rate_event *ev;
+	int fd, len, rlen, i, n;
+	__u32 group;
+	__u16 family;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC)) < 0 ||
+	    bind(fd, (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		perror("qcnctl: netlink");
+		return 1;
+	}
+	if ((group = events_group(fd, &family)) == 0) {
+		fprintf(stderr, "qcnctl: no rate events, is qcn loaded?\n");
+		close(fd);
+		return 1;
+	}
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
+		       sizeof(group)) < 0) {
+		perror("qcnctl: setsockopt");
+		close(fd);
+		return 1;
+	}
+
+	for (;;) {
+		if ((len = recv(fd, buf, sizeof(buf), 0)) < 0) {
+			if (errno == ENOBUFS) {
+				fprintf(stderr, "qcnctl: events overrun\n");
+				continue;
+			}
+			perror("qcnctl: recv");
+			close(fd);
+			return 1;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned int)len);
+		     h = NLMSG_NEXT(h, len)) {
+			rlen = h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+			for (rta = GENL_ATTR(NLMSG_DATA(h)); RTA_OK(rta, rlen);
+			     rta = RTA_NEXT(rta, rlen)) {
+				if (rta->rta_type == QCN_ATTR_LOST &&
+				    *(__u32 *)RTA_DATA(rta))
+					printf("lost %u\n",
+					       *(__u32 *)RTA_DATA(rta));
+				if (rta->rta_type != QCN_ATTR_EVENTS)
+					continue;
+				ev = RTA_DATA(rta);
+				n = RTA_PAYLOAD(rta) / sizeof(*ev);
+				for (i = 0; i < n; i++)
+					if ((int)ev[i].ifindex == ifindex)
+						print_event(&ev[i]);
+			}
+		}
+		fflush(stdout);
+	}
+}
+
+static void print_rec(const struct qcn_rp_rec *r)
+{
+	print_handle("rp class", r->handle);
+	printf("queue %d crate %u trate %u bcount_stg %u timer_stg %u cnm %u "
+	       "bytes %llu packets %u drops %u\n", r->queue, r->crate,
+	       r->trate, r->bcount_stg, r->timer_stg, r->cnm_received,
+	       (unsigned long long)r->bytes, r->packets, r->drops);
+}
+
+/* QCN_CMD_RP_DUMP, many classes to a message */
+static int classes(int ifindex)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	struct {
+		struct nlmsghdr		n;
+		struct genlmsghdr	g;
+		char			buf[64];
+	} req;
+	char buf[65536];
+	struct nlmsghdr *h;
+	struct rtattr *rta;
+	const struct qcn_rp_rec *r;
+	int fd, len, rlen, i, n;
+	__u32 idx = ifindex;
+	__u16 family;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC)) < 0 ||
+	    bind(fd, (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		perror("qcnctl: netlink");
+		return 1;
+	}
+	events_group(fd, &family);
+	if (family == 0) {
+		fprintf(stderr, "qcnctl: no qcn family, is qcn loaded?\n");
+		close(fd);
+		return 1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	req.n.nlmsg_type = family;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.g.cmd = QCN_CMD_RP_DUMP;
+	req.g.version = QCN_GENL_VERSION;
+	addattr(&req.n, QCN_ATTR_IFINDEX, &idx, sizeof(idx));
+	if (send(fd, &req, req.n.nlmsg_len, 0) < 0) {
+		perror("qcnctl: send");
+		close(fd);
+		return 1;
+	}
+
+	while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned int)len);
+		     h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) {
+				close(fd);
+				return 0;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				fprintf(stderr, "qcnctl: dump failed\n");
+				close(fd);
+				return 1;
+			}
+			rlen = h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+			for (rta = GENL_ATTR(NLMSG_DATA(h)); RTA_OK(rta, rlen);
+			     rta = RTA_NEXT(rta, rlen)) {
+				if (rta->rta_type != QCN_ATTR_RPS)
+					continue;
+				r = RTA_DATA(rta);
+				n = RTA_PAYLOAD(rta) / sizeof(*r);
+				for (i = 0; i < n; i++)
+					print_rec(&r[i]);
+			}
+		}
+	}
+	if (len < 0)
+		perror("qcnctl: recv");
+	close(fd);
+	return 1;
+}
+
+static void print_stats(struct nlmsghdr *h, void *arg)
+{
+	struct tcmsg *t = NLMSG_DATA(h);
+	struct rtattr *rta = TCA_RTA(t);
+	int len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*t));
+	const char *kind = NULL;
+	void *app = NULL;
+	int app_len = 0;
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == TCA_KIND)
+			kind = RTA_DATA(rta);
+		else if (rta->rta_type == TCA_STATS2) {
+			struct rtattr *sub = RTA_DATA(rta);
+			int sub_len = RTA_PAYLOAD(rta);
+
+			for (; RTA_OK(sub, sub_len);
+			     sub = RTA_NEXT(sub, sub_len))
+				if (sub->rta_type == TCA_STATS_APP) {
+					app = RTA_DATA(sub);
+					app_len = RTA_PAYLOAD(sub);
+				}
+		}
+	}
+	if (kind == NULL || app == NULL)
+		return;
+
+	if (h->nlmsg_type == RTM_NEWQDISC &&
+	    (!strcmp(kind, "tbf") || !strcmp(kind, "qcnfifo")) &&
+	    app_len >= (int)sizeof(struct tc_qcn_cp_xstats)) {
+		printf("cp %s ", kind);
+		print_handle("handle", t->tcm_handle);
+		print_cp(app);
+	} else if (h->nlmsg_type == RTM_NEWQDISC && !strcmp(kind, "htb") &&
+		   app_len >= (int)sizeof(struct tc_qcn_rp_qstats)) {
+		const struct tc_qcn_rp_qstats *st = app;
+
+		print_handle("rp htb handle", t->tcm_handle);
+		printf("cnm unmatched %u deferred %u overflows %u "
+		       "auto classes %u created %u reclaimed %u exhausted %u "
+		       "hw vfs %u set %u failed %u untagged gso %u\n",
+		       st->cnm_unmatched, st->cnm_deferred, st->cnm_overflows,
+		       st->auto_classes, st->auto_created, st->auto_reclaimed,
+		       st->auto_exhausted, st->hw_bound, st->hw_pushed,
+		       st->hw_failed, st->cntag_gso);
+	} else if (h->nlmsg_type == RTM_NEWTCLASS && !strcmp(kind, "htb") &&
+		   app_len >= (int)sizeof(struct tc_qcn_rp_xstats)) {
+		print_handle("rp class", t->tcm_handle);
+		print_rp(app);
+	} else if (h->nlmsg_type == RTM_NEWQDISC &&
+		   !strcmp(kind, "qcningress") &&
+		   app_len >= (int)sizeof(struct tc_qcn_ingress_xstats)) {
+		const struct tc_qcn_ingress_xstats *st = app;
+
+		print_handle("rp qcningress handle", t->tcm_handle);
+		printf("flows %u created %u exhausted %u cnm %u unmatched %u "
+		       "policed %u crate_min %u\n", st->flows,
+		       st->flows_created, st->flows_exhausted,
+		       st->cnm_received, st->cnm_unmatched, st->policed,
+		       st->crate_min);
+		if (st->cp.cnm_generated || st->cp.qlen[0] ||
+		    st->cp_overlimits) {
+			printf("cp qcningress overlimits %u ",
+			       st->cp_overlimits);
+			print_cp(&st->cp);
+		}
+	}
+}
+
+/* Hands every qdisc or class of ifindex to fn */
+static int dump(int ifindex, int type,
+		void (*fn)(struct nlmsghdr *, void *), void *arg)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	struct req req;
+	char buf[16384];
+	struct nlmsghdr *h;
+	struct tcmsg *t;
+	int fd, len;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+	req.n.nlmsg_type = type;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.t.tcm_family = AF_UNSPEC;
+	req.t.tcm_ifindex = ifindex;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+		perror("qcnctl: socket");
+		return -1;
+	}
+	if (sendto(fd, &req, req.n.nlmsg_len, 0, (struct sockaddr *)&nladdr,
+		   sizeof(nladdr)) < 0) {
+		perror("qcnctl: sendto");
+		close(fd);
+		return -1;
+	}
+	while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned int)len);
+		     h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) {
+				close(fd);
+				return 0;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				fprintf(stderr, "qcnctl: dump failed\n");
+				close(fd);
+				return -1;
+			}
+			t = NLMSG_DATA(h);
+			if (t->tcm_ifindex == ifindex)
+				fn(h, arg);
+		}
+	}
+	if (len < 0)
+		perror("qcnctl: recv");
+	close(fd);
+	return -1;
+}
+
+/*
+ * tune: a closed loop over one CP, and optionally the htb RP on the same
+ * port. Every interval it looks at the utilization, the queue swing and
+ * the CNM rate, and when TUNE_HOLD intervals in a row call for it, moves
+ * q_eq by an eighth, w and gd by one, always within the given bounds.
+ */
+#define TUNE_SAMPLE	1000000		/* ns between telemetry samples */
+#define TUNE_HOLD	3		/* intervals a verdict must persist */
+#define TUNE_W_MAX	8
+#define TUNE_GD_MIN	4
+#define TUNE_GD_MAX	10
+
+enum { TUNE_KEEP, TUNE_UP, TUNE_DOWN };
+
+struct tune {
+	__u32			parent;		/* of the CP */
+	__u32			rp_parent;	/* of the htb, 0 none */
+	__u32			target;		/* ns of queueing aimed at */
+	__u32			interval;	/* ns between steps */
+	__u32			util;		/* percent counted as busy */
+	__u32			q_eq_min, q_eq_max; /* bytes, 0 derived */
+	double			rate;		/* bytes/s the port drains at */
+	int			dry;
+
+	/* what the last dump found */
+	int			cp_found, rp_found;
+	__u32			handle;
+	char			kind[IFNAMSIZ];
+	struct tc_qcn_cp_opt	cp;
+	struct tc_qcn_rp_opt	rp;
+	struct tc_qcn_cp_xstats	st;
+	__u32			tbf_rate;	/* bytes/s, 0 not a tbf */
+	__u64			bytes;
+
+	/* this interval */
+	__u64			q_sum, q_min, q_max, samples;
+	int			verdict, streak;
+};
+
+static void tune_attrs(struct rtattr *rta, int len, int type,
+		       void *data, int size)
+{
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if (rta->rta_type == type) {
+			memset(data, 0, size);
+			memcpy(data, RTA_DATA(rta), RTA_PAYLOAD(rta) < size ?
+			       RTA_PAYLOAD(rta) : size);
+		}
+}
+
+static void tune_parse(struct nlmsghdr *h, void *arg)
+{
+	struct tune *tn = arg;
+	struct tcmsg *t = NLMSG_DATA(h);
+	struct rtattr *rta = TCA_RTA(t);
+	int len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*t));
+	struct rtattr *opts = NULL, *stats = NULL;
+	const char *kind = NULL;
+	struct tc_tbf_qopt qopt;
+	struct gnet_stats_basic bs;
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == TCA_KIND)
+			kind = RTA_DATA(rta);
+		else if (rta->rta_type == TCA_OPTIONS)
+			opts = rta;
+		else if (rta->rta_type == TCA_STATS2)
+			stats = rta;
+	}
+	if (h->nlmsg_type != RTM_NEWQDISC || kind == NULL || opts == NULL)
+		return;
+
+	if (t->tcm_parent == tn->rp_parent && !strcmp(kind, "htb")) {
+		tune_attrs(RTA_DATA(opts), RTA_PAYLOAD(opts), TCA_HTB_QCN,
+			   &tn->rp, sizeof(tn->rp));
+		tn->rp_found = 1;
+		return;
+	}
+	if (t->tcm_parent != tn->parent || stats == NULL ||
+	    (strcmp(kind, "tbf") && strcmp(kind, "qcnfifo")))
+		return;
+
+	tn->cp_found = 1;
+	tn->handle = t->tcm_handle;
+	snprintf(tn->kind, sizeof(tn->kind), "%s", kind);
+	tune_attrs(RTA_DATA(opts), RTA_PAYLOAD(opts), TCA_TBF_QCN,
+		   &tn->cp, sizeof(tn->cp));
+	tn->tbf_rate = 0;
+	if (!strcmp(kind, "tbf")) {
+		tune_attrs(RTA_DATA(opts), RTA_PAYLOAD(opts), TCA_TBF_PARMS,
+			   &qopt, sizeof(qopt));
+		tn->tbf_rate = qopt.rate.rate;
+	}
+	tune_attrs(RTA_DATA(stats), RTA_PAYLOAD(stats), TCA_STATS_BASIC,
+		   &bs, sizeof(bs));
+	tn->bytes = bs.bytes;
+	tune_attrs(RTA_DATA(stats), RTA_PAYLOAD(stats), TCA_STATS_APP,
+		   &tn->st, sizeof(tn->st));
+}
+
+static void tune_sample(struct tune *tn, __u64 qlen)
+{
+	if (!tn->samples || qlen < tn->q_min)
+		tn->q_min = qlen;
+	if (qlen > tn->q_max)
+		tn->q_max = qlen;
+	tn->q_sum += qlen;
+	tn->samples++;
+}
+
+/* The bytes the CP holds now, summed over its priorities */
+static void tune_telem(struct tune *tn, const struct qcn_telem *area,
+		       int slots, int ifindex)
+{
+	struct qcn_telem c;
+	__u64 qlen = 0;
+	int i;
+
+	for (i = 0; i < slots; i++)
+		if (telem_read(&area[i], &c) && c.type == QCN_TELEM_CP &&
+		    (int)c.ifindex == ifindex && c.handle == tn->handle)
+			qlen += c.qlen;
+	tune_sample(tn, qlen);
+}
+
+/* bytes/s of DEV from sysfs, 0 if it does not say */
+static double tune_speed(const char *dev)
+{
+	char path[64];
+	FILE *f;
+	int mbps = 0;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/speed", dev);
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	if (fscanf(f, "%d", &mbps) != 1 || mbps < 0)
+		mbps = 0;
+	fclose(f);
+	return mbps * 125000.0;
+}
+
+static int tune_send(int ifindex, __u32 parent, int type, const void *opt,
+		     int len)
+{
+	struct req req;
+	struct rtattr *nest;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+	req.n.nlmsg_type = RTM_NEWQDISC;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req.t.tcm_family = AF_UNSPEC;
+	req.t.tcm_ifindex = ifindex;
+	req.t.tcm_parent = parent;
+	nest = NLMSG_TAIL(&req.n);
+	addattr(&req.n, TCA_OPTIONS, NULL, 0);
+	addattr(&req.n, type, opt, len);
+	nest->rta_len = (char *)NLMSG_TAIL(&req.n) - (char *)nest;
+	return talk(&req.n);
+}
+
+/* q_eq of the first congestion controlled priority */
+static int tune_prio(const struct tc_qcn_cp_opt *cp)
+{
+	int p;
+
+	for (p = 0; p < QCN_NR_PRIO; p++)
+		if (cp->cnpv & (1 << p))
+			return p;
+	return 0;
+}
+
+/* One interval's verdict, and the step once it has held */
+static int tune_step(struct tune *tn, int ifindex, __u64 bytes, __u32 cnm)
+{
+	int p = tune_prio(&tn->cp);
+	double secs = tn->interval / 1e9, util, delay, mean;
+	__u32 q_eq = tn->cp.q_eq[p], w = tn->cp.w[p], gd = tn->rp.gd;
+	__u32 q_min, q_max, swing;
+	struct tc_qcn_cp_opt cp;
+	struct tc_qcn_rp_opt rp;
+	int verdict = TUNE_KEEP;
+
+	mean = tn->samples ? (double)tn->q_sum / tn->samples : 0;
+	util = 100.0 * (tn->bytes - bytes) / (tn->rate * secs);
+	delay = mean * 1e9 / tn->rate;
+	swing = tn->q_max - tn->q_min;
+
+	/* the queue that drains in target at the port rate, at most */
+	q_max = tn->q_eq_max ? tn->q_eq_max : tn->rate * tn->target / 1e9;
+	q_min = tn->q_eq_min;
+	if (q_max < q_min)
+		q_max = q_min;
+
+	if (delay > tn->target || q_eq > q_max)
+		verdict = TUNE_DOWN;
+	else if (util < tn->util && cnm && delay < tn->target / 2 &&
+		 q_eq < q_max)
+		verdict = TUNE_UP;
+
+	printf("tune util %.0f%% delay %.0f us swing %u cnm %.0f/s "
+	       "q_eq %u w %u", util, delay / 1000, swing, cnm / secs, q_eq, w);
+	if (tn->rp_found)
+		printf(" gd %u", gd);
+	printf("%s\n", verdict == TUNE_UP ? " up" :
+	       verdict == TUNE_DOWN ? " down" : "");
+
+	if (verdict == TUNE_KEEP || verdict != tn->verdict) {
+		tn->verdict = verdict;
+		tn->streak = 0;
+	}
+	if (verdict == TUNE_KEEP || ++tn->streak < TUNE_HOLD)
+		return 0;
+	tn->streak = 0;
+
+	if (verdict == TUNE_DOWN) {
+		q_eq -= q_eq / 8;
+		/* a swing past the set point wants more of the derivative */
+		if (swing > q_eq && w < TUNE_W_MAX)
+			w++;
+		/* q_eq has nowhere left to go: cut the rates harder */
+		else if (q_eq <= q_min && gd > TUNE_GD_MIN)
+			gd--;
+	} else {
+		q_eq += q_eq / 8 ? q_eq / 8 : 1;
+		if (swing < q_eq / 4 && w > 1)
+			w--;
+		else if (q_eq >= q_max && gd < TUNE_GD_MAX)
+			gd++;
+	}
+	q_eq = q_eq < q_min ? q_min : q_eq > q_max ? q_max : q_eq;
+
+	printf("tune q_eq %u w %u", q_eq, w);
+	if (tn->rp_found)
+		printf(" gd %u", gd);
+	printf("%s\n", tn->dry ? " (dry)" : "");
+	fflush(stdout);
+	if (tn->dry)
+		return 0;
+
+	if (q_eq != tn->cp.q_eq[p] || w != tn->cp.w[p]) {
+		memset(&cp, 0, sizeof(cp));
+		cp.flags = TC_QCN_CP_Q_EQ | TC_QCN_CP_W;
+		cp.prio_mask = (1 << QCN_NR_PRIO) - 1;
+		for (p = 0; p < QCN_NR_PRIO; p++) {
+			cp.q_eq[p] = q_eq;
+			cp.w[p] = w;
+		}
+		if (tune_send(ifindex, tn->parent, TCA_TBF_QCN, &cp,
+			      sizeof(cp)))
+			return -1;
+	}
+	if (tn->rp_found && gd != tn->rp.gd) {
+		memset(&rp, 0, sizeof(rp));
+		rp.flags = TC_QCN_RP_GD;
+		rp.gd = gd;
+		if (tune_send(ifindex, tn->rp_parent, TCA_HTB_QCN, &rp,
+			      sizeof(rp)))
+			return -1;
+	}
+	return 0;
+}
+
+static int tune(int ifindex, const char *dev, struct tune *tn)
+{
+	const struct qcn_telem *area;
+	struct tc_qcn_rp_opt rp;
+	struct timespec ts;
+	__u64 bytes;
+	__u32 cnm, n, i;
+	int slots;
+
+	if (dump(ifindex, RTM_GETQDISC, tune_parse, tn))
+		return 1;
+	if (!tn->cp_found) {
+		fprintf(stderr, "qcnctl: no tbf or qcnfifo CP there\n");
+		return 1;
+	}
+	if (tn->rp_parent && !tn->rp_found) {
+		fprintf(stderr, "qcnctl: no htb RP there\n");
+		return 1;
+	}
+	if (!tn->rate)
+		tn->rate = tn->tbf_rate ? tn->tbf_rate : tune_speed(dev);
+	if (!tn->rate) {
+		fprintf(stderr, "qcnctl: no rate for %s, give \"rate\"\n", dev);
+		return 1;
+	}
+
+	/* AI and HAI scaled from the module defaults, which are for 10G */
+	if (tn->rp_found && !tn->dry) {
+		memset(&rp, 0, sizeof(rp));
+		rp.flags = TC_QCN_RP_AI | TC_QCN_RP_HAI;
+		rp.ai = tn->rate / 2400;
+		rp.hai = tn->rate / 240;
+		if (tune_send(ifindex, tn->rp_parent, TCA_HTB_QCN, &rp,
+			      sizeof(rp)))
+			return 1;
+	}
+
+	/* without the page each interval has the one sample of its dump */
+	area = telem_map(&slots);
+	n = area ? tn->interval / TUNE_SAMPLE : 1;
+	if (!n)
+		n = 1;
+	ts.tv_sec = tn->interval / n / 1000000000;
+	ts.tv_nsec = tn->interval / n % 1000000000;
+
+	for (;;) {
+		bytes = tn->bytes;
+		cnm = tn->st.cnm_generated;
+		tn->q_sum = tn->q_min = tn->q_max = tn->samples = 0;
+		for (i = 0; i < n; i++) {
+			if (nanosleep(&ts, NULL))
+				return 0;
+			if (area)
+				tune_telem(tn, area, slots, ifindex);
+		}
+
+		tn->cp_found = 0;
+		if (dump(ifindex, RTM_GETQDISC, tune_parse, tn))
+			return 1;
+		if (!tn->cp_found) {
+			fprintf(stderr, "qcnctl: the CP went away\n");
+			return 1;
+		}
+		if (!area) {
+			__u64 qlen = 0;
+
+			for (i = 0; i < QCN_NR_PRIO; i++)
+				qlen += tn->st.qlen[i];
+			tune_sample(tn, qlen);
+		}
+		if (tune_step(tn, ifindex, bytes, tn->st.cnm_generated - cnm))
+			return 1;
+	}
+}
+
+/* QCN_MARK_STEPS comma separated byte counts */
+static void get_mark(const char *arg, __u32 *mark)
+{
+	char buf[128], *tok, *save;
+	int i = 0;
+
+	snprintf(buf, sizeof(buf), "%s", arg);
+	for (tok = strtok_r(buf, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (i == QCN_MARK_STEPS)
+			usage();
+		mark[i++] = get_u32(tok);
+	}
+	if (i != QCN_MARK_STEPS)
+		usage();
+}
+
+static void parse_cp(int argc, char **argv, struct req *req)
+{
+	struct tc_qcn_cp_opt opt;
+	__u32 prios = 0, q_eq = 0, w = 0;
+	int p;
+
+	memset(&opt, 0, sizeof(opt));
+	req->n.nlmsg_type = RTM_NEWQDISC;
+	req->t.tcm_parent = TC_H_ROOT;
+
+	for (; argc > 1; argc -= 2, argv += 2) {
+		if (!strcmp(argv[0], "parent")) {
+			req->t.tcm_parent = get_handle(argv[1]);
+		} else if (!strcmp(argv[0], "prio")) {
+			if ((p = get_u32(argv[1])) >= QCN_NR_PRIO)
+				usage();
+			prios |= 1 << p;
+		} else if (!strcmp(argv[0], "q_eq")) {
+			opt.flags |= TC_QCN_CP_Q_EQ;
+			q_eq = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "w")) {
+			opt.flags |= TC_QCN_CP_W;
+			w = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "cnpv")) {
+			opt.flags |= TC_QCN_CP_CNPV;
+			opt.cnpv = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "jitter")) {
+			opt.flags |= TC_QCN_CP_JITTER;
+			opt.sample_jitter = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "format")) {
+			opt.flags |= TC_QCN_CP_FORMAT;
+			opt.cnm_format = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "coalesce")) {
+			opt.flags |= TC_QCN_CP_COALESCE;
+			opt.coalesce = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "min_interval")) {
+			opt.flags |= TC_QCN_CP_MIN_INTERVAL;
+			opt.min_interval = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "mark")) {
+			opt.flags |= TC_QCN_CP_MARK;
+			get_mark(argv[1], opt.mark);
+		} else if (!strcmp(argv[0], "mark_rate")) {
+			opt.flags |= TC_QCN_CP_MARK_RATE;
+			opt.mark_rate = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "fb_period")) {
+			opt.flags |= TC_QCN_CP_FB_PERIOD;
+			opt.fb_period = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "ecn")) {
+			opt.flags |= TC_QCN_CP_ECN;
+			opt.ecn = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "metric")) {
+			opt.flags |= TC_QCN_CP_METRIC;
+			if (!strcmp(argv[1], "qlen"))
+				opt.metric = TC_QCN_METRIC_QLEN;
+			else if (!strcmp(argv[1], "delay"))
+				opt.metric = TC_QCN_METRIC_DELAY;
+			else
+				usage();
+		} else if (!strcmp(argv[0], "target")) {
+			opt.flags |= TC_QCN_CP_TARGET;
+			opt.target = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "heavy")) {
+			opt.flags |= TC_QCN_CP_HEAVY;
+			opt.heavy = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "flows")) {
+			opt.flags |= TC_QCN_CP_FLOWS;
+			opt.flows = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "bulk")) {
+			opt.flags |= TC_QCN_CP_BULK;
+			opt.bulk = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "exact_rate")) {
+			opt.flags |= TC_QCN_CP_EXACT_RATE;
+			opt.exact_rate = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "sojourn")) {
+			opt.flags |= TC_QCN_CP_SOJOURN;
+			opt.sojourn = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "alg")) {
+			opt.flags |= TC_QCN_CP_ALG;
+			get_alg(argv[1], opt.alg);
+		} else if (!strcmp(argv[0], "sbuf")) {
+			opt.flags |= TC_QCN_CP_SBUF;
+			opt.sbuf = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "sbuf_size")) {
+			opt.flags |= TC_QCN_CP_SBUF_SIZE;
+			opt.sbuf_size = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "sbuf_alpha")) {
+			opt.flags |= TC_QCN_CP_SBUF_ALPHA;
+			opt.sbuf_alpha = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "enable")) {
+			opt.flags |= TC_QCN_CP_ENABLE;
+			opt.enable = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "fb_delay")) {
+			opt.flags |= TC_QCN_CP_FB_DELAY;
+			opt.fb_delay = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "fb_loss")) {
+			opt.flags |= TC_QCN_CP_FB_LOSS;
+			opt.fb_loss = get_u32(argv[1]);
+		} else if (!strcmp(argv[0], "ring")) {
+			opt.flags |= TC_QCN_CP_RING;
+			opt.ring = get_u32(argv[1]);
+		} else
+			usage();
+	}
+	if (argc || !opt.flags)
+		usage();
+
+	opt.prio_mask = prios ? prios : (1 << QCN_NR_PRIO) - 1;
+	for (p = 0; p < QCN_NR_PRIO; p++) {
+		opt.q_eq[p] = q_eq;
+		opt.w[p] = w;
+	}
+	/* the CP of qcningress, whose TCA_HTB_QCN is the RP one */
+	addattr(&req->n, req->t.tcm_parent == TC_H_INGRESS ?
+		TCA_INGRESS_QCN_CP : TCA_TBF_QCN, &opt, sizeof(opt));
+}
+
+/* An IPv4 address, or an IPv6 one folded as qcn_ipv6_fold() does it;
+   1 if it was IPv6 */
+static int parse_flow_addr(const char *arg, __be32 *addr)
+{
+	struct in6_addr a6;
+
+	if (inet_pton(AF_INET, arg, addr) == 1)
+		return 0;
+	if (inet_pton(AF_INET6, arg, &a6) != 1) {
+		fprintf(stderr, "qcnctl: bad address \"%s\"\n", arg);
+		exit(1);
+	}
+	*addr = a6.s6_addr32[0] ^ a6.s6_addr32[1] ^
+		a6.s6_addr32[2] ^ a6.s6_addr32[3];
+	return 1;
+}
+
+/* VID or OUTER.INNER, as qcn_vlan_key() has them */
+static void parse_vlan(const char *arg, struct tc_qcn_rp_opt *opt)
+{
+	unsigned int outer, inner = 0;
+	char c;
+
+	if ((sscanf(arg, "%u%c", &outer, &c) != 1 &&
+	     sscanf(arg, "%u.%u%c", &outer, &inner, &c) != 2) ||
+	    outer > 4095 || inner > 4095) {
+		fprintf(stderr, "qcnctl: bad vlan \"%s\"\n", arg);
+		exit(1);
+	}
+	opt->flow_scope = (opt->flow_scope & QCN_SCOPE_IPV6) |
+		outer << 12 | inner;
+	opt->flags |= TC_QCN_RP_FLOW;
+}
+
+/* pair, src, dst or the prefix lengths S/D of the flow key */
+static void parse_aggregate(const char *arg, struct tc_qcn_rp_opt *opt)
+{
+	unsigned int src, dst;
+	char c;
+
+	if (!strcmp(arg, "pair"))
+		src = dst = 32;
+	else if (!strcmp(arg, "src"))
+		src = 32, dst = 0;
+	else if (!strcmp(arg, "dst"))
+		src = 0, dst = 32;
+	else if (sscanf(arg, "%u/%u%c", &src, &dst, &c) != 2 ||
+		 src > 32 || dst > 32) {
+		fprintf(stderr, "qcnctl: bad aggregate \"%s\"\n", arg);
+		exit(1);
+	}
+	opt->agg_src = src;
+	opt->agg_dst = dst;
+	opt->flags |= TC_QCN_RP_AGGREGATE;
+}
+
+#define RP_KEY(name, flag, field) \
+	{ name, TC_QCN_RP_##flag, offsetof(struct tc_qcn_rp_opt, field) }
+
+static void parse_rp(int argc, char **argv, struct req *req)
+{
+	static const struct {
+		const char	*name;
+		__u32		flag;
+		size_t		off;
+	} keys[] = {
+		RP_KEY("timer", TIMER, timer),
+		RP_KEY("fastrec", FASTREC, fastrec),
+		RP_KEY("bc", BC, bc),
+		RP_KEY("ai", AI, ai),
+		RP_KEY("hai", HAI, hai),
+		RP_KEY("gd", GD, gd),
+		RP_KEY("min_rate", MIN_RATE, min_rate),
+		RP_KEY("min_rate_dec", MIN_RATE_DEC, min_rate_dec),
+		RP_KEY("jitter", JITTER, timer_jitter),
+		RP_KEY("classify", CLASSIFY, classify),
+		RP_KEY("idle", AUTO_IDLE, auto_idle),
+		RP_KEY("backpressure", BACKPRESSURE, backpressure),
+		RP_KEY("exact", EXACT, exact),
+		RP_KEY("enable", ENABLE, enable),
+	};
+	struct tc_qcn_rp_opt opt;
+	struct tc_qcn_ingress_opt iopt;
+	__u32 parent = TC_H_ROOT;
+	unsigned int i;
+	int v6 = -1, is_v6;		/* family of src and dst, -1 none yet */
+
+	memset(&opt, 0, sizeof(opt));
+	memset(&iopt, 0, sizeof(iopt));
+	req->n.nlmsg_type = RTM_NEWQDISC;
+
+	for (; argc > 1; argc -= 2, argv += 2) {
+		if (!strcmp(argv[0], "parent")) {
+			parent = get_handle(argv[1]);
+			continue;
+		}
+		if (!strcmp(argv[0], "classid")) {
+			req->n.nlmsg_type = RTM_NEWTCLASS;
+			req->t.tcm_parent = TC_H_UNSPEC;
+			req->t.tcm_handle = get_handle(argv[1]);
+			continue;
+		}
+		if (!strcmp(argv[0], "src") || !strcmp(argv[0], "dst")) {
+			is_v6 = parse_flow_addr(argv[1], argv[0][0] == 's' ?
+						&opt.flow_src : &opt.flow_dst);
+			if (v6 >= 0 && is_v6 != v6) {
+				fprintf(stderr, "qcnctl: src and dst must both "
+					"be IPv4 or both IPv6\n");
+				exit(1);
+			}
+			v6 = is_v6;
+			if (v6)
+				opt.flow_scope |= QCN_SCOPE_IPV6;
+			opt.flags |= TC_QCN_RP_FLOW;
+			continue;
+		}
+		if (!strcmp(argv[0], "vlan")) {
+			parse_vlan(argv[1], &opt);
+			continue;
+		}
+		if (!strcmp(argv[0], "auto")) {
+			opt.auto_class = get_handle(argv[1]);
+			opt.flags |= TC_QCN_RP_AUTO;
+			continue;
+		}
+		if (!strcmp(argv[0], "aggregate")) {
+			parse_aggregate(argv[1], &opt);
+			continue;
+		}
+		if (!strcmp(argv[0], "alg")) {
+			get_alg(argv[1], opt.alg);
+			opt.flags |= TC_QCN_RP_ALG;
+			continue;
+		}
+		if (!strcmp(argv[0], "hw_vf")) {
+			opt.hw_vf = strcmp(argv[1], "none") ?
+				(__s32)get_u32(argv[1]) : -1;
+			opt.flags |= TC_QCN_RP_HW_VF;
+			continue;
+		}
+		if (!strcmp(argv[0], "rate")) {
+			iopt.rate = get_u32(argv[1]);
+			iopt.flags |= TC_QCN_INGRESS_RATE;
+			continue;
+		}
+		if (!strcmp(argv[0], "burst")) {
+			iopt.burst = get_u32(argv[1]);
+			iopt.flags |= TC_QCN_INGRESS_BURST;
+			continue;
+		}
+		if (!strcmp(argv[0], "limit")) {
+			iopt.limit = get_u32(argv[1]);
+			iopt.flags |= TC_QCN_INGRESS_LIMIT;
+			continue;
+		}
+		if (!strcmp(argv[0], "cp_rate")) {
+			iopt.cp_rate = get_u32(argv[1]);
+			iopt.flags |= TC_QCN_INGRESS_CP_RATE;
+			continue;
+		}
+		if (!strcmp(argv[0], "cp_limit")) {
+			iopt.cp_limit = get_u32(argv[1]);
+			iopt.flags |= TC_QCN_INGRESS_CP_LIMIT;
+			continue;
+		}
+		for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+			if (!strcmp(argv[0], keys[i].name))
+				break;
+		if (i == sizeof(keys) / sizeof(keys[0]))
+			usage();
+		opt.flags |= keys[i].flag;
+		*(__u32 *)((char *)&opt + keys[i].off) =
+			keys[i].flag == TC_QCN_RP_TIMER ? get_time_ns(argv[1]) :
+			get_u32(argv[1]);
+	}
+	if (argc || (!opt.flags && !iopt.flags))
+		usage();
+	/* a class is found by its classid alone */
+	if (req->n.nlmsg_type == RTM_NEWQDISC)
+		req->t.tcm_parent = parent;
+
+	if (opt.flags)
+		addattr(&req->n, TCA_HTB_QCN, &opt, sizeof(opt));
+	if (iopt.flags)
+		addattr(&req->n, TCA_INGRESS_QCN, &iopt, sizeof(iopt));
+}
+
+struct flows_msg {
+	struct tc_qcn_rp_flows	hdr;
+	struct tc_qcn_rp_flow	flow[TC_QCN_FLOWS_MAX];
+};
+
+/* One TCA_HTB_QCN_FLOWS change of the qdisc req names */
+static int flows_send(const struct req *req, struct flows_msg *fm)
+{
+	size_t len = sizeof(fm->hdr) + fm->hdr.count * sizeof(fm->flow[0]);
+	struct nlmsghdr *n;
+	struct rtattr *nest;
+	int ret;
+
+	n = malloc(NLMSG_SPACE(sizeof(struct tcmsg)) + 2 * RTA_SPACE(0) +
+		   RTA_ALIGN(len));
+	if (n == NULL) {
+		perror("qcnctl: malloc");
+		return -1;
+	}
+	memcpy(n, req, NLMSG_LENGTH(sizeof(struct tcmsg)));
+	n->nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+	nest = NLMSG_TAIL(n);
+	addattr(n, TCA_OPTIONS, NULL, 0);
+	addattr(n, TCA_HTB_QCN_FLOWS, fm, len);
+	nest->rta_len = (char *)NLMSG_TAIL(n) - (char *)nest;
+
+	ret = talk(n);
+	free(n);
+	return ret;
+}
+
+static int flows(struct req *req, const char *op, const char *path)
+{
+	struct flows_msg *fm;
+	struct tc_qcn_rp_flow *f;
+	char line[256], id[32], src[32], dst[32];
+	unsigned int lineno = 0;
+	FILE *fp;
+	int fields, ret = 0;
+
+	if ((fm = calloc(1, sizeof(*fm))) == NULL) {
+		perror("qcnctl: calloc");
+		return 1;
+	}
+	if (!strcmp(op, "add"))
+		fm->hdr.op = TC_QCN_FLOWS_ADD;
+	else if (!strcmp(op, "del"))
+		fm->hdr.op = TC_QCN_FLOWS_DEL;
+	else
+		usage();
+	if ((fp = strcmp(path, "-") ? fopen(path, "r") : stdin) == NULL) {
+		perror(path);
+		free(fm);
+		return 1;
+	}
+
+	req->n.nlmsg_type = RTM_NEWQDISC;
+	while (!ret && fgets(line, sizeof(line), fp)) {
+		lineno++;
+		f = &fm->flow[fm->hdr.count];
+		memset(f, 0, sizeof(*f));
+		fields = sscanf(line, "%31s %31s %31s %u %u", id, src, dst,
+				&f->rate, &f->burst);
+		if (fields < 1 || id[0] == '#')
+			continue;
+		if (strcmp(id, "-"))
+			f->classid = get_handle(id);
+		if ((fields >= 3 &&
+		     (inet_pton(AF_INET, src, &f->src) != 1 ||
+		      inet_pton(AF_INET, dst, &f->dst) != 1)) ||
+		    (fm->hdr.op == TC_QCN_FLOWS_ADD ?
+		     fields < 4 || !f->classid || !f->rate :
+		     !f->classid && fields < 3)) {
+			fprintf(stderr, "qcnctl: %s:%u: bad flow\n", path,
+				lineno);
+			ret = -1;
+			break;
+		}
+		if (++fm->hdr.count == TC_QCN_FLOWS_MAX) {
+			ret = flows_send(req, fm);
+			fm->hdr.count = 0;
+		}
+	}
+	if (!ret && fm->hdr.count)
+		ret = flows_send(req, fm);
+
+	if (fp != stdin)
+		fclose(fp);
+	free(fm);
+	return ret ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct req req;
+	struct rtattr *nest;
+
+	if (argc < 3)
+		usage();
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+	/* no NLM_F_CREATE: only an existing instance is changed */
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req.t.tcm_family = AF_UNSPEC;
+	if ((req.t.tcm_ifindex = if_nametoindex(argv[2])) == 0) {
+		fprintf(stderr, "qcnctl: no device \"%s\"\n", argv[2]);
+		return 1;
+	}
+
+	if (!strcmp(argv[1], "stats")) {
+		if (argc != 3)
+			usage();
+		return dump(req.t.tcm_ifindex, RTM_GETQDISC, print_stats,
+			    NULL) ||
+			dump(req.t.tcm_ifindex, RTM_GETTCLASS, print_stats,
+			     NULL) ? 1 : 0;
+	}
+	if (!strcmp(argv[1], "telemetry")) {
+		if (argc == 5 && !strcmp(argv[3], "interval"))
+			return telemetry(req.t.tcm_ifindex,
+					 get_time_ns(argv[4]));
+		if (argc != 3)
+			usage();
+		return telemetry(req.t.tcm_ifindex, 0);
+	}
+	if (!strcmp(argv[1], "events")) {
+		if (argc != 3)
+			usage();
+		return events(req.t.tcm_ifindex);
+	}
+	if (!strcmp(argv[1], "classes")) {
+		if (argc != 3)
+			usage();
+		return classes(req.t.tcm_ifindex);
+	}
+	if (!strcmp(argv[1], "tune")) {
+		const char *dev = argv[2];
+		struct tune tn;
+
+		memset(&tn, 0, sizeof(tn));
+		tn.parent = TC_H_ROOT;
+		tn.target = 100000;
+		tn.interval = 100000000;
+		tn.util = 95;
+		tn.q_eq_min = 3028;
+		for (argc -= 3, argv += 3; argc > 1; argc -= 2, argv += 2) {
+			if (!strcmp(argv[0], "parent"))
+				tn.parent = get_handle(argv[1]);
+			else if (!strcmp(argv[0], "target"))
+				tn.target = get_u32(argv[1]) * 1000;
+			else if (!strcmp(argv[0], "interval"))
+				tn.interval = get_time_ns(argv[1]);
+			else if (!strcmp(argv[0], "util"))
+				tn.util = get_u32(argv[1]);
+			else if (!strcmp(argv[0], "rate"))
+				tn.rate = get_u32(argv[1]);
+			else if (!strcmp(argv[0], "q_eq_min"))
+				tn.q_eq_min = get_u32(argv[1]);
+			else if (!strcmp(argv[0], "q_eq_max"))
+				tn.q_eq_max = get_u32(argv[1]);
+			else if (!strcmp(argv[0], "rp"))
+				tn.rp_parent = !strcmp(argv[1], "root") ?
+					TC_H_ROOT : get_handle(argv[1]);
+			else if (!strcmp(argv[0], "dry"))
+				tn.dry = get_u32(argv[1]);
+			else
+				usage();
+		}
+		if (argc || !tn.target || !tn.interval || !tn.q_eq_min)
+			usage();
+		return tune(req.t.tcm_ifindex, dev, &tn);
+	}
+	if (!strcmp(argv[1], "flows")) {
+		req.t.tcm_parent = TC_H_ROOT;
+		if (argc == 7 && !strcmp(argv[5], "parent"))
+			req.t.tcm_parent = get_handle(argv[6]);
+		else if (argc != 5)
+			usage();
+		return flows(&req, argv[3], argv[4]);
+	}
+
+	nest = NLMSG_TAIL(&req.n);
+	addattr(&req.n, TCA_OPTIONS, NULL, 0);
+	if (!strcmp(argv[1], "cp"))
+		parse_cp(argc - 3, argv + 3, &req);
+	else if (!strcmp(argv[1], "rp"))
+		parse_rp(argc - 3, argv + 3, &req);
+	else
+		usage();
+	nest->rta_len = (char *)NLMSG_TAIL(&req.n) - (char *)nest;
+
+	return talk(&req.n) ? 1 : 0;
+}
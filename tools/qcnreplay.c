@@ -0,0 +1,498 @@
+/*
+ * qcnreplay.c	Replay of a packet capture through one Congestion Point, a
+ *		tbf shaper running the CP arithmetic of the modules
+ *		(qcn_alg.h), as fast as the trace can be read.
+ *
+ *		qcnreplay [-l MBIT] [-b BYTES] [-i US] [-s SEED] [-q]
+ *		          [KEY=VALUE]... FILE
+ *
+ *		FILE is a pcap capture (Ethernet, Linux cooked or raw IP; us
+ *		or ns timestamps, either byte order), "-" for stdin. Its
+ *		packets arrive at the CP when they were captured and with
+ *		their length on the wire; the shaper serves them at -l Mbit
+ *		with a bucket of -b bytes. The priority of a packet is the
+ *		PCP of its VLAN tag, 0 for untagged ones. KEY is a CP
+ *		parameter: q_eq and w (all priorities), sample_jitter,
+ *		mark_rate in bytes/s, mark (the sampling table, 8 comma
+ *		separated byte counts), cnpv, and the queue limit in bytes;
+ *		the defaults are those of the modules.
+ *
+ *		Every CNM the CP would have sent is printed as
+ *			cnm TIME prio P src SA dst DA fb FB
+ *			    qoff QOFF qdelta QDELTA
+ *		(src and dst are "flow ID" for CN-TAG frames) and, every
+ *		-i us of trace time, the backlog of the shaper as
+ *			queue TIME BYTES
+ *		with TIME in us from the first packet; -q leaves the queue
+ *		out. A summary goes to stderr.
+ *
+ *		The capture is open loop: the senders do not slow down
+ *		for the CNMs, so the queue is that of the traffic as it was
+ *		captured. The CNM filter (min_interval), heavy hitters, ECN
+ *		and the delay metric are not modeled.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../qcn_alg.h"
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NS		0xa1b23c4d
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		101
+#define LINKTYPE_LINUX_SLL	113
+
+#define ETH_P_IP		0x0800
+#define ETH_P_8021Q		0x8100
+#define ETH_P_CNTAG		0x22E9	/* as qcn.h */
+
+#define SNAP_MAX		65536
+
+struct pcap_hdr {
+	uint32_t	magic;
+	uint16_t	major, minor;
+	int32_t		zone;
+	uint32_t	sigfigs;
+	uint32_t	snaplen;
+	uint32_t	linktype;
+};
+
+struct pcap_rec {
+	uint32_t	sec, frac;
+	uint32_t	caplen, len;
+};
+
+/* What qcn_flow_fill() takes from a frame */
+struct flow {
+	int		ip;		/* SA and DA valid */
+	int		tagged;		/* flow_id valid */
+	uint32_t	sa, da;		/* network order */
+	uint16_t	flow_id;
+	int		prio;
+};
+
+struct cp_prio {
+	int		qlen;		/* bytes queued, qcn_qlen */
+	int		qlen_old;
+	int		sample;
+	int		generate_fb_frame;
+	uint32_t	fb_max;
+	int		fb_shift;
+	uint64_t	cnms;
+};
+
+static struct {
+	int		q_eq, w;
+	unsigned int	sample_jitter;
+	__u32		mark_rate;
+	__u32		mark_cfg[QCN_MARK_STEPS];
+	__u32		mark[QCN_MARK_STEPS];
+	uint32_t	cnpv;
+	uint64_t	limit;
+
+	struct cp_prio	prio[QCN_NR_PRIO];
+} cp = {
+	.q_eq		= 33792,
+	.w		= 2,
+	.sample_jitter	= 15,
+	.mark_cfg	= QCN_MARK_DEFAULT,
+	.cnpv		= 0xFF,
+	.limit		= 4 << 20,
+};
+
+/* The shaper: a FIFO served from a token bucket */
+static struct {
+	struct pkt {
+		uint32_t	len;
+		int		prio;
+	}		*q;
+	size_t		head, tail, size;
+	uint64_t	backlog;
+	double		rate;		/* bytes/ns */
+	double		burst, tokens;
+	uint64_t	t;		/* tokens is as of t */
+	uint64_t	drops;
+} tbf;
+
+static uint32_t rnd_state;
+static int swapped;
+
+/* xorshift32, stands in for net_random() */
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+/* same as the kernel's qcn_randomize() */
+static uint32_t randomize(uint32_t base, unsigned int pct)
+{
+	uint32_t span;
+
+	if (pct == 0)
+		return base;
+	span = (uint32_t)(((uint64_t)base * (pct < 100 ? pct : 100)) / 100);
+	return base - span +
+		(uint32_t)(((uint64_t)rnd() * (2 * span + 1)) >> 32);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: qcnreplay [-l MBIT] [-b BYTES] [-i US] [-s SEED] [-q]\n"
+		"                 [KEY=VALUE]... FILE\n"
+		"KEY: q_eq w sample_jitter mark_rate mark=B,B,B,B,B,B,B,B\n"
+		"     cnpv limit\n");
+	exit(1);
+}
+
+static void set_param(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	unsigned long v;
+	char *end;
+	int i;
+
+	if (eq == NULL)
+		usage();
+	if (!strncmp(arg, "mark=", 5)) {
+		for (i = 0, end = (char *)eq; i < QCN_MARK_STEPS; i++) {
+			cp.mark_cfg[i] = strtoul(end + 1, &end, 0);
+			if (*end != (i < QCN_MARK_STEPS - 1 ? ',' : '\0'))
+				usage();
+		}
+		return;
+	}
+	v = strtoul(eq + 1, &end, 0);
+	if (*end || end == eq + 1)
+		usage();
+
+	if (!strncmp(arg, "q_eq=", 5))
+		cp.q_eq = v;
+	else if (!strncmp(arg, "w=", 2))
+		cp.w = v;
+	else if (!strncmp(arg, "sample_jitter=", 14))
+		cp.sample_jitter = v;
+	else if (!strncmp(arg, "mark_rate=", 10))
+		cp.mark_rate = v;
+	else if (!strncmp(arg, "cnpv=", 5))
+		cp.cnpv = v;
+	else if (!strncmp(arg, "limit=", 6))
+		cp.limit = v;
+	else
+		usage();
+}
+
+static uint32_t pcap32(uint32_t v)
+{
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+/* Fills f from a frame of caplen bytes, as qcn_flow_fill() would from
+   the skb; returns 0 for frames the CP cannot send a CNM for */
+static int flow_fill(const unsigned char *p, uint32_t caplen,
+		     uint32_t linktype, struct flow *f)
+{
+	uint32_t off;
+	uint16_t proto;
+
+	memset(f, 0, sizeof(*f));
+	switch (linktype) {
+	case LINKTYPE_ETHERNET:
+		off = 14;
+		break;
+	case LINKTYPE_LINUX_SLL:
+		off = 16;
+		break;
+	case LINKTYPE_RAW:
+		proto = ETH_P_IP;
+		off = 0;
+		goto ip;
+	default:
+		return 0;
+	}
+	if (caplen < off)
+		return 0;
+	proto = get16(p + off - 2);
+	while (proto == ETH_P_8021Q && caplen >= off + 4) {
+		f->prio = p[off] >> 5;
+		proto = get16(p + off + 2);
+		off += 4;
+	}
+	if (proto == ETH_P_CNTAG) {
+		/* h_flow_id, then the encapsulated ethertype */
+		if (caplen < off + 4)
+			return 0;
+		f->tagged = 1;
+		f->flow_id = get16(p + off);
+		return 1;
+	}
+ip:
+	/* IPv4, version and both the addresses captured */
+	if (proto != ETH_P_IP || caplen < off + 20 || p[off] >> 4 != 4)
+		return 0;
+	memcpy(&f->sa, p + off + 12, 4);
+	memcpy(&f->da, p + off + 16, 4);
+	f->ip = 1;
+	return 1;
+}
+
+/* Serves the FIFO up to now */
+static void tbf_drain(uint64_t now)
+{
+	while (tbf.head != tbf.tail) {
+		struct pkt *p = &tbf.q[tbf.head];
+		double need = p->len - tbf.tokens;
+		uint64_t dep = tbf.t;
+
+		if (need > 0)
+			dep += (uint64_t)(need / tbf.rate) + 1;
+		if (dep > now)
+			break;
+		tbf.tokens += (dep - tbf.t) * tbf.rate;
+		if (tbf.tokens > tbf.burst)
+			tbf.tokens = tbf.burst;
+		tbf.tokens -= p->len;
+		tbf.t = dep;
+		tbf.backlog -= p->len;
+		cp.prio[p->prio].qlen -= p->len;
+		tbf.head = (tbf.head + 1) % tbf.size;
+	}
+	tbf.tokens += (now - tbf.t) * tbf.rate;
+	if (tbf.tokens > tbf.burst)
+		tbf.tokens = tbf.burst;
+	tbf.t = now;
+}
+
+/* tbf_enqueue(), 0 for a drop: larger than the bucket, or the queue
+   full */
+static int tbf_enqueue(uint32_t len, int prio)
+{
+	size_t n;
+
+	if (len > tbf.burst || tbf.backlog + len > cp.limit) {
+		tbf.drops++;
+		return 0;
+	}
+	if ((tbf.tail + 1) % tbf.size == tbf.head) {
+		struct pkt *q = malloc(2 * tbf.size * sizeof(*q));
+
+		if (q == NULL) {
+			perror("qcnreplay");
+			exit(1);
+		}
+		for (n = 0; tbf.head != tbf.tail; n++) {
+			q[n] = tbf.q[tbf.head];
+			tbf.head = (tbf.head + 1) % tbf.size;
+		}
+		free(tbf.q);
+		tbf.q = q;
+		tbf.size *= 2;
+		tbf.head = 0;
+		tbf.tail = n;
+	}
+	tbf.q[tbf.tail].len = len;
+	tbf.q[tbf.tail].prio = prio;
+	tbf.tail = (tbf.tail + 1) % tbf.size;
+	tbf.backlog += len;
+	return 1;
+}
+
+/* As qcn_algorithm() in sch_tbf_switch.c, for a frame just queued;
+   returns the Fb of the CNM to send, 0 for none */
+static uint32_t cp_arrive(const struct flow *f, int ok, uint32_t len,
+			  int *qoff, int *qdelta)
+{
+	struct cp_prio *c = &cp.prio[f->prio];
+	uint32_t qntz_Fb = 0;
+
+	c->qlen += len;
+	if (!(cp.cnpv & (1 << f->prio)))
+		return 0;
+
+	c->sample -= len;
+	if (c->sample < 0 || c->generate_fb_frame) {
+		qntz_Fb = qcn_quantize_fb(cp.q_eq, cp.w, c->qlen, c->qlen_old,
+					  c->fb_max, c->fb_shift);
+		if (qntz_Fb == 0)
+			c->generate_fb_frame = 0;
+	}
+	while (c->sample < 0) {
+		if (qntz_Fb > 0)
+			c->generate_fb_frame = 1;
+		c->qlen_old = c->qlen;
+		c->sample += randomize(qcn_mark_table(cp.mark, qntz_Fb),
+				       cp.sample_jitter);
+	}
+	*qoff = cp.q_eq - c->qlen;
+	*qdelta = c->qlen - c->qlen_old;
+	if (!c->generate_fb_frame || !ok)
+		return 0;
+	c->generate_fb_frame = 0;
+	c->cnms++;
+	return qntz_Fb;
+}
+
+static void print_cnm(uint64_t t, const struct flow *f, uint32_t Fb,
+		      int qoff, int qdelta)
+{
+	char sa[INET_ADDRSTRLEN], da[INET_ADDRSTRLEN];
+
+	if (f->tagged) {
+		snprintf(sa, sizeof(sa), "flow");
+		snprintf(da, sizeof(da), "%u", f->flow_id);
+	} else {
+		inet_ntop(AF_INET, &f->sa, sa, sizeof(sa));
+		inet_ntop(AF_INET, &f->da, da, sizeof(da));
+	}
+	printf("cnm %.3f prio %d src %s dst %s fb %u qoff %d qdelta %d\n",
+	       t / 1e3, f->prio, sa, da, Fb, qoff, qdelta);
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char pkt[SNAP_MAX];
+	double link_mbit = 1000, burst = 10000, sum_q = 0, wall;
+	uint64_t interval = 100000, t, t0 = 0, next, ns, max_q = 0;
+	uint64_t packets = 0, bytes = 0, cnms = 0, nr_q = 0;
+	int quiet = 0, c, i, qoff, qdelta;
+	struct timespec w0, w1;
+	struct pcap_hdr gh;
+	struct pcap_rec rh;
+	struct flow f;
+	uint32_t Fb;
+	FILE *in;
+
+	rnd_state = 1;
+	while ((c = getopt(argc, argv, "l:b:i:s:q")) != -1) {
+		switch (c) {
+		case 'l': link_mbit = strtod(optarg, NULL); break;
+		case 'b': burst = strtod(optarg, NULL); break;
+		case 'i': interval = strtoull(optarg, NULL, 0) * 1000; break;
+		case 's': rnd_state = strtoul(optarg, NULL, 0); break;
+		case 'q': quiet = 1; break;
+		default: usage();
+		}
+	}
+	for (; optind < argc - 1; optind++)
+		set_param(argv[optind]);
+	if (optind != argc - 1 || link_mbit <= 0 || burst <= 0 ||
+	    interval == 0 || rnd_state == 0)
+		usage();
+
+	in = strcmp(argv[optind], "-") ? fopen(argv[optind], "rb") : stdin;
+	if (in == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(&gh, sizeof(gh), 1, in) != 1) {
+		fprintf(stderr, "qcnreplay: %s: no pcap header\n",
+			argv[optind]);
+		return 1;
+	}
+	swapped = gh.magic == __builtin_bswap32(PCAP_MAGIC) ||
+		gh.magic == __builtin_bswap32(PCAP_MAGIC_NS);
+	ns = pcap32(gh.magic) == PCAP_MAGIC_NS ? 1 : 1000;
+	if (pcap32(gh.magic) != PCAP_MAGIC && ns == 1000) {
+		fprintf(stderr, "qcnreplay: %s: not a pcap file\n",
+			argv[optind]);
+		return 1;
+	}
+	gh.linktype = pcap32(gh.linktype);
+
+	tbf.rate = link_mbit * 1e6 / 8 / 1e9;
+	tbf.burst = tbf.tokens = burst;
+	tbf.size = 1024;
+	tbf.q = malloc(tbf.size * sizeof(*tbf.q));
+	if (tbf.q == NULL) {
+		perror("qcnreplay");
+		return 1;
+	}
+	qcn_mark_scale(cp.mark, cp.mark_cfg, cp.mark_rate,
+		       (__u64)(link_mbit * 1e6 / 8));
+	for (i = 0; i < QCN_NR_PRIO; i++) {
+		cp.prio[i].fb_max = qcn_fb_max(cp.q_eq, cp.w,
+					       cp.limit < 4e9 ? cp.limit : 0);
+		cp.prio[i].fb_shift = qcn_fb_shift(cp.prio[i].fb_max);
+		cp.prio[i].sample = randomize(qcn_mark_table(cp.mark, 0),
+					      cp.sample_jitter);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &w0);
+	t = next = 0;
+	while (fread(&rh, sizeof(rh), 1, in) == 1) {
+		rh.caplen = pcap32(rh.caplen);
+		if (rh.caplen > SNAP_MAX ||
+		    fread(pkt, 1, rh.caplen, in) != rh.caplen) {
+			fprintf(stderr, "qcnreplay: %s: truncated\n",
+				argv[optind]);
+			break;
+		}
+		t = (uint64_t)pcap32(rh.sec) * 1000000000ULL +
+			(uint64_t)pcap32(rh.frac) * ns;
+		if (!packets)
+			t0 = t;
+		/* a capture is not always in order, nor is time monotonic */
+		t = t > t0 ? t - t0 : 0;
+		if (t < tbf.t)
+			t = tbf.t;
+		packets++;
+		rh.len = pcap32(rh.len);
+		bytes += rh.len;
+
+		for (; next <= t; next += interval) {
+			tbf_drain(next);
+			sum_q += tbf.backlog;
+			nr_q++;
+			if (tbf.backlog > max_q)
+				max_q = tbf.backlog;
+			if (!quiet)
+				printf("queue %.3f %llu\n", next / 1e3,
+				       (unsigned long long)tbf.backlog);
+		}
+		tbf_drain(t);
+
+		i = flow_fill(pkt, rh.caplen, gh.linktype, &f);
+		if (!tbf_enqueue(rh.len, f.prio))
+			continue;
+		if ((Fb = cp_arrive(&f, i, rh.len, &qoff, &qdelta)) != 0) {
+			print_cnm(t, &f, Fb, qoff, qdelta);
+			cnms++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &w1);
+	wall = (w1.tv_sec - w0.tv_sec) + (w1.tv_nsec - w0.tv_nsec) / 1e9;
+
+	fprintf(stderr, "packets %llu bytes %llu time %.3f ms link %.0f Mbit\n",
+		(unsigned long long)packets, (unsigned long long)bytes, t / 1e6,
+		link_mbit);
+	fprintf(stderr, "replayed in %.3f s, %.1fx real time\n", wall,
+		wall > 0 ? t / 1e9 / wall : 0);
+	fprintf(stderr, "queue mean %.0f max %llu bytes\n",
+		nr_q ? sum_q / nr_q : 0, (unsigned long long)max_q);
+	fprintf(stderr, "cnms %llu drops %llu\n", (unsigned long long)cnms,
+		(unsigned long long)tbf.drops);
+	for (i = 0; i < QCN_NR_PRIO; i++)
+		if (cp.prio[i].cnms)
+			fprintf(stderr, "  prio %d cnms %llu\n", i,
+				(unsigned long long)cp.prio[i].cnms);
+	return 0;
+}
@@ -0,0 +1,497 @@
+/*
+ * qcnsim.c	Event driven simulation of QCN sources sharing one Congestion
+ *		Point, running the CP and RP arithmetic of the modules
+ *		(qcn_alg.h). Runs are deterministic for a given seed.
+ *
+ *		qcnsim [-n SOURCES] [-l MBIT] [-d US] [-t MS] [-s SEED]
+ *		       [-i US] [-e PCT] [-v] [KEY=VALUE]...
+ *
+ *		Every source can send at the link rate, so n sources load the
+ *		link n times over. -d is the one way delay of data from a
+ *		source to the CP and of CNMs back. KEY is an RP parameter
+ *		(timer in us, fastrec, bc, ai, hai, gd, min_rate,
+ *		min_rate_dec, timer_jitter, exact) or a CP one (q_eq, w,
+ *		sample_jitter, mark_rate in bytes/s, and the frame size mtu
+ *		and queue limit, in bytes); the defaults are those of the
+ *		modules. alg=dcqcn runs CP and RPs
+ *		on that algorithm instead of the 802.1Qau one, alg=qcn. The
+ *		state is sampled every -i us; the run counts as converged from
+ *		the sample on which the sum of the source rates stays within -e
+ *		percent of the link rate. -v prints every sample.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../qcn_alg.h"
+
+enum {
+	EV_SEND,		/* a source puts a frame on the wire */
+	EV_ARRIVE,		/* ... which reaches the CP */
+	EV_CNM,			/* feedback reaches a source */
+	EV_TIMER,		/* RP timer stage */
+	EV_SAMPLE,		/* statistics */
+};
+
+struct event {
+	uint64_t	t;	/* ns */
+	uint64_t	seq;	/* keeps events of the same t in order */
+	int		type;
+	int		src;
+	uint32_t	arg;	/* ARRIVE bytes, CNM Fb, TIMER generation */
+	int		qoff;	/* CNM */
+	int		qdelta;
+};
+
+struct source {
+	struct qcn_rp_state	rp;
+	uint32_t		timer_gen;
+	int			timer_active;
+	uint64_t		cnms;
+};
+
+static struct {
+	struct event	*ev;
+	unsigned int	nr, size;
+	uint64_t	seq;
+} heap;
+
+static struct tc_qcn_rp_opt rp_opt = {
+	.timer		= 25000000,
+	.fastrec	= 5,
+	.bc		= 153600,
+	.ai		= 524288,
+	.hai		= 5242880,
+	.gd		= 7,
+	.min_rate	= 524288,
+	.min_rate_dec	= 1,
+	.timer_jitter	= 15,
+};
+
+static const struct qcn_alg_ops dcqcn = { QCN_ALG_DCQCN };
+static const struct qcn_alg_ops *alg;	/* NULL for 802.1Qau */
+static int cp_prof, rp_prof;		/* qcn_cp_prof(), qcn_rp_prof() */
+
+static struct {
+	int		q_eq, w;
+	unsigned int	sample_jitter;
+	uint32_t	mtu;
+	double		limit;	/* bytes */
+	uint32_t	fb_max;	/* -Fb clamp, as the CP derives it */
+	int		fb_shift;
+	__u32		mark_rate;
+	__u32		mark[QCN_MARK_STEPS];
+
+	double		qlen;	/* bytes, drained as a fluid */
+	int		qlen_old;
+	int		sample;
+	uint64_t	t;	/* of the last drain */
+	double		served;
+	uint64_t	drops;
+} cp = {
+	.q_eq		= 33792,
+	.w		= 2,
+	.sample_jitter	= 15,
+	.mtu		= 1500,
+	.limit		= 4 << 20,
+};
+
+static uint32_t rnd_state;
+
+/* xorshift32, stands in for net_random() */
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+/* same as the kernel's qcn_randomize() */
+static uint32_t randomize(uint32_t base, unsigned int pct)
+{
+	uint32_t span;
+
+	if (pct == 0)
+		return base;
+	span = (uint32_t)(((uint64_t)base * (pct < 100 ? pct : 100)) / 100);
+	return base - span +
+		(uint32_t)(((uint64_t)rnd() * (2 * span + 1)) >> 32);
+}
+
+static int ev_before(const struct event *a, const struct event *b)
+{
+	return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+static void ev_insert(struct event e)
+{
+	unsigned int i, p;
+
+	if (heap.nr == heap.size) {
+		heap.size = heap.size ? 2 * heap.size : 1024;
+		heap.ev = realloc(heap.ev, heap.size * sizeof(*heap.ev));
+		if (heap.ev == NULL) {
+			perror("qcnsim");
+			exit(1);
+		}
+	}
+	for (i = heap.nr++; i > 0; i = p) {
+		p = (i - 1) / 2;
+		if (!ev_before(&e, &heap.ev[p]))
+			break;
+		heap.ev[i] = heap.ev[p];
+	}
+	heap.ev[i] = e;
+}
+
+static void ev_push(uint64_t t, int type, int src, uint32_t arg)
+{
+	struct event e = { t, heap.seq++, type, src, arg, 0, 0 };
+
+	ev_insert(e);
+}
+
+static void ev_push_cnm(uint64_t t, int src, uint32_t Fb, int qoff,
+			int qdelta)
+{
+	struct event e = { t, heap.seq++, EV_CNM, src, Fb, qoff, qdelta };
+
+	ev_insert(e);
+}
+
+static struct event ev_pop(void)
+{
+	struct event top = heap.ev[0], last = heap.ev[--heap.nr];
+	unsigned int i = 0, c;
+
+	while ((c = 2 * i + 1) < heap.nr) {
+		if (c + 1 < heap.nr && ev_before(&heap.ev[c + 1], &heap.ev[c]))
+			c++;
+		if (!ev_before(&heap.ev[c], &last))
+			break;
+		heap.ev[i] = heap.ev[c];
+		i = c;
+	}
+	heap.ev[i] = last;
+	return top;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: qcnsim [-n SOURCES] [-l MBIT] [-d US] [-t MS]\n"
+		"              [-s SEED] [-i US] [-e PCT] [-v] [KEY=VALUE]...\n"
+		"KEY: timer fastrec bc ai hai gd min_rate min_rate_dec\n"
+		"     timer_jitter exact q_eq w sample_jitter mtu limit\n"
+		"     alg=qcn|dcqcn\n");
+	exit(1);
+}
+
+static void set_param(const char *arg)
+{
+	static const struct {
+		const char	*name;
+		__u32		*val;
+	} keys[] = {
+		{ "fastrec", &rp_opt.fastrec },
+		{ "bc", &rp_opt.bc },
+		{ "ai", &rp_opt.ai },
+		{ "hai", &rp_opt.hai },
+		{ "gd", &rp_opt.gd },
+		{ "min_rate", &rp_opt.min_rate },
+		{ "min_rate_dec", &rp_opt.min_rate_dec },
+		{ "timer_jitter", &rp_opt.timer_jitter },
+		{ "exact", &rp_opt.exact },
+		{ "sample_jitter", &cp.sample_jitter },
+		{ "mtu", &cp.mtu },
+		{ "mark_rate", &cp.mark_rate },
+	};
+	const char *eq = strchr(arg, '=');
+	unsigned long v;
+	unsigned int i;
+	char *end;
+
+	if (eq == NULL)
+		usage();
+	if (!strcmp(arg, "alg=qcn") || !strcmp(arg, "alg=dcqcn")) {
+		alg = arg[4] == 'd' ? &dcqcn : NULL;
+		return;
+	}
+	v = strtoul(eq + 1, &end, 0);
+	if (*end || end == eq + 1)
+		usage();
+
+	if (!strncmp(arg, "timer=", 6)) {
+		rp_opt.timer = v * 1000;
+		return;
+	}
+	if (!strncmp(arg, "q_eq=", 5)) {
+		cp.q_eq = v;
+		return;
+	}
+	if (!strncmp(arg, "w=", 2)) {
+		cp.w = v;
+		return;
+	}
+	if (!strncmp(arg, "limit=", 6)) {
+		cp.limit = v;
+		return;
+	}
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+		if (strlen(keys[i].name) == (size_t)(eq - arg) &&
+		    !strncmp(arg, keys[i].name, eq - arg)) {
+			*keys[i].val = v;
+			return;
+		}
+	usage();
+}
+
+/* The link serves the queue at rate bytes/s up to now */
+static void cp_drain(uint64_t now, double rate)
+{
+	double bytes = (now - cp.t) * rate / 1e9;
+
+	if (bytes > cp.qlen)
+		bytes = cp.qlen;
+	cp.qlen -= bytes;
+	cp.served += bytes;
+	cp.t = now;
+}
+
+/* As qcn_algorithm() in sch_tbf_switch.c for one segment; returns the
+   Fb of a CNM for the sender of the frame, 0 for none, and its qoff and
+   qdelta */
+static uint32_t cp_arrive(uint32_t len, int *qoff, int *qdelta)
+{
+	uint32_t qntz_Fb = 0;
+	int qlen;
+
+	if (cp.qlen + len > cp.limit) {
+		cp.drops++;
+		return 0;
+	}
+	cp.qlen += len;
+	qlen = (int)cp.qlen;
+
+	cp.sample -= len;
+	if (cp.sample >= 0)
+		return 0;
+	qntz_Fb = qcn_alg_fb(alg, cp_prof, cp.q_eq, cp.w, qlen, cp.qlen_old,
+			     cp.fb_max, cp.fb_shift);
+	*qoff = cp.q_eq - qlen;
+	*qdelta = qlen - cp.qlen_old;
+	cp.qlen_old = qlen;
+	cp.sample += randomize(qcn_mark_table(cp.mark, qntz_Fb),
+			       cp.sample_jitter);
+	return qntz_Fb;
+}
+
+static void rp_timer_start(struct source *s, int i, uint64_t now)
+{
+	s->timer_gen++;
+	s->timer_active = 1;
+	ev_push(now + randomize(qcn_rp_timer_period(&s->rp, &rp_opt),
+				rp_opt.timer_jitter),
+		EV_TIMER, i, s->timer_gen);
+}
+
+int main(int argc, char **argv)
+{
+	static const __u32 mark[QCN_MARK_STEPS] = QCN_MARK_DEFAULT;
+	unsigned int n = 10, i, nr_samples, k, conv;
+	double link_mbit = 10000, link, tol = 10;
+	uint64_t delay = 50000, duration = 1000000000ULL, interval = 100000;
+	uint64_t events = 0, cnms = 0, t_conv;
+	int verbose = 0, c;
+	struct source *src;
+	double *s_qlen, *s_rate, *s_served;
+	double mean = 0, var = 0, qmin = 0, qmax = 0, sum, sum2;
+	double per_sample;		/* bytes the link serves in one */
+	struct timespec w0, w1;
+	double wall;
+
+	rnd_state = 1;
+	while ((c = getopt(argc, argv, "n:l:d:t:s:i:e:v")) != -1) {
+		switch (c) {
+		case 'n': n = strtoul(optarg, NULL, 0); break;
+		case 'l': link_mbit = strtod(optarg, NULL); break;
+		case 'd': delay = strtoull(optarg, NULL, 0) * 1000; break;
+		case 't': duration = strtoull(optarg, NULL, 0) * 1000000; break;
+		case 's': rnd_state = strtoul(optarg, NULL, 0); break;
+		case 'i': interval = strtoull(optarg, NULL, 0) * 1000; break;
+		case 'e': tol = strtod(optarg, NULL); break;
+		case 'v': verbose = 1; break;
+		default: usage();
+		}
+	}
+	for (; optind < argc; optind++)
+		set_param(argv[optind]);
+	/* RP rates are 32 bit bytes/s, see qcn_alg.h */
+	if (n == 0 || link_mbit <= 0 || link_mbit * 1e6 / 8 > 0xFFFFFFFF ||
+	    interval == 0 || cp.mtu == 0 || rp_opt.timer == 0 || rnd_state == 0)
+		usage();
+
+	link = link_mbit * 1e6 / 8;
+	nr_samples = duration / interval;
+	src = calloc(n, sizeof(*src));
+	s_qlen = calloc(nr_samples + 1, sizeof(double));
+	s_rate = calloc(nr_samples + 1, sizeof(double));
+	s_served = calloc(nr_samples + 1, sizeof(double));
+	if (!src || !s_qlen || !s_rate || !s_served) {
+		perror("qcnsim");
+		return 1;
+	}
+
+	cp.fb_max = qcn_fb_max(cp.q_eq, cp.w, cp.limit < 4e9 ? cp.limit : 0);
+	cp.fb_shift = qcn_fb_shift(cp.fb_max);
+	cp_prof = qcn_cp_prof(cp.w);
+	rp_prof = qcn_rp_prof(&rp_opt);
+	qcn_mark_scale(cp.mark, mark, cp.mark_rate, (__u64)link);
+	cp.sample = randomize(qcn_mark_table(cp.mark, 0), cp.sample_jitter);
+	for (i = 0; i < n; i++) {
+		src[i].rp.crate = src[i].rp.trate = (uint32_t)link;
+		qcn_alg_init(alg, &src[i].rp, &rp_opt);
+		/* not all at once */
+		ev_push(rnd() % (uint64_t)(cp.mtu * 1e9 / link + 1),
+			EV_SEND, i, 0);
+	}
+	ev_push(interval, EV_SAMPLE, 0, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &w0);
+	k = 0;
+	while (heap.nr) {
+		struct event e = ev_pop();
+		struct source *s = &src[e.src];
+		uint32_t rate;
+		int qoff, qdelta, restart;
+
+		if (e.t > duration)
+			break;
+		events++;
+		switch (e.type) {
+		case EV_SEND:
+			rate = s->rp.crate < link ? s->rp.crate :
+				(uint32_t)link;
+			ev_push(e.t + delay, EV_ARRIVE, e.src, cp.mtu);
+			ev_push(e.t + (uint64_t)(cp.mtu * 1e9 / rate) + 1,
+				EV_SEND, e.src, 0);
+			/* as htb_accnt_tokens(), only while rate limited */
+			if (s->rp.crate < link) {
+				uint32_t bytes = cp.mtu;
+
+				if (s->rp.bcount_tx <= bytes) {
+					bytes -= s->rp.bcount_tx;
+					qcn_alg_byte_stage(alg, rp_prof,
+							   &s->rp, &rp_opt);
+				}
+				if (s->rp.bcount_tx > bytes)
+					s->rp.bcount_tx -= bytes;
+			}
+			break;
+		case EV_ARRIVE:
+			cp_drain(e.t, link);
+			if ((e.arg = cp_arrive(e.arg, &qoff, &qdelta)) != 0)
+				ev_push_cnm(e.t + delay, e.src, e.arg, qoff,
+					    qdelta);
+			break;
+		case EV_CNM:
+			/* as qcn_recv_fb() */
+			s->cnms++;
+			cnms++;
+			restart = qcn_alg_decrease(alg, rp_prof, &s->rp,
+						   &rp_opt, e.arg,
+						   (uint32_t)link, e.qoff,
+						   e.qdelta);
+			if (restart || !s->timer_active)
+				rp_timer_start(s, e.src, e.t);
+			break;
+		case EV_TIMER:
+			if (e.arg != s->timer_gen)
+				break;	/* restarted since */
+			qcn_alg_timer_stage(alg, rp_prof, &s->rp, &rp_opt);
+			if (s->rp.crate < link)
+				rp_timer_start(s, e.src, e.t);
+			else
+				s->timer_active = 0;
+			break;
+		case EV_SAMPLE:
+			cp_drain(e.t, link);
+			for (sum = 0, i = 0; i < n; i++)
+				sum += src[i].rp.crate < link ?
+					src[i].rp.crate : link;
+			s_qlen[k] = cp.qlen;
+			s_rate[k] = sum;
+			s_served[k] = cp.served;
+			if (verbose)
+				printf("%.3f ms qlen %.0f rate %.1f Mbit\n",
+				       e.t / 1e6, cp.qlen, sum * 8 / 1e6);
+			k++;
+			ev_push(e.t + interval, EV_SAMPLE, 0, 0);
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &w1);
+	wall = (w1.tv_sec - w0.tv_sec) + (w1.tv_nsec - w0.tv_nsec) / 1e9;
+	nr_samples = k;
+
+	/* converged from the sample after the last one out of the band */
+	for (conv = nr_samples; conv > 0; conv--)
+		if (fabs(s_rate[conv - 1] - link) > tol / 100 * link)
+			break;
+	t_conv = (uint64_t)conv * interval;
+
+	if (conv < nr_samples) {
+		qmin = qmax = s_qlen[conv];
+		for (sum = sum2 = 0, k = conv; k < nr_samples; k++) {
+			sum += s_qlen[k];
+			sum2 += s_qlen[k] * s_qlen[k];
+			if (s_qlen[k] < qmin)
+				qmin = s_qlen[k];
+			if (s_qlen[k] > qmax)
+				qmax = s_qlen[k];
+		}
+		mean = sum / (nr_samples - conv);
+		var = sum2 / (nr_samples - conv) - mean * mean;
+	}
+
+	/* Jain's index of the final rates */
+	for (sum = sum2 = 0, i = 0; i < n; i++) {
+		sum += src[i].rp.crate;
+		sum2 += (double)src[i].rp.crate * src[i].rp.crate;
+	}
+
+	printf("sources %u link %.0f Mbit delay %llu us time %llu ms\n",
+	       n, link_mbit, (unsigned long long)delay / 1000,
+	       (unsigned long long)duration / 1000000);
+	printf("events %llu in %.3f s, %.2f M/s\n", (unsigned long long)events,
+	       wall, wall > 0 ? events / wall / 1e6 : 0);
+	if (conv < nr_samples) {
+		printf("converged %.3f ms\n", t_conv / 1e6);
+		printf("queue mean %.0f std %.0f min %.0f max %.0f bytes\n",
+		       mean, var > 0 ? sqrt(var) : 0, qmin, qmax);
+	} else {
+		printf("converged never\n");
+	}
+	per_sample = link * interval / 1e9;
+	printf("utilization %.2f%%", nr_samples ?
+	       100 * s_served[nr_samples - 1] / (per_sample * nr_samples) : 0);
+	if (conv > 0 && conv < nr_samples)
+		printf(" %.2f%% converged",
+		       100 * (s_served[nr_samples - 1] - s_served[conv - 1]) /
+		       (per_sample * (nr_samples - conv)));
+	printf("\n");
+	printf("cnms %llu drops %llu fairness %.3f\n", (unsigned long long)cnms,
+	       (unsigned long long)cp.drops, sum * sum / (n * sum2));
+	return 0;
+}